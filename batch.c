@@ -0,0 +1,449 @@
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "detect.h"
+
+#define MAX_BATCH_PATH 4096
+
+const char* const batchReadErrorMessage = "cannot read image file";
+static const char* const writeErrorMessage = "cannot write output";
+static const char* const otherErrorMessage = "other";
+static const double nanosPerSecond = 1000000000.0;
+static const size_t maxNumberLength = 12; // "-n" and the NUL, for any int
+
+// The output name of an input while the names are being made unique
+typedef struct {
+    char* stem; // the name without the output extension
+    int input; // its index in the inputs
+} OutputName;
+
+/*
+ * compare_paths
+ * -------------
+ * qsort comparator putting paths in byte order.
+ */
+static int compare_paths(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * add_input
+ * ---------
+ * Appends a copy of path to the growing list of inputs.
+ */
+static void add_input(char*** inputs, int* count, int* capacity, char* path)
+{
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *inputs = realloc(*inputs, sizeof(char*) * *capacity);
+    }
+    (*inputs)[(*count)++] = path;
+}
+
+/*
+ * list_directory
+ * --------------
+ * Lists the regular files of a directory, hidden ones aside, in name order
+ * so runs over the same directory process it alike.
+ */
+static char** list_directory(DIR* dir, const char* path, int* count)
+{
+    char** inputs = NULL;
+    int capacity = 0;
+    struct dirent* entry;
+    struct stat info;
+    char name[MAX_BATCH_PATH];
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+        if (stat(name, &info) == 0 && S_ISREG(info.st_mode)) {
+            add_input(&inputs, count, &capacity, strdup(name));
+        }
+    }
+    if (*count > 1) {
+        qsort(inputs, *count, sizeof(char*), compare_paths);
+    }
+    return inputs ? inputs : malloc(sizeof(char*));
+}
+
+/*
+ * list_file
+ * ---------
+ * Lists the paths in a list file, one per line, blank lines aside.
+ */
+static char** list_file(FILE* file, int* count)
+{
+    char** inputs = NULL;
+    int capacity = 0;
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &size, file)) >= 0) {
+        while (length > 0
+                && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length > 0) {
+            add_input(&inputs, count, &capacity, strdup(line));
+        }
+    }
+    free(line);
+    return inputs ? inputs : malloc(sizeof(char*));
+}
+
+/*
+ * batch_list_inputs
+ * -----------------
+ * Returns the images of a batch given by path: the regular files of it if
+ * it is a directory, otherwise the paths listed in it, and sets count.
+ * Returns NULL if path cannot be read.
+ */
+char** batch_list_inputs(const char* path, int* count)
+{
+    *count = 0;
+    DIR* dir = opendir(path);
+    if (dir) {
+        char** inputs = list_directory(dir, path, count);
+        closedir(dir);
+        return inputs;
+    }
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return NULL;
+    }
+    char** inputs = list_file(file, count);
+    fclose(file);
+    return inputs;
+}
+
+/*
+ * batch_free_inputs
+ * -----------------
+ * Frees a list returned by batch_list_inputs().
+ */
+void batch_free_inputs(char** inputs, int count)
+{
+    for (int i = 0; i < count; i++) {
+        free(inputs[i]);
+    }
+    free(inputs);
+}
+
+/*
+ * compare_stems
+ * -------------
+ * qsort comparator putting output names in byte order.
+ */
+static int compare_stems(const void* a, const void* b)
+{
+    return strcmp(((const OutputName*)a)->stem, ((const OutputName*)b)->stem);
+}
+
+/*
+ * rename_collisions
+ * -----------------
+ * Sorts the output names and appends to every name shared by more than
+ * one input "-n", n the input's place in the list from 1, which tells them
+ * apart. Returns true if any name was changed.
+ */
+static bool rename_collisions(OutputName* names, int count)
+{
+    qsort(names, count, sizeof(OutputName), compare_stems);
+    bool renamed = false;
+    int first = 0;
+    for (int i = 1; i <= count; i++) {
+        if (i < count && strcmp(names[i].stem, names[first].stem) == 0) {
+            continue;
+        }
+        for (int j = first; i - first > 1 && j < i; j++) {
+            size_t size = strlen(names[j].stem) + maxNumberLength;
+            char* stem = malloc(size);
+            snprintf(stem, size, "%s-%d", names[j].stem, names[j].input + 1);
+            free(names[j].stem);
+            names[j].stem = stem;
+            renamed = true;
+        }
+        first = i;
+    }
+    return renamed;
+}
+
+/*
+ * batch_output_names
+ * ------------------
+ * Returns the file names the outputs of a batch's inputs are written under,
+ * in the output directory: the input's name with the output extension in
+ * place of its own, unless another input would come out under the same
+ * name, a/x.jpg and b/x.jpg or x.jpg and x.png say, in which case each of
+ * them is numbered after its place in the list. Freed with
+ * batch_free_inputs().
+ */
+char** batch_output_names(char** inputs, int count)
+{
+    OutputName* names = malloc(sizeof(OutputName) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        const char* base = strrchr(inputs[i], '/');
+        base = base ? base + 1 : inputs[i];
+        const char* extension = strrchr(base, '.');
+        size_t length = extension && extension != base
+                ? (size_t)(extension - base)
+                : strlen(base);
+        names[i].stem = strndup(base, length);
+        names[i].input = i;
+    }
+    while (rename_collisions(names, count)) {
+        // a numbered name may be another input's own, so check them again
+    }
+    char** outputs = malloc(sizeof(char*) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        size_t size = strlen(names[i].stem) + strlen(outputImageExtension) + 1;
+        outputs[names[i].input] = malloc(size);
+        snprintf(outputs[names[i].input], size, "%s%s", names[i].stem,
+                outputImageExtension);
+        free(names[i].stem);
+    }
+    free(names);
+    return outputs;
+}
+
+/*
+ * batch_read_file
+ * ---------------
+ * Reads a whole file into a malloc'd buffer. Returns false if it cannot be
+ * read or is too big to be an image.
+ */
+bool batch_read_file(const char* path, uint8_t** data, uint32_t* size)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size > UINT32_MAX) {
+        close(fd);
+        return false;
+    }
+    *size = (uint32_t)info.st_size;
+    *data = malloc(*size ? *size : 1);
+    uint32_t done = 0;
+    while (done < *size) {
+        ssize_t got = read(fd, *data + done, *size - done);
+        if (got <= 0) {
+            break;
+        }
+        done += (uint32_t)got;
+    }
+    close(fd);
+    if (done < *size) {
+        free(*data);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * batch_init
+ * ----------
+ * Sets up a run writing to outputDir, which is created if it does not
+ * exist, and opens the geometry file there if geometry is set.
+ * Returns false if the output directory cannot be written.
+ */
+bool batch_init(BatchRun* run, const char* outputDir, bool geometry)
+{
+    memset(run, 0, sizeof(BatchRun));
+    if (mkdir(outputDir, 0755) != 0 && errno != EEXIST) {
+        return false;
+    }
+    struct stat info;
+    if (stat(outputDir, &info) != 0 || !S_ISDIR(info.st_mode)
+            || access(outputDir, W_OK | X_OK) != 0) {
+        return false;
+    }
+    run->outputDir = outputDir;
+    run->geometry = geometry;
+    if (geometry) {
+        char name[MAX_BATCH_PATH];
+        snprintf(name, sizeof(name), "%s/%s", outputDir, BATCH_GEOMETRY_FILE);
+        run->geometryFile = fopen(name, "w");
+        if (!run->geometryFile) {
+            return false;
+        }
+    }
+    pthread_mutex_init(&run->lock, NULL);
+    pthread_cond_init(&run->finishedChanged, NULL);
+    return true;
+}
+
+/*
+ * batch_submitted
+ * ---------------
+ * Counts an input about to be handed to the pipeline.
+ */
+void batch_submitted(BatchRun* run)
+{
+    pthread_mutex_lock(&run->lock);
+    run->submitted++;
+    pthread_mutex_unlock(&run->lock);
+}
+
+/*
+ * count_finished
+ * --------------
+ * Counts a finished input, as failed with error if it is not NULL, and
+ * wakes the run waiting for the last one. Must be called with the lock
+ * held.
+ */
+static void count_finished(BatchRun* run, const char* error)
+{
+    run->finished++;
+    if (!error) {
+        run->ok++;
+    } else {
+        int i = 0;
+        while (i < run->errorKinds && strcmp(run->errors[i].error, error)) {
+            i++;
+        }
+        if (i == run->errorKinds && i == MAX_BATCH_ERROR_KINDS) {
+            i--; // the last kind takes every kind beyond it
+            run->errors[i].error = otherErrorMessage;
+        } else if (i == run->errorKinds) {
+            run->errors[run->errorKinds++].error = error;
+        }
+        run->errors[i].count++;
+    }
+    pthread_cond_broadcast(&run->finishedChanged);
+}
+
+/*
+ * batch_fail
+ * ----------
+ * Counts an input that failed before it reached the pipeline.
+ */
+void batch_fail(BatchRun* run, const char* error)
+{
+    pthread_mutex_lock(&run->lock);
+    run->submitted++;
+    count_finished(run, error);
+    pthread_mutex_unlock(&run->lock);
+}
+
+/*
+ * write_output
+ * ------------
+ * Writes the encoded output of a job to the output directory, under the
+ * name batch_output_names() gave its input. Returns false if it cannot.
+ */
+static bool write_output(BatchRun* run, Job* job)
+{
+    char name[MAX_BATCH_PATH];
+    snprintf(name, sizeof(name), "%s/%s", run->outputDir, job->batchOutput);
+    FILE* file = fopen(name, "wb");
+    if (!file) {
+        return false;
+    }
+    size_t size = (size_t)job->output->rows * job->output->cols;
+    bool written = fwrite(job->output->data.ptr, 1, size, file) == size;
+    return fclose(file) == 0 && written;
+}
+
+/*
+ * write_geometry
+ * --------------
+ * Appends the faces found in a job to the geometry file. Must be called
+ * with the lock held, so lines do not interleave.
+ */
+static void write_geometry(BatchRun* run, Job* job)
+{
+    fprintf(run->geometryFile, "%s\t%d", job->batchInput, job->faceCount);
+    for (int i = 0; i < job->faceCount; i++) {
+        CvRect* face = &job->faces[i];
+        fprintf(run->geometryFile, "\t%d,%d,%d,%d", face->x, face->y,
+                face->width, face->height);
+    }
+    fputc('\n', run->geometryFile);
+}
+
+/*
+ * batch_finish
+ * ------------
+ * Called by the send stage in place of a response: writes the output of a
+ * finished batch job, counts it and frees it. Images are written here,
+ * outside the lock, so the send threads write them in parallel.
+ */
+void batch_finish(Job* job)
+{
+    BatchRun* run = job->batch;
+    const char* error = job->error;
+    if (!error && !run->geometry && !write_output(run, job)) {
+        error = writeErrorMessage;
+    }
+    pthread_mutex_lock(&run->lock);
+    if (!error && run->geometry) {
+        write_geometry(run, job);
+    }
+    count_finished(run, error);
+    pthread_mutex_unlock(&run->lock);
+    job->replace = NULL; // shared by the run
+    job_free(job);
+}
+
+/*
+ * batch_wait
+ * ----------
+ * Waits until every input submitted has finished.
+ */
+void batch_wait(BatchRun* run)
+{
+    pthread_mutex_lock(&run->lock);
+    while (run->finished < run->submitted) {
+        pthread_cond_wait(&run->finishedChanged, &run->lock);
+    }
+    pthread_mutex_unlock(&run->lock);
+}
+
+/*
+ * batch_report
+ * ------------
+ * Writes how many inputs the run went through and how fast, given the
+ * nanoseconds it took, and how many failed with each error.
+ */
+void batch_report(BatchRun* run, FILE* out, uint64_t elapsed)
+{
+    double seconds = elapsed / nanosPerSecond;
+    fprintf(out, "images: %" PRIu64 "\n", run->finished);
+    fprintf(out, "seconds: %.3f\n", seconds);
+    fprintf(out, "images per second: %.2f\n",
+            seconds > 0 ? run->finished / seconds : 0.0);
+    fprintf(out, "ok: %" PRIu64 "\n", run->ok);
+    fprintf(out, "failed: %" PRIu64 "\n", run->finished - run->ok);
+    for (int i = 0; i < run->errorKinds; i++) {
+        fprintf(out, "  %s: %" PRIu64 "\n", run->errors[i].error,
+                run->errors[i].count);
+    }
+}
+
+/*
+ * batch_destroy
+ * -------------
+ * Closes the geometry file and releases the shared replacement.
+ */
+void batch_destroy(BatchRun* run)
+{
+    if (run->geometryFile) {
+        fclose(run->geometryFile);
+    }
+    if (run->replace) {
+        cvReleaseImage(&run->replace);
+    }
+    pthread_mutex_destroy(&run->lock);
+    pthread_cond_destroy(&run->finishedChanged);
+}
@@ -0,0 +1,55 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <opencv2/imgproc/imgproc_c.h>
+#include "pipeline.h"
+
+#define MAX_BATCH_ERROR_KINDS 32
+
+// File the faces found are written to in the output directory, one line
+// per input: its path, the face count, then x,y,width,height of each face
+#define BATCH_GEOMETRY_FILE "faces.tsv"
+
+// Error an input that cannot be read fails with
+extern const char* const batchReadErrorMessage;
+
+// How many inputs of a batch failed with one error
+typedef struct {
+    const char* error;
+    uint64_t count;
+} BatchErrorCount;
+
+// An offline run over image files, fed to the pipeline in place of clients.
+// The send stage hands every finished job back here, where its output is
+// written and it is counted.
+typedef struct BatchRun {
+    const char* outputDir;
+    bool geometry; // write the faces found rather than the processed images
+    FILE* geometryFile; // NULL unless geometry
+    IplImage* replace; // pasted over the faces of every input, NULL to detect
+    pthread_mutex_t lock;
+    pthread_cond_t finishedChanged;
+    uint64_t submitted; // inputs handed to the pipeline or failed before it
+    uint64_t finished;
+    uint64_t ok;
+    BatchErrorCount errors[MAX_BATCH_ERROR_KINDS];
+    int errorKinds;
+} BatchRun;
+
+char** batch_list_inputs(const char* path, int* count);
+void batch_free_inputs(char** inputs, int count);
+char** batch_output_names(char** inputs, int count);
+bool batch_read_file(const char* path, uint8_t** data, uint32_t* size);
+bool batch_init(BatchRun* run, const char* outputDir, bool geometry);
+void batch_submitted(BatchRun* run);
+void batch_fail(BatchRun* run, const char* error);
+void batch_finish(Job* job);
+void batch_wait(BatchRun* run);
+void batch_report(BatchRun* run, FILE* out, uint64_t elapsed);
+void batch_destroy(BatchRun* run);
+
+#endif
@@ -0,0 +1,630 @@
+#include "bench.h"
+
+/* cleanup_and_exit()
+ * ---------------
+ * Print the message for the given exit status to stderr, free the args
+ * struct and exit with the given exit status.
+ */
+void cleanup_and_exit(Arguments* args, int exitStatus)
+{
+    if (exitStatus == EXIT_USAGE_STATUS) {
+        fprintf(stderr, "%s", usageErrorMessage);
+    } else if (exitStatus == EXIT_INPUTFILE_STATUS) {
+        fprintf(stderr, inputFileErrorMessageFormat, args->badFileName);
+    } else if (exitStatus == EXIT_OUTPUTFILE_STATUS) {
+        fprintf(stderr, outputFileErrorMessageFormat, args->badFileName);
+    } else if (exitStatus == EXIT_CASCADE_STATUS) {
+        fprintf(stderr, "%s", cascadeErrorMessage);
+    }
+    if (args) {
+        free(args);
+    }
+    exit(exitStatus);
+}
+
+/*
+ * check_option_value
+ * ------------------
+ * Parses the value of an optional argument as an integer between min and max
+ * inclusive. Exits with usage status on invalid input.
+ */
+int check_option_value(char* value, int min, int max, Arguments* args)
+{
+    char* ptr;
+    long result = strtol(value, &ptr, baseTen);
+    if (!*value || *ptr != '\0' || result < min || result > max) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    return (int)result;
+}
+
+/*
+ * parse_option
+ * ------------
+ * Applies one optional argument and its value. Exits with usage status on
+ * an unknown option or invalid value.
+ */
+void parse_option(char* option, char* value, Arguments* args)
+{
+    if (strcmp(option, iterationsArg) == 0) {
+        args->iterations = check_option_value(value, 1, maxIterations, args);
+    } else if (strcmp(option, warmupArg) == 0) {
+        args->warmup = check_option_value(value, 0, maxWarmup, args);
+    } else if (strcmp(option, threadsArg) == 0) {
+        args->threads = check_option_value(value, 0, maxThreads, args);
+    } else if (strcmp(option, bandsArg) == 0) {
+        args->bands = check_option_value(value, 1, maxBands, args);
+    } else if (strcmp(option, engineArg) == 0
+            && strcmp(value, simdEngineName) == 0) {
+        args->simdCascade = true;
+    } else if (strcmp(option, engineArg) == 0
+            && strcmp(value, opencvEngineName) == 0) {
+        args->simdCascade = false;
+    } else if (strcmp(option, replaceFileArg) == 0 && *value) {
+        args->replaceFileName = value;
+    } else if (strcmp(option, jsonArg) == 0 && *value) {
+        args->jsonFileName = value;
+    } else {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+}
+
+/*
+ * parse_arguments
+ * ---------------
+ * Parses the image files and optional arguments of the command line.
+ * Exits with usage status if they are invalid.
+ */
+Arguments* parse_arguments(int argc, char** argv)
+{
+    Arguments* args = calloc(1, sizeof(Arguments));
+    args->iterations = defaultIterations;
+    args->warmup = defaultWarmup;
+    args->bands = 1;
+    args->simdCascade = true;
+    int positional = firstImageIndex; // arguments before the first --option
+    while (positional < argc
+            && strncmp(argv[positional], optionArgStart,
+                       strlen(optionArgStart))
+                    != 0) {
+        if (!*argv[positional]) {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        positional++;
+    }
+    args->imageFileNames = argv + firstImageIndex;
+    args->imageCount = positional - firstImageIndex;
+    for (int i = positional; i < argc; i += 2) {
+        // Options come in pairs: --name value
+        if (i + 1 >= argc) {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        parse_option(argv[i], argv[i + 1], args);
+    }
+    return args;
+}
+
+/*
+ * read_image_file
+ * ---------------
+ * Reads an image file and decodes it as the server decodes a request's
+ * image, with the given OpenCV flags. Exits with input file status if the
+ * file cannot be read or is not an image.
+ */
+IplImage* read_image_file(char* fileName, int flags, Arguments* args)
+{
+    IplImage* image = NULL;
+    FILE* file = fopen(fileName, "rb");
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        rewind(file);
+        uint8_t* data = malloc(size > 0 ? size : 1);
+        if (size > 0 && fread(data, 1, size, file) == (size_t)size) {
+            CvMat buffer = cvMat(1, (int)size, CV_8UC1, data);
+            image = cvDecodeImage(&buffer, flags);
+        }
+        free(data);
+        fclose(file);
+    }
+    if (!image) {
+        args->badFileName = fileName;
+        cleanup_and_exit(args, EXIT_INPUTFILE_STATUS);
+    }
+    return image;
+}
+
+/*
+ * init_bench_worker
+ * -----------------
+ * Gives a thread of the task pool its own copy of the cascades, as the
+ * server's detection threads have.
+ */
+void* init_bench_worker(void* context)
+{
+    Bench* bench = (Bench*)context;
+    DetectWorker* worker = calloc(1, sizeof(DetectWorker));
+    detect_worker_use(worker, bench->models);
+    worker->pool = &bench->pool;
+    worker->prescreen = &bench->prescreen;
+    return worker;
+}
+
+/*
+ * next_random
+ * -----------
+ * Returns the next number of a fixed sequence, so every run benchmarks the
+ * same synthetic pixels.
+ */
+uint32_t next_random(uint32_t* state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 24;
+}
+
+/*
+ * create_synthetic_frame
+ * ----------------------
+ * Returns a colour frame of the given size filled with a gradient under
+ * noise, which the cascades have to scan in full without finding faces.
+ */
+IplImage* create_synthetic_frame(int width, int height)
+{
+    IplImage* frame = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 3);
+    uint32_t state = syntheticSeed;
+    for (int y = 0; y < height; y++) {
+        uint8_t* row = (uint8_t*)frame->imageData + y * frame->widthStep;
+        for (int x = 0; x < width * 3; x++) {
+            row[x] = (uint8_t)((x / 3 + y) / 2 + next_random(&state) / 4);
+        }
+    }
+    return frame;
+}
+
+/*
+ * create_synthetic_replace
+ * ------------------------
+ * Returns a square replacement image with an alpha channel, opaque in the
+ * inscribed circle and transparent outside it, as a cut-out face would be.
+ */
+IplImage* create_synthetic_replace(int size)
+{
+    IplImage* replace = cvCreateImage(cvSize(size, size), IPL_DEPTH_8U, 4);
+    int radius = size / 2;
+    for (int y = 0; y < size; y++) {
+        uint8_t* row = (uint8_t*)replace->imageData + y * replace->widthStep;
+        for (int x = 0; x < size; x++) {
+            int dx = x - radius;
+            int dy = y - radius;
+            row[4 * x] = (uint8_t)x;
+            row[4 * x + 1] = (uint8_t)y;
+            row[4 * x + 2] = (uint8_t)(x + y);
+            row[4 * x + 3] = dx * dx + dy * dy <= radius * radius ? 255 : 0;
+        }
+    }
+    return replace;
+}
+
+/*
+ * layout_faces
+ * ------------
+ * Lays count faces out in a square grid over a frame of the given size,
+ * each a square filling most of its cell with two eyes in its upper half.
+ * Stores the faces, and an eye search result for each, in malloc'd arrays.
+ */
+void layout_faces(CvSize frame, int count, CvRect** faces,
+        EyeSearch** searches)
+{
+    int columns = (int)ceil(sqrt(count));
+    int rows = (count + columns - 1) / columns;
+    int cellWidth = frame.width / columns;
+    int cellHeight = frame.height / rows;
+    int side = (cellWidth < cellHeight ? cellWidth : cellHeight) * 3 / 4;
+    *faces = malloc(sizeof(CvRect) * count);
+    *searches = calloc(count, sizeof(EyeSearch));
+    for (int i = 0; i < count; i++) {
+        CvRect face = cvRect(cellWidth * (i % columns)
+                        + (cellWidth - side) / 2,
+                cellHeight * (i / columns) + (cellHeight - side) / 2, side,
+                side);
+        (*faces)[i] = face;
+        (*searches)[i].face = face;
+        (*searches)[i].eyeCount = 2;
+        (*searches)[i].eyes[0]
+                = cvRect(side / 5, side / 4, side / 5, side / 5);
+        (*searches)[i].eyes[1]
+                = cvRect(side * 3 / 5, side / 4, side / 5, side / 5);
+    }
+}
+
+/*
+ * detect_faces_kernel
+ * -------------------
+ * What the detect stage times of a frame up to the eye search: the grey
+ * equalised copy with its integral images, and the face search.
+ */
+void detect_faces_kernel(BenchInput* input)
+{
+    CascadeIntegral* integral;
+    IplImage* frameGray
+            = create_equalised_gray(input->worker, input->frame, &integral);
+    CvRect* faces;
+    find_faces(input->worker, frameGray, integral, input->bands, &faces);
+    free(faces);
+    if (integral) {
+        cascade_integral_free(integral);
+    }
+    cleanup_opencv_resources(frameGray, NULL);
+}
+
+/*
+ * draw_detections_kernel
+ * ----------------------
+ * The rest of a detect request: the grey frame, the eye search of every
+ * face and the drawing of the faces and eyes found.
+ */
+void draw_detections_kernel(BenchInput* input)
+{
+    CascadeIntegral* integral;
+    IplImage* frameGray
+            = create_equalised_gray(input->worker, input->frame, &integral);
+    if (integral) {
+        cascade_integral_free(integral);
+    }
+    draw_detections(input->worker, input->frame, frameGray,
+            input->faces, input->faceCount);
+    cleanup_opencv_resources(frameGray, NULL);
+}
+
+/*
+ * draw_ellipses_and_eyes_kernel
+ * -----------------------------
+ * Draws every face and its eyes, without searching for them.
+ */
+void draw_ellipses_and_eyes_kernel(BenchInput* input)
+{
+    for (int i = 0; i < input->faceCount; i++) {
+        draw_ellipses_and_eyes(input->frame, &input->searches[i]);
+    }
+}
+
+/*
+ * draw_replace_on_face_kernel
+ * ---------------------------
+ * Pastes the replacement over the first face, on the calling thread.
+ */
+void draw_replace_on_face_kernel(BenchInput* input)
+{
+    draw_replace_on_face(input->frame, input->replace, &input->faces[0]);
+}
+
+/*
+ * replace_faces_kernel
+ * --------------------
+ * Pastes the replacement over every face, as tasks of the pool.
+ */
+void replace_faces_kernel(BenchInput* input)
+{
+    replace_faces(input->worker->pool, input->frame, input->replace,
+            input->faces, input->faceCount);
+}
+
+/*
+ * compare_nanos
+ * -------------
+ * qsort comparator of timings.
+ */
+int compare_nanos(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * run_case
+ * --------
+ * Runs a kernel on its input the warm-up number of times, to fill caches
+ * and let lazily made state be made, then times each of the given number
+ * of runs and keeps the timings as a result of the suite. Every run starts
+ * from the pristine frame, copied untimed.
+ */
+void run_case(Bench* bench, const char* kernelName, BenchKernel kernel,
+        const char* inputName, BenchInput* input)
+{
+    Arguments* args = bench->args;
+    input->worker = bench->worker;
+    input->bands = args->bands;
+    for (int i = 0; i < args->warmup; i++) {
+        cvCopy(input->pristine, input->frame, NULL);
+        kernel(input);
+    }
+    uint64_t* samples = malloc(sizeof(uint64_t) * args->iterations);
+    for (int i = 0; i < args->iterations; i++) {
+        cvCopy(input->pristine, input->frame, NULL);
+        uint64_t start = now_nanos();
+        kernel(input);
+        samples[i] = now_nanos() - start;
+    }
+    qsort(samples, args->iterations, sizeof(uint64_t), compare_nanos);
+    if (bench->resultCount == bench->resultCapacity) {
+        bench->resultCapacity = bench->resultCapacity * 2 + 16;
+        bench->results = realloc(
+                bench->results, sizeof(BenchResult) * bench->resultCapacity);
+    }
+    BenchResult* result = &bench->results[bench->resultCount++];
+    snprintf(result->kernel, MAX_LABEL_LENGTH, "%s", kernelName);
+    snprintf(result->input, MAX_LABEL_LENGTH, "%s", inputName);
+    result->width = input->frame->width;
+    result->height = input->frame->height;
+    result->faces = input->faceCount;
+    result->samples = samples;
+    result->count = args->iterations;
+}
+
+/*
+ * run_synthetic_cases
+ * -------------------
+ * Times every kernel on the synthetic frames: the face search at every
+ * resolution, the drawing and replacing of every grid of faces, and a
+ * single paste of every face size.
+ */
+void run_synthetic_cases(Bench* bench)
+{
+    char name[MAX_LABEL_LENGTH];
+    for (int i = 0; i < SYNTHETIC_SIZES; i++) {
+        BenchInput input = {0};
+        input.pristine = create_synthetic_frame(
+                syntheticWidths[i], syntheticHeights[i]);
+        input.frame = cvCloneImage(input.pristine);
+        input.replace = bench->replace;
+        snprintf(name, MAX_LABEL_LENGTH, "synthetic %dx%d",
+                syntheticWidths[i], syntheticHeights[i]);
+        run_case(bench, "detect_faces", detect_faces_kernel, name, &input);
+        for (int j = 0; j < SYNTHETIC_FACE_COUNTS; j++) {
+            input.faceCount = syntheticFaceCounts[j];
+            layout_faces(cvGetSize(input.frame), input.faceCount,
+                    &input.faces, &input.searches);
+            run_case(bench, "draw_ellipses_and_eyes",
+                    draw_ellipses_and_eyes_kernel, name, &input);
+            run_case(bench, "replace_faces", replace_faces_kernel, name,
+                    &input);
+            free(input.faces);
+            free(input.searches);
+        }
+        if (i == pasteFrameIndex) {
+            for (int j = 0; j < PASTE_FACE_SIZES; j++) {
+                CvRect face = cvRect(0, 0, pasteFaceSizes[j],
+                        pasteFaceSizes[j]);
+                input.faces = &face;
+                input.faceCount = 1;
+                snprintf(name, MAX_LABEL_LENGTH, "synthetic %dx%d face %d",
+                        syntheticWidths[i], syntheticHeights[i],
+                        pasteFaceSizes[j]);
+                run_case(bench, "draw_replace_on_face",
+                        draw_replace_on_face_kernel, name, &input);
+            }
+        }
+        cvReleaseImage(&input.frame);
+        cvReleaseImage(&input.pristine);
+    }
+}
+
+/*
+ * run_image_cases
+ * ---------------
+ * Times the face search of every image file given, and the eye search and
+ * drawing, and the replacing, of the faces it finds there. Runs first, so
+ * a file that cannot be read is reported before the synthetic cases.
+ */
+void run_image_cases(Bench* bench)
+{
+    Arguments* args = bench->args;
+    for (int i = 0; i < args->imageCount; i++) {
+        char* name = args->imageFileNames[i];
+        BenchInput input = {0};
+        input.pristine = read_image_file(name, CV_LOAD_IMAGE_COLOR, args);
+        input.frame = cvCloneImage(input.pristine);
+        input.replace = bench->replace;
+        CascadeIntegral* integral;
+        IplImage* frameGray
+                = create_equalised_gray(bench->worker, input.frame, &integral);
+        input.faceCount = find_faces(
+                bench->worker, frameGray, integral, args->bands, &input.faces);
+        if (integral) {
+            cascade_integral_free(integral);
+        }
+        cleanup_opencv_resources(frameGray, NULL);
+        run_case(bench, "detect_faces", detect_faces_kernel, name, &input);
+        if (input.faceCount) {
+            run_case(bench, "draw_detections", draw_detections_kernel, name,
+                    &input);
+            run_case(bench, "replace_faces", replace_faces_kernel, name,
+                    &input);
+        }
+        free(input.faces);
+        cvReleaseImage(&input.frame);
+        cvReleaseImage(&input.pristine);
+    }
+}
+
+/*
+ * mean_nanos
+ * ----------
+ * Returns the mean of a result's timings.
+ */
+double mean_nanos(BenchResult* result)
+{
+    double sum = 0;
+    for (int i = 0; i < result->count; i++) {
+        sum += result->samples[i];
+    }
+    return sum / result->count;
+}
+
+/*
+ * stddev_nanos
+ * ------------
+ * Returns the sample standard deviation of a result's timings.
+ */
+double stddev_nanos(BenchResult* result, double mean)
+{
+    if (result->count < 2) {
+        return 0;
+    }
+    double sum = 0;
+    for (int i = 0; i < result->count; i++) {
+        double delta = result->samples[i] - mean;
+        sum += delta * delta;
+    }
+    return sqrt(sum / (result->count - 1));
+}
+
+/*
+ * percentile_nanos
+ * ----------------
+ * Returns the given fraction's percentile of a result's sorted timings.
+ */
+uint64_t percentile_nanos(BenchResult* result, double fraction)
+{
+    int rank = (int)(fraction * result->count + 0.999999);
+    return result->samples[rank ? rank - 1 : 0];
+}
+
+/*
+ * write_text_report
+ * -----------------
+ * Writes one line per result for people to read, times in milliseconds.
+ */
+void write_text_report(FILE* out, Bench* bench)
+{
+    for (int i = 0; i < bench->resultCount; i++) {
+        BenchResult* result = &bench->results[i];
+        double mean = mean_nanos(result);
+        fprintf(out, "%-22s %-32s faces %2d min %.3f", result->kernel,
+                result->input, result->faces,
+                result->samples[0] / nanosPerMilli);
+        for (int j = 0; j < PERCENTILE_COUNT; j++) {
+            fprintf(out, " %s %.3f", percentileNames[j],
+                    percentile_nanos(result, percentiles[j]) / nanosPerMilli);
+        }
+        fprintf(out, " mean %.3f sd %.3f ms\n", mean / nanosPerMilli,
+                stddev_nanos(result, mean) / nanosPerMilli);
+    }
+}
+
+/*
+ * write_json_string
+ * -----------------
+ * Writes a string as a JSON string literal.
+ */
+void write_json_string(FILE* out, const char* string)
+{
+    fputc('"', out);
+    for (const char* c = string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if ((unsigned char)*c < ' ') {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * write_json_report
+ * -----------------
+ * Writes the settings of the run and every result as a JSON object, times
+ * in milliseconds, for runs to be compared.
+ */
+void write_json_report(FILE* out, Bench* bench)
+{
+    Arguments* args = bench->args;
+    fprintf(out,
+            "{\"engine\": \"%s\", \"iterations\": %d, \"warmup\": %d, "
+            "\"threads\": %d, \"bands\": %d,\n \"results\": [",
+            bench->models->faceEngine ? simdEngineName : opencvEngineName,
+            args->iterations, args->warmup, args->threads, args->bands);
+    for (int i = 0; i < bench->resultCount; i++) {
+        BenchResult* result = &bench->results[i];
+        double mean = mean_nanos(result);
+        uint64_t median = percentile_nanos(result, percentiles[0]);
+        fprintf(out, "%s\n  {\"kernel\": \"%s\", \"input\": ", i ? "," : "",
+                result->kernel);
+        write_json_string(out, result->input);
+        fprintf(out,
+                ", \"width\": %d, \"height\": %d, \"faces\": %d, "
+                "\"min_ms\": %.4f, ",
+                result->width, result->height, result->faces,
+                result->samples[0] / nanosPerMilli);
+        for (int j = 0; j < PERCENTILE_COUNT; j++) {
+            fprintf(out, "\"%s_ms\": %.4f, ", percentileNames[j],
+                    percentile_nanos(result, percentiles[j]) / nanosPerMilli);
+        }
+        double megapixels
+                = result->width * (double)result->height / pixelsPerMegapixel;
+        fprintf(out,
+                "\"max_ms\": %.4f, \"mean_ms\": %.4f, \"stddev_ms\": %.4f, "
+                "\"megapixels_per_second\": %.2f}",
+                result->samples[result->count - 1] / nanosPerMilli,
+                mean / nanosPerMilli,
+                stddev_nanos(result, mean) / nanosPerMilli,
+                median ? megapixels / (median / nanosPerSecond) : 0);
+    }
+    fprintf(out, "\n]}\n");
+}
+
+/*
+ * setup_bench
+ * -----------
+ * Loads the cascades as the server does, compiling the face one unless
+ * OpenCV is asked to run it, and starts the task pool with the calling
+ * thread attached. Exits if a cascade cannot be loaded.
+ */
+void setup_bench(Bench* bench)
+{
+    Arguments* args = bench->args;
+    CvHaarClassifierCascade* faceCascade = (CvHaarClassifierCascade*)cvLoad(
+            faceCascadeFilename, NULL, NULL, NULL);
+    CvHaarClassifierCascade* eyesCascade = (CvHaarClassifierCascade*)cvLoad(
+            eyesCascadeFilename, NULL, NULL, NULL);
+    if (!faceCascade || !eyesCascade) {
+        cleanup_and_exit(args, EXIT_CASCADE_STATUS);
+    }
+    ModelConfig config = {.simdCascade = args->simdCascade,
+            .scaleFactor = haarScaleFactor,
+            .minNeighbours = haarMinNeighbours};
+    bench->models = models_create(faceCascade, eyesCascade,
+            args->simdCascade ? cascade_compile(faceCascade) : NULL, NULL, 0,
+            &config);
+    bench->replace = args->replaceFileName
+            ? read_image_file(
+                      args->replaceFileName, CV_LOAD_IMAGE_UNCHANGED, args)
+            : create_synthetic_replace(syntheticReplaceSize);
+    taskpool_init(&bench->pool, args->threads, 1, init_bench_worker, bench);
+    taskpool_start(&bench->pool);
+    bench->worker = (DetectWorker*)taskpool_attach(&bench->pool);
+}
+
+int main(int argc, char** argv)
+{
+    Arguments* args = parse_arguments(argc, argv);
+    FILE* json = NULL;
+    if (args->jsonFileName && !(json = fopen(args->jsonFileName, "w"))) {
+        args->badFileName = args->jsonFileName;
+        cleanup_and_exit(args, EXIT_OUTPUTFILE_STATUS);
+    }
+    Bench bench = {0};
+    bench.args = args;
+    setup_bench(&bench);
+    run_image_cases(&bench);
+    run_synthetic_cases(&bench);
+    write_text_report(stdout, &bench);
+    if (json) {
+        write_json_report(json, &bench);
+        fclose(json);
+    }
+    cleanup_and_exit(args, EXIT_OK_STATUS);
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include <opencv2/imgcodecs/imgcodecs_c.h>
+#include <opencv2/imgproc/imgproc_c.h>
+#include <opencv2/objdetect/objdetect_c.h>
+#include "detect.h"
+#include "metrics.h"
+
+#define MAX_LABEL_LENGTH 64
+
+// Optional arguments, after the image files
+const char* const optionArgStart = "--";
+const char* const iterationsArg = "--iterations";
+const char* const warmupArg = "--warmup";
+const char* const threadsArg = "--threads";
+const char* const bandsArg = "--bands";
+const char* const engineArg = "--engine";
+const char* const replaceFileArg = "--replacefile";
+const char* const jsonArg = "--json";
+const char* const simdEngineName = "simd";
+const char* const opencvEngineName = "opencv";
+
+// Defaults and limits of the optional arguments
+const int defaultIterations = 30;
+const int maxIterations = 100000;
+const int defaultWarmup = 3;
+const int maxWarmup = 1000;
+const int maxThreads = 1024; // helper threads of the task pool
+const int maxBands = 64;
+const int baseTen = 10;
+const int firstImageIndex = 1;
+
+// The synthetic corpus: frames of each resolution, with faces laid out in a
+// square grid of each count, and the face sizes a single paste is timed at
+const int syntheticWidths[] = {320, 640, 1280, 1920};
+const int syntheticHeights[] = {240, 480, 720, 1080};
+#define SYNTHETIC_SIZES 4
+const int syntheticFaceCounts[] = {1, 4, 16};
+#define SYNTHETIC_FACE_COUNTS 3
+const int pasteFaceSizes[] = {64, 128, 256, 512};
+#define PASTE_FACE_SIZES 4
+const int pasteFrameIndex = 3; // the resolution single pastes are made on
+const int syntheticReplaceSize = 256;
+const uint32_t syntheticSeed = 2310;
+
+const double nanosPerSecond = 1000000000.0;
+const double nanosPerMilli = 1000000.0;
+const double pixelsPerMegapixel = 1000000.0;
+
+// The percentiles reported, and their names in the reports
+const double percentiles[] = {0.5, 0.9, 0.99};
+const char* const percentileNames[] = {"median", "p90", "p99"};
+#define PERCENTILE_COUNT 3
+
+// Error Message
+const char* const usageErrorMessage
+        = "Usage: ./uqfacebench [imagefile ...] [--iterations n]"
+          " [--warmup n] [--threads n] [--bands n] [--engine simd|opencv]"
+          " [--replacefile filename] [--json filename]\n";
+const char* const inputFileErrorMessageFormat
+        = "uqfacebench: cannot read the image file \"%s\"\n";
+const char* const outputFileErrorMessageFormat
+        = "uqfacebench: unable to open the output file \"%s\" for writing\n";
+const char* const cascadeErrorMessage
+        = "uqfacebench: cannot load a cascade classifier\n";
+
+// The Argument of the program
+typedef struct {
+    char** imageFileNames;
+    int imageCount;
+    int iterations; // timed runs of every case
+    int warmup; // untimed runs before them
+    int threads; // helper threads of the task pool, 0 for none
+    int bands; // bands the face search is split into
+    bool simdCascade; // run the face cascade with cascade.c if it can
+    char* replaceFileName; // NULL for a synthetic replacement
+    char* jsonFileName; // where the JSON report goes, NULL for none
+    char* badFileName; // the file that could not be used, for the error
+} Arguments;
+
+// What a kernel runs on. The frame is drawn over by the drawing kernels, so
+// it is copied afresh from the pristine one before every run.
+typedef struct {
+    DetectWorker* worker;
+    IplImage* pristine; // the frame as read or made
+    IplImage* frame; // what the kernel runs on
+    IplImage* replace;
+    CvRect* faces;
+    int faceCount;
+    EyeSearch* searches; // the faces with eyes, for drawing
+    int bands;
+} BenchInput;
+
+// One of the functions timed, run once on its input
+typedef void (*BenchKernel)(BenchInput* input);
+
+// The timings of one kernel on one input, in nanoseconds, sorted
+typedef struct {
+    char kernel[MAX_LABEL_LENGTH];
+    char input[MAX_LABEL_LENGTH];
+    int width;
+    int height;
+    int faces;
+    uint64_t* samples;
+    int count;
+} BenchResult;
+
+// A run of the suite: the shared state of the kernels and what they timed
+typedef struct {
+    Arguments* args;
+    ModelSet* models; // the server's built in ones
+    Prescreen prescreen; // unused, the workers need one
+    TaskPool pool;
+    DetectWorker* worker; // of the main thread, attached to the pool
+    IplImage* replace;
+    BenchResult* results;
+    int resultCount;
+    int resultCapacity;
+} Bench;
+
+// This enum contains the program exit status codes
+typedef enum {
+    EXIT_OK_STATUS = 0,
+    EXIT_USAGE_STATUS = 17,
+    EXIT_OUTPUTFILE_STATUS = 9,
+    EXIT_CASCADE_STATUS = 10,
+    EXIT_INPUTFILE_STATUS = 20
+} ExitStatus;
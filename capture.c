@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture.h"
+
+static int captureFd = -1; // the capture file, -1 while capture is off
+static int captureInterval; // requests per sampled one, 0 for none
+static uint64_t captureSlowNanos; // 0 for no slow request capture
+static uint64_t requestsSeen; // picks the sampled requests
+static uint32_t connectionsSeen; // numbers the connections of the process
+
+/*
+ * capture_open
+ * ------------
+ * Turns capture on, appending requests to the capture file at path: one of
+ * every sampleInterval requests (none for 0), and every request whose
+ * response takes longer than slowNanos (none for 0). A new file is created
+ * with the capture header; an existing capture file is appended to, so runs
+ * and processes forked later, such as shards, add to the same one.
+ * Returns false if the file cannot be written or is not a capture file.
+ */
+bool capture_open(const char* path, int sampleInterval, uint64_t slowNanos)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    char magic[CAPTURE_MAGIC_BYTES];
+    bool valid = fstat(fd, &info) == 0;
+    if (valid && info.st_size == 0) {
+        valid = write(fd, CAPTURE_MAGIC, CAPTURE_MAGIC_BYTES)
+                == CAPTURE_MAGIC_BYTES;
+    } else if (valid) {
+        // records are only ever appended after a valid header
+        valid = info.st_size % CAPTURE_ALIGN == 0
+                && pread(fd, magic, CAPTURE_MAGIC_BYTES, 0)
+                        == CAPTURE_MAGIC_BYTES
+                && memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_BYTES) == 0;
+    }
+    if (!valid) {
+        close(fd);
+        return false;
+    }
+    captureFd = fd;
+    captureInterval = sampleInterval;
+    captureSlowNanos = slowNanos;
+    return true;
+}
+
+/*
+ * capture_enabled
+ * ---------------
+ * Returns true if requests are being captured.
+ */
+bool capture_enabled(void)
+{
+    return __atomic_load_n(&captureFd, __ATOMIC_RELAXED) >= 0;
+}
+
+/*
+ * capture_connection
+ * ------------------
+ * Returns a number for a new connection, unique among the processes that
+ * share the capture file, which the replay uses to keep the requests of a
+ * connection together.
+ */
+uint64_t capture_connection(void)
+{
+    uint32_t count = __atomic_add_fetch(&connectionsSeen, 1, __ATOMIC_RELAXED);
+    return (uint64_t)getpid() << 32 | count;
+}
+
+/*
+ * capture_reasons
+ * ---------------
+ * Called once per finished request with how long it took. Returns why it is
+ * to be captured, as CAPTURE_ flags, or 0 if it is not.
+ */
+uint8_t capture_reasons(uint64_t latency)
+{
+    if (!capture_enabled()) {
+        return 0;
+    }
+    uint8_t reasons = 0;
+    uint64_t seen = __atomic_fetch_add(&requestsSeen, 1, __ATOMIC_RELAXED);
+    if (captureInterval && seen % captureInterval == 0) {
+        reasons |= CAPTURE_SAMPLED;
+    }
+    if (captureSlowNanos && latency > captureSlowNanos) {
+        reasons |= CAPTURE_SLOW;
+    }
+    return reasons;
+}
+
+/*
+ * capture_write
+ * -------------
+ * Appends a record made of the header and the parts of the framed request,
+ * which are gathered by the kernel rather than copied. The record's lengths
+ * are filled in here. The record is written in a single call so the
+ * threads and processes sharing the file do not interleave. A record that
+ * cannot be written whole, on a full disk say, would shift every record
+ * after it: it is cut off the file again if nothing was appended after it,
+ * and this process captures no more.
+ */
+void capture_write(
+        CaptureRecord* record, const struct iovec* parts, int partCount)
+{
+    static const uint8_t padding[CAPTURE_ALIGN];
+    struct iovec vector[CAPTURE_MAX_PARTS + 2];
+    size_t size = 0;
+    vector[0].iov_base = record;
+    vector[0].iov_len = sizeof(CaptureRecord);
+    for (int i = 0; i < partCount && i < CAPTURE_MAX_PARTS; i++) {
+        vector[i + 1] = parts[i];
+        size += parts[i].iov_len;
+    }
+    int count = 1 + (partCount < CAPTURE_MAX_PARTS ? partCount
+                                                  : CAPTURE_MAX_PARTS);
+    size_t padded = (size + CAPTURE_ALIGN - 1) / CAPTURE_ALIGN * CAPTURE_ALIGN;
+    vector[count].iov_base = (void*)padding;
+    vector[count++].iov_len = padded - size;
+    record->requestSize = (uint32_t)size;
+    record->length = (uint32_t)(sizeof(CaptureRecord) + padded);
+    int fd = __atomic_load_n(&captureFd, __ATOMIC_RELAXED);
+    if (fd < 0) {
+        return;
+    }
+    ssize_t written = writev(fd, vector, count);
+    if (written == (ssize_t)record->length) {
+        return;
+    }
+    struct stat info;
+    off_t end = lseek(fd, 0, SEEK_CUR); // just past what was appended
+    if (written > 0 && end >= written && fstat(fd, &info) == 0
+            && info.st_size == end && ftruncate(fd, end - written) != 0) {
+        perror("capture");
+    }
+    // the descriptor is left open, as other threads may be writing to it
+    if (__atomic_exchange_n(&captureFd, -1, __ATOMIC_RELAXED) >= 0) {
+        fprintf(stderr, "capture: cannot write a record, capture stopped\n");
+    }
+}
+
+/*
+ * capture_map
+ * -----------
+ * Maps a capture file for reading. Returns false if it cannot be read or
+ * is not a capture file.
+ */
+bool capture_map(const char* path, CaptureFile* file)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0) {
+        return false;
+    }
+    file->data = NULL;
+    if (fstat(fd, &info) == 0 && info.st_size >= CAPTURE_MAGIC_BYTES) {
+        file->size = (size_t)info.st_size;
+        file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->data == MAP_FAILED) {
+            file->data = NULL;
+        }
+    }
+    close(fd);
+    if (file->data
+            && memcmp(file->data, CAPTURE_MAGIC, CAPTURE_MAGIC_BYTES) != 0) {
+        capture_unmap(file);
+    }
+    return file->data != NULL;
+}
+
+/*
+ * capture_next
+ * ------------
+ * Returns the record after the given one, or the first record for NULL.
+ * Returns NULL at the end of the file, or at a record cut short by a
+ * server that stopped while writing it.
+ */
+const CaptureRecord* capture_next(
+        const CaptureFile* file, const CaptureRecord* record)
+{
+    size_t offset = record
+            ? (size_t)((const uint8_t*)record - file->data) + record->length
+            : CAPTURE_MAGIC_BYTES;
+    if (offset + sizeof(CaptureRecord) > file->size) {
+        return NULL;
+    }
+    const CaptureRecord* next = (const CaptureRecord*)(file->data + offset);
+    if (next->length < sizeof(CaptureRecord) + next->requestSize
+            || next->length % CAPTURE_ALIGN
+            || next->length > file->size - offset) {
+        return NULL;
+    }
+    return next;
+}
+
+/*
+ * capture_request
+ * ---------------
+ * Returns the framed request of a record, requestSize bytes.
+ */
+const uint8_t* capture_request(const CaptureRecord* record)
+{
+    return (const uint8_t*)(record + 1);
+}
+
+/*
+ * capture_unmap
+ * -------------
+ * Unmaps a capture file mapped by capture_map().
+ */
+void capture_unmap(CaptureFile* file)
+{
+    if (file->data) {
+        munmap(file->data, file->size);
+        file->data = NULL;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// A capture file starts with these CAPTURE_MAGIC_BYTES, followed by one
+// record per captured request, each starting at a multiple of CAPTURE_ALIGN
+// so a mapping of the file can be read in place
+#define CAPTURE_MAGIC "UQFCAP01"
+#define CAPTURE_MAGIC_BYTES 8
+#define CAPTURE_ALIGN 8
+#define CAPTURE_MAX_PARTS 8
+
+// Why a request was captured, any of these
+#define CAPTURE_SAMPLED 0x01 // one of the sampled requests
+#define CAPTURE_SLOW 0x02 // its response took longer than the threshold
+
+// The header of a captured request in a capture file. It is followed by
+// the request as a client frames it, its images inline, then padding.
+typedef struct {
+    uint32_t length; // of the whole record, padding included
+    uint32_t requestSize; // of the framed request
+    uint64_t arrival; // monotonic nanoseconds the request began arriving
+    uint64_t latency; // nanoseconds from then until the response was sent
+    uint64_t connection; // the connection it came on, unique in the file
+    uint8_t reasons; // why it was captured, CAPTURE_ flags
+    uint8_t operation; // its operation type, as numbered in protocol.h
+    uint8_t reserved[6];
+} CaptureRecord;
+
+// A capture file mapped for reading
+typedef struct {
+    uint8_t* data;
+    size_t size;
+} CaptureFile;
+
+bool capture_open(const char* path, int sampleInterval, uint64_t slowNanos);
+bool capture_enabled(void);
+uint64_t capture_connection(void);
+uint8_t capture_reasons(uint64_t latency);
+void capture_write(
+        CaptureRecord* record, const struct iovec* parts, int partCount);
+
+bool capture_map(const char* path, CaptureFile* file);
+const CaptureRecord* capture_next(
+        const CaptureFile* file, const CaptureRecord* record);
+const uint8_t* capture_request(const CaptureRecord* record);
+void capture_unmap(CaptureFile* file);
+
+#endif
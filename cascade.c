@@ -0,0 +1,1006 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cascade.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CASCADE_X86
+#endif
+
+#define LANES 8
+#define WINDOW_MARGIN 10 // scales stop when the window is this close to a side
+#define STAGE_THRESHOLD_BIAS 0.0001
+#define INITIAL_HITS 64
+#define BYTE_ORDER_MARK 0x01020304
+#define MAX_TEMP_PATH 4096
+
+// The header of a compiled cascade file. The byte order mark and record
+// sizes tell a build of another layout that the file is not for it.
+typedef struct {
+    char magic[CASCADE_FILE_MAGIC_BYTES];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t stageSize;
+    uint32_t treeSize;
+    uint32_t nodeSize;
+    int32_t windowWidth;
+    int32_t windowHeight;
+    int32_t stageCount;
+    int32_t treeCount;
+    int32_t nodeCount;
+    uint64_t stagesOffset;
+    uint64_t treesOffset;
+    uint64_t nodesOffset;
+    uint64_t size; // of the whole file
+} CascadeFileHeader;
+
+// Values of the windows evaluated together, one per lane
+typedef uint32_t UintLanes
+        __attribute__((vector_size(LANES * sizeof(uint32_t))));
+typedef int32_t IntLanes __attribute__((vector_size(LANES * sizeof(int32_t))));
+typedef float FloatLanes __attribute__((vector_size(LANES * sizeof(float))));
+
+// Loads the integral image value at every lane's position past base. Every
+// lane holds a window of the scale, if not one still evaluated, so all the
+// loads are in bounds.
+typedef void (*GatherFunction)(
+        const uint32_t* base, const UintLanes* positions, UintLanes* out);
+
+// A node's feature at one scale: the integral image offsets from a
+// window's origin of the distinct corners of its rectangles, which
+// rectangles often share, each rectangle's corners as indices into them,
+// and the weights normalised by the window's area
+typedef struct {
+    int offsets[CASCADE_MAX_RECTS * 4];
+    int offsetCount;
+    uint8_t corners[CASCADE_MAX_RECTS][4];
+    float weights[CASCADE_MAX_RECTS];
+    int rectCount;
+    float threshold;
+} ScaledNode;
+
+// The cascade set up for the windows of one scale
+typedef struct {
+    const CompiledCascade* cascade;
+    const uint32_t* sum;
+    const double* sqsum;
+    int corners[4]; // of the window's inner area, giving its mean and variance
+    double inverseArea;
+    ScaledNode* nodes;
+} Scale;
+
+// The windows of a row still being evaluated, and the standard deviation
+// of each, in room for a whole number of LANES
+typedef struct {
+    uint32_t* positions;
+    int* xs;
+    float* norms;
+    int count;
+} Row;
+
+// The windows found so far
+typedef struct {
+    CvRect* rects;
+    int count;
+    int capacity;
+} Hits;
+
+/*
+ * link_tree
+ * ---------
+ * Records the parent and branch of every node and leaf of a weak
+ * classifier's tree. Returns false if the tree is malformed or lists a node
+ * before its parent.
+ */
+static bool link_tree(const CvHaarClassifier* source, CascadeTree* tree)
+{
+    for (int n = 0; n < source->count; n++) {
+        tree->nodeParents[n] = -1;
+    }
+    for (int leaf = 0; leaf <= source->count; leaf++) {
+        tree->leafParents[leaf] = -1;
+    }
+    for (int n = 0; n < source->count; n++) {
+        if (n > 0 && tree->nodeParents[n] < 0) {
+            return false;
+        }
+        int branches[2] = {source->left[n], source->right[n]};
+        for (int i = 0; i < 2; i++) {
+            int child = branches[i];
+            if (child > 0 && child > n && child < source->count
+                    && tree->nodeParents[child] < 0) {
+                tree->nodeParents[child] = (int8_t)n;
+                tree->nodeLeft[child] = i == 0;
+            } else if (child <= 0 && -child <= source->count
+                    && tree->leafParents[-child] < 0) {
+                tree->leafParents[-child] = (int8_t)n;
+                tree->leafLeft[-child] = i == 0;
+            } else {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * compile_tree
+ * ------------
+ * Copies a weak classifier and the features of its nodes, which are stored
+ * from nodes onwards. Returns false if it is malformed, uses tilted
+ * features or more nodes than supported.
+ */
+static bool compile_tree(
+        const CvHaarClassifier* source, CascadeTree* tree, CascadeNode* nodes)
+{
+    if (source->count < 1 || source->count > CASCADE_MAX_NODES) {
+        return false;
+    }
+    tree->nodeCount = source->count;
+    for (int leaf = 0; leaf <= source->count; leaf++) {
+        tree->leaves[leaf] = source->alpha[leaf];
+    }
+    for (int i = 0; i < source->count; i++) {
+        const CvHaarFeature* feature = &source->haar_feature[i];
+        CascadeNode* node = &nodes[i];
+        node->rectCount = 0;
+        for (int k = 0; k < CASCADE_MAX_RECTS && feature->rect[k].r.width;
+                k++) {
+            node->rects[k] = feature->rect[k].r;
+            node->weights[k] = feature->rect[k].weight;
+            node->rectCount++;
+        }
+        node->threshold = source->threshold[i];
+        if (feature->tilted || node->rectCount == 0) {
+            return false;
+        }
+    }
+    return link_tree(source, tree);
+}
+
+/*
+ * cascade_compile
+ * ---------------
+ * Lays out a Haar cascade loaded by OpenCV for evaluation by
+ * cascade_detect. Returns NULL if the cascade is empty or uses what the
+ * engine does not support: a tree of stages, tilted features or deep weak
+ * classifiers.
+ */
+CompiledCascade* cascade_compile(const CvHaarClassifierCascade* source)
+{
+    CompiledCascade* cascade = calloc(1, sizeof(CompiledCascade));
+    cascade->window = source->orig_window_size;
+    cascade->stageCount = source->count;
+    for (int s = 0; s < source->count; s++) {
+        const CvHaarStageClassifier* stage = &source->stage_classifier[s];
+        cascade->treeCount += stage->count;
+        for (int c = 0; c < stage->count; c++) {
+            cascade->nodeCount += stage->classifier[c].count;
+        }
+    }
+    cascade->stages = calloc(source->count ? source->count : 1,
+            sizeof(CascadeStage));
+    cascade->trees = calloc(cascade->treeCount ? cascade->treeCount : 1,
+            sizeof(CascadeTree));
+    cascade->nodes = calloc(cascade->nodeCount ? cascade->nodeCount : 1,
+            sizeof(CascadeNode));
+    bool supported = source->count > 0;
+    int trees = 0;
+    int nodes = 0;
+    for (int s = 0; supported && s < source->count; s++) {
+        const CvHaarStageClassifier* stage = &source->stage_classifier[s];
+        cascade->stages[s].firstTree = trees;
+        cascade->stages[s].treeCount = stage->count;
+        cascade->stages[s].threshold
+                = (float)(stage->threshold - STAGE_THRESHOLD_BIAS);
+        supported = stage->next == -1;
+        for (int c = 0; supported && c < stage->count; c++) {
+            CascadeTree* tree = &cascade->trees[trees++];
+            tree->firstNode = nodes;
+            supported = compile_tree(
+                    &stage->classifier[c], tree, &cascade->nodes[nodes]);
+            nodes += stage->classifier[c].count;
+        }
+    }
+    if (!supported) {
+        cascade_free(cascade);
+        return NULL;
+    }
+#ifdef CASCADE_X86
+    cascade->avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return cascade;
+}
+
+/*
+ * cascade_free
+ * ------------
+ * Frees a compiled cascade.
+ */
+void cascade_free(CompiledCascade* cascade)
+{
+    if (cascade->mapping) {
+        munmap(cascade->mapping, cascade->mappingSize);
+    } else {
+        free(cascade->stages);
+        free(cascade->trees);
+        free(cascade->nodes);
+    }
+    free(cascade);
+}
+
+/*
+ * cascade_mirror
+ * --------------
+ * Returns a copy of a compiled cascade with every feature flipped left to
+ * right within the window, which detects the mirror images of what the
+ * cascade detects (a profile facing the other way) on the same integral
+ * images, rather than on a flipped copy of the image.
+ */
+CompiledCascade* cascade_mirror(const CompiledCascade* source)
+{
+    CompiledCascade* cascade = calloc(1, sizeof(CompiledCascade));
+    *cascade = *source;
+    cascade->mapping = NULL;
+    cascade->mappingSize = 0;
+    size_t stagesSize = sizeof(CascadeStage) * source->stageCount;
+    size_t treesSize = sizeof(CascadeTree) * source->treeCount;
+    size_t nodesSize = sizeof(CascadeNode) * source->nodeCount;
+    cascade->stages = malloc(stagesSize ? stagesSize : 1);
+    cascade->trees = malloc(treesSize ? treesSize : 1);
+    cascade->nodes = malloc(nodesSize ? nodesSize : 1);
+    memcpy(cascade->stages, source->stages, stagesSize);
+    memcpy(cascade->trees, source->trees, treesSize);
+    memcpy(cascade->nodes, source->nodes, nodesSize);
+    for (int n = 0; n < cascade->nodeCount; n++) {
+        CascadeNode* node = &cascade->nodes[n];
+        for (int k = 0; k < node->rectCount; k++) {
+            CvRect* rect = &node->rects[k];
+            rect->x = cascade->window.width - rect->x - rect->width;
+        }
+    }
+    return cascade;
+}
+
+/*
+ * align_offset
+ * ------------
+ * Rounds a file offset up to a multiple of CASCADE_FILE_ALIGN.
+ */
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + CASCADE_FILE_ALIGN - 1) / CASCADE_FILE_ALIGN
+            * CASCADE_FILE_ALIGN;
+}
+
+/*
+ * layout_header
+ * -------------
+ * Fills in the header of a compiled cascade file for a cascade of the
+ * given window and counts, placing the arrays after it.
+ */
+static void layout_header(CascadeFileHeader* header, CvSize window,
+        int stageCount, int treeCount, int nodeCount)
+{
+    memset(header, 0, sizeof(CascadeFileHeader));
+    memcpy(header->magic, CASCADE_FILE_MAGIC, CASCADE_FILE_MAGIC_BYTES);
+    header->version = CASCADE_FILE_VERSION;
+    header->byteOrder = BYTE_ORDER_MARK;
+    header->stageSize = sizeof(CascadeStage);
+    header->treeSize = sizeof(CascadeTree);
+    header->nodeSize = sizeof(CascadeNode);
+    header->windowWidth = window.width;
+    header->windowHeight = window.height;
+    header->stageCount = stageCount;
+    header->treeCount = treeCount;
+    header->nodeCount = nodeCount;
+    header->stagesOffset = align_offset(sizeof(CascadeFileHeader));
+    header->treesOffset = align_offset(header->stagesOffset
+            + (uint64_t)stageCount * sizeof(CascadeStage));
+    header->nodesOffset = align_offset(header->treesOffset
+            + (uint64_t)treeCount * sizeof(CascadeTree));
+    header->size = header->nodesOffset
+            + (uint64_t)nodeCount * sizeof(CascadeNode);
+}
+
+/*
+ * write_at
+ * --------
+ * Writes size bytes at the given offset of a file, the gap before it
+ * left as zeros. Returns false if it cannot.
+ */
+static bool write_at(FILE* file, uint64_t offset, const void* data,
+        size_t size)
+{
+    return fseek(file, (long)offset, SEEK_SET) == 0
+            && fwrite(data, 1, size, file) == size;
+}
+
+/*
+ * cascade_save
+ * ------------
+ * Writes a compiled cascade to a compiled cascade file at path, for
+ * cascade_map to load. The file is written alongside and renamed over
+ * path, so processes that have the old one mapped keep it intact.
+ * Returns false if it cannot be written.
+ */
+bool cascade_save(const CompiledCascade* cascade, const char* path)
+{
+    CascadeFileHeader header;
+    layout_header(&header, cascade->window, cascade->stageCount,
+            cascade->treeCount, cascade->nodeCount);
+    char temp[MAX_TEMP_PATH];
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    FILE* file = fopen(temp, "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = write_at(file, 0, &header, sizeof(header))
+            && write_at(file, header.stagesOffset, cascade->stages,
+                    sizeof(CascadeStage) * cascade->stageCount)
+            && write_at(file, header.treesOffset, cascade->trees,
+                    sizeof(CascadeTree) * cascade->treeCount)
+            && write_at(file, header.nodesOffset, cascade->nodes,
+                    sizeof(CascadeNode) * cascade->nodeCount);
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temp, path) != 0) {
+        unlink(temp);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * valid_header
+ * ------------
+ * Returns true if the header of a mapped file of the given size is that of
+ * a compiled cascade file of this layout, whose arrays fit in the file.
+ */
+static bool valid_header(const CascadeFileHeader* header, size_t size)
+{
+    CascadeFileHeader expected;
+    if (size < sizeof(CascadeFileHeader) || header->stageCount < 1
+            || header->treeCount < 1 || header->nodeCount < 1
+            || header->windowWidth < 1 || header->windowHeight < 1) {
+        return false;
+    }
+    layout_header(&expected,
+            cvSize(header->windowWidth, header->windowHeight),
+            header->stageCount, header->treeCount, header->nodeCount);
+    // everything but the counts follows from them
+    return memcmp(header, &expected, sizeof(CascadeFileHeader)) == 0
+            && header->size == size;
+}
+
+/*
+ * valid_tree
+ * ----------
+ * Returns true if a tree's nodes lie within the cascade, each but the root
+ * hanging off one listed before it, and its leaves hang off its nodes.
+ */
+static bool valid_tree(const CompiledCascade* cascade, const CascadeTree* tree)
+{
+    if (tree->firstNode < 0 || tree->nodeCount < 1
+            || tree->nodeCount > CASCADE_MAX_NODES
+            || tree->firstNode > cascade->nodeCount - tree->nodeCount
+            || tree->nodeParents[0] != -1) {
+        return false;
+    }
+    for (int n = 1; n < tree->nodeCount; n++) {
+        if (tree->nodeParents[n] < 0 || tree->nodeParents[n] >= n) {
+            return false;
+        }
+    }
+    for (int leaf = 0; leaf <= tree->nodeCount; leaf++) {
+        if (tree->leafParents[leaf] < -1
+                || tree->leafParents[leaf] >= tree->nodeCount) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * valid_node
+ * ----------
+ * Returns true if a node's rectangles lie within the cascade's window, so
+ * evaluating it stays within the integral images.
+ */
+static bool valid_node(const CompiledCascade* cascade, const CascadeNode* node)
+{
+    if (node->rectCount < 1 || node->rectCount > CASCADE_MAX_RECTS) {
+        return false;
+    }
+    for (int k = 0; k < node->rectCount; k++) {
+        CvRect rect = node->rects[k];
+        if (rect.x < 0 || rect.y < 0 || rect.width < 1 || rect.height < 1
+                || rect.x + rect.width > cascade->window.width
+                || rect.y + rect.height > cascade->window.height) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * valid_cascade
+ * -------------
+ * Returns true if the arrays of a mapped cascade refer only within
+ * themselves, so a damaged file cannot send the evaluator astray.
+ */
+static bool valid_cascade(const CompiledCascade* cascade)
+{
+    for (int s = 0; s < cascade->stageCount; s++) {
+        const CascadeStage* stage = &cascade->stages[s];
+        if (stage->firstTree < 0 || stage->treeCount < 1
+                || stage->firstTree > cascade->treeCount - stage->treeCount) {
+            return false;
+        }
+    }
+    for (int t = 0; t < cascade->treeCount; t++) {
+        if (!valid_tree(cascade, &cascade->trees[t])) {
+            return false;
+        }
+    }
+    for (int n = 0; n < cascade->nodeCount; n++) {
+        if (!valid_node(cascade, &cascade->nodes[n])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * cascade_map
+ * -----------
+ * Maps a compiled cascade file written by cascade_save read only. The
+ * cascade is evaluated in place, so loading it costs a check of the file
+ * rather than a parse, and every process mapping the file shares its pages.
+ * Returns NULL if the file cannot be read or is not a valid compiled
+ * cascade file of this version and layout.
+ */
+CompiledCascade* cascade_map(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0) {
+        return NULL;
+    }
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd,
+                0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    const CascadeFileHeader* header = mapping;
+    CompiledCascade* cascade = calloc(1, sizeof(CompiledCascade));
+    cascade->mapping = mapping;
+    cascade->mappingSize = (size_t)info.st_size;
+    if (!valid_header(header, cascade->mappingSize)) {
+        cascade_free(cascade);
+        return NULL;
+    }
+    uint8_t* base = mapping;
+    cascade->window = cvSize(header->windowWidth, header->windowHeight);
+    cascade->stageCount = header->stageCount;
+    cascade->stages = (CascadeStage*)(base + header->stagesOffset);
+    cascade->treeCount = header->treeCount;
+    cascade->trees = (CascadeTree*)(base + header->treesOffset);
+    cascade->nodeCount = header->nodeCount;
+    cascade->nodes = (CascadeNode*)(base + header->nodesOffset);
+    if (!valid_cascade(cascade)) {
+        cascade_free(cascade);
+        return NULL;
+    }
+#ifdef CASCADE_X86
+    cascade->avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return cascade;
+}
+
+/*
+ * cascade_integral_create
+ * -----------------------
+ * Allocates the integral images of a grey image of the given size, to be
+ * filled in by equalise_gray.
+ */
+CascadeIntegral* cascade_integral_create(CvSize size)
+{
+    CascadeIntegral* integral = malloc(sizeof(CascadeIntegral));
+    size_t cells = (size_t)(size.width + 1) * (size.height + 1);
+    integral->size = size;
+    integral->sum = malloc(sizeof(uint32_t) * cells);
+    integral->sqsum = malloc(sizeof(double) * cells);
+    return integral;
+}
+
+/*
+ * cascade_integral_free
+ * ---------------------
+ * Frees integral images.
+ */
+void cascade_integral_free(CascadeIntegral* integral)
+{
+    free(integral->sum);
+    free(integral->sqsum);
+    free(integral);
+}
+
+/*
+ * rect_corners
+ * ------------
+ * Stores the integral image offsets of the rectangle's corners, in the
+ * order its sum is p0 - p1 - p2 + p3.
+ */
+static void rect_corners(CvRect rect, int step, int* corners)
+{
+    corners[0] = rect.y * step + rect.x;
+    corners[1] = rect.y * step + rect.x + rect.width;
+    corners[2] = (rect.y + rect.height) * step + rect.x;
+    corners[3] = (rect.y + rect.height) * step + rect.x + rect.width;
+}
+
+/*
+ * distinct_offset
+ * ---------------
+ * Returns the index of an integral image offset among the node's distinct
+ * corner offsets, adding it if it is new.
+ */
+static int distinct_offset(ScaledNode* node, int offset)
+{
+    for (int i = 0; i < node->offsetCount; i++) {
+        if (node->offsets[i] == offset) {
+            return i;
+        }
+    }
+    node->offsets[node->offsetCount] = offset;
+    return node->offsetCount++;
+}
+
+/*
+ * prepare_scale
+ * -------------
+ * Scales the cascade's features to the window size of the given factor, as
+ * cvSetImagesForHaarClassifierCascade does: rectangles are rounded, and the
+ * first one's weight is set so every feature sums to zero over a flat
+ * window despite the rounding.
+ */
+static void prepare_scale(Scale* scale, double factor, int step)
+{
+    const CompiledCascade* cascade = scale->cascade;
+    CvRect inner = cvRect(cvRound(factor), cvRound(factor),
+            cvRound((cascade->window.width - 2) * factor),
+            cvRound((cascade->window.height - 2) * factor));
+    scale->inverseArea = 1. / (inner.width * inner.height);
+    rect_corners(inner, step, scale->corners);
+    for (int i = 0; i < cascade->nodeCount; i++) {
+        const CascadeNode* node = &cascade->nodes[i];
+        ScaledNode* scaled = &scale->nodes[i];
+        scaled->offsetCount = 0;
+        double firstArea = 0;
+        double weightedArea = 0; // of the other rectangles
+        for (int k = 0; k < node->rectCount; k++) {
+            CvRect rect = cvRect(cvRound(node->rects[k].x * factor),
+                    cvRound(node->rects[k].y * factor),
+                    cvRound(node->rects[k].width * factor),
+                    cvRound(node->rects[k].height * factor));
+            int corners[4];
+            rect_corners(rect, step, corners);
+            for (int c = 0; c < 4; c++) {
+                scaled->corners[k][c] = (uint8_t)distinct_offset(scaled,
+                        corners[c]);
+            }
+            scaled->weights[k]
+                    = (float)(node->weights[k] * scale->inverseArea);
+            if (k == 0) {
+                firstArea = rect.width * rect.height;
+            } else {
+                weightedArea += scaled->weights[k] * rect.width * rect.height;
+            }
+        }
+        scaled->weights[0] = (float)(-weightedArea / firstArea);
+        scaled->rectCount = node->rectCount;
+        scaled->threshold = node->threshold;
+    }
+}
+
+/*
+ * gather_generic
+ * --------------
+ * Loads the lanes' integral image values one by one.
+ */
+static void gather_generic(
+        const uint32_t* base, const UintLanes* positions, UintLanes* out)
+{
+    for (int i = 0; i < LANES; i++) {
+        (*out)[i] = base[(*positions)[i]];
+    }
+}
+
+#ifdef CASCADE_X86
+/*
+ * gather_avx2
+ * -----------
+ * Loads the lanes' integral image values with one AVX2 gather.
+ */
+__attribute__((target("avx2"))) static void gather_avx2(
+        const uint32_t* base, const UintLanes* positions, UintLanes* out)
+{
+    *out = (UintLanes)_mm256_i32gather_epi32((const int*)base,
+            (__m256i)*positions, sizeof(uint32_t));
+}
+#endif
+
+/*
+ * window_norms
+ * ------------
+ * Stores the standard deviation of the grey values over the inner area of
+ * every lane's window (1 if rounding makes the variance negative), which
+ * the node thresholds are scaled by. Vectors go through pointers, which
+ * keeps to one calling convention with and without AVX.
+ */
+static inline __attribute__((always_inline)) void window_norms(
+        const Scale* scale, const UintLanes* positions, GatherFunction gather,
+        FloatLanes* norms)
+{
+    UintLanes corners[4];
+    for (int c = 0; c < 4; c++) {
+        gather(scale->sum + scale->corners[c], positions, &corners[c]);
+    }
+    IntLanes sum = (IntLanes)(corners[0] - corners[1] - corners[2]
+            + corners[3]);
+    for (int i = 0; i < LANES; i++) {
+        const double* sqsum = scale->sqsum + (*positions)[i];
+        double mean = sum[i] * scale->inverseArea;
+        double variance = (sqsum[scale->corners[0]] - sqsum[scale->corners[1]]
+                                  - sqsum[scale->corners[2]]
+                                  + sqsum[scale->corners[3]])
+                        * scale->inverseArea
+                - mean * mean;
+        (*norms)[i] = (float)(variance >= 0 ? sqrt(variance) : 1);
+    }
+}
+
+/*
+ * node_below
+ * ----------
+ * Evaluates a node's feature on every lane's window, loading each distinct
+ * corner once, and stores which fall below its threshold.
+ * Sums are in single precision, as in OpenCV's own AVX code for Haar
+ * cascades, rather than the double precision of its scalar code.
+ */
+static inline __attribute__((always_inline)) void node_below(
+        const Scale* scale, const ScaledNode* node,
+        const UintLanes* positions, const FloatLanes* norms,
+        GatherFunction gather, IntLanes* below)
+{
+    UintLanes values[CASCADE_MAX_RECTS * 4];
+    for (int i = 0; i < node->offsetCount; i++) {
+        gather(scale->sum + node->offsets[i], positions, &values[i]);
+    }
+    FloatLanes feature = {0};
+    for (int k = 0; k < node->rectCount; k++) {
+        const uint8_t* corners = node->corners[k];
+        IntLanes sum = (IntLanes)(values[corners[0]] - values[corners[1]]
+                - values[corners[2]] + values[corners[3]]);
+        feature += __builtin_convertvector(sum, FloatLanes) * node->weights[k];
+    }
+    *below = feature < *norms * node->threshold;
+}
+
+/*
+ * any_lane
+ * --------
+ * Returns whether the mask is set in any lane.
+ */
+static inline bool any_lane(const IntLanes* mask)
+{
+    uint64_t words[sizeof(IntLanes) / sizeof(uint64_t)];
+    memcpy(words, mask, sizeof(words));
+    uint64_t any = 0;
+    for (size_t i = 0; i < sizeof(words) / sizeof(uint64_t); i++) {
+        any |= words[i];
+    }
+    return any != 0;
+}
+
+/*
+ * lane_bits
+ * ---------
+ * Returns a bit per lane, set where the mask is.
+ */
+static inline unsigned lane_bits(const IntLanes* mask)
+{
+    unsigned bits = 0;
+    for (int i = 0; i < LANES; i++) {
+        bits |= (unsigned)((*mask)[i] != 0) << i;
+    }
+    return bits;
+}
+
+/*
+ * add_tree_value
+ * --------------
+ * Evaluates a weak classifier on the windows of the given lanes and adds
+ * its value to each one's stage sum. Lanes walk the tree together: a node
+ * is skipped if no lane reaches it, and its result only counts for those
+ * that do.
+ */
+static inline __attribute__((always_inline)) void add_tree_value(
+        const Scale* scale, const CascadeTree* tree,
+        const UintLanes* positions, const IntLanes* lanes,
+        const FloatLanes* norms, GatherFunction gather, FloatLanes* stageSum)
+{
+    IntLanes reach[CASCADE_MAX_NODES];
+    IntLanes below[CASCADE_MAX_NODES];
+    for (int n = 0; n < tree->nodeCount; n++) {
+        int parent = tree->nodeParents[n];
+        if (parent < 0) {
+            reach[n] = *lanes;
+        } else {
+            reach[n] = reach[parent]
+                    & (tree->nodeLeft[n] ? below[parent] : ~below[parent]);
+        }
+        below[n] = (IntLanes){0};
+        if (any_lane(&reach[n])) {
+            node_below(scale, &scale->nodes[tree->firstNode + n], positions,
+                    norms, gather, &below[n]);
+        }
+    }
+    for (int leaf = 0; leaf <= tree->nodeCount; leaf++) {
+        int parent = tree->leafParents[leaf];
+        if (parent < 0) {
+            continue;
+        }
+        IntLanes taken = reach[parent]
+                & (tree->leafLeft[leaf] ? below[parent] : ~below[parent]);
+        FloatLanes leafValue = (FloatLanes){0} + tree->leaves[leaf];
+        *stageSum += (FloatLanes)((IntLanes)leafValue & taken);
+    }
+}
+
+/*
+ * visited_lanes
+ * -------------
+ * Returns the lanes among the valid ones (the first few) that OpenCV would
+ * evaluate: it skips the window after one rejected by the first stage.
+ * skip carries that over from the previous lanes of the row.
+ */
+static unsigned visited_lanes(unsigned valid, unsigned passed, bool* skip)
+{
+    unsigned visited = 0;
+    for (int i = 0; i < LANES && (valid >> i & 1); i++) {
+        if (*skip) {
+            *skip = false;
+            continue;
+        }
+        visited |= 1u << i;
+        *skip = !(passed >> i & 1);
+    }
+    return visited;
+}
+
+/*
+ * stage_passes
+ * ------------
+ * Runs a stage of the cascade on the windows of the given lanes (a bit per
+ * lane). Returns the lanes whose window passed it.
+ */
+static inline __attribute__((always_inline)) unsigned stage_passes(
+        const Scale* scale, const CascadeStage* stage,
+        const UintLanes* positions, unsigned lanes, const FloatLanes* norms,
+        GatherFunction gather)
+{
+    const CompiledCascade* cascade = scale->cascade;
+    IntLanes laneMask;
+    for (int i = 0; i < LANES; i++) {
+        laneMask[i] = lanes >> i & 1 ? -1 : 0;
+    }
+    FloatLanes stageSum = {0};
+    for (int t = 0; t < stage->treeCount; t++) {
+        add_tree_value(scale, &cascade->trees[stage->firstTree + t],
+                positions, &laneMask, norms, gather, &stageSum);
+    }
+    IntLanes passing = stageSum >= stage->threshold;
+    return lane_bits(&passing) & lanes;
+}
+
+/*
+ * keep_lanes
+ * ----------
+ * Moves the windows of the passed lanes, those from first onwards in the
+ * row, down to the kept windows. Returns the new number kept.
+ */
+static int keep_lanes(Row* row, int first, unsigned passed,
+        const FloatLanes* norms, int kept)
+{
+    for (int i = 0; i < LANES; i++) {
+        if (passed >> i & 1) {
+            row->positions[kept] = row->positions[first + i];
+            row->xs[kept] = row->xs[first + i];
+            row->norms[kept] = (*norms)[i];
+            kept++;
+        }
+    }
+    return kept;
+}
+
+/*
+ * lane_mask
+ * ---------
+ * Returns the lanes holding one of count windows from first onwards.
+ */
+static unsigned lane_mask(int first, int count)
+{
+    return count - first >= LANES ? (1u << LANES) - 1
+                                  : (1u << (count - first)) - 1;
+}
+
+/*
+ * evaluate_row
+ * ------------
+ * Runs the cascade on the windows of a row, stage by stage: every stage
+ * runs on LANES windows at a time, and the windows that pass it are packed
+ * together for the next, so lanes are not spent on rejected windows. Keeps
+ * in the row the windows that passed every stage.
+ */
+static inline __attribute__((always_inline)) void evaluate_row(
+        const Scale* scale, Row* row, GatherFunction gather)
+{
+    const CompiledCascade* cascade = scale->cascade;
+    UintLanes positions;
+    FloatLanes norms;
+    bool skip = false;
+    int kept = 0;
+    for (int i = 0; i < row->count; i += LANES) {
+        unsigned lanes = lane_mask(i, row->count);
+        memcpy(&positions, row->positions + i, sizeof(positions));
+        window_norms(scale, &positions, gather, &norms);
+        unsigned passed = stage_passes(scale, &cascade->stages[0],
+                &positions, lanes, &norms, gather);
+        passed &= visited_lanes(lanes, passed, &skip);
+        kept = keep_lanes(row, i, passed, &norms, kept);
+    }
+    row->count = kept;
+    for (int s = 1; s < cascade->stageCount && row->count; s++) {
+        kept = 0;
+        for (int i = 0; i < row->count; i += LANES) {
+            memcpy(&positions, row->positions + i, sizeof(positions));
+            memcpy(&norms, row->norms + i, sizeof(norms));
+            unsigned passed = stage_passes(scale, &cascade->stages[s],
+                    &positions, lane_mask(i, row->count), &norms, gather);
+            kept = keep_lanes(row, i, passed, &norms, kept);
+        }
+        row->count = kept;
+    }
+}
+
+/*
+ * evaluate_row_generic
+ * --------------------
+ * evaluate_row for any CPU: SSE2 on x86-64.
+ */
+static void evaluate_row_generic(const Scale* scale, Row* row)
+{
+    evaluate_row(scale, row, gather_generic);
+}
+
+#ifdef CASCADE_X86
+/*
+ * evaluate_row_avx2
+ * -----------------
+ * evaluate_row for CPUs with AVX2.
+ */
+__attribute__((target("avx2"))) static void evaluate_row_avx2(
+        const Scale* scale, Row* row)
+{
+    evaluate_row(scale, row, gather_avx2);
+}
+#endif
+
+/*
+ * add_hit
+ * -------
+ * Appends a window that passed every stage to the hits.
+ */
+static void add_hit(Hits* hits, CvRect rect)
+{
+    if (hits->count == hits->capacity) {
+        hits->capacity *= 2;
+        hits->rects = realloc(hits->rects, sizeof(CvRect) * hits->capacity);
+    }
+    hits->rects[hits->count++] = rect;
+}
+
+/*
+ * scan_scale
+ * ----------
+ * Runs the cascade over the windows of one scale row by row, stepping
+ * through them as cvHaarDetectObjects does.
+ */
+static void scan_scale(const Scale* scale, double factor, CvSize size,
+        CvSize image, Hits* hits)
+{
+    double ystep = factor > 2 ? factor : 2;
+    int endX = cvRound((image.width - size.width) / ystep);
+    int endY = cvRound((image.height - size.height) / ystep);
+    int step = image.width + 1;
+    int capacity = (endX + LANES - 1) / LANES * LANES;
+    Row row = {calloc(capacity ? capacity : 1, sizeof(uint32_t)),
+            malloc(sizeof(int) * (capacity ? capacity : 1)),
+            calloc(capacity ? capacity : 1, sizeof(float)), 0};
+    for (int iy = 0; iy < endY; iy++) {
+        int y = cvRound(iy * ystep);
+        for (int ix = 0; ix < endX; ix++) {
+            row.xs[ix] = cvRound(ix * ystep);
+            row.positions[ix] = (uint32_t)(y * step + row.xs[ix]);
+        }
+        row.count = endX;
+#ifdef CASCADE_X86
+        if (scale->cascade->avx2) {
+            evaluate_row_avx2(scale, &row);
+        } else {
+            evaluate_row_generic(scale, &row);
+        }
+#else
+        evaluate_row_generic(scale, &row);
+#endif
+        for (int i = 0; i < row.count; i++) {
+            add_hit(hits, cvRect(row.xs[i], y, size.width, size.height));
+        }
+    }
+    free(row.positions);
+    free(row.xs);
+    free(row.norms);
+}
+
+/*
+ * cascade_detect
+ * --------------
+ * Runs the compiled cascade over an 8-bit grey image, given by its integral
+ * images, at the window sizes between minSize and maxSize (0 for the
+ * image's size), stepping through scales and positions as
+ * cvHaarDetectObjects does without flags. The raw, ungrouped hits are
+ * stored in a malloc'd array through found. Returns the number of hits.
+ */
+int cascade_detect(const CompiledCascade* cascade,
+        const CascadeIntegral* integral, double scaleFactor, CvSize minSize,
+        CvSize maxSize, CvRect** found)
+{
+    CvSize image = integral->size;
+    int step = image.width + 1;
+    if (maxSize.width == 0 || maxSize.height == 0) {
+        maxSize = image;
+    }
+    Scale scale = {.cascade = cascade, .sum = integral->sum,
+            .sqsum = integral->sqsum};
+    scale.nodes = malloc(sizeof(ScaledNode)
+            * (cascade->nodeCount ? cascade->nodeCount : 1));
+    Hits hits = {malloc(sizeof(CvRect) * INITIAL_HITS), 0, INITIAL_HITS};
+    for (double factor = 1;
+            factor * cascade->window.width < image.width - WINDOW_MARGIN
+            && factor * cascade->window.height < image.height - WINDOW_MARGIN;
+            factor *= scaleFactor) {
+        CvSize size = cvSize(cvRound(cascade->window.width * factor),
+                cvRound(cascade->window.height * factor));
+        if (size.width < minSize.width || size.height < minSize.height) {
+            continue;
+        }
+        if (size.width > maxSize.width || size.height > maxSize.height) {
+            break;
+        }
+        prepare_scale(&scale, factor, step);
+        scan_scale(&scale, factor, size, image, &hits);
+    }
+    free(scale.nodes);
+    *found = hits.rects;
+    return hits.count;
+}
@@ -0,0 +1,84 @@
+#ifndef CASCADE_H
+#define CASCADE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <opencv2/core/core_c.h>
+#include <opencv2/objdetect/objdetect_c.h>
+
+#define CASCADE_MAX_RECTS 3
+#define CASCADE_MAX_NODES 8
+
+// A compiled cascade file starts with a header holding these, followed by
+// the stage, tree and node arrays as they are laid out in memory, each at a
+// multiple of CASCADE_FILE_ALIGN, so it can be mapped and evaluated in place
+#define CASCADE_FILE_MAGIC "UQFCASC\n"
+#define CASCADE_FILE_MAGIC_BYTES 8
+#define CASCADE_FILE_VERSION 1
+#define CASCADE_FILE_ALIGN 64
+
+// A Haar feature of a tree node, in the cascade's window coordinates
+typedef struct {
+    CvRect rects[CASCADE_MAX_RECTS];
+    float weights[CASCADE_MAX_RECTS];
+    int rectCount;
+    float threshold;
+} CascadeNode;
+
+// A weak classifier: a tree of nodes, each comparing its feature against
+// its threshold, whose leaves hold its value. Every node but the root, and
+// every leaf, hangs off a parent node listed before it, on the left branch
+// (feature below the threshold) or the right one.
+typedef struct {
+    int firstNode;
+    int nodeCount;
+    int8_t nodeParents[CASCADE_MAX_NODES]; // -1 for the root
+    bool nodeLeft[CASCADE_MAX_NODES];
+    float leaves[CASCADE_MAX_NODES + 1];
+    int8_t leafParents[CASCADE_MAX_NODES + 1]; // -1 for an unused leaf
+    bool leafLeft[CASCADE_MAX_NODES + 1];
+} CascadeTree;
+
+typedef struct {
+    int firstTree;
+    int treeCount;
+    float threshold;
+} CascadeStage;
+
+// The integral images of a grey image, one row and column larger than it:
+// the sums of its values, wrapping around as OpenCV's 32-bit ones do (the
+// sum of a window never does), and the sums of their squares
+typedef struct {
+    CvSize size; // of the grey image
+    uint32_t* sum;
+    double* sqsum;
+} CascadeIntegral;
+
+// A Haar cascade loaded by OpenCV, laid out for evaluating many windows
+// at once. Read only once compiled, so threads may share it, as may
+// processes when it is mapped from a compiled cascade file.
+typedef struct {
+    CvSize window;
+    int stageCount;
+    CascadeStage* stages;
+    int treeCount;
+    CascadeTree* trees;
+    int nodeCount;
+    CascadeNode* nodes;
+    bool avx2; // the CPU has AVX2
+    void* mapping; // the file the arrays are in, NULL if they are malloc'd
+    size_t mappingSize;
+} CompiledCascade;
+
+CompiledCascade* cascade_compile(const CvHaarClassifierCascade* source);
+int cascade_detect(const CompiledCascade* cascade,
+        const CascadeIntegral* integral, double scaleFactor, CvSize minSize,
+        CvSize maxSize, CvRect** found);
+void cascade_free(CompiledCascade* cascade);
+CompiledCascade* cascade_mirror(const CompiledCascade* source);
+bool cascade_save(const CompiledCascade* cascade, const char* path);
+CompiledCascade* cascade_map(const char* path);
+CascadeIntegral* cascade_integral_create(CvSize size);
+void cascade_integral_free(CascadeIntegral* integral);
+
+#endif
@@ -0,0 +1,58 @@
+#include "compile.h"
+
+/*
+ * fail
+ * ----
+ * Prints the message for the given exit status, about the named file, to
+ * stderr and exits with that status.
+ */
+void fail(int exitStatus, const char* fileName)
+{
+    if (exitStatus == EXIT_USAGE_STATUS) {
+        fprintf(stderr, "%s", usageErrorMessage);
+    } else if (exitStatus == EXIT_CASCADE_STATUS) {
+        fprintf(stderr, cascadeErrorMessageFormat, fileName);
+    } else if (exitStatus == EXIT_UNSUPPORTED_STATUS) {
+        fprintf(stderr, unsupportedErrorMessageFormat, fileName);
+    } else if (exitStatus == EXIT_OUTPUTFILE_STATUS) {
+        fprintf(stderr, outputFileErrorMessageFormat, fileName);
+    }
+    exit(exitStatus);
+}
+
+/*
+ * main
+ * ----
+ * Entry point for uqfacecompile: loads a Haar cascade from its XML,
+ * compiles it for the evaluator of cascade.c and writes it as a compiled
+ * cascade file for uqfacedetect --cascadefile. The file is mapped back to
+ * check it before a summary of it is printed.
+ */
+int main(int argc, char** argv)
+{
+    if (argc != argsCount || !*argv[cascadeIndex] || !*argv[outputIndex]) {
+        fail(EXIT_USAGE_STATUS, NULL);
+    }
+    CvHaarClassifierCascade* source = (CvHaarClassifierCascade*)cvLoad(
+            argv[cascadeIndex], NULL, NULL, NULL);
+    if (!source) {
+        fail(EXIT_CASCADE_STATUS, argv[cascadeIndex]);
+    }
+    CompiledCascade* cascade = cascade_compile(source);
+    cvReleaseHaarClassifierCascade(&source);
+    if (!cascade) {
+        fail(EXIT_UNSUPPORTED_STATUS, argv[cascadeIndex]);
+    }
+    bool saved = cascade_save(cascade, argv[outputIndex]);
+    cascade_free(cascade);
+    CompiledCascade* mapped = saved ? cascade_map(argv[outputIndex]) : NULL;
+    if (!mapped) {
+        fail(EXIT_OUTPUTFILE_STATUS, argv[outputIndex]);
+    }
+    printf("%s: %dx%d window, %d stages, %d trees, %d nodes, %zu bytes\n",
+            argv[outputIndex], mapped->window.width, mapped->window.height,
+            mapped->stageCount, mapped->treeCount, mapped->nodeCount,
+            mapped->mappingSize);
+    cascade_free(mapped);
+    return EXIT_OK_STATUS;
+}
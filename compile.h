@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <opencv2/core/core_c.h>
+#include <opencv2/objdetect/objdetect_c.h>
+#include "cascade.h"
+
+const int argsCount = 3;
+const int cascadeIndex = 1;
+const int outputIndex = 2;
+
+// Error Message
+const char* const usageErrorMessage
+        = "Usage: ./uqfacecompile cascadefile outputfile\n";
+const char* const cascadeErrorMessageFormat
+        = "uqfacecompile: cannot load the cascade \"%s\"\n";
+const char* const unsupportedErrorMessageFormat
+        = "uqfacecompile: the cascade \"%s\" uses features the evaluator"
+          " does not support\n";
+const char* const outputFileErrorMessageFormat
+        = "uqfacecompile: unable to write the compiled cascade \"%s\"\n";
+
+// This enum contains the program exit status codes
+typedef enum {
+    EXIT_OK_STATUS = 0,
+    EXIT_USAGE_STATUS = 17,
+    EXIT_OUTPUTFILE_STATUS = 9,
+    EXIT_CASCADE_STATUS = 10,
+    EXIT_UNSUPPORTED_STATUS = 11
+} ExitStatus;
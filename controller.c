@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include "controller.h"
+#include "metrics.h"
+
+#define TICK_NANOS 500000000L
+#define MIN_SAMPLE_JOBS 4
+#define HOLD_TICKS 4
+
+// How the controller reads and reacts to the latency of the detect stage
+static const double minGradient = 0.5;
+static const double increaseGradient = 0.9; // below this no worker is added
+static const double decreaseGradient = 0.7; // below this workers are cut
+static const double decreaseFactor = 0.75;
+static const double saturation = 0.8; // busy share of the active workers
+static const double baselineDrift = 1.01; // the best latency fades by 1%
+static const double smoothing = 0.2;
+
+// Admission state, shared with the client threads
+static struct {
+    bool enabled;
+    Pipeline* pipeline;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    int inFlight;
+    int peakInFlight; // most requests in flight since the last tick
+    int limit;
+    int maxLimit;
+} controller = {.lock = PTHREAD_MUTEX_INITIALIZER,
+        .released = PTHREAD_COND_INITIALIZER};
+
+// What the controller remembers between ticks
+typedef struct {
+    StageTotals last;
+    uint64_t lastTime;
+    double serviceBaseline; // best detect time per unit of cost
+    double responseBaseline; // best wait plus detect time per unit of cost
+    double limit;
+    int active;
+    int hold; // ticks left before workers may be added again
+} ControlState;
+
+/*
+ * gradient
+ * --------
+ * Compares a latency with the best seen recently, which is updated and
+ * slowly forgotten so a lasting change of the host becomes the new normal.
+ * Returns best / latency, between minGradient and 1.
+ */
+static double gradient(double latency, double* baseline)
+{
+    if (*baseline == 0 || latency < *baseline) {
+        *baseline = latency;
+    } else {
+        *baseline *= baselineDrift;
+    }
+    double result = latency > 0 ? *baseline / latency : 1;
+    return result < minGradient ? minGradient : (result > 1 ? 1 : result);
+}
+
+/*
+ * queue_allowance
+ * ---------------
+ * Returns the integer square root of the limit: how many requests beyond
+ * the current limit may queue while the limit probes upwards.
+ */
+static double queue_allowance(double limit)
+{
+    double root = 1;
+    while ((root + 1) * (root + 1) <= limit) {
+        root++;
+    }
+    return root;
+}
+
+/*
+ * adjust_workers
+ * --------------
+ * AIMD on the active detect workers: add one while they are saturated and
+ * their time per unit of cost stays near its best, cut a quarter when it
+ * inflates, which happens past the knee where workers only contend for the
+ * CPUs, memory bandwidth or a noisy neighbour.
+ */
+static void adjust_workers(ControlState* state, double service, bool saturated)
+{
+    Stage* detect = &controller.pipeline->stages[STAGE_DETECT];
+    if (service < decreaseGradient) {
+        state->active = (int)(state->active * decreaseFactor);
+        state->hold = HOLD_TICKS;
+    } else if (state->hold > 0) {
+        state->hold--;
+    } else if (saturated && service >= increaseGradient) {
+        state->active++;
+    }
+    if (state->active < 1) {
+        state->active = 1;
+    } else if (state->active > detect->threads) {
+        state->active = detect->threads;
+    }
+    pipeline_set_active(controller.pipeline, STAGE_DETECT, state->active);
+    metrics_gauge(GAUGE_DETECT_ACTIVE, state->active);
+}
+
+/*
+ * adjust_limit
+ * ------------
+ * Gradient scheme on the requests admitted at once: the limit shrinks in
+ * proportion as queueing inflates the response time per unit of cost, and
+ * probes upwards by a square root allowance while it is actually reached.
+ */
+static void adjust_limit(ControlState* state, double response)
+{
+    pthread_mutex_lock(&controller.lock);
+    double target = state->limit * response + queue_allowance(state->limit);
+    if (target > state->limit && controller.peakInFlight < state->limit / 2) {
+        target = state->limit; // not using the limit, no point raising it
+    }
+    state->limit = state->limit * (1 - smoothing) + target * smoothing;
+    if (state->limit < state->active) {
+        state->limit = state->active; // keep the active workers fed
+    }
+    if (state->limit > controller.maxLimit) {
+        state->limit = controller.maxLimit;
+    }
+    controller.limit = (int)state->limit;
+    controller.peakInFlight = controller.inFlight;
+    pthread_cond_broadcast(&controller.released);
+    pthread_mutex_unlock(&controller.lock);
+    metrics_gauge(GAUGE_INFLIGHT_LIMIT, controller.limit);
+}
+
+/*
+ * control_loop
+ * ------------
+ * Body of the controller thread: every tick, measures the throughput and
+ * latency of the detect stage since the last tick (once enough jobs have
+ * finished) and adjusts the active workers and the admission limit.
+ */
+static void* control_loop(void* arg)
+{
+    ControlState* state = (ControlState*)arg;
+    struct timespec tick = {0, TICK_NANOS};
+    while (1) {
+        nanosleep(&tick, NULL);
+        StageTotals now;
+        metrics_stage_totals(STAGE_DETECT, &now);
+        if (now.jobs - state->last.jobs < MIN_SAMPLE_JOBS) {
+            continue; // too few to measure, the window grows
+        }
+        uint64_t time = now_nanos();
+        double cost = now.cost > state->last.cost
+                ? (double)(now.cost - state->last.cost)
+                : 1;
+        double busy = (double)(now.busyNanos - state->last.busyNanos);
+        double waited = (double)(now.waitNanos - state->last.waitNanos);
+        bool saturated = busy
+                >= saturation * (double)(time - state->lastTime)
+                        * state->active;
+        double service = gradient(busy / cost, &state->serviceBaseline);
+        double response
+                = gradient((busy + waited) / cost, &state->responseBaseline);
+        state->last = now;
+        state->lastTime = time;
+        adjust_workers(state, service, saturated);
+        adjust_limit(state, response);
+    }
+    return NULL;
+}
+
+/*
+ * controller_start
+ * ----------------
+ * Starts adapting the active detect workers of the pipeline and the number
+ * of requests admitted at once, at most maxInFlight, to the measured load.
+ * Until started, admission is unlimited.
+ */
+void controller_start(Pipeline* pipeline, int maxInFlight)
+{
+    ControlState* state = calloc(1, sizeof(ControlState));
+    state->active = pipeline->stages[STAGE_DETECT].threads;
+    state->limit = maxInFlight < 2 * state->active ? maxInFlight
+                                                   : 2 * state->active;
+    state->lastTime = now_nanos();
+    metrics_stage_totals(STAGE_DETECT, &state->last);
+    controller.pipeline = pipeline;
+    controller.maxLimit = maxInFlight;
+    controller.limit = (int)state->limit;
+    controller.enabled = true;
+    metrics_gauge(GAUGE_DETECT_ACTIVE, state->active);
+    metrics_gauge(GAUGE_INFLIGHT_LIMIT, controller.limit);
+    pthread_t tid;
+    pthread_create(&tid, NULL, control_loop, state);
+    pthread_detach(tid);
+}
+
+/*
+ * controller_admit
+ * ----------------
+ * Waits until a request may start under the admission limit, leaving the
+ * ones behind it in the client's socket.
+ */
+void controller_admit(void)
+{
+    if (!controller.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&controller.lock);
+    while (controller.inFlight >= controller.limit) {
+        pthread_cond_wait(&controller.released, &controller.lock);
+    }
+    controller.inFlight++;
+    if (controller.inFlight > controller.peakInFlight) {
+        controller.peakInFlight = controller.inFlight;
+    }
+    metrics_gauge(GAUGE_INFLIGHT, controller.inFlight);
+    pthread_mutex_unlock(&controller.lock);
+}
+
+/*
+ * controller_release
+ * ------------------
+ * Marks an admitted request as answered.
+ */
+void controller_release(void)
+{
+    if (!controller.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&controller.lock);
+    controller.inFlight--;
+    metrics_gauge(GAUGE_INFLIGHT, controller.inFlight);
+    pthread_cond_signal(&controller.released);
+    pthread_mutex_unlock(&controller.lock);
+}
@@ -0,0 +1,10 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include "pipeline.h"
+
+void controller_start(Pipeline* pipeline, int maxInFlight);
+void controller_admit(void);
+void controller_release(void);
+
+#endif
@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include "cpuset.h"
+
+#define NODE_CPULIST_FORMAT "/sys/devices/system/node/node%d/cpulist"
+#define MAX_NODES 1024
+#define MAX_PATH_LENGTH 64
+
+/*
+ * add_cpu
+ * -------
+ * Appends a CPU to the ordered list if the process may run on it and it is
+ * not listed yet.
+ */
+static void add_cpu(int cpu, const cpu_set_t* allowed, cpu_set_t* listed,
+        int* order, int* count)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, allowed)
+            || CPU_ISSET(cpu, listed)) {
+        return;
+    }
+    CPU_SET(cpu, listed);
+    order[(*count)++] = cpu;
+}
+
+/*
+ * add_node_cpus
+ * -------------
+ * Appends the CPUs of one NUMA node, read from its sysfs cpulist (e.g.
+ * "0-3,8-11"), to the ordered list. Returns false if the node does not exist.
+ */
+static bool add_node_cpus(int node, const cpu_set_t* allowed,
+        cpu_set_t* listed, int* order, int* count)
+{
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), NODE_CPULIST_FORMAT, node);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    int first, last;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        int separator = fgetc(file);
+        if (separator == '-') {
+            if (fscanf(file, "%d", &last) != 1) {
+                break;
+            }
+            separator = fgetc(file);
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            add_cpu(cpu, allowed, listed, order, count);
+        }
+        if (separator != ',') {
+            break;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+/*
+ * cpuset_split
+ * ------------
+ * Splits the CPUs this process may run on into parts disjoint sets, stored
+ * in sets[0..parts-1]. CPUs are taken NUMA node by node, so each set lies
+ * within one node wherever the counts allow. If there are fewer CPUs than
+ * parts the sets have one CPU each and some share it.
+ * Returns the number of CPUs split, or 0 if the affinity cannot be read (the
+ * sets are then left allowing every CPU).
+ */
+int cpuset_split(int parts, cpu_set_t* sets)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        for (int i = 0; i < parts; i++) {
+            CPU_ZERO(&sets[i]);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                CPU_SET(cpu, &sets[i]);
+            }
+        }
+        return 0;
+    }
+    int order[CPU_SETSIZE];
+    int count = 0;
+    cpu_set_t listed;
+    CPU_ZERO(&listed);
+    for (int node = 0; node < MAX_NODES; node++) {
+        if (!add_node_cpus(node, &allowed, &listed, order, &count)) {
+            break;
+        }
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        // CPUs of no node, or every CPU without NUMA information
+        add_cpu(cpu, &allowed, &listed, order, &count);
+    }
+    for (int i = 0; i < parts; i++) {
+        CPU_ZERO(&sets[i]);
+        if (count <= parts) {
+            if (count > 0) {
+                CPU_SET(order[i % count], &sets[i]);
+            }
+            continue;
+        }
+        for (int j = i * count / parts; j < (i + 1) * count / parts; j++) {
+            CPU_SET(order[j], &sets[i]);
+        }
+    }
+    return count;
+}
@@ -0,0 +1,9 @@
+#ifndef CPUSET_H
+#define CPUSET_H
+
+#include <stdbool.h>
+#include <sched.h> // cpu_set_t needs _GNU_SOURCE defined by the includer
+
+int cpuset_split(int parts, cpu_set_t* sets);
+
+#endif
@@ -0,0 +1,919 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <opencv2/imgcodecs/imgcodecs_c.h>
+#include "detect.h"
+#include "imageinfo.h"
+#include "equalise.h"
+#include "metrics.h"
+#include "trace.h"
+
+const char* const outputImageExtension = ".jpg";
+
+const char* const faceCascadeFilename = "/local/courses/csse2310/resources/a4/"
+                                        "haarcascade_frontalface_alt2.xml";
+const char* const eyesCascadeFilename = "/local/courses/csse2310/resources/a4/"
+                                        "haarcascade_eye_tree_eyeglasses.xml";
+
+const float haarScaleFactor = 1.1;
+const int haarMinNeighbours = 4;
+const int haarFlags = 0;
+const int haarMinSize = 0;
+const int haarMaxSize = 1000;
+const int haarWindowMargin = 10; // windows stop this far short of the edges
+const int lineThickness = 4;
+const int defaultCropQuality = 95;
+
+// Drawing and grouping parameters, private to the detection code
+static const double groupEps = 0.2; // how far apart one face's hits may be
+static const int ellipseStartAngle = 0;
+static const int ellipseEndAngle = 360;
+static const int lineType = 8;
+static const int shift = 0;
+static const int bgraChannels = 4;
+static const int alphaIndex = 3;
+static const int dataBytes = 4; // the face count of a crop response
+
+// Bounds on the pixels an image is charged for, whatever its header claims:
+// the most OpenCV decodes (CV_IO_MAX_IMAGE_PIXELS), and the most a byte of
+// a compressed image can expand to (deflate's 1032 to 1, at a bit a pixel)
+static const uint64_t maxCostPixels = (uint64_t)1 << 30;
+static const uint64_t maxPixelsPerByte = 8 * 1032;
+
+/*
+ * detect_worker_use
+ * -----------------
+ * Sets the model set the worker's thread works with until told another,
+ * replacing its copies of the cascades if they are of an older set. A set
+ * is only used while a request holding it is being worked on.
+ */
+void detect_worker_use(DetectWorker* worker, const ModelSet* models)
+{
+    worker->models = models;
+    worker->faceEngine = models->faceEngine;
+    worker->faceWindow = models->faceWindow;
+    if (worker->generation == models->generation) {
+        return;
+    }
+    if (worker->faceCascade) {
+        cvReleaseHaarClassifierCascade(&worker->faceCascade);
+    }
+    if (worker->eyesCascade) {
+        cvReleaseHaarClassifierCascade(&worker->eyesCascade);
+    }
+    worker->faceCascade = models->faceCascade
+            ? (CvHaarClassifierCascade*)cvClone(models->faceCascade)
+            : NULL;
+    worker->eyesCascade
+            = (CvHaarClassifierCascade*)cvClone(models->eyesCascade);
+    worker->generation = models->generation;
+}
+
+/*
+ * cleanup_opencv_resources
+ * ------------------------
+ * Frees the OpenCV scratch resources of a detection to avoid memory leaks.
+ * The frame and replacement images belong to the job and are freed with it.
+ */
+void cleanup_opencv_resources(IplImage* frameGray, CvMemStorage* storage)
+{
+    if (frameGray) {
+        cvReleaseImage(&frameGray);
+    }
+    if (storage) {
+        cvReleaseMemStorage(&storage);
+    }
+}
+
+/*
+ * cleanup_roi_resources
+ * ------------------------
+ * Frees all allocated roi resources to avoid memory leaks.
+ */
+void cleanup_roi_resources(IplImage* faceROI, CvMemStorage* eyeStorage)
+{
+    if (faceROI) {
+        cvReleaseImageHeader(&faceROI); // the pixels belong to the frame
+    }
+    if (eyeStorage) {
+        cvReleaseMemStorage(&eyeStorage);
+    }
+}
+
+/*
+ * search_eyes_task
+ * ----------------
+ * Task searching one face of the equalised grey frame for eyes, with the eye
+ * cascade of the thread running it. The face region is searched in place
+ * through an image header of its own, so faces can be searched in parallel.
+ */
+void search_eyes_task(void* arg, void* state)
+{
+    EyeSearch* search = (EyeSearch*)arg;
+    DetectWorker* worker = (DetectWorker*)state;
+    detect_worker_use(worker, search->models);
+    uint64_t start = now_nanos();
+    IplImage* faceROI = cvCreateImageHeader(
+            cvGetSize(search->frameGray), IPL_DEPTH_8U, 1);
+    cvSetData(faceROI, search->frameGray->imageData,
+            search->frameGray->widthStep);
+    cvSetImageROI(faceROI, search->face);
+
+    CvMemStorage* eyeStorage = cvCreateMemStorage(0);
+    cvClearMemStorage(eyeStorage);
+
+    CvSeq* eyes = cvHaarDetectObjects(faceROI, worker->eyesCascade,
+            eyeStorage, haarScaleFactor, haarMinNeighbours, haarFlags,
+            cvSize(haarMinSize, haarMinSize), cvSize(haarMaxSize, haarMaxSize));
+
+    search->eyeCount = eyes->total;
+    if (eyes->total == 2) {
+        for (int j = 0; j < eyes->total; j++) {
+            search->eyes[j] = *(CvRect*)cvGetSeqElem(eyes, j);
+        }
+    }
+
+    cleanup_roi_resources(faceROI, eyeStorage);
+    metrics_phase(PHASE_EYES, now_nanos() - start);
+    trace_end_for("eye_search", start, search->request, -1);
+}
+
+/*
+ * Helper function for draw_detections() draw the face and its eyes
+ */
+void draw_ellipses_and_eyes(IplImage* frame, EyeSearch* search)
+{
+    CvRect* face = &search->face;
+    CvPoint center = {face->x + face->width / 2, face->y + face->height / 2};
+    const CvScalar magenta = cvScalar(255, 0, 255, 0);
+    const CvScalar blue = cvScalar(255, 0, 0, 0);
+
+    cvEllipse(frame, center, cvSize(face->width / 2, face->height / 2), 0,
+            ellipseStartAngle, ellipseEndAngle, magenta, lineThickness,
+            lineType, shift);
+
+    if (search->eyeCount == 2) {
+        for (int j = 0; j < search->eyeCount; j++) {
+            CvRect* eye = &search->eyes[j];
+            CvPoint eyeCenter = {face->x + eye->x + eye->width / 2,
+                    face->y + eye->y + eye->height / 2};
+            int radius = cvRound((eye->width / 2 + eye->height / 2) / 2);
+            cvCircle(frame, eyeCenter, radius, blue, lineThickness, lineType,
+                    shift);
+        }
+    }
+}
+
+/*
+ * create_equalised_gray
+ * ---------------------
+ * Returns a new grey, histogram equalised copy of the frame, the input the
+ * cascades run on, made by the worker's thread and idle ones of the pool.
+ * When any face cascade runs on cascade.c, the integral images they share
+ * are made in the same pass and stored through integral; otherwise that is
+ * set to NULL. A NULL integral asks for none.
+ */
+IplImage* create_equalised_gray(
+        DetectWorker* worker, IplImage* frame, CascadeIntegral** integral)
+{
+    uint64_t start = now_nanos();
+    CascadeIntegral* made = integral
+                    && (worker->faceEngine || worker->models->extraCount)
+            ? cascade_integral_create(cvGetSize(frame))
+            : NULL;
+    if (integral) {
+        *integral = made;
+    }
+    IplImage* frameGray = equalise_gray(worker->pool, frame, made);
+    metrics_phase(PHASE_GRAY, now_nanos() - start);
+    trace_end("equalise", start, -1);
+    return frameGray;
+}
+
+/*
+ * haar_scales
+ * -----------
+ * Lists the window sizes a cascade with the given smallest window is run at
+ * over an image of the given size, as cvHaarDetectObjects steps through
+ * them by scaleFactor, and the relative work of each: the number of window
+ * positions. Either array may be NULL. Returns the number of scales.
+ */
+int haar_scales(int width, int height, CvSize window, float scaleFactor,
+        CvSize* windows, double* work)
+{
+    int scales = 0;
+    for (double factor = 1; factor * window.width < width - haarWindowMargin
+            && factor * window.height < height - haarWindowMargin
+            && factor * window.width <= haarMaxSize
+            && scales < MAX_HAAR_SCALES;
+            factor *= scaleFactor) {
+        CvSize size = cvSize(cvRound(window.width * factor),
+                cvRound(window.height * factor));
+        double step = factor > 2 ? factor : 2;
+        if (windows) {
+            windows[scales] = size;
+        }
+        if (work) {
+            work[scales] = (width - size.width) / step
+                    * ((height - size.height) / step);
+        }
+        scales++;
+    }
+    return scales;
+}
+
+/*
+ * pixel_cost
+ * ----------
+ * Estimates the work needed to search an image of the given size: its pixel
+ * count, up to the most any image is decoded with, times the number of
+ * scales the face cascade is evaluated at, with the default scale factor.
+ */
+uint64_t pixel_cost(int width, int height, CvSize window)
+{
+    uint64_t scales
+            = haar_scales(width, height, window, haarScaleFactor, NULL, NULL);
+    uint64_t pixels = (uint64_t)width * (uint64_t)height;
+    pixels = pixels < maxCostPixels ? pixels : maxCostPixels;
+    return pixels * (scales ? scales : 1);
+}
+
+/*
+ * estimate_cost
+ * -------------
+ * Estimates the work needed to process an encoded image from the size read
+ * from its header. Images in a format we cannot size are charged their byte
+ * count, which also keeps garbage (rejected by the decoder) cheap. A header
+ * claiming more pixels than the bytes after it could decode to is charged
+ * as if it held only those, so it cannot wrap the cost into a cheap one.
+ */
+uint64_t estimate_cost(uint8_t* image, uint32_t imageSize, CvSize window)
+{
+    int width, height;
+    if (!image_dimensions(image, imageSize, &width, &height)) {
+        return imageSize;
+    }
+    uint64_t cost = pixel_cost(width, height, window);
+    uint64_t most = (uint64_t)imageSize * maxPixelsPerByte * MAX_HAAR_SCALES;
+    return cost < most ? cost : most;
+}
+
+/*
+ * similar_rects
+ * -------------
+ * Returns true if two detections are close enough in position and size to
+ * be the same object, as OpenCV's rectangle grouping decides it.
+ */
+bool similar_rects(CvRect a, CvRect b)
+{
+    double delta = groupEps
+            * ((a.width < b.width ? a.width : b.width)
+                    + (a.height < b.height ? a.height : b.height))
+            * 0.5;
+    return abs(a.x - b.x) <= delta && abs(a.y - b.y) <= delta
+            && abs(a.x + a.width - b.x - b.width) <= delta
+            && abs(a.y + a.height - b.y - b.height) <= delta;
+}
+
+/*
+ * find_root
+ * ---------
+ * Returns the representative of a detection's cluster, flattening the path.
+ */
+int find_root(int* parent, int i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+/*
+ * group_rectangles
+ * ----------------
+ * Merges detections the way cvHaarDetectObjects groups its raw hits: similar
+ * detections are clustered and averaged, weighted by how many hits each one
+ * already stands for, clusters of at most minNeighbours hits are dropped,
+ * and so are clusters lying inside a stronger one. The merged faces, with
+ * the hits each stands for, are stored in faces (room for count).
+ * Returns the number of faces.
+ */
+int group_rectangles(
+        CvAvgComp* found, int count, int minNeighbours, CvAvgComp* faces)
+{
+    int* parent = malloc(sizeof(int) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        parent[i] = i;
+        for (int j = 0; j < i; j++) {
+            if (similar_rects(found[i].rect, found[j].rect)) {
+                parent[find_root(parent, j)] = find_root(parent, i);
+            }
+        }
+    }
+    CvAvgComp* clusters = calloc(count ? count : 1, sizeof(CvAvgComp));
+    double* sums = calloc(4 * (count ? count : 1), sizeof(double));
+    for (int i = 0; i < count; i++) {
+        int root = find_root(parent, i);
+        double weight = found[i].neighbors;
+        sums[4 * root] += found[i].rect.x * weight;
+        sums[4 * root + 1] += found[i].rect.y * weight;
+        sums[4 * root + 2] += found[i].rect.width * weight;
+        sums[4 * root + 3] += found[i].rect.height * weight;
+        clusters[root].neighbors += found[i].neighbors;
+    }
+    for (int i = 0; i < count; i++) {
+        if (clusters[i].neighbors > 0) {
+            double scale = 1.0 / clusters[i].neighbors;
+            clusters[i].rect = cvRect(cvRound(sums[4 * i] * scale),
+                    cvRound(sums[4 * i + 1] * scale),
+                    cvRound(sums[4 * i + 2] * scale),
+                    cvRound(sums[4 * i + 3] * scale));
+        }
+    }
+    int faceCount = 0;
+    for (int i = 0; i < count; i++) {
+        int n1 = clusters[i].neighbors;
+        CvRect r1 = clusters[i].rect;
+        bool inside = n1 <= minNeighbours;
+        for (int j = 0; !inside && j < count; j++) {
+            int n2 = clusters[j].neighbors;
+            CvRect r2 = clusters[j].rect;
+            int dx = cvRound(r2.width * groupEps);
+            int dy = cvRound(r2.height * groupEps);
+            inside = j != i && n2 > minNeighbours && r1.x >= r2.x - dx
+                    && r1.y >= r2.y - dy
+                    && r1.x + r1.width <= r2.x + r2.width + dx
+                    && r1.y + r1.height <= r2.y + r2.height + dy
+                    && (n2 > (n1 > 3 ? n1 : 3) || n1 < 3);
+        }
+        if (!inside) {
+            faces[faceCount++] = clusters[i];
+        }
+    }
+    free(sums);
+    free(clusters);
+    free(parent);
+    return faceCount;
+}
+
+/*
+ * search_faces_simd
+ * -----------------
+ * search_faces on a compiled face cascade. Its raw hits, each standing for
+ * one, are grouped here as cvHaarDetectObjects groups its own, unless
+ * minNeighbours is 0.
+ */
+int search_faces_simd(const CascadeIntegral* integral,
+        const CompiledCascade* faceEngine, float scaleFactor, CvSize minSize,
+        CvSize maxSize, int minNeighbours, CvAvgComp** found)
+{
+    CvRect* hits;
+    int count = cascade_detect(
+            faceEngine, integral, scaleFactor, minSize, maxSize, &hits);
+    CvAvgComp* raw = malloc(sizeof(CvAvgComp) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        raw[i].rect = hits[i];
+        raw[i].neighbors = 1;
+    }
+    free(hits);
+    if (!minNeighbours) {
+        *found = raw;
+        return count;
+    }
+    *found = malloc(sizeof(CvAvgComp) * (count ? count : 1));
+    count = group_rectangles(raw, count, minNeighbours, *found);
+    free(raw);
+    return count;
+}
+
+/*
+ * search_cascade
+ * --------------
+ * Runs one face cascade of the worker's model set, 0 for the face one and
+ * i for its i-th more one, over the equalised grey frame, or its integral
+ * images when the cascade runs on cascade.c, at the window sizes between
+ * minSize and maxSize, stepped by the scale factor of the set. The
+ * detections found are stored in a malloc'd array through found; with
+ * minNeighbours 0 they are the raw hits, each standing for one.
+ * Returns the number of detections.
+ *
+ * REF: Example 2 from a4 spec
+ */
+int search_cascade(DetectWorker* worker, IplImage* frameGray,
+        const CascadeIntegral* integral, int cascade, CvSize minSize,
+        CvSize maxSize, int minNeighbours, CvAvgComp** found)
+{
+    if (cascade > 0) {
+        return search_faces_simd(integral,
+                worker->models->extraEngines[cascade - 1],
+                worker->models->scaleFactor, minSize, maxSize, minNeighbours,
+                found);
+    }
+    if (worker->faceEngine) {
+        return search_faces_simd(integral, worker->faceEngine,
+                worker->models->scaleFactor, minSize, maxSize, minNeighbours,
+                found);
+    }
+    CvMemStorage* storage = 0;
+    storage = cvCreateMemStorage(0);
+    cvClearMemStorage(storage);
+    CvSeq* detected = cvHaarDetectObjects(frameGray, worker->faceCascade,
+            storage, worker->models->scaleFactor, minNeighbours, haarFlags,
+            minSize, maxSize);
+    int count = detected->total;
+    *found = malloc(sizeof(CvAvgComp) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        (*found)[i] = *(CvAvgComp*)cvGetSeqElem(detected, i);
+        if (!minNeighbours) {
+            // OpenCV leaves the raw hits it does not group weightless
+            (*found)[i].neighbors = 1;
+        }
+    }
+    cleanup_opencv_resources(NULL, storage);
+    return count;
+}
+
+/*
+ * search_faces
+ * ------------
+ * search_cascade with every face cascade of the worker's model set in turn.
+ * The detections of each are listed after those of the one before, not
+ * merged with them.
+ */
+int search_faces(DetectWorker* worker, IplImage* frameGray,
+        const CascadeIntegral* integral, CvSize minSize, CvSize maxSize,
+        int minNeighbours, CvAvgComp** found)
+{
+    int count = search_cascade(worker, frameGray, integral, 0, minSize,
+            maxSize, minNeighbours, found);
+    for (int i = 1; i <= worker->models->extraCount; i++) {
+        CvAvgComp* more;
+        int extra = search_cascade(worker, frameGray, integral, i, minSize,
+                maxSize, minNeighbours, &more);
+        *found = realloc(*found, sizeof(CvAvgComp) * (count + extra + 1));
+        memcpy(*found + count, more, sizeof(CvAvgComp) * extra);
+        count += extra;
+        free(more);
+    }
+    return count;
+}
+
+/*
+ * search_faces_task
+ * -----------------
+ * Task running one band of scales of a face search with one face cascade,
+ * that of the thread running it for the face one. Its hits are left raw,
+ * to be grouped with those of the other bands.
+ */
+void search_faces_task(void* arg, void* state)
+{
+    FaceSearch* search = (FaceSearch*)arg;
+    DetectWorker* worker = (DetectWorker*)state;
+    detect_worker_use(worker, search->models);
+    uint64_t start = trace_begin();
+    search->count = search_cascade(worker, search->frameGray,
+            search->integral, search->cascade, search->minSize,
+            search->maxSize, 0, &search->found);
+    trace_end_for("face_search", start, search->request, search->count);
+}
+
+/*
+ * merge_repeated_scales
+ * ---------------------
+ * Merges neighbouring scales of a face search that round to the same window
+ * size, as a scale factor close to 1 makes them, into one with their work
+ * summed. A search between two window sizes runs every scale of either, so
+ * bands split between such scales would each run both. Returns the number
+ * of scales left.
+ */
+int merge_repeated_scales(CvSize* windows, double* work, int scales)
+{
+    int kept = 0;
+    for (int i = 0; i < scales; i++) {
+        if (kept && windows[i].width == windows[kept - 1].width
+                && windows[i].height == windows[kept - 1].height) {
+            work[kept - 1] += work[i];
+        } else {
+            windows[kept] = windows[i];
+            work[kept++] = work[i];
+        }
+    }
+    return kept;
+}
+
+/*
+ * search_face_bands
+ * -----------------
+ * Splits the distinct window sizes of a face search, as
+ * merge_repeated_scales leaves them, into bands of about equal work and
+ * searches each band with every face cascade of the worker's model set, as
+ * parallel tasks of its pool over the same grey frame and integral images.
+ * The raw hits of every band of the i-th cascade are stored in a malloc'd
+ * array through found[i], and their number in counts[i].
+ */
+void search_face_bands(DetectWorker* worker, IplImage* frameGray,
+        const CascadeIntegral* integral, CvSize* windows, double* work,
+        int scales, int bands, CvAvgComp** found, int* counts)
+{
+    int cascades = 1 + worker->models->extraCount;
+    int tasks = bands * cascades;
+    FaceSearch* searches = calloc(tasks, sizeof(FaceSearch));
+    double total = 0;
+    for (int i = 0; i < scales; i++) {
+        total += work[i];
+    }
+    TaskGroup group = {0};
+    double done = 0;
+    int first = 0;
+    for (int band = 0; band < bands; band++) {
+        // take scales up to the band's share of the work, leaving at least
+        // one scale for every later band
+        int last = first;
+        done += work[first];
+        while (last + 1 < scales - (bands - band - 1)
+                && (band == bands - 1
+                        || done + work[last + 1] / 2
+                                <= total * (band + 1) / bands)) {
+            done += work[++last];
+        }
+        for (int cascade = 0; cascade < cascades; cascade++) {
+            FaceSearch* search = &searches[band * cascades + cascade];
+            search->models = worker->models;
+            search->cascade = cascade;
+            search->frameGray = frameGray;
+            search->integral = integral;
+            search->request = trace_request();
+            search->minSize = windows[first];
+            search->maxSize = windows[last];
+            if (cascade > 0) {
+                // the others step through window sizes of their own, so
+                // their bands are split by width and leave no gaps
+                search->minSize = cvSize(
+                        band ? windows[first].width : haarMinSize,
+                        haarMinSize);
+                search->maxSize = cvSize(band < bands - 1
+                                ? windows[last + 1].width - 1
+                                : haarMaxSize,
+                        haarMaxSize);
+            }
+            taskpool_spawn(worker->pool, &group, search_faces_task, search);
+        }
+        first = last + 1;
+    }
+    taskpool_wait(worker->pool, &group);
+    // the wait may have run tasks of other requests, with other models
+    detect_worker_use(worker, searches[0].models);
+    for (int cascade = 0; cascade < cascades; cascade++) {
+        counts[cascade] = 0;
+        for (int band = 0; band < bands; band++) {
+            counts[cascade] += searches[band * cascades + cascade].count;
+        }
+        int count = counts[cascade];
+        found[cascade] = malloc(sizeof(CvAvgComp) * (count ? count : 1));
+        count = 0;
+        for (int band = 0; band < bands; band++) {
+            FaceSearch* search = &searches[band * cascades + cascade];
+            memcpy(found[cascade] + count, search->found,
+                    sizeof(CvAvgComp) * search->count);
+            count += search->count;
+            free(search->found);
+        }
+    }
+    free(searches);
+}
+
+/*
+ * same_face
+ * ---------
+ * Returns true if two faces, found by different cascades, are taken for
+ * the same one: the centre of either lies inside the other.
+ */
+bool same_face(CvRect a, CvRect b)
+{
+    int ax = a.x + a.width / 2;
+    int ay = a.y + a.height / 2;
+    int bx = b.x + b.width / 2;
+    int by = b.y + b.height / 2;
+    return (ax >= b.x && ax < b.x + b.width && ay >= b.y
+                   && ay < b.y + b.height)
+            || (bx >= a.x && bx < a.x + a.width && by >= a.y
+                    && by < a.y + a.height);
+}
+
+/*
+ * find_faces
+ * ----------
+ * Detects faces in the equalised grey frame, with integral images
+ * as create_equalised_gray made them, using the face cascades of the
+ * worker's model set. With more than one band or cascade the scales are
+ * searched in that many parallel tasks of the pool. The raw hits of all
+ * the bands of a cascade are then grouped once, as OpenCV would group
+ * those of one search over every scale, so banding changes nothing. The
+ * faces of the face cascade are kept as they are, and those of each more
+ * cascade added unless one before found the same face, frontal and
+ * profile say.
+ * The faces found are stored in a malloc'd array through faces.
+ * Returns the number of faces found.
+ *
+ * REF: Example 2 from a4 spec
+ */
+int find_faces(DetectWorker* worker, IplImage* frameGray,
+        const CascadeIntegral* integral, int bands, CvRect** faces)
+{
+    uint64_t start = now_nanos();
+    CvSize windows[MAX_HAAR_SCALES];
+    double work[MAX_HAAR_SCALES];
+    int scales = haar_scales(frameGray->width, frameGray->height,
+            worker->faceWindow, worker->models->scaleFactor, windows, work);
+    scales = merge_repeated_scales(windows, work, scales);
+    bands = bands < scales ? bands : scales;
+    CvAvgComp* found;
+    int count;
+    if (bands > 1 || worker->models->extraCount) {
+        int cascades = 1 + worker->models->extraCount;
+        CvAvgComp* raw[1 + 2 * MODEL_MAX_EXTRA_CASCADES];
+        int counts[1 + 2 * MODEL_MAX_EXTRA_CASCADES];
+        search_face_bands(worker, frameGray, integral, windows, work, scales,
+                bands, raw, counts);
+        int total = 0;
+        for (int i = 0; i < cascades; i++) {
+            total += counts[i];
+        }
+        found = malloc(sizeof(CvAvgComp) * (total ? total : 1));
+        count = 0;
+        for (int i = 0; i < cascades; i++) {
+            CvAvgComp* grouped = found + count;
+            int groupedCount = group_rectangles(raw[i], counts[i],
+                    worker->models->minNeighbours, grouped);
+            free(raw[i]);
+            int kept = count;
+            for (int j = 0; j < groupedCount; j++) {
+                bool known = false;
+                for (int k = 0; !known && k < count; k++) {
+                    known = same_face(found[k].rect, grouped[j].rect);
+                }
+                if (!known) {
+                    found[kept++] = grouped[j];
+                }
+            }
+            count = kept;
+        }
+    } else {
+        count = search_faces(worker, frameGray, integral,
+                cvSize(haarMinSize, haarMinSize),
+                cvSize(haarMaxSize, haarMaxSize),
+                worker->models->minNeighbours, &found);
+        trace_end("face_search", start, count);
+    }
+    *faces = malloc(sizeof(CvRect) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        (*faces)[i] = found[i].rect;
+    }
+    free(found);
+    metrics_phase(PHASE_FACES, now_nanos() - start);
+    return count;
+}
+
+/*
+ * draw_detections
+ * ---------------
+ * Draws an ellipse around every face found, and circles around its eyes
+ * when both can be found, onto the frame. The faces are searched for eyes
+ * as parallel tasks of the worker's pool, with its model set; drawing,
+ * which may overlap, is done after.
+ *
+ * REF: Example 2 from a4 spec
+ */
+void draw_detections(DetectWorker* worker, IplImage* frame,
+        IplImage* frameGray, CvRect* faces, int faceCount)
+{
+    TaskPool* pool = worker->pool;
+    EyeSearch* searches = calloc(faceCount, sizeof(EyeSearch));
+    TaskGroup group = {0};
+    for (int i = 0; i < faceCount; i++) {
+        searches[i].models = worker->models;
+        searches[i].frameGray = frameGray;
+        searches[i].face = faces[i];
+        searches[i].request = trace_request();
+        taskpool_spawn(pool, &group, search_eyes_task, &searches[i]);
+    }
+    taskpool_wait(pool, &group);
+    for (int i = 0; i < faceCount; i++) {
+        uint64_t start = trace_begin();
+        draw_ellipses_and_eyes(frame, &searches[i]);
+        trace_end("draw_ellipses_and_eyes", start, -1);
+    }
+    free(searches);
+}
+
+/*
+ * Helper function for replace_face() draw the replace face
+ */
+void draw_replace_on_face(IplImage* frame, IplImage* replace, CvRect* face)
+{
+    IplImage* resized = cvCreateImage(cvSize(face->width, face->height),
+            IPL_DEPTH_8U, replace->nChannels);
+    cvResize(replace, resized, CV_INTER_AREA);
+
+    char* frameData = frame->imageData;
+    char* faceData = resized->imageData;
+
+    for (int y = 0; y < face->height; y++) {
+        for (int x = 0; x < face->width; x++) {
+            int faceIndex = resized->widthStep * y + x * resized->nChannels;
+            if (resized->nChannels == bgraChannels
+                    && faceData[faceIndex + alphaIndex] == 0) {
+                continue;
+            }
+            int frameIndex = frame->widthStep * (face->y + y)
+                    + (face->x + x) * frame->nChannels;
+            frameData[frameIndex + 0] = faceData[faceIndex + 0];
+            frameData[frameIndex + 1] = faceData[faceIndex + 1];
+            frameData[frameIndex + 2] = faceData[faceIndex + 2];
+        }
+    }
+
+    cvReleaseImage(&resized);
+}
+
+/*
+ * composite_task
+ * --------------
+ * Task pasting the replacement over one face of the frame.
+ */
+void composite_task(void* arg, void* state)
+{
+    (void)state;
+    Composite* composite = (Composite*)arg;
+    uint64_t start = trace_begin();
+    draw_replace_on_face(composite->frame, composite->replace, composite->face);
+    trace_end_for("composite", start, composite->request, -1);
+}
+
+/*
+ * faces_overlap
+ * -------------
+ * Returns true if any two of the faces share a pixel.
+ */
+bool faces_overlap(CvRect* faces, int faceCount)
+{
+    for (int i = 0; i < faceCount; i++) {
+        for (int j = 0; j < i; j++) {
+            if (faces[i].x < faces[j].x + faces[j].width
+                    && faces[j].x < faces[i].x + faces[i].width
+                    && faces[i].y < faces[j].y + faces[j].height
+                    && faces[j].y < faces[i].y + faces[i].height) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * replace_faces
+ * -------------
+ * Replaces every face found in the frame, in place, with the given
+ * replacement image. Faces are composited as parallel tasks of the pool,
+ * unless some overlap, where the later face must be drawn last.
+ *
+ * REF: Example 3 from a4 spec
+ */
+void replace_faces(TaskPool* pool, IplImage* frame, IplImage* replace,
+        CvRect* faces, int faceCount)
+{
+    if (faces_overlap(faces, faceCount)) {
+        for (int i = 0; i < faceCount; i++) {
+            uint64_t start = trace_begin();
+            draw_replace_on_face(frame, replace, &faces[i]);
+            trace_end("composite", start, -1);
+        }
+        return;
+    }
+    Composite* composites = calloc(faceCount, sizeof(Composite));
+    TaskGroup group = {0};
+    for (int i = 0; i < faceCount; i++) {
+        composites[i]
+                = (Composite) {frame, replace, &faces[i], trace_request()};
+        taskpool_spawn(pool, &group, composite_task, &composites[i]);
+    }
+    taskpool_wait(pool, &group);
+    free(composites);
+}
+
+/*
+ * crop_rect
+ * ---------
+ * Returns the face grown by the margin (in percent of its size) on every
+ * side, cut to the frame.
+ */
+CvRect crop_rect(CvRect face, int marginPercent, CvSize frame)
+{
+    int dx = face.width * marginPercent / 100;
+    int dy = face.height * marginPercent / 100;
+    int left = face.x - dx > 0 ? face.x - dx : 0;
+    int top = face.y - dy > 0 ? face.y - dy : 0;
+    int right = face.x + face.width + dx < frame.width
+            ? face.x + face.width + dx
+            : frame.width;
+    int bottom = face.y + face.height + dy < frame.height
+            ? face.y + face.height + dy
+            : frame.height;
+    return cvRect(left, top, right - left, bottom - top);
+}
+
+/*
+ * crop_encode_task
+ * ----------------
+ * Task cutting one face out of the frame, through an image header of its
+ * own, resizing it if asked and encoding it as a JPEG.
+ */
+void crop_encode_task(void* arg, void* state)
+{
+    (void)state;
+    CropEncode* part = (CropEncode*)arg;
+    uint64_t start = trace_begin();
+    IplImage* face = cvCreateImageHeader(
+            cvGetSize(part->frame), IPL_DEPTH_8U, part->frame->nChannels);
+    cvSetData(face, part->frame->imageData, part->frame->widthStep);
+    cvSetImageROI(face, part->crop);
+    IplImage* resized = NULL;
+    int longer = part->crop.width > part->crop.height ? part->crop.width
+                                                      : part->crop.height;
+    if (part->options->size && part->options->size != longer) {
+        double scale = (double)part->options->size / longer;
+        CvSize size = cvSize(cvRound(part->crop.width * scale),
+                cvRound(part->crop.height * scale));
+        resized = cvCreateImage(cvSize(size.width ? size.width : 1,
+                                        size.height ? size.height : 1),
+                IPL_DEPTH_8U, face->nChannels);
+        cvResize(face, resized, CV_INTER_AREA);
+    }
+    int params[] = {CV_IMWRITE_JPEG_QUALITY,
+            part->options->quality ? part->options->quality
+                                   : defaultCropQuality,
+            0};
+    part->encoded = cvEncodeImage(
+            outputImageExtension, resized ? resized : face, params);
+    if (resized) {
+        cvReleaseImage(&resized);
+    }
+    cvReleaseImageHeader(&face);
+    trace_end_for("crop_encode", start, part->request, -1);
+}
+
+/*
+ * encode_face_crops
+ * -----------------
+ * Cuts every face out of the frame and encodes it, as parallel tasks of the
+ * pool, then packs the crops into the payload of a crop response.
+ * Returns the payload, or NULL if a crop could not be encoded.
+ */
+CvMat* encode_face_crops(TaskPool* pool, Job* job)
+{
+    CropEncode* parts = calloc(job->faceCount, sizeof(CropEncode));
+    TaskGroup group = {0};
+    for (int i = 0; i < job->faceCount; i++) {
+        parts[i].frame = job->frame;
+        parts[i].crop = crop_rect(job->faces[i], job->crop.marginPercent,
+                cvGetSize(job->frame));
+        parts[i].options = &job->crop;
+        parts[i].request = trace_request();
+        taskpool_spawn(pool, &group, crop_encode_task, &parts[i]);
+    }
+    taskpool_wait(pool, &group);
+    size_t total = dataBytes;
+    CvMat* payload = NULL;
+    for (int i = 0; i < job->faceCount; i++) {
+        if (!parts[i].encoded) {
+            total = 0; // cannot answer without every face
+            break;
+        }
+        total += CROP_PART_HEADER_BYTES + parts[i].encoded->cols;
+    }
+    if (total) {
+        payload = cvCreateMat(1, (int)total, CV_8UC1);
+        uint8_t* data = payload->data.ptr;
+        uint32_t count = (uint32_t)job->faceCount;
+        memcpy(data, &count, dataBytes);
+        data += dataBytes;
+        for (int i = 0; i < job->faceCount; i++) {
+            uint32_t header[] = {parts[i].crop.x, parts[i].crop.y,
+                    parts[i].crop.width, parts[i].crop.height,
+                    parts[i].encoded->cols};
+            memcpy(data, header, CROP_PART_HEADER_BYTES);
+            memcpy(data + CROP_PART_HEADER_BYTES, parts[i].encoded->data.ptr,
+                    parts[i].encoded->cols);
+            data += CROP_PART_HEADER_BYTES + parts[i].encoded->cols;
+        }
+    }
+    for (int i = 0; i < job->faceCount; i++) {
+        if (parts[i].encoded) {
+            cvReleaseMat(&parts[i].encoded);
+        }
+    }
+    free(parts);
+    return payload;
+}
+
@@ -0,0 +1,123 @@
+#ifndef DETECT_H
+#define DETECT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <opencv2/imgproc/imgproc_c.h>
+#include <opencv2/objdetect/objdetect_c.h>
+#include "pipeline.h"
+#include "worksteal.h"
+#include "cascade.h"
+#include "models.h"
+
+#define MAX_HAAR_SCALES 128
+
+// The format the processed image is sent back in
+extern const char* const outputImageExtension;
+
+// the cascade file name for OpenCv
+extern const char* const faceCascadeFilename;
+extern const char* const eyesCascadeFilename;
+
+// OpenCV parameters of the cascade searches
+extern const float haarScaleFactor;
+extern const int haarMinNeighbours;
+extern const int haarFlags;
+extern const int haarMinSize;
+extern const int haarMaxSize;
+extern const int haarWindowMargin;
+
+// Thickness of the ellipses and circles drawn around faces and eyes
+extern const int lineThickness;
+
+// JPEG quality of a crop request that gives none
+extern const int defaultCropQuality;
+
+// Settings and state of the prescreen shared by the detect workers
+typedef struct {
+    int scale; // how many times smaller the frame is screened, 0 for off
+    int auditInterval; // rejections per audited one, 0 for no audit
+    uint64_t rejected; // rejections so far, picks the ones audited
+} Prescreen;
+
+// The private state of a thread of the detection task pool (helpers, detect
+// and encode stage workers). The Haar cascades keep per-image scratch data,
+// so every thread runs on its own copy of those of the model set it works
+// with, made again when it meets a newer set; the compiled one is read
+// only. A face cascade mapped from a compiled cascade file has no OpenCV
+// copy.
+typedef struct {
+    const ModelSet* models; // of the request being worked on
+    uint64_t generation; // of the set copied, 0 before the first
+    CvHaarClassifierCascade* faceCascade; // NULL if only compiled
+    CvSize faceWindow; // smallest window of the face cascade
+    CvHaarClassifierCascade* eyesCascade;
+    const CompiledCascade* faceEngine; // NULL to run faceCascade on OpenCV
+    TaskPool* pool;
+    Prescreen* prescreen;
+} DetectWorker;
+
+// A band of consecutive scales of a face search with one face cascade, run
+// as one task
+typedef struct {
+    const ModelSet* models; // of the request
+    int cascade; // 0 for the face cascade, i for the i-th more one
+    IplImage* frameGray;
+    const CascadeIntegral* integral; // of frameGray, NULL for OpenCV
+    uint64_t request; // the request, in traces
+    CvSize minSize; // smallest and largest window of the band
+    CvSize maxSize;
+    CvAvgComp* found; // detections of the band
+    int count;
+} FaceSearch;
+
+// The eye search of one face, run as one task
+typedef struct {
+    const ModelSet* models; // of the request
+    IplImage* frameGray;
+    uint64_t request; // the request, in traces
+    CvRect face;
+    CvRect eyes[2];
+    int eyeCount;
+} EyeSearch;
+
+// The compositing of one face of a replace, run as one task
+typedef struct {
+    IplImage* frame;
+    IplImage* replace;
+    CvRect* face;
+    uint64_t request; // the request, in traces
+} Composite;
+
+// The cropping and encoding of one face of a crop request, run as one task
+typedef struct {
+    IplImage* frame;
+    CvRect crop; // the face with its margin, within the frame
+    CropOptions* options;
+    CvMat* encoded;
+    uint64_t request; // the request, in traces
+} CropEncode;
+
+void detect_worker_use(DetectWorker* worker, const ModelSet* models);
+void cleanup_opencv_resources(IplImage* frameGray, CvMemStorage* storage);
+IplImage* create_equalised_gray(
+        DetectWorker* worker, IplImage* frame, CascadeIntegral** integral);
+int haar_scales(int width, int height, CvSize window, float scaleFactor,
+        CvSize* windows, double* work);
+uint64_t pixel_cost(int width, int height, CvSize window);
+uint64_t estimate_cost(uint8_t* image, uint32_t imageSize, CvSize window);
+int search_faces(DetectWorker* worker, IplImage* frameGray,
+        const CascadeIntegral* integral, CvSize minSize, CvSize maxSize,
+        int minNeighbours, CvAvgComp** found);
+int find_faces(DetectWorker* worker, IplImage* frameGray,
+        const CascadeIntegral* integral, int bands, CvRect** faces);
+void search_eyes_task(void* arg, void* state);
+void draw_ellipses_and_eyes(IplImage* frame, EyeSearch* search);
+void draw_detections(DetectWorker* worker, IplImage* frame,
+        IplImage* frameGray, CvRect* faces, int faceCount);
+void draw_replace_on_face(IplImage* frame, IplImage* replace, CvRect* face);
+void replace_faces(TaskPool* pool, IplImage* frame, IplImage* replace,
+        CvRect* faces, int faceCount);
+CvMat* encode_face_crops(TaskPool* pool, Job* job);
+
+#endif
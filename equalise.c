@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "equalise.h"
+#if defined(__x86_64__) || defined(__i386__)
+#define EQUALISE_X86
+#endif
+
+#define BAND_PIXELS (1 << 18) // pixels of the frame per task of a pass
+#define MAX_BANDS 64
+#define GRAY_LEVELS 256
+#define HISTOGRAM_COPIES 4 // counted into in turn, so increments overlap
+
+// cvCvtColor's fixed point weights of blue, green and red, which sum to
+// 1 << GRAY_SHIFT
+#define GRAY_SHIFT 14
+#define BLUE_WEIGHT 1868
+#define GREEN_WEIGHT 9617
+#define RED_WEIGHT 4899
+
+// A band of rows of the frame, converted and equalised by one task
+typedef struct {
+    const IplImage* frame;
+    IplImage* gray;
+    CascadeIntegral* integral; // NULL if not wanted
+    const uint8_t* levels; // the equalised value of every grey level
+    int firstRow;
+    int rowCount;
+    uint32_t histogram[GRAY_LEVELS];
+    // sums of the rows above the band, added to its integral rows, which
+    // are first computed as if it started the frame
+    uint32_t* sumCarry;
+    double* sqsumCarry;
+} GrayBand;
+
+/*
+ * convert_row
+ * -----------
+ * Converts a row of BGR or BGRA pixels to grey values as cvCvtColor does.
+ * Inlined for a constant number of channels, which lets the compiler
+ * vectorise it (from -O3, its cost model being too strict below).
+ */
+static inline __attribute__((always_inline)) void convert_row(
+        const uint8_t* restrict pixels, uint8_t* restrict gray, int width,
+        int channels)
+{
+    for (int x = 0; x < width; x++) {
+        const uint8_t* pixel = pixels + x * channels;
+        gray[x] = (uint8_t)((pixel[0] * BLUE_WEIGHT + pixel[1] * GREEN_WEIGHT
+                                    + pixel[2] * RED_WEIGHT
+                                    + (1 << (GRAY_SHIFT - 1)))
+                >> GRAY_SHIFT);
+    }
+}
+
+/*
+ * count_row
+ * ---------
+ * Adds the grey values of a row to the histogram copies, taking turns so
+ * that runs of one value do not wait on their own increments.
+ */
+static void count_row(const uint8_t* gray, int width,
+        uint32_t (*counts)[GRAY_LEVELS])
+{
+    int x = 0;
+    for (; x + HISTOGRAM_COPIES <= width; x += HISTOGRAM_COPIES) {
+        for (int c = 0; c < HISTOGRAM_COPIES; c++) {
+            counts[c][gray[x + c]]++;
+        }
+    }
+    for (; x < width; x++) {
+        counts[0][gray[x]]++;
+    }
+}
+
+/*
+ * convert_band
+ * ------------
+ * Converts a band of the frame to grey, counting the band's histogram
+ * while each row is still in cache.
+ */
+static inline __attribute__((always_inline)) void convert_band(GrayBand* band)
+{
+    const IplImage* frame = band->frame;
+    IplImage* gray = band->gray;
+    uint32_t counts[HISTOGRAM_COPIES][GRAY_LEVELS];
+    memset(counts, 0, sizeof(counts));
+    for (int y = band->firstRow; y < band->firstRow + band->rowCount; y++) {
+        const uint8_t* pixels
+                = (const uint8_t*)frame->imageData + y * frame->widthStep;
+        uint8_t* row = (uint8_t*)gray->imageData + y * gray->widthStep;
+        if (frame->nChannels == 3) {
+            convert_row(pixels, row, frame->width, 3);
+        } else if (frame->nChannels == 4) {
+            convert_row(pixels, row, frame->width, 4);
+        } else {
+            memcpy(row, pixels, frame->width);
+        }
+        count_row(row, gray->width, counts);
+    }
+    for (int i = 0; i < GRAY_LEVELS; i++) {
+        band->histogram[i] = 0;
+        for (int c = 0; c < HISTOGRAM_COPIES; c++) {
+            band->histogram[i] += counts[c][i];
+        }
+    }
+}
+
+/*
+ * convert_band_generic
+ * --------------------
+ * convert_band for any CPU: SSE2 on x86-64.
+ */
+static void convert_band_generic(GrayBand* band)
+{
+    convert_band(band);
+}
+
+#ifdef EQUALISE_X86
+/*
+ * convert_band_avx2
+ * -----------------
+ * convert_band for CPUs with AVX2, whose wider vectors about double the
+ * speed of the conversion.
+ */
+__attribute__((target("avx2"))) static void convert_band_avx2(GrayBand* band)
+{
+    convert_band(band);
+}
+#endif
+
+/*
+ * convert_task
+ * ------------
+ * Task converting a band of the frame to grey and counting its histogram.
+ */
+static void convert_task(void* arg, void* state)
+{
+    (void)state;
+    GrayBand* band = (GrayBand*)arg;
+#ifdef EQUALISE_X86
+    if (__builtin_cpu_supports("avx2")) {
+        convert_band_avx2(band);
+    } else {
+        convert_band_generic(band);
+    }
+#else
+    convert_band_generic(band);
+#endif
+}
+
+/*
+ * equalise_levels
+ * ---------------
+ * Works out the equalised value of every grey level from the histogram of
+ * the frame, as cvEqualizeHist does: the cumulative count above the lowest
+ * level present, scaled in single precision to 0-255.
+ */
+static void equalise_levels(const uint64_t* histogram, uint64_t total,
+        uint8_t* levels)
+{
+    memset(levels, 0, GRAY_LEVELS);
+    int lowest = 0;
+    while (lowest < GRAY_LEVELS - 1 && !histogram[lowest]) {
+        lowest++;
+    }
+    if (histogram[lowest] == total) {
+        memset(levels, lowest, GRAY_LEVELS); // a flat frame stays as it is
+        return;
+    }
+    float scale = (GRAY_LEVELS - 1.f) / (float)(total - histogram[lowest]);
+    uint64_t sum = 0;
+    for (int i = lowest + 1; i < GRAY_LEVELS; i++) {
+        sum += histogram[i];
+        int level = cvRound((float)sum * scale);
+        levels[i] = (uint8_t)(level > GRAY_LEVELS - 1 ? GRAY_LEVELS - 1
+                                                      : level);
+    }
+}
+
+/*
+ * integrate_row
+ * -------------
+ * Computes a row of the integral images from an equalised row of the frame
+ * and, unless it starts its band, the integral row above it.
+ */
+static void integrate_row(
+        CascadeIntegral* integral, const uint8_t* row, int y, bool first)
+{
+    int step = integral->size.width + 1;
+    uint32_t* sumRow = integral->sum + (size_t)(y + 1) * step;
+    double* sqsumRow = integral->sqsum + (size_t)(y + 1) * step;
+    uint32_t rowSum = 0;
+    uint64_t rowSquares = 0;
+    sumRow[0] = 0;
+    sqsumRow[0] = 0;
+    if (first) {
+        for (int x = 0; x < integral->size.width; x++) {
+            rowSum += row[x];
+            rowSquares += row[x] * row[x];
+            sumRow[x + 1] = rowSum;
+            sqsumRow[x + 1] = (double)rowSquares;
+        }
+        return;
+    }
+    for (int x = 0; x < integral->size.width; x++) {
+        rowSum += row[x];
+        rowSquares += row[x] * row[x];
+        sumRow[x + 1] = sumRow[x + 1 - step] + rowSum;
+        sqsumRow[x + 1] = sqsumRow[x + 1 - step] + (double)rowSquares;
+    }
+}
+
+/*
+ * equalise_task
+ * -------------
+ * Task equalising a band of the grey frame and, if wanted, computing its
+ * integral rows as if the band started the frame.
+ */
+static void equalise_task(void* arg, void* state)
+{
+    (void)state;
+    GrayBand* band = (GrayBand*)arg;
+    IplImage* gray = band->gray;
+    for (int y = band->firstRow; y < band->firstRow + band->rowCount; y++) {
+        uint8_t* row = (uint8_t*)gray->imageData + y * gray->widthStep;
+        for (int x = 0; x < gray->width; x++) {
+            row[x] = band->levels[row[x]];
+        }
+        if (band->integral) {
+            integrate_row(band->integral, row, y, y == band->firstRow);
+        }
+    }
+}
+
+/*
+ * carry_task
+ * ----------
+ * Task adding the sums of the rows above a band to its integral rows.
+ */
+static void carry_task(void* arg, void* state)
+{
+    (void)state;
+    GrayBand* band = (GrayBand*)arg;
+    CascadeIntegral* integral = band->integral;
+    int step = integral->size.width + 1;
+    for (int y = band->firstRow; y < band->firstRow + band->rowCount; y++) {
+        uint32_t* sumRow = integral->sum + (size_t)(y + 1) * step;
+        double* sqsumRow = integral->sqsum + (size_t)(y + 1) * step;
+        for (int x = 1; x < step; x++) {
+            sumRow[x] += band->sumCarry[x];
+            sqsumRow[x] += band->sqsumCarry[x];
+        }
+    }
+}
+
+/*
+ * carry_bands
+ * -----------
+ * Works out the sums of the rows above every band but the first from the
+ * last integral row of each band before it, still counted from that band's
+ * start, then adds them in as parallel tasks of the pool. Sums of whole
+ * numbers, these come out exactly as if summed down the frame in one go.
+ * The carries are stored in sumCarries and sqsumCarries, with room for an
+ * integral row of every band but the first.
+ */
+static void carry_bands(TaskPool* pool, GrayBand* bands, int bandCount,
+        uint32_t* sumCarries, double* sqsumCarries)
+{
+    CascadeIntegral* integral = bands[0].integral;
+    int step = integral->size.width + 1;
+    for (int b = 1; b < bandCount; b++) {
+        bands[b].sumCarry = sumCarries + (size_t)(b - 1) * step;
+        bands[b].sqsumCarry = sqsumCarries + (size_t)(b - 1) * step;
+        size_t last = (size_t)bands[b].firstRow * step; // of band b - 1
+        for (int x = 0; x < step; x++) {
+            bands[b].sumCarry[x] = integral->sum[last + x]
+                    + (b > 1 ? bands[b - 1].sumCarry[x] : 0);
+            bands[b].sqsumCarry[x] = integral->sqsum[last + x]
+                    + (b > 1 ? bands[b - 1].sqsumCarry[x] : 0);
+        }
+    }
+    TaskGroup group = {0};
+    for (int b = 1; b < bandCount; b++) {
+        taskpool_spawn(pool, &group, carry_task, &bands[b]);
+    }
+    taskpool_wait(pool, &group);
+}
+
+/*
+ * run_bands
+ * ---------
+ * Runs a task on every band as parallel tasks of the pool.
+ */
+static void run_bands(
+        TaskPool* pool, GrayBand* bands, int bandCount, TaskFunction run)
+{
+    TaskGroup group = {0};
+    for (int b = 0; b < bandCount; b++) {
+        taskpool_spawn(pool, &group, run, &bands[b]);
+    }
+    taskpool_wait(pool, &group);
+}
+
+/*
+ * equalise_gray
+ * -------------
+ * Returns a new grey, histogram equalised copy of a BGR or BGRA frame, as
+ * cvCvtColor then cvEqualizeHist would make it, in two passes over bands
+ * of rows run as parallel tasks of the pool: the first converts to grey and
+ * counts the histogram, the second equalises, and also fills in integral
+ * images of the result for cascade_detect unless integral is NULL.
+ */
+IplImage* equalise_gray(
+        TaskPool* pool, const IplImage* frame, CascadeIntegral* integral)
+{
+    IplImage* gray = cvCreateImage(cvGetSize(frame), IPL_DEPTH_8U, 1);
+    uint64_t pixels = (uint64_t)frame->width * frame->height;
+    int bandCount = (int)(pixels / BAND_PIXELS);
+    bandCount = bandCount < 1 ? 1 : bandCount;
+    bandCount = bandCount > MAX_BANDS ? MAX_BANDS : bandCount;
+    bandCount = bandCount > frame->height ? frame->height : bandCount;
+    uint8_t levels[GRAY_LEVELS];
+    GrayBand* bands = calloc(bandCount, sizeof(GrayBand));
+    for (int b = 0; b < bandCount; b++) {
+        bands[b].frame = frame;
+        bands[b].gray = gray;
+        bands[b].integral = integral;
+        bands[b].levels = levels;
+        bands[b].firstRow = (int)((int64_t)frame->height * b / bandCount);
+        bands[b].rowCount = (int)((int64_t)frame->height * (b + 1) / bandCount)
+                - bands[b].firstRow;
+    }
+    run_bands(pool, bands, bandCount, convert_task);
+    uint64_t histogram[GRAY_LEVELS] = {0};
+    for (int b = 0; b < bandCount; b++) {
+        for (int i = 0; i < GRAY_LEVELS; i++) {
+            histogram[i] += bands[b].histogram[i];
+        }
+    }
+    equalise_levels(histogram, pixels, levels);
+    if (integral) {
+        memset(integral->sum, 0, sizeof(uint32_t) * (frame->width + 1));
+        memset(integral->sqsum, 0, sizeof(double) * (frame->width + 1));
+    }
+    run_bands(pool, bands, bandCount, equalise_task);
+    if (integral && bandCount > 1) {
+        size_t carries = (size_t)(bandCount - 1) * (frame->width + 1);
+        uint32_t* sumCarries = malloc(sizeof(uint32_t) * carries);
+        double* sqsumCarries = malloc(sizeof(double) * carries);
+        carry_bands(pool, bands, bandCount, sumCarries, sqsumCarries);
+        free(sumCarries);
+        free(sqsumCarries);
+    }
+    free(bands);
+    return gray;
+}
@@ -0,0 +1,11 @@
+#ifndef EQUALISE_H
+#define EQUALISE_H
+
+#include <opencv2/core/core_c.h>
+#include "worksteal.h"
+#include "cascade.h"
+
+IplImage* equalise_gray(
+        TaskPool* pool, const IplImage* frame, CascadeIntegral* integral);
+
+#endif
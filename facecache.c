@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <opencv2/imgproc/imgproc_c.h>
+#include "facecache.h"
+#include "metrics.h"
+
+#define THUMBNAIL FACECACHE_THUMBNAIL_SIZE
+#define FREQUENCIES FACECACHE_HASH_FREQUENCIES
+#define HASH_BITS (FREQUENCIES * FREQUENCIES)
+
+// How far, relatively, the aspect ratio of an image may be from that of a
+// cached one for its faces to be scaled over: a resize keeps it, a crop
+// does not
+static const double maxAspectChange = 0.02;
+
+// A cached result: the faces found in an image of the given size, with the
+// models of the given generation
+typedef struct {
+    uint64_t hash;
+    CvSize size;
+    uint64_t generation; // 0 for an empty entry
+    CvRect* faces;
+    int count;
+    uint64_t lastUsed; // the least recently used entry is replaced first
+} CacheEntry;
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static CacheEntry* cacheEntries; // NULL while the cache is off
+static int cacheSize;
+static int cacheMaxDistance;
+static uint64_t cacheClock; // orders the uses of the entries
+static uint64_t cacheHits;
+static uint64_t cacheMisses;
+static double cosines[FREQUENCIES][THUMBNAIL]; // the DCT-II basis
+
+/*
+ * facecache_init
+ * --------------
+ * Turns the cache on with room for the given number of results (none for
+ * 0). An image matches a cached one whose hash differs from its own in at
+ * most maxDistance bits. Must be called before any other thread starts.
+ */
+void facecache_init(int entries, int maxDistance)
+{
+    if (entries <= 0) {
+        return;
+    }
+    cacheEntries = calloc(entries, sizeof(CacheEntry));
+    cacheSize = entries;
+    cacheMaxDistance = maxDistance;
+    for (int u = 0; u < FREQUENCIES; u++) {
+        for (int x = 0; x < THUMBNAIL; x++) {
+            cosines[u][x] = cos((2 * x + 1) * u * M_PI / (2 * THUMBNAIL));
+        }
+    }
+}
+
+/*
+ * facecache_enabled
+ * -----------------
+ * Returns true if results are being cached.
+ */
+bool facecache_enabled(void)
+{
+    return cacheEntries != NULL;
+}
+
+/*
+ * compare_doubles
+ * ---------------
+ * qsort comparator putting doubles in increasing order.
+ */
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * gray_thumbnail
+ * --------------
+ * Returns the frame, grey or BGR, shrunk to a grey thumbnail of the hash's
+ * size, by area so every pixel counts, which is what makes the hash blind
+ * to resizing and to the noise of recompression.
+ */
+static IplImage* gray_thumbnail(const IplImage* frame)
+{
+    CvSize size = cvSize(THUMBNAIL, THUMBNAIL);
+    IplImage* small = cvCreateImage(size, IPL_DEPTH_8U, frame->nChannels);
+    cvResize(frame, small, CV_INTER_AREA);
+    if (frame->nChannels == 1) {
+        return small;
+    }
+    IplImage* gray = cvCreateImage(size, IPL_DEPTH_8U, 1);
+    cvCvtColor(small, gray, CV_BGR2GRAY);
+    cvReleaseImage(&small);
+    return gray;
+}
+
+/*
+ * facecache_hash
+ * --------------
+ * Returns the perceptual hash of a decoded frame: a bit per low frequency
+ * of the DCT of its grey thumbnail, set if the coefficient is above their
+ * median. The same picture resized or recompressed hashes to the same
+ * value, or one differing in a few bits.
+ */
+uint64_t facecache_hash(const IplImage* frame)
+{
+    IplImage* gray = gray_thumbnail(frame);
+    // the transform of the rows, then of the columns, of the lowest
+    // frequencies only
+    double rows[THUMBNAIL][FREQUENCIES];
+    for (int y = 0; y < THUMBNAIL; y++) {
+        const uint8_t* pixels
+                = (const uint8_t*)gray->imageData + y * gray->widthStep;
+        for (int u = 0; u < FREQUENCIES; u++) {
+            double sum = 0;
+            for (int x = 0; x < THUMBNAIL; x++) {
+                sum += pixels[x] * cosines[u][x];
+            }
+            rows[y][u] = sum;
+        }
+    }
+    cvReleaseImage(&gray);
+    double coefficients[HASH_BITS];
+    for (int v = 0; v < FREQUENCIES; v++) {
+        for (int u = 0; u < FREQUENCIES; u++) {
+            double sum = 0;
+            for (int y = 0; y < THUMBNAIL; y++) {
+                sum += rows[y][u] * cosines[v][y];
+            }
+            coefficients[v * FREQUENCIES + u] = sum;
+        }
+    }
+    double sorted[HASH_BITS];
+    memcpy(sorted, coefficients, sizeof(sorted));
+    qsort(sorted, HASH_BITS, sizeof(double), compare_doubles);
+    double median = (sorted[HASH_BITS / 2 - 1] + sorted[HASH_BITS / 2]) / 2;
+    uint64_t hash = 0;
+    for (int i = 0; i < HASH_BITS; i++) {
+        if (coefficients[i] > median) {
+            hash |= (uint64_t)1 << i;
+        }
+    }
+    return hash;
+}
+
+/*
+ * similar_aspect
+ * --------------
+ * Returns true if two image sizes have about the same aspect ratio.
+ */
+static bool similar_aspect(CvSize a, CvSize b)
+{
+    double cross = (double)a.width * b.height;
+    return fabs(cross - (double)b.width * a.height)
+            <= maxAspectChange * cross;
+}
+
+/*
+ * scale_faces
+ * -----------
+ * Scales the faces of a cached result to an image of the given size,
+ * clamped to lie within it, into faces. Returns false if any comes out
+ * smaller than the cascade window, a face the search could not have found
+ * in that image.
+ */
+static bool scale_faces(
+        const CacheEntry* entry, CvSize size, CvSize window, CvRect* faces)
+{
+    double scaleX = (double)size.width / entry->size.width;
+    double scaleY = (double)size.height / entry->size.height;
+    for (int i = 0; i < entry->count; i++) {
+        CvRect face = entry->faces[i];
+        int left = cvRound(face.x * scaleX);
+        int top = cvRound(face.y * scaleY);
+        int right = cvRound((face.x + face.width) * scaleX);
+        int bottom = cvRound((face.y + face.height) * scaleY);
+        left = left > 0 ? left : 0;
+        top = top > 0 ? top : 0;
+        right = right < size.width ? right : size.width;
+        bottom = bottom < size.height ? bottom : size.height;
+        if (right - left < window.width || bottom - top < window.height) {
+            return false;
+        }
+        faces[i] = cvRect(left, top, right - left, bottom - top);
+    }
+    return true;
+}
+
+/*
+ * facecache_lookup
+ * ----------------
+ * Looks for the result of an image like the one of the given hash and size
+ * found with the models of the given generation: the closest cached hash
+ * within the distance, of about the same aspect ratio. On a hit, its faces
+ * scaled to the size are stored in a malloc'd array through faces, and
+ * their number through count. A result with a face that would scale below
+ * the cascade window is a miss. Returns true on a hit.
+ */
+bool facecache_lookup(uint64_t hash, CvSize size, uint64_t generation,
+        CvSize window, CvRect** faces, int* count)
+{
+    pthread_mutex_lock(&cacheLock);
+    CacheEntry* best = NULL;
+    int bestDistance = cacheMaxDistance + 1;
+    for (int i = 0; i < cacheSize; i++) {
+        CacheEntry* entry = &cacheEntries[i];
+        int distance = __builtin_popcountll(entry->hash ^ hash);
+        if (entry->generation == generation && distance < bestDistance
+                && similar_aspect(entry->size, size)) {
+            best = entry;
+            bestDistance = distance;
+        }
+    }
+    if (best) {
+        *count = best->count;
+        *faces = malloc(sizeof(CvRect) * (best->count ? best->count : 1));
+        if (!scale_faces(best, size, window, *faces)) {
+            free(*faces);
+            best = NULL;
+        }
+    }
+    if (best) {
+        best->lastUsed = ++cacheClock;
+        cacheHits++;
+    } else {
+        cacheMisses++;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    metrics_count(best ? COUNTER_FACE_CACHE_HITS : COUNTER_FACE_CACHE_MISSES);
+    return best != NULL;
+}
+
+/*
+ * facecache_store
+ * ---------------
+ * Caches the faces found in an image of the given hash and size with the
+ * models of the given generation, in place of the result of the same image
+ * if there is one, otherwise of the least recently used result. Results of
+ * models since reloaded are never matched again, so they age out.
+ */
+void facecache_store(uint64_t hash, CvSize size, uint64_t generation,
+        const CvRect* faces, int count)
+{
+    CvRect* copy = malloc(sizeof(CvRect) * (count ? count : 1));
+    memcpy(copy, faces, sizeof(CvRect) * count);
+    pthread_mutex_lock(&cacheLock);
+    CacheEntry* slot = &cacheEntries[0];
+    for (int i = 0; i < cacheSize; i++) {
+        CacheEntry* entry = &cacheEntries[i];
+        if (entry->generation == generation && entry->hash == hash
+                && entry->size.width == size.width
+                && entry->size.height == size.height) {
+            slot = entry;
+            break;
+        }
+        if (entry->lastUsed < slot->lastUsed) {
+            slot = entry;
+        }
+    }
+    free(slot->faces);
+    slot->hash = hash;
+    slot->size = size;
+    slot->generation = generation;
+    slot->faces = copy;
+    slot->count = count;
+    slot->lastUsed = ++cacheClock;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/*
+ * facecache_stats
+ * ---------------
+ * Reads how many lookups have hit and missed.
+ */
+void facecache_stats(uint64_t* hits, uint64_t* misses)
+{
+    pthread_mutex_lock(&cacheLock);
+    *hits = cacheHits;
+    *misses = cacheMisses;
+    pthread_mutex_unlock(&cacheLock);
+}
@@ -0,0 +1,26 @@
+#ifndef FACECACHE_H
+#define FACECACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <opencv2/core/core_c.h>
+
+// The perceptual hash of an image: the signs of the lowest 8 by 8
+// frequencies of the DCT of a 32 by 32 grey thumbnail, against their median
+#define FACECACHE_THUMBNAIL_SIZE 32
+#define FACECACHE_HASH_FREQUENCIES 8
+
+// Most entries, and most bits two hashes may differ in to match
+#define FACECACHE_MAX_ENTRIES 65536
+#define FACECACHE_MAX_DISTANCE 32
+
+void facecache_init(int entries, int maxDistance);
+bool facecache_enabled(void);
+uint64_t facecache_hash(const IplImage* frame);
+bool facecache_lookup(uint64_t hash, CvSize size, uint64_t generation,
+        CvSize window, CvRect** faces, int* count);
+void facecache_store(uint64_t hash, CvSize size, uint64_t generation,
+        const CvRect* faces, int count);
+void facecache_stats(uint64_t* hits, uint64_t* misses);
+
+#endif
@@ -18,6 +18,12 @@ Arguments* init_arguments_struct(void)
     args->outputFileName = NULL;
     args->replaceFileName = NULL;
     args->errorMessage = NULL;
+    args->deadlineMs = 0;
+    args->clientTag = NULL;
+    args->local = false;
+    memset(&args->raw, 0, sizeof(RawImage));
+    args->cropFaces = false;
+    memset(&args->crop, 0, sizeof(CropOptions));
     args->sockfd = 0;
     return args;
 }
@@ -108,6 +114,76 @@ char* check_emptystring(char* argument, Arguments* args)
     return argument;
 }
 
+/*
+ * check_deadline
+ * --------------
+ * Parses the deadline argument as a positive number of milliseconds,
+ * otherwise exits with usage error.
+ */
+uint32_t check_deadline(char* deadline, Arguments* args)
+{
+    check_emptystring(deadline, args);
+    char* ptr;
+    unsigned long value = strtoul(deadline, &ptr, baseTen);
+    if (*ptr != '\0' || *deadline == '-' || value == 0 || value > UINT32_MAX) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    return (uint32_t)value;
+}
+
+/*
+ * check_raw_shape
+ * ---------------
+ * Parses a raw image shape WIDTHxHEIGHT:format into the arguments, rows
+ * being stored without padding, otherwise exits with usage error.
+ */
+void check_raw_shape(char* shape, Arguments* args)
+{
+    char format[MAX_PIXEL_FORMAT_LENGTH];
+    int length = 0;
+    if (sscanf(shape, rawShapeFormat, &args->raw.width, &args->raw.height,
+                format, &length)
+                    != 3
+            || shape[length] != '\0' || args->raw.width == 0
+            || args->raw.height == 0) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    int channels = 0;
+    for (int i = 0; i < pixelFormatCount; i++) {
+        if (strcmp(format, pixelFormatNames[i]) == 0) {
+            args->raw.format = (uint8_t)i;
+            channels = protocol_pixel_channels(args->raw.format);
+        }
+    }
+    if (!channels || args->raw.width > UINT32_MAX / channels) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    args->raw.stride = args->raw.width * channels;
+}
+
+/*
+ * check_crop_options
+ * ------------------
+ * Parses the crop options margin,size,quality into the arguments, otherwise
+ * exits with usage error.
+ */
+void check_crop_options(char* options, Arguments* args)
+{
+    unsigned margin, size, quality;
+    int length = 0;
+    if (sscanf(options, cropOptionsFormat, &margin, &size, &quality, &length)
+                    != 3
+            || options[length] != '\0' || *options == '-'
+            || margin > maxCropMargin || size > maxCropSize
+            || quality > maxCropQuality) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    args->cropFaces = true;
+    args->crop.marginPercent = (uint8_t)margin;
+    args->crop.size = (uint16_t)size;
+    args->crop.quality = (uint8_t)quality;
+}
+
 /* check_file()
  * --------------------------
  * check of the file can read or written
@@ -132,10 +208,35 @@ void check_file(char* fileName, int fileType, Arguments* args)
     fclose(file);
 }
 
+/*
+ * connect_to_socket
+ * -----------------
+ * Tries to connect to the server's Unix socket at the given path.
+ */
+void connect_to_socket(char* path, Arguments* args)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        cleanup_and_exit(args, EXIT_PORT_STATUS);
+    }
+    strcpy(address.sun_path, path);
+    args->sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (args->sockfd < 0
+            || connect(args->sockfd, (struct sockaddr*)&address,
+                       sizeof(address))
+                    != 0) {
+        cleanup_and_exit(args, EXIT_PORT_STATUS);
+    }
+    args->local = true;
+}
+
 /*
  * connect_to_server
  * -----------------
- * Tries to connect to the server at localhost on the given port string.
+ * Tries to connect to the server at localhost on the given port string, or
+ * to its Unix socket if the port is a path.
  *
  * port: A string representing a port number or service name
  * args: the arguments struct
@@ -143,6 +244,10 @@ void check_file(char* fileName, int fileType, Arguments* args)
  */
 void connect_to_server(char* port, Arguments* args)
 {
+    if (strchr(port, socketPathSeparator)) {
+        connect_to_socket(port, args);
+        return;
+    }
     struct addrinfo* ai;
     struct addrinfo hints;
     // Clear the hints structure
@@ -196,14 +301,58 @@ uint8_t* read_stdin_to_buffer(uint32_t* imageSize)
     return buffer;
 }
 
+/*
+ * send_shared_request
+ * -------------------
+ * Sends a request whose images are passed as sealed memfds over the Unix
+ * socket, so the server maps them instead of reading them from the socket.
+ * Returns false, having sent nothing, if the memfds cannot be made.
+ */
+bool send_shared_request(Arguments* args, int operation,
+        RequestOptions* options, uint8_t* image1, uint32_t image1Size,
+        uint8_t* image2, uint32_t image2Size)
+{
+    int memfd1 = protocol_create_memfd(image1, image1Size);
+    int memfd2 = image2 ? protocol_create_memfd(image2, image2Size) : -1;
+    if (memfd1 < 0 || (image2 && memfd2 < 0)) {
+        if (memfd1 >= 0) {
+            close(memfd1);
+        }
+        return false;
+    }
+    uint8_t* header = NULL;
+    size_t headerSize = 0;
+    protocol_pack_header(
+            operation | FLAG_SHARED_MEMORY, options, &header, &headerSize);
+    bool sent = write(args->sockfd, header, headerSize) == (ssize_t)headerSize
+            && protocol_send_fd(args->sockfd, image1Size, memfd1)
+            && (!image2 || protocol_send_fd(args->sockfd, image2Size, memfd2));
+    free(header);
+    close(memfd1);
+    if (image2) {
+        close(memfd2);
+    }
+    if (!sent) {
+        // Sending fail
+        free(image1);
+        free(image2);
+        cleanup_and_exit(args, EXIT_COMMUNICATE_STATUS);
+    }
+    return true;
+}
+
 /*
  * Constructs and sends a face detection or replacement request to the server.
  * Reads input images from file or stdin, packs them using the protocol, and
- * sends the resulting buffer through the socket specified in args.
+ * sends the resulting buffer through the socket specified in args. Over a
+ * Unix socket the images are passed as memfds instead.
  */
 void build_image_process(Arguments* args)
 {
     int operation = (args->replaceFileName) ? REQUEST_REPLACE : REQUEST_DETECT;
+    if (args->cropFaces) {
+        operation = REQUEST_CROP;
+    }
     // get the operation type
     uint32_t image1Size = 0, image2Size = 0;
     uint8_t* image1 = NULL;
@@ -220,11 +369,22 @@ void build_image_process(Arguments* args)
         image2 = read_file_to_buffer(args->replaceFileName, &image2Size);
     }
 
+    RequestOptions options = {.deadlineMs = args->deadlineMs,
+            .clientTag = args->clientTag,
+            .raw = args->raw.width ? &args->raw : NULL,
+            .crop = &args->crop};
+    if (args->local
+            && send_shared_request(args, operation, &options, image1,
+                    image1Size, image2, image2Size)) {
+        free(image1);
+        free(image2);
+        return;
+    }
     uint8_t* finalBuffer = NULL;
     size_t finalSize = 0;
     // Pack the image and opration detail
-    protocol_pack_request(operation, image1, image1Size, image2, image2Size,
-            &finalBuffer, &finalSize);
+    protocol_pack_request_with_options(operation, &options, image1, image1Size,
+            image2, image2Size, &finalBuffer, &finalSize);
     free(image1);
     if (image2) {
         free(image2);
@@ -269,13 +429,34 @@ Arguments* parse_arguments(int argc, char** argv)
                 cleanup_and_exit(args, EXIT_USAGE_STATUS);
             }
             args->replaceFileName = strdup(check_emptystring(argv[i], args));
+        } else if (strcmp(argv[i], deadlineArg) == 0) { // --deadline
+            if (args->deadlineMs || (++i >= argc)) {
+                cleanup_and_exit(args, EXIT_USAGE_STATUS);
+            }
+            args->deadlineMs = check_deadline(argv[i], args);
+        } else if (strcmp(argv[i], clientTagArg) == 0) { // --clienttag
+            if (args->clientTag || (++i >= argc)
+                    || strlen(argv[i]) > MAX_CLIENT_TAG_LENGTH) {
+                cleanup_and_exit(args, EXIT_USAGE_STATUS);
+            }
+            args->clientTag = check_emptystring(argv[i], args);
+        } else if (strcmp(argv[i], rawArg) == 0) { // --raw
+            if (args->raw.width || (++i >= argc)) {
+                cleanup_and_exit(args, EXIT_USAGE_STATUS);
+            }
+            check_raw_shape(argv[i], args);
+        } else if (strcmp(argv[i], cropArg) == 0) { // --crop
+            if (args->cropFaces || (++i >= argc)) {
+                cleanup_and_exit(args, EXIT_USAGE_STATUS);
+            }
+            check_crop_options(argv[i], args);
         } else {
             cleanup_and_exit(args, EXIT_USAGE_STATUS);
         }
         i++; // Incremnet index
     }
-    if (!args->port) {
-        // No port given
+    if (!args->port || (args->cropFaces && args->replaceFileName)) {
+        // No port given, or two operations
         cleanup_and_exit(args, EXIT_USAGE_STATUS);
     }
     if (args->detectFileName) {
@@ -286,40 +467,77 @@ Arguments* parse_arguments(int argc, char** argv)
         // Check if it's readable
         check_file(args->replaceFileName, detectFileType, args);
     }
-    if (args->outputFileName) {
-        // Check if it can be written
+    if (args->outputFileName && !args->cropFaces) {
+        // Check if it can be written, crops are named after it
         check_file(args->outputFileName, outputFileType, args);
     }
     connect_to_server(args->port, args);
     return args;
 }
 
-void handle_response(Arguments* args)
+/*
+ * write_crops
+ * -----------
+ * Writes every face of a crop response to its own file named after the
+ * output file. Exits with a communication error if the response is not
+ * well formed.
+ */
+void write_crops(Arguments* args, uint8_t* result, uint32_t size)
 {
-    uint32_t prefix;
-    uint8_t operation;
-    uint32_t size;
-
-    if ((read(args->sockfd, &prefix, PREFIX_BYTES) != PREFIX_BYTES)
-            || prefix != PROTOCOL_PREFIX) {
-        // check the prefix
-        cleanup_and_exit(args, EXIT_COMMUNICATE_STATUS);
-    }
-    if (read(args->sockfd, &operation, OPERATION_BYTES) != 1) {
-        // Read the operation type
+    uint32_t count;
+    if (size < (uint32_t)dataBytes) {
         cleanup_and_exit(args, EXIT_COMMUNICATE_STATUS);
     }
-    if (read(args->sockfd, &size, dataBytes) != dataBytes) {
-        // Read the data size
-        cleanup_and_exit(args, EXIT_COMMUNICATE_STATUS);
+    memcpy(&count, result, dataBytes);
+    uint32_t index = dataBytes;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t header[CROP_PART_HEADER_BYTES / sizeof(uint32_t)];
+        if (size - index < CROP_PART_HEADER_BYTES) {
+            cleanup_and_exit(args, EXIT_COMMUNICATE_STATUS);
+        }
+        memcpy(header, result + index, CROP_PART_HEADER_BYTES);
+        index += CROP_PART_HEADER_BYTES;
+        uint32_t cropSize = header[4];
+        if (size - index < cropSize) {
+            cleanup_and_exit(args, EXIT_COMMUNICATE_STATUS);
+        }
+        size_t length = strlen(args->outputFileName) + initialSize;
+        char* name = malloc(length);
+        snprintf(name, length, cropFileFormat, args->outputFileName, i);
+        FILE* output = fopen(name, "wb");
+        free(name);
+        if (!output) {
+            cleanup_and_exit(args, EXIT_OUTPUTFILE_STATUS);
+        }
+        fwrite(result + index, 1, cropSize, output);
+        fclose(output);
+        index += cropSize;
     }
-    uint8_t* result = malloc(size + 1);
-    if (!result || read(args->sockfd, result, size) != size) {
-        // Read the data
-        free(result);
+}
+
+/*
+ * handle_response
+ * ---------------
+ * Reads the server's response and writes the output image, or the crops, to
+ * the output file or stdout. Exits with the error status and the server's
+ * message on an error response, or with a communication error if the
+ * response is not well formed.
+ */
+void handle_response(Arguments* args)
+{
+    uint8_t operation;
+    uint8_t* result;
+    uint32_t size;
+    bool mapped;
+    if (!protocol_read_response(
+                args->sockfd, &operation, &result, &size, &mapped)) {
         cleanup_and_exit(args, EXIT_COMMUNICATE_STATUS);
     }
-    if (operation == REQUEST_OUTPUT) { // Output image
+    if (operation == REQUEST_CROP && args->outputFileName) { // Face crops
+        write_crops(args, result, size);
+        protocol_free_payload(result, size, mapped);
+    } else if (operation == REQUEST_OUTPUT || operation == REQUEST_CROP) {
+        // Output image, or crops to stdout
         FILE* output = args->outputFileName ? fopen(args->outputFileName, "wb")
                                             : stdout;
         // Get the output file
@@ -329,14 +547,15 @@ void handle_response(Arguments* args)
             // Prevent close the stdout
             fclose(output);
         }
-        free(result);
+        protocol_free_payload(result, size, mapped);
     } else if (operation == ERROR_MESSAGE) { // Error message
-        args->errorMessage = strdup((char*)result);
-        free(result);
+        // the message is not NUL terminated on the wire
+        args->errorMessage = strndup((char*)result, size);
+        protocol_free_payload(result, size, mapped);
         cleanup_and_exit(args, EXIT_ERRORMESSAGE_STATUS);
     } else {
         // Other unknow operation type
-        free(result);
+        protocol_free_payload(result, size, mapped);
         cleanup_and_exit(args, EXIT_COMMUNICATE_STATUS);
     }
 }
@@ -6,6 +6,8 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdbool.h>
@@ -17,8 +19,32 @@ const char* const optionArgStart = "--";
 const char* const detectFileArg = "--detectfilename";
 const char* const outputFileArg = "--outputfilename";
 const char* const replaceFileArg = "--replacefile";
+const char* const deadlineArg = "--deadline";
+const char* const clientTagArg = "--clienttag";
+const char* const rawArg = "--raw";
+const char* const cropArg = "--crop";
 const char* const emptyString = "";
 
+// The input image of --raw WIDTHxHEIGHT:format is raw pixels, in rows with
+// no padding, in one of these formats (indexed by PIXEL_*)
+const char* const rawShapeFormat = "%ux%u:%7s%n";
+const char* const pixelFormatNames[] = {"bgr", "bgra", "gray"};
+const int pixelFormatCount = 3;
+#define MAX_PIXEL_FORMAT_LENGTH 8
+
+// --crop margin,size,quality asks for the faces only, cut out with margin
+// percent around them, resized to size (0 keeps them) at a JPEG quality (0
+// for the server's default). Crop n is written to outputfilename-n.jpg, or
+// the whole response to stdout
+const char* const cropOptionsFormat = "%3u,%5u,%3u%n";
+const char* const cropFileFormat = "%s-%u.jpg";
+const unsigned maxCropMargin = 100;
+const unsigned maxCropSize = 4096;
+const unsigned maxCropQuality = 100;
+
+// A port with this in it is the path of the server's Unix socket instead
+const char socketPathSeparator = '/';
+
 // File type for file check easier
 const int detectFileType = 69;
 const int outputFileType = 99;
@@ -26,11 +52,15 @@ const int outputFileType = 99;
 // The initial size for reading
 const size_t initialSize = 1024;
 const int dataBytes = 4;
+const int baseTen = 10;
 
 // Error Message
 const char* const usageErrorMessage
         = "Usage: ./uqfaceclient port [--detectfilename filename]"
-          " [--outputfilename filename] [--replacefile filename]\n";
+          " [--outputfilename filename] [--replacefile filename]"
+          " [--deadline milliseconds] [--clienttag tag]"
+          " [--raw WIDTHxHEIGHT:bgr|bgra|gray]"
+          " [--crop margin,size,quality]\n";
 
 const char* const inputFileErrorMessageFormat
         = "uqfaceclient: cannot open the input file \"%s\" for reading\n";
@@ -54,6 +84,12 @@ typedef struct {
     char* outputFileName;
     char* replaceFileName;
     char* errorMessage;
+    uint32_t deadlineMs;
+    char* clientTag; // names the client to the server's fairness controls
+    bool local; // connected to a Unix socket, images go as file descriptors
+    RawImage raw; // shape of a raw input image, width 0 if it is encoded
+    bool cropFaces; // ask for the faces cut out instead of the whole frame
+    CropOptions crop;
     int sockfd;
 } Arguments;
 
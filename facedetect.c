@@ -17,6 +17,42 @@ Arguments* init_arguments_struct(void)
     args->clientLimit = 0;
     args->maxSize = 0;
     args->sockfd = 0;
+    args->socketPath = NULL;
+    args->localfd = -1;
+    memset(&args->pipeline, 0, sizeof(Pipeline));
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        args->stageThreads[i] = defaultStageThreads;
+        args->stageQueueSizes[i] = defaultQueueSize;
+    }
+    args->stageThreads[STAGE_DETECT] = 0; // one per CPU, see start_pipeline
+    args->stageThreads[STAGE_SEND] = defaultSendThreads;
+    args->schedule = SCHEDULE_SJF;
+    args->fairQueue = false;
+    args->agingFactor = defaultAgingFactor;
+    args->rateLimit = 0;
+    args->burst = 0;
+    args->clientCap = 0;
+    args->shards = 0;
+    args->stealThreads = 0; // one per CPU, see start_pipeline
+    args->adaptive = false;
+    args->prescreen.scale = 0;
+    args->prescreen.auditInterval = defaultPrescreenAudit;
+    args->prescreen.rejected = 0;
+    args->simdCascade = true;
+    args->cascadeFile = NULL;
+    args->modelsPath = NULL;
+    args->faceCacheSize = 0;
+    args->faceCacheDistance = defaultFaceCacheDistance;
+    args->statsPort = 0;
+    args->tracePath = NULL;
+    args->capturePath = NULL;
+    args->captureSample = defaultCaptureSample;
+    args->captureSlow = 0;
+    args->batchPath = NULL;
+    args->batchOutput = NULL;
+    args->batchReplace = NULL;
+    args->batchGeometry = false;
+    args->batchBadPath = NULL;
     return args;
 }
 
@@ -34,6 +70,8 @@ void setup_sigpipe_handler()
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     sigaction(SIGINT, &sa, NULL);
+    // A client may have gone before its response is written
+    sigaction(SIGPIPE, &sa, NULL);
 }
 
 /* cleanup_and_exit()
@@ -61,240 +99,252 @@ void cleanup_and_exit(Arguments* args, int exitStatus)
         fprintf(stderr, cascadeErrorMessage);
     } else if (exitStatus == EXIT_PORT_STATUS) {
         fprintf(stderr, portErrorMessage, args->port);
+    } else if (exitStatus == EXIT_SOCKET_STATUS) {
+        fprintf(stderr, socketErrorMessage, args->socketPath);
+    } else if (exitStatus == EXIT_STATS_STATUS) {
+        fprintf(stderr, statsPortErrorMessage, args->statsPort);
+    } else if (exitStatus == EXIT_TRACE_STATUS) {
+        fprintf(stderr, traceErrorMessage, args->tracePath);
+    } else if (exitStatus == EXIT_CAPTURE_STATUS) {
+        fprintf(stderr, captureErrorMessage, args->capturePath);
+    } else if (exitStatus == EXIT_BATCH_INPUT_STATUS) {
+        fprintf(stderr, batchInputErrorMessage, args->batchBadPath);
+    } else if (exitStatus == EXIT_BATCH_OUTPUT_STATUS) {
+        fprintf(stderr, batchOutputErrorMessage, args->batchOutput);
     }
     if (args) {
         if (args->port) {
             free(args->port);
         }
-        if (args->faceCascade) {
-            cvReleaseHaarClassifierCascade(&args->faceCascade);
+        if (args->socketPath) {
+            free(args->socketPath);
+        }
+        if (args->tracePath) {
+            free(args->tracePath);
         }
-        if (args->eyesCascade) {
-            cvReleaseHaarClassifierCascade(&args->eyesCascade);
+        if (args->capturePath) {
+            free(args->capturePath);
         }
+        free(args->cascadeFile);
+        free(args->modelsPath);
+        free(args->batchPath);
+        free(args->batchOutput);
+        free(args->batchReplace);
         free(args);
     }
     exit(exitStatus);
 }
 
 /*
- * check_cascade
- * -------------
- * Store  cascade classifiers for face and eye detection into the args struct.
- * Exits the program if either classifier cannot be loaded.
- *
- * REF: Example 2 from the A4 spec sheet.
+ * model_config
+ * ------------
+ * Fills in where the models come from and the face search parameters: the
+ * built in cascades and parameters and the arguments, overridden by the
+ * model file if there is one. Returns false if the model file is invalid.
  */
-void check_cascade(Arguments* args)
+bool model_config(Arguments* args, ModelConfig* config)
 {
-    // Load the cascade
-    args->faceCascade = (CvHaarClassifierCascade*)cvLoad(
-            faceCascadeFilename, NULL, NULL, NULL);
-    args->eyesCascade = (CvHaarClassifierCascade*)cvLoad(
-            eyesCascadeFilename, NULL, NULL, NULL);
-    if (!args->faceCascade || !args->eyesCascade) {
-        cleanup_and_exit(args, EXIT_CASCADE_STATUS);
+    snprintf(config->faceCascade, MODEL_MAX_PATH, "%s", faceCascadeFilename);
+    snprintf(config->eyesCascade, MODEL_MAX_PATH, "%s", eyesCascadeFilename);
+    snprintf(config->compiledFace, MODEL_MAX_PATH, "%s",
+            args->cascadeFile ? args->cascadeFile : emptyString);
+    config->simdCascade = args->simdCascade;
+    config->scaleFactor = haarScaleFactor;
+    config->minNeighbours = haarMinNeighbours;
+    config->extraCount = 0;
+    if (args->modelsPath && !models_read_config(args->modelsPath, config)) {
+        fprintf(stderr, modelFileErrorMessage, args->modelsPath);
+        return false;
     }
+    return true;
 }
 
 /*
- * cleanup_opencv_resources
- * ------------------------
- * Frees all allocated OpenCV resources to avoid memory leaks.
+ * load_extra_cascades
+ * -------------------
+ * Loads and compiles the more face cascades of the configuration into
+ * engines, adding a mirrored copy after each one to be searched mirrored.
+ * They always run on cascade.c, over the integral images the face search
+ * makes anyway. Returns the number of engines, or -1 if a cascade cannot be
+ * loaded or the evaluator does not support it.
  */
-void cleanup_opencv_resources(IplImage* frame, IplImage* frameGray,
-        CvHaarClassifierCascade* faceCascade,
-        CvHaarClassifierCascade* eyesCascade, CvMemStorage* storage,
-        IplImage* replace)
+int load_extra_cascades(const ModelConfig* config, CompiledCascade** engines)
 {
-    if (frame) {
-        cvReleaseImage(&frame);
+    int count = 0;
+    for (int i = 0; i < config->extraCount; i++) {
+        CvHaarClassifierCascade* cascade = (CvHaarClassifierCascade*)cvLoad(
+                config->extraCascades[i], NULL, NULL, NULL);
+        CompiledCascade* engine = cascade ? cascade_compile(cascade) : NULL;
+        if (cascade) {
+            cvReleaseHaarClassifierCascade(&cascade);
+        }
+        if (!engine) {
+            fprintf(stderr, extraCascadeErrorMessage,
+                    config->extraCascades[i]);
+            while (count > 0) {
+                cascade_free(engines[--count]);
+            }
+            return -1;
+        }
+        engines[count++] = engine;
+        if (config->extraMirrored[i]) {
+            engines[count++] = cascade_mirror(engine);
+        }
     }
-    if (frameGray) {
-        cvReleaseImage(&frameGray);
+    return count;
+}
+
+/*
+ * load_models
+ * -----------
+ * Loads the cascade classifiers for face and eye detection as a model set,
+ * and compiles the face one for cascade.c unless OpenCV is asked to run it;
+ * a cascade the evaluator does not support is left to OpenCV. A compiled
+ * cascade file, if given, is mapped instead of loading and compiling the
+ * face XML, which is only loaded if the file cannot be used. More face
+ * cascades of the model file are searched alongside the face one.
+ * Returns NULL if the model file is invalid or a classifier cannot be
+ * loaded.
+ *
+ * REF: Example 2 from the A4 spec sheet.
+ */
+ModelSet* load_models(Arguments* args)
+{
+    ModelConfig config;
+    CompiledCascade* extraEngines[2 * MODEL_MAX_EXTRA_CASCADES];
+    int extraCount;
+    if (!model_config(args, &config)
+            || (extraCount = load_extra_cascades(&config, extraEngines)) < 0) {
+        return NULL;
     }
-    if (faceCascade) {
-        // cvReleaseHaarClassifierCascade(&faceCascade);
+    CompiledCascade* faceEngine = NULL;
+    CvHaarClassifierCascade* faceCascade = NULL;
+    if (config.simdCascade && *config.compiledFace) {
+        faceEngine = cascade_map(config.compiledFace);
+        if (!faceEngine) {
+            fprintf(stderr, cascadeFileWarningMessage, config.compiledFace);
+        }
     }
-    if (eyesCascade) {
-        // cvReleaseHaarClassifierCascade(&eyesCascade);
+    // Load the cascade
+    if (!faceEngine) {
+        faceCascade = (CvHaarClassifierCascade*)cvLoad(
+                config.faceCascade, NULL, NULL, NULL);
     }
-    if (storage) {
-        cvReleaseMemStorage(&storage);
+    CvHaarClassifierCascade* eyesCascade = (CvHaarClassifierCascade*)cvLoad(
+            config.eyesCascade, NULL, NULL, NULL);
+    if ((!faceEngine && !faceCascade) || !eyesCascade) {
+        if (faceCascade) {
+            cvReleaseHaarClassifierCascade(&faceCascade);
+        }
+        if (eyesCascade) {
+            cvReleaseHaarClassifierCascade(&eyesCascade);
+        }
+        if (faceEngine) {
+            cascade_free(faceEngine);
+        }
+        for (int i = 0; i < extraCount; i++) {
+            cascade_free(extraEngines[i]);
+        }
+        return NULL;
     }
-    if (replace) {
-        cvReleaseImage(&replace);
+    if (config.simdCascade && !faceEngine) {
+        faceEngine = cascade_compile(faceCascade);
     }
+    return models_create(faceCascade, eyesCascade, faceEngine, extraEngines,
+            extraCount, &config);
 }
 
 /*
- * cleanup_roi_resources
- * ------------------------
- * Frees all allocated roi resources to avoid memory leaks.
+ * check_cascade
+ * -------------
+ * Loads the models and makes them the ones requests are detected with.
+ * Exits the program if they cannot be loaded.
  */
-void cleanup_roi_resources(IplImage* faceROI, CvMemStorage* eyeStorage)
+void check_cascade(Arguments* args)
 {
-    if (faceROI) {
-        cvReleaseImage(&faceROI);
-    }
-    if (eyeStorage) {
-        cvReleaseMemStorage(&eyeStorage);
+    ModelSet* models = load_models(args);
+    if (!models) {
+        cleanup_and_exit(args, EXIT_CASCADE_STATUS);
     }
+    models_publish(models);
+    metrics_gauge(GAUGE_MODEL_GENERATION, models->generation);
 }
 
 /*
- * Helper function for replace_face() draw the replace face
+ * reload_models
+ * -------------
+ * Loads the models again, from the model file as it is now if there is
+ * one, while requests go on being served, and swaps them in for the
+ * requests that start after. Those already running finish on the models
+ * they started with, which are freed after the last of them. If the new
+ * models cannot be loaded the current ones are kept.
  */
-void draw_ellipses_and_eyes(IplImage* frame, IplImage* frameGray, CvRect* face,
-        CvHaarClassifierCascade* eyesCascade)
+void reload_models(Arguments* args)
 {
-    CvPoint center = {face->x + face->width / 2, face->y + face->height / 2};
-    const CvScalar magenta = cvScalar(255, 0, 255, 0);
-    const CvScalar blue = cvScalar(255, 0, 0, 0);
-
-    cvEllipse(frame, center, cvSize(face->width / 2, face->height / 2), 0,
-            ellipseStartAngle, ellipseEndAngle, magenta, lineThickness,
-            lineType, shift);
-
-    IplImage* faceROI = cvCreateImage(cvGetSize(frameGray), IPL_DEPTH_8U, 1);
-    cvCopy(frameGray, faceROI, NULL);
-    cvSetImageROI(faceROI, *face);
-
-    CvMemStorage* eyeStorage = cvCreateMemStorage(0);
-    cvClearMemStorage(eyeStorage);
-
-    CvSeq* eyes = cvHaarDetectObjects(faceROI, eyesCascade, eyeStorage,
-            haarScaleFactor, haarMinNeighbours, haarFlags,
-            cvSize(haarMinSize, haarMinSize), cvSize(haarMaxSize, haarMaxSize));
-
-    if (eyes->total == 2) {
-        for (int j = 0; j < eyes->total; j++) {
-            CvRect* eye = (CvRect*)cvGetSeqElem(eyes, j);
-            CvPoint eyeCenter = {face->x + eye->x + eye->width / 2,
-                    face->y + eye->y + eye->height / 2};
-            int radius = cvRound((eye->width / 2 + eye->height / 2) / 2);
-            cvCircle(frame, eyeCenter, radius, blue, lineThickness, lineType,
-                    shift);
-        }
+    ModelSet* models = load_models(args);
+    if (!models) {
+        metrics_count(COUNTER_MODEL_RELOAD_FAILURES);
+        fprintf(stderr, "%s", modelReloadFailedMessage);
+        return;
     }
-
-    cleanup_roi_resources(faceROI, eyeStorage);
+    uint64_t generation = models->generation;
+    models_publish(models);
+    metrics_count(COUNTER_MODEL_RELOADS);
+    metrics_gauge(GAUGE_MODEL_GENERATION, generation);
+    fprintf(stderr, modelReloadMessage, (unsigned long long)generation);
 }
 
 /*
- * detect_faces
- * ------------
- * Detects faces and eyes in the given input image using cascade classifiers,
- * draws ellipses around them, and saves the annotated image to the output file.
- * Returns 0 on success, 1 if no faces found, or -1 on image load failure.
- *
- * REF: Example 2 from a4 spec
- */
-int detect_faces(char* inputfile, char* outputfile,
-        CvHaarClassifierCascade* faceCascade,
-        CvHaarClassifierCascade* eyesCascade)
-{
-    IplImage* frame = cvLoadImage(inputfile, CV_LOAD_IMAGE_COLOR);
-    if (!frame) {
-        return -1;
-    }
-    IplImage* frameGray = cvCreateImage(cvGetSize(frame), IPL_DEPTH_8U, 1);
-    cvCvtColor(frame, frameGray, CV_BGR2GRAY);
-    cvEqualizeHist(frameGray, frameGray);
-    CvMemStorage* storage = 0;
-    storage = cvCreateMemStorage(0);
-    cvClearMemStorage(storage);
-    CvSeq* faces = cvHaarDetectObjects(frameGray, faceCascade, storage,
-            haarScaleFactor, haarMinNeighbours, haarFlags,
-            cvSize(haarMinSize, haarMinSize), cvSize(haarMaxSize, haarMaxSize));
-    if (faces->total == 0) {
-        cleanup_opencv_resources(
-                frame, frameGray, faceCascade, eyesCascade, storage, NULL);
-        return 1;
-    }
-    for (int i = 0; i < faces->total; i++) {
-        CvRect* face = (CvRect*)cvGetSeqElem(faces, i);
-        draw_ellipses_and_eyes(frame, frameGray, face, eyesCascade);
-    }
-    cvSaveImage(outputfile, frame, 0);
-    cleanup_opencv_resources(
-            frame, frameGray, faceCascade, eyesCascade, storage, NULL);
-    return 0;
+ * handled_signals
+ * ---------------
+ * Fills set with the signals the signal thread handles.
+ */
+void handled_signals(sigset_t* set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGUSR1);
+    sigaddset(set, SIGHUP);
 }
 
 /*
- * Helper function for replace_face() draw the replace face
+ * handle_signals
+ * --------------
+ * Thread body that waits for SIGUSR1 and writes the server metrics to stderr,
+ * and flushes the trace, every time it arrives, and for SIGHUP, on which it
+ * loads the models again. Requests are served on while they load.
  */
-void draw_replace_on_face(IplImage* frame, IplImage* replace, CvRect* face)
+void* handle_signals(void* arg)
 {
-    IplImage* resized = cvCreateImage(cvSize(face->width, face->height),
-            IPL_DEPTH_8U, replace->nChannels);
-    cvResize(replace, resized, CV_INTER_AREA);
-
-    char* frameData = frame->imageData;
-    char* faceData = resized->imageData;
-
-    for (int y = 0; y < face->height; y++) {
-        for (int x = 0; x < face->width; x++) {
-            int faceIndex = resized->widthStep * y + x * resized->nChannels;
-            if (resized->nChannels == bgraChannels
-                    && faceData[faceIndex + alphaIndex] == 0) {
-                continue;
-            }
-            int frameIndex = frame->widthStep * (face->y + y)
-                    + (face->x + x) * frame->nChannels;
-            frameData[frameIndex + 0] = faceData[faceIndex + 0];
-            frameData[frameIndex + 1] = faceData[faceIndex + 1];
-            frameData[frameIndex + 2] = faceData[faceIndex + 2];
+    Arguments* args = (Arguments*)arg;
+    sigset_t set;
+    handled_signals(&set);
+    int signal;
+    while (sigwait(&set, &signal) == 0) {
+        if (signal == SIGUSR1) {
+            metrics_write(stderr);
+            trace_flush();
+        } else if (signal == SIGHUP) {
+            reload_models(args);
         }
     }
-
-    cvReleaseImage(&resized);
+    return NULL;
 }
 
 /*
- * replace_faces
- * -------------
- * Detects faces in the input frame and replaces each one with the given
- * replacement image. Saves the modified image to the specified output file and
- * returns 0 on success, 1 if no faces were found, or -1 if the input images are
- * invalid.
- *
- * REF: Example 3 from a4 spec
- */
-int replace_faces(IplImage* frame, IplImage* replace, char* outputFilename,
-        CvHaarClassifierCascade* faceCascade)
-{
-    if (!frame) {
-        cvReleaseHaarClassifierCascade(&faceCascade);
-        return -1;
-    }
-    if (!replace) {
-        cvReleaseImage(&frame);
-        cvReleaseHaarClassifierCascade(&faceCascade);
-        return -1;
-    }
-    IplImage* frameGray = cvCreateImage(cvGetSize(frame), IPL_DEPTH_8U, 1);
-    cvCvtColor(frame, frameGray, CV_BGR2GRAY);
-    cvEqualizeHist(frameGray, frameGray);
-    CvMemStorage* storage = cvCreateMemStorage(0);
-    cvClearMemStorage(storage);
-    CvSeq* faces = cvHaarDetectObjects(frameGray, faceCascade, storage,
-            haarScaleFactor, haarMinNeighbours, haarFlags,
-            cvSize(haarMinSize, haarMinSize), cvSize(haarMaxSize, haarMaxSize));
-    if (faces->total == 0) {
-        cleanup_opencv_resources(
-                frame, frameGray, faceCascade, NULL, storage, replace);
-        return 1;
-    }
-    for (int i = 0; i < faces->total; i++) {
-        CvRect* face = (CvRect*)cvGetSeqElem(faces, i);
-        draw_replace_on_face(frame, replace, face);
-    }
-    cvSaveImage(outputFilename, frame, 0);
-    cleanup_opencv_resources(
-            frame, frameGray, faceCascade, NULL, storage, replace);
-    return 0;
+ * setup_signal_thread
+ * -------------------
+ * Blocks SIGUSR1 and SIGHUP in every thread and starts a thread that
+ * handles them synchronously. Must be called before any other thread is
+ * created.
+ */
+void setup_signal_thread(Arguments* args)
+{
+    sigset_t set;
+    handled_signals(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t tid;
+    pthread_create(&tid, NULL, handle_signals, args);
+    pthread_detach(tid);
 }
 
 /*
@@ -360,6 +410,304 @@ uint32_t check_maxsize(char* maxSize, Arguments* args)
     return (uint32_t)value;
 }
 
+/*
+ * check_option_value
+ * ------------------
+ * Parses the value of an optional argument as an integer between min and max
+ * inclusive. Exits with usage status on invalid input.
+ */
+int check_option_value(char* value, int min, int max, Arguments* args)
+{
+    check_emptystring(value, args); // Check if it's empty string
+    char* ptr;
+    long result = strtol(value, &ptr, baseTen);
+    if (*ptr != '\0' || result < min || result > max) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    return (int)result;
+}
+
+/*
+ * parse_client_weight
+ * -------------------
+ * Applies a --clientweight name=weight value: requests from the named client
+ * identity (a peer address or client tag) get weight times the default share
+ * of the detect workers under fair scheduling. Exits with usage status on an
+ * invalid value.
+ */
+void parse_client_weight(char* value, Arguments* args)
+{
+    char* separator = strrchr(value, clientWeightSeparator);
+    if (!separator || separator == value
+            || separator - value >= MAX_IDENTITY_LENGTH) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    int weight = check_option_value(separator + 1, 1, maxClientWeight, args);
+    *separator = '\0';
+    bool stored = fairness_set_weight(value, weight);
+    *separator = clientWeightSeparator;
+    if (!stored) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+}
+
+/*
+ * parse_client_option
+ * -------------------
+ * Applies one of the optional arguments limiting each client identity.
+ * Returns false if the option is not one of them.
+ */
+bool parse_client_option(char* option, char* value, Arguments* args)
+{
+    if (strcmp(option, rateLimitArg) == 0) {
+        args->rateLimit = check_option_value(value, 0, maxRateLimit, args);
+    } else if (strcmp(option, burstArg) == 0) {
+        args->burst = check_option_value(value, 1, maxRateLimit, args);
+    } else if (strcmp(option, clientCapArg) == 0) {
+        args->clientCap = check_option_value(value, 0, maxClientCap, args);
+    } else if (strcmp(option, clientWeightArg) == 0) {
+        parse_client_weight(value, args);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * parse_capture_option
+ * --------------------
+ * Applies an optional argument recording requests to a capture file.
+ * Returns false if the option is not one of those. Exits with usage status
+ * on an invalid value.
+ */
+bool parse_capture_option(char* option, char* value, Arguments* args)
+{
+    if (strcmp(option, captureArg) == 0) {
+        check_emptystring(value, args);
+        if (args->capturePath) {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        args->capturePath = strdup(value);
+    } else if (strcmp(option, captureSampleArg) == 0) {
+        args->captureSample
+                = check_option_value(value, 0, maxCaptureSample, args);
+    } else if (strcmp(option, captureSlowArg) == 0) {
+        args->captureSlow = check_option_value(value, 1, maxCaptureSlow, args);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * parse_batch_option
+ * ------------------
+ * Applies an optional argument of an offline batch run. Returns false if
+ * the option is not one of those. Exits with usage status on an invalid
+ * value.
+ */
+bool parse_batch_option(char* option, char* value, Arguments* args)
+{
+    char** path = NULL;
+    if (strcmp(option, batchArg) == 0) {
+        path = &args->batchPath;
+    } else if (strcmp(option, batchOutputArg) == 0) {
+        path = &args->batchOutput;
+    } else if (strcmp(option, batchReplaceArg) == 0) {
+        path = &args->batchReplace;
+    } else if (strcmp(option, batchFormatArg) == 0) {
+        if (strcmp(value, imageFormatName) == 0) {
+            args->batchGeometry = false;
+        } else if (strcmp(value, geometryFormatName) == 0) {
+            args->batchGeometry = true;
+        } else {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        return true;
+    } else {
+        return false;
+    }
+    check_emptystring(value, args);
+    if (*path) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    *path = strdup(value);
+    return true;
+}
+
+/*
+ * parse_option
+ * ------------
+ * Applies one optional argument and its value. Every pipeline stage after
+ * receive can be sized with --<stage>threads and --<stage>queue, for example
+ * --detectthreads 8 --encodequeue 32. --schedule fifo|sjf|fair and
+ * --agingfactor n choose the order queued jobs are served in, and the client
+ * limits are set with --ratelimit, --burst, --clientcap and --clientweight.
+ * --stealthreads n sizes the pool running detection sub-tasks,
+ * --adaptive on|off lets the load decide the active detect workers and
+ * admitted requests, --shards n runs the server as n processes,
+ * --socket path also listens on a Unix socket, --prescreen n with
+ * --prescreenaudit n turn on the cheap first pass of face detection,
+ * --facecache n with --facecachedistance bits reuses the faces found in
+ * near duplicate images and --cascadeengine simd|opencv chooses what runs
+ * the face cascade, --cascadefile path maps it compiled, --models path
+ * reads the models from a model file, --statsport n serves the metrics
+ * over HTTP, --trace path records a trace of every request and --capture
+ * path, with --capturesample n and --captureslow ms, records requests for
+ * replay. --batch path with
+ * --batchoutput dir, --batchreplace file and --batchformat image|geometry
+ * runs over image files instead of serving clients.
+ * Exits with usage status on an unknown option or invalid value.
+ */
+void parse_option(char* option, char* value, Arguments* args)
+{
+    if (strcmp(option, scheduleArg) == 0) {
+        if (strcmp(value, fifoScheduleName) == 0) {
+            args->schedule = SCHEDULE_FIFO;
+        } else if (strcmp(value, sjfScheduleName) == 0) {
+            args->schedule = SCHEDULE_SJF;
+        } else if (strcmp(value, fairScheduleName) == 0) {
+            // fair queuing for detection, the other stages stay sjf
+            args->schedule = SCHEDULE_SJF;
+            args->fairQueue = true;
+        } else {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        return;
+    }
+    if (strcmp(option, agingFactorArg) == 0) {
+        args->agingFactor = check_option_value(value, 0, maxAgingFactor, args);
+        return;
+    }
+    if (parse_client_option(option, value, args)) {
+        return;
+    }
+    if (strcmp(option, stealThreadsArg) == 0) {
+        args->stealThreads
+                = check_option_value(value, 1, maxStageThreads, args);
+        return;
+    }
+    if (strcmp(option, adaptiveArg) == 0) {
+        if (strcmp(value, onValue) == 0) {
+            args->adaptive = true;
+        } else if (strcmp(value, offValue) == 0) {
+            args->adaptive = false;
+        } else {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        return;
+    }
+    if (strcmp(option, prescreenArg) == 0) {
+        args->prescreen.scale = check_option_value(
+                value, minPrescreenScale, maxPrescreenScale, args);
+        return;
+    }
+    if (strcmp(option, prescreenAuditArg) == 0) {
+        args->prescreen.auditInterval
+                = check_option_value(value, 0, maxPrescreenAudit, args);
+        return;
+    }
+    if (strcmp(option, faceCacheArg) == 0) {
+        args->faceCacheSize
+                = check_option_value(value, 0, FACECACHE_MAX_ENTRIES, args);
+        return;
+    }
+    if (strcmp(option, faceCacheDistanceArg) == 0) {
+        args->faceCacheDistance
+                = check_option_value(value, 0, FACECACHE_MAX_DISTANCE, args);
+        return;
+    }
+    if (strcmp(option, cascadeEngineArg) == 0) {
+        if (strcmp(value, simdEngineName) == 0) {
+            args->simdCascade = true;
+        } else if (strcmp(value, opencvEngineName) == 0) {
+            args->simdCascade = false;
+        } else {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        return;
+    }
+    if (strcmp(option, modelsArg) == 0) {
+        check_emptystring(value, args);
+        if (args->modelsPath) {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        args->modelsPath = strdup(value);
+        return;
+    }
+    if (strcmp(option, cascadeFileArg) == 0) {
+        check_emptystring(value, args);
+        if (args->cascadeFile) {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        args->cascadeFile = strdup(value);
+        return;
+    }
+    if (strcmp(option, traceArg) == 0) {
+        check_emptystring(value, args);
+        if (args->tracePath) {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        args->tracePath = strdup(value);
+        return;
+    }
+    if (strcmp(option, statsPortArg) == 0) {
+        args->statsPort = check_option_value(value, 1, maxStatsPort, args);
+        return;
+    }
+    if (parse_capture_option(option, value, args)) {
+        return;
+    }
+    if (parse_batch_option(option, value, args)) {
+        return;
+    }
+    if (strcmp(option, shardsArg) == 0) {
+        args->shards = check_option_value(value, 1, maxShards, args);
+        return;
+    }
+    if (strcmp(option, socketArg) == 0) {
+        struct sockaddr_un address;
+        check_emptystring(value, args);
+        if (args->socketPath || strlen(value) >= sizeof(address.sun_path)) {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        args->socketPath = strdup(value);
+        return;
+    }
+    char name[MAX_OPTION_LENGTH];
+    for (int i = STAGE_DECODE; i < STAGE_COUNT; i++) {
+        snprintf(name, sizeof(name), "%s%s%s", optionArgStart, stageNames[i],
+                threadsArgSuffix);
+        if (strcmp(option, name) == 0) {
+            args->stageThreads[i]
+                    = check_option_value(value, 1, maxStageThreads, args);
+            return;
+        }
+        snprintf(name, sizeof(name), "%s%s%s", optionArgStart, stageNames[i],
+                queueArgSuffix);
+        if (strcmp(option, name) == 0) {
+            args->stageQueueSizes[i]
+                    = check_option_value(value, 1, maxQueueSize, args);
+            return;
+        }
+    }
+    cleanup_and_exit(args, EXIT_USAGE_STATUS);
+}
+
+/*
+ * reply_error
+ * -----------
+ * Sends an error message to the client, counting it by its text and the
+ * bytes it takes.
+ */
+void reply_error(int fd, const char* message)
+{
+    metrics_error(message);
+    metrics_add(COUNTER_BYTES_SENT,
+            PREFIX_BYTES + OPERATION_BYTES + IMAGE_BYTES + strlen(message));
+    send_error(fd, message);
+}
+
 /*
  * read_exact_bytes
  * ----------------
@@ -382,6 +730,7 @@ ssize_t read_exact_bytes(int fd, void* buffer, size_t size)
         }
         readed += readBytes; // increment the bytes read
     }
+    metrics_add(COUNTER_BYTES_RECEIVED, readed);
     return readed; // the total bytes read, should be equal to size
 }
 
@@ -396,7 +745,8 @@ bool read_prefix(int fd)
 {
     uint32_t prefix;
     if (read_exact_bytes(fd, &prefix, sizeof(prefix)) != sizeof(prefix)) {
-        // Not correct format
+        // Not correct format, or far more often the client leaving between
+        // requests, which is not counted as an error
         send_error(fd, invalidErrorMessage);
         close(fd);
         return false;
@@ -413,7 +763,8 @@ bool read_prefix(int fd)
 /*
  * read_operation
  * --------------
- * Reads a single-byte operation type from the client and checks its validity
+ * Reads a single-byte operation type from the client and checks its validity,
+ * including the flags for optional header fields in its high bits.
  * Sends an error message and closes the connection if invalid or unreadable.
  * Returns true on success, false otherwise.
  */
@@ -421,13 +772,118 @@ bool read_operation(int fd, uint8_t* operation)
 {
     if (read(fd, operation, 1) != 1) {
         // Not correct format
-        send_error(fd, invalidErrorMessage);
+        reply_error(fd, invalidErrorMessage);
+        close(fd);
+        return false;
+    }
+    metrics_add(COUNTER_BYTES_RECEIVED, 1);
+    metrics_request(*operation);
+    uint8_t type = *operation & OPERATION_MASK;
+    if ((type != REQUEST_DETECT && type != REQUEST_REPLACE
+                && type != REQUEST_CROP)
+            || (*operation & ~OPERATION_MASK & ~supportedFlags)) {
+        // wrong operation type or unknown header fields
+        reply_error(fd, operationErrorMessage);
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * read_deadline
+ * -------------
+ * Reads the optional deadline field: how many milliseconds the caller will
+ * wait for its response. Sends an error message and closes the connection if
+ * it cannot be read. Returns true on success, false otherwise.
+ */
+bool read_deadline(int fd, uint32_t* deadlineMs)
+{
+    if (read_exact_bytes(fd, deadlineMs, DEADLINE_BYTES) != DEADLINE_BYTES) {
+        // Not correct format
+        reply_error(fd, invalidErrorMessage);
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * read_client_tag
+ * ---------------
+ * Reads the optional client tag field, a length byte followed by the tag,
+ * into tag as a string. Sends an error message and closes the connection if
+ * it cannot be read. Returns true on success, false otherwise.
+ */
+bool read_client_tag(int fd, char* tag)
+{
+    uint8_t length;
+    if (read_exact_bytes(fd, &length, CLIENT_TAG_LENGTH_BYTES)
+                    != CLIENT_TAG_LENGTH_BYTES
+            || read_exact_bytes(fd, tag, length) != length) {
+        // Not correct format
+        reply_error(fd, invalidErrorMessage);
+        close(fd);
+        return false;
+    }
+    tag[length] = '\0';
+    return true;
+}
+
+/*
+ * read_raw_header
+ * ---------------
+ * Reads the optional raw image field: the shape of the raw pixels sent as
+ * the first image. Sends an error message and closes the connection if it
+ * cannot be read or describes no valid image. Returns true on success, false
+ * otherwise.
+ */
+bool read_raw_header(int fd, RawImage* raw)
+{
+    uint32_t shape[3];
+    if (read_exact_bytes(fd, shape, sizeof(shape)) != sizeof(shape)
+            || read_exact_bytes(fd, &raw->format, 1) != 1) {
+        // Not correct format
+        reply_error(fd, invalidErrorMessage);
         close(fd);
         return false;
     }
-    if (*operation != 0 && *operation != 1) {
-        // wrong operation type
-        send_error(fd, operationErrorMessage);
+    raw->width = shape[0];
+    raw->height = shape[1];
+    raw->stride = shape[2];
+    int channels = protocol_pixel_channels(raw->format);
+    if (!channels || raw->width == 0 || raw->width > maxRawDimension
+            || raw->height == 0 || raw->height > maxRawDimension
+            || raw->stride < raw->width * channels) {
+        reply_error(fd, imageInvalidErrorMessage);
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * read_crop_options
+ * -----------------
+ * Reads the crop field of a crop request. Sends an error message and closes
+ * the connection if it cannot be read or is out of range. Returns true on
+ * success, false otherwise.
+ */
+bool read_crop_options(int fd, CropOptions* crop)
+{
+    uint8_t field[CROP_HEADER_BYTES];
+    if (read_exact_bytes(fd, field, CROP_HEADER_BYTES) != CROP_HEADER_BYTES) {
+        // Not correct format
+        reply_error(fd, invalidErrorMessage);
+        close(fd);
+        return false;
+    }
+    crop->marginPercent = field[0];
+    memcpy(&crop->size, field + 1, sizeof(uint16_t));
+    crop->quality = field[3];
+    if (crop->marginPercent > maxCropMargin || crop->size > maxCropSize
+            || crop->quality > maxCropQuality) {
+        reply_error(fd, invalidErrorMessage);
         close(fd);
         return false;
     }
@@ -446,27 +902,28 @@ bool read_image(int fd, uint32_t* size, uint32_t maxSize, uint8_t** image)
 {
     if (read_exact_bytes(fd, size, sizeof(uint32_t)) != sizeof(uint32_t)) {
         // wrong format for size
-        send_error(fd, invalidErrorMessage);
+        reply_error(fd, invalidErrorMessage);
         close(fd);
         return false;
     }
     if (*size == 0) {
         // the image has no bytes
-        send_error(fd, imageErrorMessage);
+        reply_error(fd, imageErrorMessage);
         close(fd);
         return false;
     }
     if (*size > maxSize) {
         // image is larger than the fixed limit
-        send_error(fd, bigImageErrorMessage);
+        reply_error(fd, bigImageErrorMessage);
         close(fd);
         return false;
     }
     *image = malloc(*size);
     if (!*image || read_exact_bytes(fd, *image, *size) != *size) {
         // Worng format for image
-        send_error(fd, invalidErrorMessage);
+        reply_error(fd, invalidErrorMessage);
         free(*image);
+        *image = NULL;
         close(fd);
         return false;
     }
@@ -474,162 +931,726 @@ bool read_image(int fd, uint32_t* size, uint32_t maxSize, uint8_t** image)
 }
 
 /*
- * save_and_detect_image
- * ---------------------
- * Saves the received image to disk and runs face and eye detection using
- * OpenCV. Returns the detection result via detectResult and sends error
- * messages to the client if detection fails. Ensures exclusive access to the
- * temporary image file using a mutex lock.
+ * read_shared_image
+ * -----------------
+ * As read_image, for an image passed as a file descriptor attached to its
+ * size field. A sealed memfd is mapped rather than copied, and mapped is set.
+ * Returns true on success, false once the connection has been closed.
  */
-bool save_and_detect_image(
-        ClientInfo* clt, uint8_t* image, uint32_t imageSize, int* detectResult)
+bool read_shared_image(int fd, uint32_t* size, uint32_t maxSize,
+        uint8_t** image, bool* mapped)
 {
-    bool error;
-    // Avoid race condition
-    pthread_mutex_lock(&clt->lock);
-    FILE* file = fopen(TEMP_IMAGE_PATH, "wb");
-    fwrite(image, 1, imageSize, file); // write the image data into temp file
-    fclose(file);
-    // Check the detect result
-    *detectResult = detect_faces(TEMP_IMAGE_PATH, TEMP_IMAGE_PATH,
-            clt->faceCascade, clt->eyesCascade);
-    pthread_mutex_unlock(&clt->lock);
-    if (*detectResult == -1) {
-        // unable to read the file
-        send_error(clt->clientfd, imageInvalidErrorMessage);
-        error = true;
-    } else if (*detectResult == 1) {
-        // No face detect
-        send_error(clt->clientfd, noFaceErrorMessage);
-        error = true;
+    int imagefd;
+    if (!protocol_receive_fd(fd, size, &imagefd) || imagefd < 0) {
+        // wrong format for size, or no descriptor with it
+        reply_error(fd, invalidErrorMessage);
+        close(fd);
+        return false;
+    }
+    const char* error = NULL;
+    if (*size == 0) {
+        error = imageErrorMessage;
+    } else if (*size > maxSize) {
+        error = bigImageErrorMessage;
+    } else if (!(*image = protocol_map_image(imagefd, *size, mapped))) {
+        // the file is shorter than its size field or unreadable
+        error = invalidErrorMessage;
     }
+    close(imagefd);
     if (error) {
+        reply_error(fd, error);
+        close(fd);
         return false;
     }
     return true;
 }
 
 /*
- * save_and_replace_image
- * ----------------------
- * Saves two input images to disk and uses them to perform face replacement
- * using OpenCV. Ensures thread-safe access to the shared temporary file via a
- * mutex lock. Returns true on success, or false after sending an appropriate
- * error message to the client.
- */
-bool save_and_replace_image(ClientInfo* clt, uint8_t* image1,
-        uint32_t image1Size, uint8_t* image2, uint32_t image2Size,
-        int* replaceResult)
-{
-    bool error;
-    // Avoid race condition
-    pthread_mutex_lock(&clt->lock);
-    FILE* file1 = fopen(TEMP_IMAGE_PATH, "wb");
-    fwrite(image1, 1, image1Size, file1); // write the image1 into temp file
-    fclose(file1);
-    IplImage* frame = cvLoadImage(TEMP_IMAGE_PATH, CV_LOAD_IMAGE_COLOR);
-    // Grab the frame from the path first
-
-    FILE* file2 = fopen(TEMP_IMAGE_PATH, "wb");
-    fwrite(image2, 1, image2Size, file2); // overwrite the image2 into temp file
-    fclose(file2);
-    IplImage* replace = cvLoadImage(TEMP_IMAGE_PATH, CV_LOAD_IMAGE_UNCHANGED);
-    // Grab the frame from the path first
-
-    // Check the replace result
-    *replaceResult
-            = replace_faces(frame, replace, TEMP_IMAGE_PATH, clt->faceCascade);
-    pthread_mutex_unlock(&clt->lock);
-    if (*replaceResult == -1) {
-        // unable read file
-        send_error(clt->clientfd, imageInvalidErrorMessage);
-        error = true;
-    } else if (*replaceResult == 1) {
-        // No face detect
-        send_error(clt->clientfd, noFaceErrorMessage);
-        error = true;
-    }
-    if (error) {
-        return false;
-    }
-    return true;
+ * read_job_image
+ * --------------
+ * Reads the first image of a request into the job, or its replacement image
+ * if replacement is set, as bytes or as a descriptor depending on how the
+ * request passes its images.
+ * Returns true on success, false once the connection has been closed.
+ */
+bool read_job_image(ClientInfo* clt, Job* job, bool replacement)
+{
+    uint32_t* size = replacement ? &job->image2Size : &job->image1Size;
+    uint8_t** image = replacement ? &job->image2 : &job->image1;
+    uint64_t start = trace_begin();
+    bool read = job->sharedMemory
+            ? read_shared_image(clt->clientfd, size, clt->maxSize, image,
+                      replacement ? &job->image2Mapped : &job->image1Mapped)
+            : read_image(clt->clientfd, size, clt->maxSize, image);
+    trace_end(replacement ? "read_replacement" : "read_image", start, -1);
+    return read;
 }
 
 /*
- * handle_client
- * -------------
- * Handles the client's requests in a dedicated thread.
- * Reads and validates protocol messages,
- * performs face detection or replacement based on the request,
- * and sends back the processed image.
- * Manages memory and concurrency using mutex locks and performs cleanup on
- * failure.
+ * read_request
+ * ------------
+ * Reads the start of a request (prefix, operation, optional header fields
+ * and first image) from the client into the job. This is the receive stage
+ * of the pipeline; the replacement image of a replace is read by
+ * receive_replacement() while the first image is already being processed.
+ * The client tag, if any, is stored in clientTag (at least
+ * MAX_CLIENT_TAG_LENGTH + 1 bytes), otherwise it is left empty.
+ * Returns true on success, false once the connection has been closed.
  */
-void* handle_client(void* arg)
+bool read_request(ClientInfo* clt, Job* job, char* clientTag)
 {
-    ClientInfo* clt = (ClientInfo*)arg;
     int fd = clt->clientfd;
+    if (!read_prefix(fd)) { // read prefix
+        return false;
+    }
+    uint64_t start = now_nanos(); // the request has started arriving
+    job->arrival = start;
+    trace_set_request(job->id, 0);
     uint8_t operation;
-    uint32_t image1Size;
-    uint8_t* image1 = NULL;
-    while (1) {
-        // loop keep process until sth wrong
-        // handle multi request
-        if (!read_prefix(fd)) { // read prefix
-            return NULL;
-        }
-        if (!read_operation(fd, &operation)) { // read operation type
-            return NULL;
-        }
-        if (!read_image(fd, &image1Size, clt->maxSize, &image1)) {
-            return NULL;
-        }
-        if (operation == REQUEST_DETECT) {
-            int detectResult;
-            if (!save_and_detect_image(
-                        clt, image1, image1Size, &detectResult)) {
-                free(image1);
-                return NULL;
-            }
+    if (!read_operation(fd, &operation)) { // read operation type
+        return false;
+    }
+    job->operation = operation & OPERATION_MASK;
+    job->sharedMemory = operation & FLAG_SHARED_MEMORY;
+    if (job->sharedMemory && !clt->local) {
+        // descriptors can only be passed over the Unix socket
+        reply_error(fd, operationErrorMessage);
+        close(fd);
+        return false;
+    }
+    if (operation & FLAG_DEADLINE) {
+        // the caller's budget starts when its request does
+        uint32_t deadlineMs;
+        if (!read_deadline(fd, &deadlineMs)) {
+            return false;
         }
-        if (operation == REQUEST_REPLACE) {
-            uint32_t image2Size;
-            uint8_t* image2 = NULL;
-            if (!read_image(fd, &image2Size, clt->maxSize, &image2)) {
-                free(image1);
-                return NULL;
-            }
-            int replaceResult;
-            if (!save_and_replace_image(clt, image1, image1Size, image2,
-                        image2Size, &replaceResult)) {
-                free(image1);
-                free(image2);
-                return NULL;
-            }
-            free(image2);
+        job->deadline = start + deadlineMs * nanosPerMilli;
+    }
+    *clientTag = '\0';
+    if ((operation & FLAG_CLIENT_TAG) && !read_client_tag(fd, clientTag)) {
+        return false;
+    }
+    job->rawPixels = operation & FLAG_RAW_PIXELS;
+    if (job->rawPixels && !read_raw_header(fd, &job->raw)) {
+        return false;
+    }
+    if (job->operation == REQUEST_CROP && !read_crop_options(fd, &job->crop)) {
+        return false;
+    }
+    if (!read_job_image(clt, job, false)) {
+        return false;
+    }
+    if (job->rawPixels) {
+        if (job->image1Size < (uint64_t)job->raw.stride * job->raw.height) {
+            // fewer pixels than the shape needs
+            reply_error(fd, imageInvalidErrorMessage);
+            close(fd);
+            return false;
         }
-        pthread_mutex_lock(&clt->lock); // avoid race condition
-        send_client(fd); // send the image data to client if it reaach here
-        pthread_mutex_unlock(&clt->lock);
-        free(image1);
+        job->cost = pixel_cost(
+                (int)job->raw.width, (int)job->raw.height,
+                job->models->faceWindow);
+    } else {
+        job->cost = estimate_cost(
+                job->image1, job->image1Size, job->models->faceWindow);
     }
-    return NULL;
+    metrics_stage_record(STAGE_RECEIVE, job->cost, 0, now_nanos() - start);
+    trace_set_request(job->id, job->image1Size);
+    trace_end(stageNames[STAGE_RECEIVE], start, -1);
+    return true;
 }
 
 /*
- * run_server
+ * decode_image
+ * ------------
+ * Decodes an encoded image held in memory. flags is passed to OpenCV as for
+ * cvLoadImage. Returns NULL if the data is not a valid image.
+ */
+IplImage* decode_image(uint8_t* data, uint32_t size, int flags)
+{
+    CvMat buffer = cvMat(1, (int)size, CV_8UC1, data);
+    return cvDecodeImage(&buffer, flags);
+}
+
+/*
+ * receive_replacement
+ * -------------------
+ * Second part of a replace request, run on the client thread while the
+ * pipeline decodes and searches the first image: reads the replacement image
+ * and decodes it with its alpha channel kept, then joins the job in front of
+ * the encode stage, where the faces are replaced. The replacement of a job
+ * past its deadline is read but not decoded: the encode stage expires it.
+ * Returns true on success, false once the connection has been closed.
+ */
+bool receive_replacement(ClientInfo* clt, Job* job)
+{
+    bool open = read_job_image(clt, job, true);
+    if (!open) {
+        job->closed = true;
+    } else if (!job->deadline || now_nanos() < job->deadline) {
+        // the deadline, not job->error, which the pipeline threads own
+        // until the join
+        job->replace = decode_image(
+                job->image2, job->image2Size, CV_LOAD_IMAGE_UNCHANGED);
+    }
+    pipeline_join(clt->pipeline, STAGE_ENCODE, job);
+    return open;
+}
+
+/*
+ * refuse_request
+ * --------------
+ * Answers a request that was not admitted with the reason as an error
+ * message. The replacement image of a replace is still read, so the next
+ * request on the connection can be.
+ * Returns true on success, false once the connection has been closed.
+ */
+bool refuse_request(ClientInfo* clt, Job* job, Admission admission)
+{
+    if (job->operation == REQUEST_REPLACE && !read_job_image(clt, job, true)) {
+        return false;
+    }
+    if (admission == ADMIT_RATE_LIMITED) {
+        metrics_count(COUNTER_RATE_LIMITED);
+        reply_error(clt->clientfd, rateLimitedErrorMessage);
+    } else {
+        metrics_count(COUNTER_TOO_MANY_IN_FLIGHT);
+        reply_error(clt->clientfd, tooManyErrorMessage);
+    }
+    return true;
+}
+
+/*
+ * wrap_raw_pixels
+ * ---------------
+ * Makes the frame of a request that sent raw pixels. BGR pixels are used in
+ * place, through an image header over the request data, unless requests
+ * are being captured: drawing or replacing writes into the frame, and the
+ * capture needs the pixels as they were sent. Other formats are converted
+ * to a BGR frame.
+ */
+IplImage* wrap_raw_pixels(Job* job)
+{
+    CvSize size = cvSize((int)job->raw.width, (int)job->raw.height);
+    int channels = protocol_pixel_channels(job->raw.format);
+    IplImage* pixels = cvCreateImageHeader(size, IPL_DEPTH_8U, channels);
+    cvSetData(pixels, job->image1, (int)job->raw.stride);
+    if (job->raw.format == PIXEL_BGR && !capture_enabled()) {
+        job->frameBorrowed = true;
+        return pixels;
+    }
+    if (job->raw.format == PIXEL_BGR) {
+        IplImage* frame = cvCloneImage(pixels);
+        cvReleaseImageHeader(&pixels);
+        return frame;
+    }
+    IplImage* frame = cvCreateImage(size, IPL_DEPTH_8U, 3);
+    cvCvtColor(pixels, frame,
+            job->raw.format == PIXEL_GRAY ? CV_GRAY2BGR : CV_BGRA2BGR);
+    cvReleaseImageHeader(&pixels);
+    return frame;
+}
+
+/*
+ * lookup_face_cache
+ * -----------------
+ * Hashes the decoded frame and takes its faces from the face cache if an
+ * image like it was searched with the same models, so the detect stage
+ * goes straight to drawing or replacing them.
+ */
+void lookup_face_cache(Job* job)
+{
+    job->frameHash = facecache_hash(job->frame);
+    job->hashed = true;
+    job->cachedFaces = facecache_lookup(job->frameHash,
+            cvGetSize(job->frame), job->models->generation,
+            job->models->faceWindow, &job->faces, &job->faceCount);
+}
+
+/*
+ * decode_stage
+ * ------------
+ * Decodes the first image of a request in colour, and looks it up in the
+ * face cache if there is one. Raw pixels need no decoding and are wrapped
+ * as they are. A job that has already failed, by expiring say, is left
+ * alone, so its error stands.
+ */
+void decode_stage(Job* job, void* state)
+{
+    (void)state;
+    if (job->error) {
+        return;
+    }
+    if (job->rawPixels) {
+        job->frame = wrap_raw_pixels(job);
+    } else {
+        job->frame = decode_image(
+                job->image1, job->image1Size, CV_LOAD_IMAGE_COLOR);
+    }
+    if (!job->frame) {
+        // unable to read the image
+        job->error = imageInvalidErrorMessage;
+    } else if (facecache_enabled()) {
+        lookup_face_cache(job);
+    }
+}
+
+/*
+ * init_detect_worker
+ * ------------------
+ * Sets up a thread of the detection task pool. It copies the cascades of
+ * the models it is given by the first request it works on, and again
+ * whenever one comes with other models.
+ */
+void* init_detect_worker(void* context)
+{
+    Arguments* args = (Arguments*)context;
+    DetectWorker* worker = calloc(1, sizeof(DetectWorker));
+    worker->pool = &args->tasks;
+    worker->prescreen = &args->prescreen;
+    return worker;
+}
+
+/*
+ * attach_stage_worker
+ * -------------------
+ * Joins a detect or encode stage worker to the detection task pool, so the
+ * sub-tasks it spawns spread onto idle threads and it helps with theirs.
+ */
+void* attach_stage_worker(void* context)
+{
+    Arguments* args = (Arguments*)context;
+    return taskpool_attach(&args->tasks);
+}
+
+/*
+ * face_bands
  * ----------
- * Sets up a listening TCP socket on the specified port, prints the actual port
- * number, and enters an infinite loop to accept client connections. For each
- * accepted client, it spawns a new thread to handle the request using
- * handle_client().
- *
- * Exits the program with EXIT_PORT_STATUS if socket creation, binding, or
- * listening fails.
+ * Returns how many parallel bands of scales the face search of a job of the
+ * given cost is split into: one for ordinary images, more for big ones.
+ */
+int face_bands(uint64_t cost)
+{
+    uint64_t bands = cost / faceBandCost;
+    if (bands < 1) {
+        return 1;
+    }
+    return bands > (uint64_t)maxFaceBands ? maxFaceBands : (int)bands;
+}
+
+/*
+ * prescreen_faces
+ * ---------------
+ * Cheap first pass of face detection: runs the face cascade over a copy of
+ * the frame shrunk by the prescreen scale, keeping every raw hit rather than
+ * only grouped ones. A face smaller than the scale times the cascade window
+ * cannot be seen there, which is the price of the shortcut; the audit
+ * measures how often it is paid. Frames too small to shrink are let through.
+ * Returns false if nothing face-like was found.
+ */
+bool prescreen_faces(DetectWorker* worker, IplImage* frame)
+{
+    int scale = worker->prescreen->scale;
+    CvSize size = cvSize(frame->width / scale, frame->height / scale);
+    CvSize window = worker->faceWindow;
+    if (size.width - haarWindowMargin <= window.width
+            || size.height - haarWindowMargin <= window.height) {
+        return true;
+    }
+    IplImage* small = cvCreateImage(size, IPL_DEPTH_8U, frame->nChannels);
+    cvResize(frame, small, CV_INTER_AREA);
+    CascadeIntegral* integral;
+    IplImage* smallGray = create_equalised_gray(worker, small, &integral);
+    CvAvgComp* found;
+    int count = search_faces(worker, smallGray, integral,
+            cvSize(haarMinSize, haarMinSize),
+            cvSize(haarMaxSize / scale, haarMaxSize / scale),
+            prescreenMinNeighbours, &found);
+    free(found);
+    cvReleaseImage(&small);
+    cvReleaseImage(&smallGray);
+    if (integral) {
+        cascade_integral_free(integral);
+    }
+    return count > 0;
+}
+
+/*
+ * prescreen_rejects
+ * -----------------
+ * Runs the prescreen, if on, over the job's frame. One of every audit
+ * interval images it finds nothing in is still searched in full, so
+ * audit is set and the caller counts whether faces were missed.
+ * Returns true if the job can be answered without a full search.
+ */
+bool prescreen_rejects(DetectWorker* worker, Job* job, bool* audit)
+{
+    Prescreen* prescreen = worker->prescreen;
+    *audit = false;
+    if (!prescreen->scale || prescreen_faces(worker, job->frame)) {
+        return false;
+    }
+    metrics_count(COUNTER_PRESCREEN_REJECTED);
+    uint64_t rejected
+            = __atomic_add_fetch(&prescreen->rejected, 1, __ATOMIC_RELAXED);
+    *audit = prescreen->auditInterval
+            && rejected % (uint64_t)prescreen->auditInterval == 0;
+    if (*audit) {
+        metrics_count(COUNTER_PRESCREEN_AUDITED);
+    }
+    return !*audit;
+}
+
+/*
+ * detect_stage
+ * ------------
+ * Runs face detection on the decoded frame, after the prescreen if it is
+ * on, unless its faces came from the face cache; those found are cached.
+ * For a detect request the ellipses are drawn straight away; a replace
+ * waits for its replacement image and is composited in the encode stage.
+ * A job that only wants the faces is done once they are found, none being
+ * an answer rather than an error.
+ */
+void detect_stage(Job* job, void* state)
+{
+    DetectWorker* worker = (DetectWorker*)state;
+    if (job->error) {
+        return;
+    }
+    detect_worker_use(worker, job->models);
+    IplImage* frameGray = NULL;
+    if (!job->cachedFaces) {
+        bool audit;
+        if (prescreen_rejects(worker, job, &audit)) {
+            job->error = job->facesOnly ? NULL : noFaceErrorMessage;
+            return;
+        }
+        CascadeIntegral* integral;
+        frameGray = create_equalised_gray(worker, job->frame, &integral);
+        job->faceCount = find_faces(worker, frameGray, integral,
+                face_bands(job->cost), &job->faces);
+        if (integral) {
+            cascade_integral_free(integral);
+        }
+        if (audit && job->faceCount > 0) {
+            metrics_count(COUNTER_PRESCREEN_MISSED);
+        }
+        if (job->hashed) {
+            facecache_store(job->frameHash, cvGetSize(job->frame),
+                    job->models->generation, job->faces, job->faceCount);
+        }
+    }
+    if (job->faceCount == 0 && !job->facesOnly) {
+        // No face detect
+        job->error = noFaceErrorMessage;
+    } else if (job->operation == REQUEST_DETECT && !job->facesOnly) {
+        if (!frameGray) {
+            // the eyes are still searched for
+            frameGray = create_equalised_gray(worker, job->frame, NULL);
+        }
+        draw_detections(worker, job->frame, frameGray, job->faces,
+                job->faceCount);
+    }
+    cleanup_opencv_resources(frameGray, NULL);
+}
+
+/*
+ * encode_frame
+ * ------------
+ * Encodes the processed frame into the output image format. A frame decoded
+ * from a JPEG has been drawn on around its faces only, so the JPEG is
+ * patched there and keeps its original data everywhere else.
+ * Returns NULL if the frame cannot be encoded.
+ */
+CvMat* encode_frame(Job* job)
+{
+    CvMat* output = NULL;
+    if (!job->rawPixels) {
+        CvRect* regions = malloc(sizeof(CvRect) * job->faceCount);
+        for (int i = 0; i < job->faceCount; i++) {
+            // the outlines are drawn centred on the face's edges
+            regions[i] = cvRect(job->faces[i].x - lineThickness,
+                    job->faces[i].y - lineThickness,
+                    job->faces[i].width + 2 * lineThickness,
+                    job->faces[i].height + 2 * lineThickness);
+        }
+        output = jpegpatch_encode(job->image1, job->image1Size, job->frame,
+                regions, job->faceCount);
+        free(regions);
+    }
+    if (output) {
+        metrics_count(COUNTER_PARTIAL_ENCODES);
+        return output;
+    }
+    return cvEncodeImage(outputImageExtension, job->frame, NULL);
+}
+
+/*
+ * encode_stage
+ * ------------
+ * Pastes the replacement over the faces of a replace request, then encodes
+ * the processed frame into the output image format. A crop request gets
+ * its faces encoded one by one instead.
+ */
+void encode_stage(Job* job, void* state)
+{
+    DetectWorker* worker = (DetectWorker*)state;
+    if (job->operation == REQUEST_REPLACE && !job->replace && !job->closed
+            && (!job->error || job->error == noFaceErrorMessage)) {
+        // An unreadable replacement is reported before a lack of faces
+        job->error = imageInvalidErrorMessage;
+    }
+    if (job->error || job->closed || job->facesOnly) {
+        return;
+    }
+    if (job->operation == REQUEST_CROP) {
+        job->output = encode_face_crops(worker->pool, job);
+    } else {
+        if (job->operation == REQUEST_REPLACE) {
+            uint64_t start = now_nanos();
+            replace_faces(worker->pool, job->frame, job->replace, job->faces,
+                    job->faceCount);
+            metrics_phase(PHASE_COMPOSITE, now_nanos() - start);
+        }
+        job->output = encode_frame(job);
+    }
+    if (!job->output) {
+        job->error = imageInvalidErrorMessage;
+    }
+}
+
+/*
+ * send_stage
+ * ----------
+ * Sends the encoded image, or the error the job failed with, to the client
+ * and wakes the receive thread waiting on the job. The image goes back the
+ * way the request's images came, as bytes or as a descriptor. A batch job
+ * has no client; its run writes its output and frees it.
+ */
+void send_stage(Job* job, void* state)
+{
+    (void)state;
+    if (job->batch) {
+        batch_finish(job);
+        return;
+    }
+    if (job->closed) {
+        // the client thread already reported the error and closed
+    } else if (job->error) {
+        reply_error(job->clientfd, job->error);
+    } else {
+        uint8_t operation = job->operation == REQUEST_CROP ? REQUEST_CROP
+                                                           : REQUEST_OUTPUT;
+        uint32_t size = (uint32_t)(job->output->rows * job->output->cols);
+        if (job->sharedMemory) {
+            send_shared_result(job->clientfd, operation,
+                    job->output->data.ptr, size);
+        } else {
+            send_result(job->clientfd, operation, job->output->data.ptr, size);
+        }
+        metrics_add(COUNTER_BYTES_SENT,
+                PREFIX_BYTES + OPERATION_BYTES + IMAGE_BYTES
+                        + (job->sharedMemory ? 0 : size));
+    }
+    sem_post(&job->done);
+}
+
+/*
+ * fair_queue_key
+ * --------------
+ * Orders the detect queue by start-time fair queuing across client
+ * identities, so no identity can hold the detect workers by sending many
+ * requests at once.
+ */
+uint64_t fair_queue_key(Job* job)
+{
+    return fairness_start_tag(job->identity, job->cost);
+}
+
+/*
+ * usable_cpus
+ * -----------
+ * Returns the number of CPUs the process may run on.
+ */
+int usable_cpus(void)
+{
+    cpu_set_t cpus;
+    int count = sched_getaffinity(0, sizeof(cpus), &cpus) == 0
+            ? CPU_COUNT(&cpus)
+            : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
+/*
+ * start_pipeline
+ * --------------
+ * Sizes every stage of the request pipeline from the arguments and starts
+ * their worker threads. The receive stage is run by the client threads.
+ * Unless sized explicitly, the detect stage and the detection task pool
+ * get one thread per CPU the process may run on.
+ */
+void start_pipeline(Arguments* args)
+{
+    if (args->stageThreads[STAGE_DETECT] == 0) {
+        args->stageThreads[STAGE_DETECT] = usable_cpus();
+    }
+    if (args->stealThreads == 0) {
+        args->stealThreads = usable_cpus();
+    }
+    taskpool_init(&args->tasks, args->stealThreads,
+            args->stageThreads[STAGE_DETECT] + args->stageThreads[STAGE_ENCODE],
+            init_detect_worker, args);
+    taskpool_start(&args->tasks);
+    fairness_configure(args->rateLimit,
+            args->burst ? args->burst
+                        : (args->rateLimit ? args->rateLimit : 1),
+            args->clientCap);
+    Pipeline* pipeline = &args->pipeline;
+    pipeline->schedule = args->schedule;
+    pipeline->agingFactor = args->agingFactor;
+    pipeline->expiredError = expiredErrorMessage;
+    StageFunction functions[STAGE_COUNT]
+            = {NULL, decode_stage, detect_stage, encode_stage, send_stage};
+    for (int i = STAGE_DECODE; i < STAGE_COUNT; i++) {
+        pipeline_init_stage(pipeline, i, args->stageThreads[i],
+                args->stageQueueSizes[i], functions[i],
+                i == STAGE_DETECT || i == STAGE_ENCODE ? attach_stage_worker
+                                                       : NULL,
+                args);
+    }
+    if (args->fairQueue) {
+        pipeline_order_stage(
+                pipeline, STAGE_DETECT, fair_queue_key, fairness_dequeued);
+    }
+    pipeline_start(pipeline);
+    if (args->adaptive) {
+        controller_start(pipeline,
+                args->clientLimit > 0 ? args->clientLimit : MAX_CLIENTS);
+    }
+}
+
+/*
+ * capture_job
+ * -----------
+ * Appends a finished request to the capture file if it is sampled or its
+ * response was slow, framed as a client sends it but with its images
+ * inline, so it replays the same whichever socket it came on. Requests
+ * whose connection closed before they were read in full are not captured.
+ */
+void capture_job(Job* job, const char* clientTag, uint64_t connection)
+{
+    if (!capture_enabled() || job->closed) {
+        return;
+    }
+    CaptureRecord record = {0};
+    record.latency = now_nanos() - job->arrival;
+    record.reasons = capture_reasons(record.latency);
+    if (!record.reasons) {
+        return;
+    }
+    record.arrival = job->arrival;
+    record.connection = connection;
+    record.operation = job->operation;
+    RequestOptions options = {0};
+    if (job->deadline) {
+        options.deadlineMs
+                = (uint32_t)((job->deadline - job->arrival) / nanosPerMilli);
+    }
+    options.clientTag = clientTag;
+    options.raw = job->rawPixels ? &job->raw : NULL;
+    options.crop = &job->crop;
+    uint8_t* header;
+    size_t headerSize;
+    protocol_pack_header(job->operation, &options, &header, &headerSize);
+    struct iovec parts[] = {{header, headerSize},
+            {&job->image1Size, IMAGE_BYTES},
+            {job->image1, job->image1Size}, {&job->image2Size, IMAGE_BYTES},
+            {job->image2, job->image2Size}};
+    int partCount = sizeof(parts) / sizeof(parts[0]);
+    if (job->operation != REQUEST_REPLACE) {
+        partCount -= 2; // no replacement image
+    }
+    capture_write(&record, parts, partCount);
+    free(header);
+    metrics_count(COUNTER_CAPTURED);
+    if (record.reasons & CAPTURE_SLOW) {
+        metrics_count(COUNTER_CAPTURED_SLOW);
+    }
+}
+
+/*
+ * handle_client
+ * -------------
+ * Handles the client's requests in a dedicated thread.
+ * Reads and validates protocol messages and hands each request to the
+ * pipeline, which decodes it, performs face detection or replacement and
+ * sends back the processed image. A replace is handed over as soon as its
+ * first image has arrived, so detection overlaps the upload and decode of
+ * the replacement. The next request is read once the response to the
+ * previous one has been sent, so responses keep their order. Every request
+ * is first admitted against the limits of its client identity, its client
+ * tag or else the peer address; refused requests get an error message.
+ * Finished requests may be recorded to the capture file.
+ */
+void* handle_client(void* arg)
+{
+    ClientInfo* clt = (ClientInfo*)arg;
+    uint64_t connection = capture_connection();
+    metrics_connection(1);
+    bool open = true;
+    while (open) {
+        // loop keep process until the connection is closed
+        // handle multi request
+        Job* job = job_create(clt->clientfd);
+        job->models = models_acquire(); // fixed for the whole request
+        char clientTag[MAX_CLIENT_TAG_LENGTH + 1];
+        if (!read_request(clt, job, clientTag)) {
+            job_free(job);
+            break;
+        }
+        Admission admission = fairness_admit(
+                *clientTag ? clientTag : clt->peer, &job->identity);
+        if (admission != ADMIT_OK) {
+            open = refuse_request(clt, job, admission);
+            if (open) {
+                capture_job(job, clientTag, connection);
+            }
+            job_free(job);
+            continue;
+        }
+        controller_admit(); // waits while the server is at its limit
+        if (job->operation == REQUEST_REPLACE) {
+            // detection and the replacement meet before the encode stage
+            job->pendingParts = 2;
+            job->joinBefore = STAGE_ENCODE;
+        }
+        pipeline_submit(clt->pipeline, STAGE_DECODE, job);
+        if (job->operation == REQUEST_REPLACE) {
+            open = receive_replacement(clt, job);
+        }
+        sem_wait(&job->done); // wait for the send stage
+        controller_release();
+        fairness_release(job->identity);
+        capture_job(job, clientTag, connection);
+        job_free(job);
+    }
+    metrics_connection(-1);
+    if (clt->clientSlot) {
+        sem_post(clt->clientSlot);
+    }
+    free(clt);
+    return NULL;
+}
+
+/*
+ * bind_listener
+ * -------------
+ * Creates a TCP socket bound to the port in the arguments, sharing the port
+ * with the other shards if reusePort is set.
+ * Exits the program with EXIT_PORT_STATUS if creation or binding fails.
  * REF: net4.c from week 9 Lec
- * REF: server-multithreaded.c from week 10 Lec
  */
-void run_server(Arguments* args, pthread_mutex_t lock)
+int bind_listener(Arguments* args, bool reusePort)
 {
     struct addrinfo* ai = 0;
     struct addrinfo hints;
@@ -641,12 +1662,29 @@ void run_server(Arguments* args, pthread_mutex_t lock)
         cleanup_and_exit(args, EXIT_PORT_STATUS);
     }
     // Create and bind the server socket
-    args->sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (args->sockfd < 0
-            || bind(args->sockfd, ai->ai_addr, ai->ai_addrlen) != 0) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    if (sockfd < 0
+            || (reusePort
+                    && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on,
+                               sizeof(on))
+                            != 0)
+            || bind(sockfd, ai->ai_addr, ai->ai_addrlen) != 0) {
         freeaddrinfo(ai);
         cleanup_and_exit(args, EXIT_PORT_STATUS);
     }
+    freeaddrinfo(ai);
+    return sockfd;
+}
+
+/*
+ * report_port
+ * -----------
+ * Prints the port the server socket is bound to. An ephemeral port is
+ * looked up and stored back in the arguments, so shards bind the same one.
+ */
+void report_port(Arguments* args)
+{
     if (strcmp(args->port, "0") == 0) {
         // Port is ephemeral
         struct sockaddr_in ad;
@@ -654,38 +1692,377 @@ void run_server(Arguments* args, pthread_mutex_t lock)
         socklen_t len = sizeof(struct sockaddr_in);
         if (getsockname(args->sockfd, (struct sockaddr*)&ad, &len) == 0) {
             // retrieves the port the OS picked
-            fprintf(stderr, "%u\n", ntohs(ad.sin_port));
-            fflush(stderr);
+            char port[MAX_OPTION_LENGTH];
+            snprintf(port, sizeof(port), "%u", ntohs(ad.sin_port));
+            free(args->port);
+            args->port = strdup(port);
         }
-    } else { // print the given port
-        fprintf(stderr, "%s\n", args->port);
-        fflush(stderr);
     }
-    if (listen(args->sockfd, args->clientLimit) != 0) {
-        freeaddrinfo(ai);
-        cleanup_and_exit(args, EXIT_PORT_STATUS);
+    fprintf(stderr, "%s\n", args->port);
+    fflush(stderr);
+}
+
+/*
+ * bind_local_listener
+ * -------------------
+ * Creates a Unix socket bound to the socket path in the arguments, replacing
+ * a socket left there by an earlier server.
+ * Exits the program with EXIT_SOCKET_STATUS if creation or binding fails.
+ */
+int bind_local_listener(Arguments* args)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, args->socketPath, sizeof(address.sun_path) - 1);
+    struct stat info;
+    if (lstat(args->socketPath, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(args->socketPath);
     }
-    while (1) { // Repeatedly accept connections
-        int clientfd = accept(args->sockfd, NULL, NULL); // accept connect
-        ClientInfo* clt = malloc(sizeof(ClientInfo));
-        // sem_wait(&args->clientSlot);
-        clt->clientfd = clientfd;
-        clt->maxSize = args->maxSize;
-        clt->lock = lock;
-        clt->faceCascade = args->faceCascade;
-        clt->eyesCascade = args->eyesCascade;
-        // clt->mutex = args->mutex;
-        pthread_t tid; // spawn thread
-        pthread_create(&tid, NULL, handle_client, clt);
-        pthread_detach(tid); // detach the thread
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0
+            || bind(sockfd, (struct sockaddr*)&address, sizeof(address))
+                    != 0) {
+        cleanup_and_exit(args, EXIT_SOCKET_STATUS);
     }
-    freeaddrinfo(ai);
+    return sockfd;
+}
+
+/*
+ * start_client
+ * ------------
+ * Accepts a connection waiting on the listening socket, local if it is the
+ * Unix socket, and spawns a thread to receive its requests using
+ * handle_client(). The client is identified by its peer address, or by its
+ * user id on the Unix socket. Returns false if there was none to accept.
+ */
+bool start_client(Arguments* args, int listenfd, bool local)
+{
+    struct sockaddr_in peer;
+    socklen_t peerLength = sizeof(peer);
+    int clientfd = accept(listenfd, local ? NULL : (struct sockaddr*)&peer,
+            local ? NULL : &peerLength); // accept connect
+    if (clientfd < 0) {
+        return false;
+    }
+    ClientInfo* clt = malloc(sizeof(ClientInfo));
+    clt->clientSlot = args->clientLimit > 0 ? &args->clientSlot : NULL;
+    clt->clientfd = clientfd;
+    clt->local = local;
+    if (local) {
+        struct ucred credentials;
+        socklen_t length = sizeof(credentials);
+        getsockopt(clientfd, SOL_SOCKET, SO_PEERCRED, &credentials, &length);
+        snprintf(clt->peer, sizeof(clt->peer), localPeerFormat,
+                (unsigned)credentials.uid);
+    } else {
+        inet_ntop(AF_INET, &peer.sin_addr, clt->peer, sizeof(clt->peer));
+    }
+    clt->maxSize = args->maxSize;
+    clt->pipeline = &args->pipeline;
+    pthread_t tid; // spawn thread
+    pthread_create(&tid, NULL, handle_client, clt);
+    pthread_detach(tid); // detach the thread
+    return true;
+}
+
+/*
+ * accept_clients
+ * --------------
+ * Listens on the bound server socket, and the Unix socket if there is one,
+ * and enters an infinite loop accepting client connections from either,
+ * taking turns while both have connections waiting. The listeners are
+ * non-blocking, as shards share the Unix socket and all wake for one client.
+ *
+ * Exits the program with EXIT_PORT_STATUS if listening fails.
+ * REF: server-multithreaded.c from week 10 Lec
+ */
+void accept_clients(Arguments* args)
+{
+    struct pollfd listeners[2]
+            = {{args->sockfd, POLLIN, 0}, {args->localfd, POLLIN, 0}};
+    int count = args->localfd >= 0 ? 2 : 1;
+    for (int i = 0; i < count; i++) {
+        if (listen(listeners[i].fd, SOMAXCONN) != 0) {
+            cleanup_and_exit(args, i ? EXIT_SOCKET_STATUS : EXIT_PORT_STATUS);
+        }
+        fcntl(listeners[i].fd, F_SETFL,
+                fcntl(listeners[i].fd, F_GETFL) | O_NONBLOCK);
+    }
+    sem_init(&args->clientSlot, 0, args->clientLimit);
+    for (int turn = 0;; turn++) { // Repeatedly accept connections
+        if (args->clientLimit > 0) {
+            // further clients wait in the backlog until one leaves
+            sem_wait(&args->clientSlot);
+        }
+        bool accepted = false;
+        while (!accepted) {
+            if (poll(listeners, count, -1) < 0) {
+                continue; // interrupted
+            }
+            for (int i = 0; !accepted && i < count; i++) {
+                int which = (turn + i) % count;
+                accepted = (listeners[which].revents & POLLIN)
+                        && start_client(args, listeners[which].fd, which == 1);
+            }
+        }
+    }
+}
+
+/*
+ * start_stats_server
+ * ------------------
+ * Serves the metrics on the stats port, if one was given.
+ * Exits the program with EXIT_STATS_STATUS if it cannot be listened on.
+ */
+void start_stats_server(Arguments* args)
+{
+    if (args->statsPort
+            && (args->statsPort > maxStatsPort
+                    || !stats_server_start(args->statsPort))) {
+        cleanup_and_exit(args, EXIT_STATS_STATUS);
+    }
+}
+
+/*
+ * run_server
+ * ----------
+ * Sets up a listening TCP socket on the specified port, and the Unix socket
+ * if one is given, prints the actual port number, and serves clients on them
+ * in this process.
+ */
+void run_server(Arguments* args)
+{
+    args->sockfd = bind_listener(args, false);
+    if (args->socketPath) {
+        args->localfd = bind_local_listener(args);
+    }
+    report_port(args);
+    accept_clients(args);
+}
+
+/*
+ * load_batch_replacement
+ * ----------------------
+ * Reads and decodes the replacement of a replace batch, alpha channel kept,
+ * once for every image of the batch. Returns NULL if it cannot.
+ */
+IplImage* load_batch_replacement(const char* path)
+{
+    uint8_t* data;
+    uint32_t size;
+    if (!batch_read_file(path, &data, &size)) {
+        return NULL;
+    }
+    IplImage* replace = size ? decode_image(data, size, CV_LOAD_IMAGE_UNCHANGED)
+                             : NULL;
+    free(data);
+    return replace;
+}
+
+/*
+ * submit_batch_input
+ * ------------------
+ * Reads one image of a batch and hands it to the pipeline as a request
+ * would be, blocking while the decode queue is full. An image that cannot
+ * be read, or that a client could not send, fails here.
+ */
+void submit_batch_input(Arguments* args, BatchRun* run, const char* path,
+        const char* output)
+{
+    Job* job = job_create(-1);
+    const char* error = NULL;
+    if (!batch_read_file(path, &job->image1, &job->image1Size)) {
+        error = batchReadErrorMessage;
+    } else if (job->image1Size == 0) {
+        error = imageErrorMessage;
+    } else if (job->image1Size > args->maxSize) {
+        error = bigImageErrorMessage;
+    }
+    if (error) {
+        batch_fail(run, error);
+        job_free(job);
+        return;
+    }
+    job->batch = run;
+    job->batchInput = path;
+    job->batchOutput = output;
+    job->operation = run->replace ? REQUEST_REPLACE : REQUEST_DETECT;
+    job->replace = run->replace;
+    job->facesOnly = run->geometry;
+    job->arrival = now_nanos();
+    job->models = models_acquire();
+    job->cost = estimate_cost(
+            job->image1, job->image1Size, job->models->faceWindow);
+    batch_submitted(run);
+    pipeline_submit(&args->pipeline, STAGE_DECODE, job);
+}
+
+/*
+ * run_batch
+ * ---------
+ * Runs detection, or replacement, over every image of the batch input
+ * instead of serving clients, writing the results to the batch output
+ * directory, then reports how fast it went on stdout. The images take the
+ * same pipeline and detection workers as requests, so every CPU is used,
+ * and are read one at a time as the decode queue has room: only as many
+ * are held at once as the stage queues and workers take, however big the
+ * batch. Exits the program if the input, the replacement or the output
+ * directory cannot be used.
+ */
+void run_batch(Arguments* args)
+{
+    int count;
+    char** inputs = batch_list_inputs(args->batchPath, &count);
+    if (!inputs) {
+        args->batchBadPath = args->batchPath;
+        cleanup_and_exit(args, EXIT_BATCH_INPUT_STATUS);
+    }
+    BatchRun run;
+    if (!batch_init(&run, args->batchOutput, args->batchGeometry)) {
+        batch_free_inputs(inputs, count);
+        cleanup_and_exit(args, EXIT_BATCH_OUTPUT_STATUS);
+    }
+    if (args->batchReplace
+            && !(run.replace = load_batch_replacement(args->batchReplace))) {
+        batch_destroy(&run);
+        batch_free_inputs(inputs, count);
+        args->batchBadPath = args->batchReplace;
+        cleanup_and_exit(args, EXIT_BATCH_INPUT_STATUS);
+    }
+    char** outputs = batch_output_names(inputs, count);
+    args->fairQueue = false; // batch jobs all come from no client
+    start_pipeline(args);
+    start_stats_server(args);
+    uint64_t start = now_nanos();
+    for (int i = 0; i < count; i++) {
+        submit_batch_input(args, &run, inputs[i], outputs[i]);
+    }
+    batch_wait(&run);
+    batch_report(&run, stdout, now_nanos() - start);
+    if (facecache_enabled()) {
+        uint64_t hits, misses;
+        facecache_stats(&hits, &misses);
+        uint64_t lookups = hits + misses;
+        printf(faceCacheReportFormat, (unsigned long long)hits,
+                (unsigned long long)lookups,
+                lookups ? 100.0 * hits / lookups : 0.0);
+    }
+    batch_destroy(&run);
+    batch_free_inputs(outputs, count);
+    batch_free_inputs(inputs, count);
+}
+
+/*
+ * run_shard
+ * ---------
+ * Body of one shard process: pins itself to its CPUs, loads its own
+ * cascades, starts its own pipeline and accepts connections on its own
+ * socket bound to the shared port. The kernel spreads incoming connections
+ * across the sockets of all the shards; the Unix socket, if any, is bound
+ * once by the supervisor and accepted on by every shard. Never returns.
+ */
+void run_shard(Arguments* args, int shard, cpu_set_t* cpus, sigset_t* mask)
+{
+    prctl(PR_SET_PDEATHSIG, SIGTERM); // go down with the supervisor
+    // SIGUSR1 and SIGHUP stay blocked until the signal thread waits for
+    // them, so one forwarded while the cascades load, as a shard starts or
+    // restarts, is held rather than fatal
+    sigset_t shardMask = *mask;
+    sigaddset(&shardMask, SIGUSR1);
+    sigaddset(&shardMask, SIGHUP);
+    sigprocmask(SIG_SETMASK, &shardMask, NULL);
+    close(args->sockfd); // the supervisor's placeholder
+    sched_setaffinity(0, sizeof(cpu_set_t), cpus);
+    metrics_set_shard(shard);
+    check_cascade(args);
+    setup_signal_thread(args);
+    trace_start_flusher();
+    start_pipeline(args);
+    if (args->statsPort) {
+        args->statsPort += shard; // every shard reports its own metrics
+    }
+    start_stats_server(args);
+    args->sockfd = bind_listener(args, true);
+    accept_clients(args);
+    cleanup_and_exit(args, 0);
+}
+
+/*
+ * run_shards
+ * ----------
+ * Runs the server as args->shards processes sharing the port through
+ * SO_REUSEPORT, each pinned to a disjoint set of CPUs (within one NUMA node
+ * where possible). The shards share nothing, so a crash takes down only the
+ * connections of one shard. This process stays as their supervisor: it
+ * restarts a shard that dies and forwards SIGUSR1 and SIGHUP to all of
+ * them. Never returns.
+ */
+void run_shards(Arguments* args)
+{
+    // Hold the port, so it stays ours while shards come and go
+    args->sockfd = bind_listener(args, true);
+    if (args->socketPath) {
+        args->localfd = bind_local_listener(args);
+    }
+    report_port(args);
+    // Every shard loads its own models, or maps the same compiled cascade
+    models_publish(NULL);
+    cpu_set_t* cpus = malloc(sizeof(cpu_set_t) * args->shards);
+    cpuset_split(args->shards, cpus);
+    pid_t* pids = calloc(args->shards, sizeof(pid_t));
+    time_t* started = calloc(args->shards, sizeof(time_t));
+    sigset_t set, mask;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGHUP);
+    sigprocmask(SIG_BLOCK, &set, &mask);
+    int signal = SIGCHLD;
+    do {
+        if (signal == SIGUSR1 || signal == SIGHUP) {
+            for (int i = 0; i < args->shards; i++) {
+                if (pids[i] > 0) {
+                    kill(pids[i], signal);
+                }
+            }
+            continue;
+        }
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < args->shards; i++) {
+                if (pids[i] == pid) {
+                    fprintf(stderr, shardRestartMessage, i);
+                    pids[i] = 0;
+                }
+            }
+        }
+        for (int i = 0; i < args->shards; i++) {
+            if (pids[i]) {
+                continue;
+            }
+            do {
+                if (started[i]
+                        && time(NULL) - started[i] < shardRestartDelay) {
+                    sleep(shardRestartDelay); // do not spin on a failing shard
+                }
+                started[i] = time(NULL);
+                pids[i] = fork();
+            } while (pids[i] < 0);
+            if (pids[i] == 0) {
+                run_shard(args, i, &cpus[i], &mask);
+            }
+        }
+    } while (sigwait(&set, &signal) == 0);
+    cleanup_and_exit(args, 0);
 }
 
 /*
  * parse_arguments
  * ----------------
- * Parses and validates command-line arguments for uqfaceclient.
+ * Parses and validates command-line arguments for uqfacedetect: the
+ * positional arguments followed by any optional --name value pairs.
  * Stores values in an Arguments struct and checks file access.
  * Exits with appropriate status on usage, file, or port errors.
  * Returns: pointer to populated Arguments struct.
@@ -693,7 +2070,14 @@ void run_server(Arguments* args, pthread_mutex_t lock)
 Arguments* parse_arguments(int argc, char** argv)
 {
     Arguments* args = init_arguments_struct();
-    if (argc < minArgsCount || argc > maxArgsCount) {
+    int positional = 1; // arguments before the first --option
+    while (positional < argc
+            && strncmp(argv[positional], optionArgStart,
+                       strlen(optionArgStart))
+                    != 0) {
+        positional++;
+    }
+    if (positional < minArgsCount || positional > maxArgsCount) {
         // the argument count must at least be 3 or at most 4
         cleanup_and_exit(args, EXIT_USAGE_STATUS);
     }
@@ -701,13 +2085,26 @@ Arguments* parse_arguments(int argc, char** argv)
     args->clientLimit = check_clientlimit(argv[clientLimitIndex], args);
     args->maxSize = check_maxsize(argv[maxSizeIndex], args);
 
-    if (argc == maxArgsCount) {
+    if (positional == maxArgsCount) {
         // Port is optional
         check_emptystring(argv[portIndex], args);
         args->port = strdup(argv[portIndex]);
     } else {
         args->port = strdup("0"); // can be free safely with strdup()
     }
+    for (int i = positional; i < argc; i += 2) {
+        // Options come in pairs: --name value
+        if (i + 1 >= argc) {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        parse_option(argv[i], argv[i + 1], args);
+    }
+    if (args->batchPath
+            ? !args->batchOutput || (args->batchReplace && args->batchGeometry)
+            : args->batchOutput || args->batchReplace || args->batchGeometry) {
+        // a batch needs somewhere to write, and a replace makes images
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
     return args;
 }
 
@@ -725,12 +2122,33 @@ Arguments* parse_arguments(int argc, char** argv)
 int main(int argc, char** argv)
 {
     setup_sigpipe_handler();
-    pthread_mutex_t lock;
-    pthread_mutex_init(&lock, NULL);
     Arguments* args = parse_arguments(argc, argv);
-    // sem_init(&args->clientSlot, 0, args->clientLimit);
     check_cascade(args);
     check_image_file(args);
-    run_server(args, lock);
+    if (args->tracePath && !trace_open(args->tracePath)) {
+        cleanup_and_exit(args, EXIT_TRACE_STATUS);
+    }
+    if (args->capturePath
+            && !capture_open(args->capturePath, args->captureSample,
+                    args->captureSlow * nanosPerMilli)) {
+        cleanup_and_exit(args, EXIT_CAPTURE_STATUS);
+    }
+    facecache_init(args->faceCacheSize, args->faceCacheDistance);
+    if (args->batchPath) {
+        // a batch runs in this one process, whatever the shards
+        setup_signal_thread(args);
+        trace_start_flusher();
+        run_batch(args);
+        trace_flush();
+        cleanup_and_exit(args, 0);
+    }
+    if (args->shards) {
+        run_shards(args);
+    }
+    setup_signal_thread(args);
+    trace_start_flusher();
+    start_pipeline(args);
+    start_stats_server(args);
+    run_server(args);
     cleanup_and_exit(args, 0);
 }
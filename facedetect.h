@@ -1,12 +1,21 @@
+#define _GNU_SOURCE // CPU affinity of the shards
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
@@ -16,24 +25,195 @@
 #include <opencv2/imgproc/imgproc_c.h>
 #include <opencv2/objdetect/objdetect_c.h>
 #include "protocol.h"
+#include "pipeline.h"
+#include "metrics.h"
+#include "imageinfo.h"
+#include "fairness.h"
+#include "cpuset.h"
+#include "worksteal.h"
+#include "controller.h"
+#include "jpegpatch.h"
+#include "cascade.h"
+#include "equalise.h"
+#include "statsserver.h"
+#include "trace.h"
+#include "detect.h"
+#include "capture.h"
+#include "batch.h"
+#include "facecache.h"
 
 #define MAX_CLIENTS 10000
+#define MAX_OPTION_LENGTH 32
 
 // Base for converting char* to long
 const int baseTen = 10;
+const uint64_t nanosPerMilli = 1000000;
 
 // Max and Min argc insert
 const int minArgsCount = 3;
 const int maxArgsCount = 4;
 
+// Optional arguments sizing the pipeline stages, e.g. --detectthreads 4
+// and --detectqueue 16
+const char* const optionArgStart = "--";
+const char* const threadsArgSuffix = "threads";
+const char* const queueArgSuffix = "queue";
+const int maxStageThreads = 1024;
+const int maxQueueSize = 65536;
+
+// Default stage sizes; the detect stage defaults to one thread per CPU the
+// process may run on (0 here)
+const int defaultQueueSize = 16;
+const int defaultStageThreads = 2;
+const int defaultSendThreads = 4;
+
+// Optional argument sizing the work-stealing pool that runs the sub-tasks
+// of detection (face search bands, eye searches, compositing), e.g.
+// --stealthreads 8; it defaults to one thread per CPU (0 here)
+const char* const stealThreadsArg = "--stealthreads";
+
+// Optional argument --adaptive on|off: adapt the active detect workers and
+// the requests admitted at once to the measured load
+const char* const adaptiveArg = "--adaptive";
+const char* const onValue = "on";
+const char* const offValue = "off";
+
+// Optional arguments choosing how queued jobs are ordered:
+// --schedule fifo|sjf|fair and --agingfactor n
+const char* const scheduleArg = "--schedule";
+const char* const agingFactorArg = "--agingfactor";
+const char* const fifoScheduleName = "fifo";
+const char* const sjfScheduleName = "sjf";
+const char* const fairScheduleName = "fair";
+const int defaultAgingFactor = 4;
+const int maxAgingFactor = 1000;
+
+// Optional arguments limiting each client identity: --ratelimit n (requests
+// per second), --burst n, --clientcap n (requests in flight) and
+// --clientweight name=weight, which may be repeated
+const char* const rateLimitArg = "--ratelimit";
+const char* const burstArg = "--burst";
+const char* const clientCapArg = "--clientcap";
+const char* const clientWeightArg = "--clientweight";
+const char clientWeightSeparator = '=';
+const int maxRateLimit = 1000000;
+const int maxClientCap = 65536;
+const int maxClientWeight = 1000;
+
+// Optional argument running the server as --shards n processes sharing the
+// port, each pinned to its own CPUs and restarted if it dies
+const char* const shardsArg = "--shards";
+const int maxShards = 256;
+const unsigned shardRestartDelay = 1; // seconds, for a shard that died young
+
+// Optional argument --socket path: also listen on a Unix socket there, over
+// which clients on this host may pass images as file descriptors
+const char* const socketArg = "--socket";
+// Identity of a client on the Unix socket, from its user id
+const char* const localPeerFormat = "uid:%u";
+
+// Limits of the crop field of a crop request
+const int maxCropMargin = 100;
+const int maxCropSize = 4096;
+const int maxCropQuality = 100;
+
+// Work per band of a face search split across the task pool, and the most
+// bands it is split into
+const uint64_t faceBandCost = 32000000;
+const int maxFaceBands = 8;
+
+// Optional arguments for the cheap first pass of face detection:
+// --prescreen n runs the face cascade over the frame shrunk n times and
+// rejects the image if it finds nothing there, and --prescreenaudit n runs
+// the full search anyway on one of every n rejected images, to measure how
+// many faces the prescreen misses (0 for none)
+const char* const prescreenArg = "--prescreen";
+const char* const prescreenAuditArg = "--prescreenaudit";
+const int minPrescreenScale = 2;
+const int maxPrescreenScale = 8;
+const int defaultPrescreenAudit = 100;
+const int maxPrescreenAudit = 1000000;
+const int prescreenMinNeighbours = 0; // any raw hit keeps the image
+
+// Optional arguments for the cache of faces found: --facecache n keeps the
+// results of the last n images (0 for none), and reuses one for an image
+// whose perceptual hash differs from its image's in at most
+// --facecachedistance bits, its faces scaled to the new image's size
+const char* const faceCacheArg = "--facecache";
+const char* const faceCacheDistanceArg = "--facecachedistance";
+const int defaultFaceCacheDistance = 4;
+const char* const faceCacheReportFormat
+        = "face cache hits: %llu of %llu (%.1f%%)\n";
+
+// Optional argument --cascadeengine simd|opencv choosing what runs the face
+// cascade: the vectorised evaluator of cascade.c, or cvHaarDetectObjects.
+// The eye cascade always runs on OpenCV, its tree of stages and tilted
+// features being beyond the evaluator.
+const char* const cascadeEngineArg = "--cascadeengine";
+const char* const simdEngineName = "simd";
+const char* const opencvEngineName = "opencv";
+
+// Optional argument --cascadefile path: map the face cascade from a compiled
+// cascade file made by uqfacecompile rather than parse the XML. All the
+// processes mapping it share its pages. Should it not be a valid one, the
+// XML is loaded instead.
+const char* const cascadeFileArg = "--cascadefile";
+
+// Optional argument --models path: read the cascades and the face search
+// parameters from a model file (see models.h) rather than use the built in
+// ones. On SIGHUP the models are loaded again, from the file if given, and
+// replace the current ones for new requests while those running finish on
+// the old; a sharded server passes the signal on to every shard.
+const char* const modelsArg = "--models";
+
+// Optional argument --statsport n: serve the metrics over HTTP on that port
+// of the loopback interface, shard k of a sharded server on port n + k
+const char* const statsPortArg = "--statsport";
+const int maxStatsPort = 65535;
+
+// Optional argument --trace path: record a span for every stage and sub-task
+// of every request and append them to a Chrome trace file at path, every
+// second and on SIGUSR1
+const char* const traceArg = "--trace";
+
+// Optional arguments recording requests for uqfacereplay: --capture path
+// appends them to a capture file at path, --capturesample n one of every n
+// requests (0 for none) and --captureslow ms every request whose response
+// took longer than ms milliseconds, whether sampled or not
+const char* const captureArg = "--capture";
+const char* const captureSampleArg = "--capturesample";
+const char* const captureSlowArg = "--captureslow";
+const int defaultCaptureSample = 1;
+const int maxCaptureSample = 1000000;
+const int maxCaptureSlow = 3600000;
+
+// Optional arguments running offline over image files instead of serving
+// clients: --batch path takes the files of a directory, or the paths listed
+// one per line in a file, --batchoutput dir is where the results go,
+// --batchreplace file pastes that image over the faces rather than outlining
+// them and --batchformat image|geometry writes the processed images, or
+// only where the faces are
+const char* const batchArg = "--batch";
+const char* const batchOutputArg = "--batchoutput";
+const char* const batchReplaceArg = "--batchreplace";
+const char* const batchFormatArg = "--batchformat";
+const char* const imageFormatName = "image";
+const char* const geometryFormatName = "geometry";
+
+// Largest width or height of a raw image
+const uint32_t maxRawDimension = 65535;
+
 // Arugment index
 const int clientLimitIndex = 1;
 const int maxSizeIndex = 2;
 const int portIndex = 3;
 
-// empty strinf and number bytes of the data
+// The flags a request may set in its operation byte
+const uint8_t supportedFlags = FLAG_DEADLINE | FLAG_CLIENT_TAG
+        | FLAG_SHARED_MEMORY | FLAG_RAW_PIXELS;
+
+// empty string
 const char* const emptyString = "";
-const int dataBytes = 4;
 
 // Error message that sned to client
 const char* const usageErrorMessage
@@ -42,34 +222,41 @@ const char* const fileErrorMessage
         = "uqfacedetect: unable to open the image file for writing\n";
 const char* const cascadeErrorMessage
         = "uqfacedetect: cannot load a cascade classifier\n";
+const char* const cascadeFileWarningMessage
+        = "uqfacedetect: cannot map compiled cascade \"%s\", loading the XML\n";
 const char* const operationErrorMessage = "invalid operation type";
 const char* const imageErrorMessage = "image is 0 bytes";
 const char* const bigImageErrorMessage = "image too large";
 const char* const invalidErrorMessage = "invalid message";
 const char* const imageInvalidErrorMessage = "invalid image";
 const char* const noFaceErrorMessage = "no faces detected in image";
+const char* const expiredErrorMessage = "deadline expired";
+const char* const rateLimitedErrorMessage = "rate limit exceeded";
+const char* const tooManyErrorMessage = "too many requests in flight";
 const char* const portErrorMessage
         = "uqfacedetect: cannot listen on given port \"%s\"\n";
-
-// the cascade file name for OpenCv
-const char* const faceCascadeFilename = "/local/courses/csse2310/resources/a4/"
-                                        "haarcascade_frontalface_alt2.xml";
-const char* const eyesCascadeFilename = "/local/courses/csse2310/resources/a4/"
-                                        "haarcascade_eye_tree_eyeglasses.xml";
-
-// OpenCV parameters
-const float haarScaleFactor = 1.1;
-const int haarMinNeighbours = 4;
-const int haarFlags = 0;
-const int haarMinSize = 0;
-const int haarMaxSize = 1000;
-const int ellipseStartAngle = 0;
-const int ellipseEndAngle = 360;
-const int lineThickness = 4;
-const int lineType = 8;
-const int shift = 0;
-const int bgraChannels = 4;
-const int alphaIndex = 3;
+const char* const socketErrorMessage
+        = "uqfacedetect: cannot listen on socket \"%s\"\n";
+const char* const statsPortErrorMessage
+        = "uqfacedetect: cannot listen on stats port \"%d\"\n";
+const char* const traceErrorMessage
+        = "uqfacedetect: cannot write trace file \"%s\"\n";
+const char* const captureErrorMessage
+        = "uqfacedetect: cannot write capture file \"%s\"\n";
+const char* const batchInputErrorMessage
+        = "uqfacedetect: cannot read batch input \"%s\"\n";
+const char* const batchOutputErrorMessage
+        = "uqfacedetect: cannot write batch output \"%s\"\n";
+const char* const modelFileErrorMessage
+        = "uqfacedetect: invalid model file \"%s\"\n";
+const char* const extraCascadeErrorMessage
+        = "uqfacedetect: cannot load or compile the face cascade \"%s\"\n";
+const char* const modelReloadMessage
+        = "uqfacedetect: loaded models generation %llu\n";
+const char* const modelReloadFailedMessage
+        = "uqfacedetect: cannot load the models, keeping the current ones\n";
+const char* const shardRestartMessage
+        = "uqfacedetect: shard %d exited, restarting\n";
 
 // The Argument of the program
 typedef struct {
@@ -77,19 +264,48 @@ typedef struct {
     uint32_t maxSize;
     char* port;
     int sockfd;
+    char* socketPath; // Unix socket also listened on, NULL for none
+    int localfd;
     sem_t clientSlot;
-    CvHaarClassifierCascade* faceCascade;
-    CvHaarClassifierCascade* eyesCascade;
+    int stageThreads[STAGE_COUNT];
+    int stageQueueSizes[STAGE_COUNT];
+    Schedule schedule;
+    bool fairQueue; // detect stage ordered by fair queuing across clients
+    int agingFactor;
+    int rateLimit; // per identity requests per second, 0 for no limit
+    int burst; // 0 for the same as rateLimit
+    int clientCap; // per identity requests in flight, 0 for no limit
+    int shards; // server processes, 0 for a single unsupervised process
+    int stealThreads; // helper threads of the task pool
+    bool adaptive; // run the concurrency controller
+    Prescreen prescreen;
+    int faceCacheSize; // results cached, 0 for no cache
+    int faceCacheDistance; // most bits a hash may differ in to match
+    bool simdCascade; // run the face cascade with cascade.c if it can
+    char* cascadeFile; // compiled face cascade mapped, NULL for the XML
+    char* modelsPath; // model file, NULL for the built in models
+    int statsPort; // port the metrics are served on, 0 for none
+    char* tracePath; // Chrome trace file written, NULL for none
+    char* capturePath; // capture file appended to, NULL for none
+    int captureSample; // requests per captured one, 0 for none
+    int captureSlow; // milliseconds past which requests are captured
+    char* batchPath; // batch input, NULL to serve clients
+    char* batchOutput; // directory the batch results go to
+    char* batchReplace; // replacement of a replace batch, NULL to detect
+    bool batchGeometry; // write only where the faces are
+    const char* batchBadPath; // the batch input that could not be read
+    TaskPool tasks; // runs the sub-tasks of detection
+    Pipeline pipeline;
 } Arguments;
 
 // The info of the client
 typedef struct {
     int clientfd;
+    sem_t* clientSlot; // posted when the client leaves, NULL for no limit
+    bool local; // on the Unix socket, so it may pass file descriptors
+    char peer[INET_ADDRSTRLEN]; // identity of requests without a client tag
     uint32_t maxSize;
-    pthread_mutex_t lock;
-    sem_t clientSlot;
-    CvHaarClassifierCascade* faceCascade;
-    CvHaarClassifierCascade* eyesCascade;
+    Pipeline* pipeline;
 } ClientInfo;
 
 // This enum contains the program exit status codes
@@ -98,5 +314,11 @@ typedef enum {
     EXIT_USAGE_STATUS = 12,
     EXIT_FILE_STATUS = 20,
     EXIT_CASCADE_STATUS = 9,
-    EXIT_PORT_STATUS = 14
+    EXIT_PORT_STATUS = 14,
+    EXIT_SOCKET_STATUS = 15,
+    EXIT_STATS_STATUS = 16,
+    EXIT_TRACE_STATUS = 17,
+    EXIT_CAPTURE_STATUS = 18,
+    EXIT_BATCH_INPUT_STATUS = 19,
+    EXIT_BATCH_OUTPUT_STATUS = 21
 } ExitStatus;
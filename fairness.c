@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "fairness.h"
+#include "metrics.h"
+
+#define IDENTITY_BUCKETS 1024
+#define MAX_IDENTITIES 4096
+#define NANOS_PER_SECOND 1000000000.0
+
+// An entry of the identity table, chained per hash bucket
+typedef struct IdentityEntry {
+    ClientIdentity identity;
+    struct IdentityEntry* next;
+} IdentityEntry;
+
+// All fairness state, guarded by one lock: every operation on it is short
+static struct {
+    pthread_mutex_t lock;
+    IdentityEntry* buckets[IDENTITY_BUCKETS];
+    int count;
+    double rate; // tokens added per second, 0 for no rate limit
+    double burst; // most tokens an identity can save up
+    int concurrencyCap; // most requests in flight per identity, 0 for none
+    uint64_t virtualTime; // start tag of the latest request dequeued
+} fairness = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * hash_name
+ * ---------
+ * FNV-1a hash of an identity name, reduced to a bucket index.
+ */
+static unsigned hash_name(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (const char* p = name; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+    return hash % IDENTITY_BUCKETS;
+}
+
+/*
+ * refill
+ * ------
+ * Tops up the identity's token bucket for the time since it was last topped
+ * up. Must be called with the lock held.
+ */
+static void refill(ClientIdentity* identity, uint64_t now)
+{
+    if (fairness.rate > 0) {
+        identity->tokens += fairness.rate * (now - identity->lastRefill)
+                / NANOS_PER_SECOND;
+        if (identity->tokens > fairness.burst) {
+            identity->tokens = fairness.burst;
+        }
+    }
+    identity->lastRefill = now;
+}
+
+/*
+ * evict_idle
+ * ----------
+ * Frees the identities that hold no state worth keeping: nothing in flight,
+ * a full token bucket, no fair queuing debt and no configured weight. Keeps
+ * the table bounded when clients come and go. Must be called with the lock
+ * held.
+ */
+static void evict_idle(uint64_t now)
+{
+    for (int i = 0; i < IDENTITY_BUCKETS; i++) {
+        IdentityEntry** link = &fairness.buckets[i];
+        while (*link) {
+            ClientIdentity* identity = &(*link)->identity;
+            refill(identity, now);
+            if (!identity->configured && identity->inFlight == 0
+                    && (fairness.rate <= 0
+                            || identity->tokens >= fairness.burst)
+                    && identity->lastFinish <= fairness.virtualTime) {
+                IdentityEntry* entry = *link;
+                *link = entry->next;
+                free(entry);
+                fairness.count--;
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+}
+
+/*
+ * find_identity
+ * -------------
+ * Returns the identity with the given name, creating it with a full token
+ * bucket if it does not exist. Returns NULL if the table is full of
+ * identities that cannot be evicted. Must be called with the lock held.
+ */
+static ClientIdentity* find_identity(const char* name, uint64_t now)
+{
+    unsigned bucket = hash_name(name);
+    for (IdentityEntry* entry = fairness.buckets[bucket]; entry;
+            entry = entry->next) {
+        if (strcmp(entry->identity.name, name) == 0) {
+            return &entry->identity;
+        }
+    }
+    if (fairness.count >= MAX_IDENTITIES) {
+        evict_idle(now);
+        if (fairness.count >= MAX_IDENTITIES) {
+            return NULL;
+        }
+    }
+    IdentityEntry* entry = calloc(1, sizeof(IdentityEntry));
+    strncpy(entry->identity.name, name, MAX_IDENTITY_LENGTH - 1);
+    entry->identity.weight = 1;
+    entry->identity.tokens = fairness.burst;
+    entry->identity.lastRefill = now;
+    entry->next = fairness.buckets[bucket];
+    fairness.buckets[bucket] = entry;
+    fairness.count++;
+    return &entry->identity;
+}
+
+/*
+ * fairness_configure
+ * ------------------
+ * Sets the limits applied to every identity: a token bucket refilled at rate
+ * requests per second holding at most burst tokens (rate 0 disables it), and
+ * a cap on requests in flight (0 disables it).
+ */
+void fairness_configure(double rate, double burst, int concurrencyCap)
+{
+    pthread_mutex_lock(&fairness.lock);
+    fairness.rate = rate;
+    fairness.burst = burst;
+    fairness.concurrencyCap = concurrencyCap;
+    pthread_mutex_unlock(&fairness.lock);
+}
+
+/*
+ * fairness_set_weight
+ * -------------------
+ * Gives the named identity the given weight; an identity with weight 2 gets
+ * twice the detect worker time of one with the default weight of 1 when
+ * both are busy. Returns false if the identity table is full.
+ */
+bool fairness_set_weight(const char* name, int weight)
+{
+    pthread_mutex_lock(&fairness.lock);
+    ClientIdentity* identity = find_identity(name, now_nanos());
+    if (identity) {
+        identity->weight = weight;
+        identity->configured = true;
+    }
+    pthread_mutex_unlock(&fairness.lock);
+    return identity != NULL;
+}
+
+/*
+ * fairness_admit
+ * --------------
+ * Decides whether a request from the named identity may start, taking a
+ * token from its bucket and counting it in flight if so. On success the
+ * identity is stored in identity and stays valid until fairness_release().
+ */
+Admission fairness_admit(const char* name, ClientIdentity** identity)
+{
+    Admission result = ADMIT_OK;
+    uint64_t now = now_nanos();
+    pthread_mutex_lock(&fairness.lock);
+    ClientIdentity* found = find_identity(name, now);
+    if (!found) {
+        result = ADMIT_TOO_MANY;
+    } else {
+        refill(found, now);
+        if (fairness.concurrencyCap > 0
+                && found->inFlight >= fairness.concurrencyCap) {
+            result = ADMIT_TOO_MANY;
+        } else if (fairness.rate > 0 && found->tokens < 1) {
+            result = ADMIT_RATE_LIMITED;
+        } else {
+            if (fairness.rate > 0) {
+                found->tokens -= 1;
+            }
+            found->inFlight++;
+            *identity = found;
+        }
+    }
+    pthread_mutex_unlock(&fairness.lock);
+    return result;
+}
+
+/*
+ * fairness_release
+ * ----------------
+ * Marks an admitted request of the identity as answered.
+ */
+void fairness_release(ClientIdentity* identity)
+{
+    pthread_mutex_lock(&fairness.lock);
+    identity->inFlight--;
+    pthread_mutex_unlock(&fairness.lock);
+}
+
+/*
+ * fairness_start_tag
+ * ------------------
+ * Start-time fair queuing: returns the virtual start tag of a request of the
+ * given cost from the identity. Serving requests in start tag order shares
+ * the detect workers between busy identities in proportion to their weights,
+ * while an identity that was idle starts level with the others.
+ */
+uint64_t fairness_start_tag(ClientIdentity* identity, uint64_t cost)
+{
+    pthread_mutex_lock(&fairness.lock);
+    uint64_t start = identity->lastFinish > fairness.virtualTime
+            ? identity->lastFinish
+            : fairness.virtualTime;
+    identity->lastFinish = start + cost / (uint64_t)identity->weight;
+    pthread_mutex_unlock(&fairness.lock);
+    return start;
+}
+
+/*
+ * fairness_dequeued
+ * -----------------
+ * Advances virtual time to the start tag of the request just taken off the
+ * fair queue.
+ */
+void fairness_dequeued(uint64_t startTag)
+{
+    pthread_mutex_lock(&fairness.lock);
+    if (startTag > fairness.virtualTime) {
+        fairness.virtualTime = startTag;
+    }
+    pthread_mutex_unlock(&fairness.lock);
+}
@@ -0,0 +1,34 @@
+#ifndef FAIRNESS_H
+#define FAIRNESS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAX_IDENTITY_LENGTH 256
+
+// Why a request was refused admission
+typedef enum {
+    ADMIT_OK = 0,
+    ADMIT_RATE_LIMITED, // the identity's token bucket is empty
+    ADMIT_TOO_MANY // the identity has too many requests in flight
+} Admission;
+
+// A client as seen by the fairness controls: a peer address or client tag
+typedef struct ClientIdentity {
+    char name[MAX_IDENTITY_LENGTH];
+    int weight; // share of the detect workers relative to other identities
+    double tokens; // requests the identity may start right now
+    uint64_t lastRefill; // when tokens was last topped up
+    int inFlight; // admitted requests not yet answered
+    uint64_t lastFinish; // virtual finish tag of its latest queued request
+    bool configured; // weight set on the command line, never evicted
+} ClientIdentity;
+
+void fairness_configure(double rate, double burst, int concurrencyCap);
+bool fairness_set_weight(const char* name, int weight);
+Admission fairness_admit(const char* name, ClientIdentity** identity);
+void fairness_release(ClientIdentity* identity);
+uint64_t fairness_start_tag(ClientIdentity* identity, uint64_t cost);
+void fairness_dequeued(uint64_t startTag);
+
+#endif
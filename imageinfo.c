@@ -0,0 +1,129 @@
+#include <string.h>
+#include "imageinfo.h"
+
+// Signatures and header offsets of the formats we can size without decoding
+#define JPEG_MARKER 0xFF
+#define JPEG_SOI 0xD8
+#define JPEG_SOF_HEADER_BYTES 8
+#define PNG_SIGNATURE_BYTES 8
+#define PNG_HEADER_BYTES 24
+#define PNG_WIDTH_OFFSET 16
+#define PNG_HEIGHT_OFFSET 20
+#define BMP_HEADER_BYTES 26
+#define BMP_WIDTH_OFFSET 18
+#define BMP_HEIGHT_OFFSET 22
+#define GIF_HEADER_BYTES 10
+#define GIF_WIDTH_OFFSET 6
+#define GIF_HEIGHT_OFFSET 8
+
+static const uint8_t pngSignature[PNG_SIGNATURE_BYTES]
+        = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+/*
+ * read_be16 / read_be32 / read_le16 / read_le32
+ * ---------------------------------------------
+ * Read a big or little endian unsigned integer from a byte buffer.
+ */
+static uint32_t read_be16(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 8) | p[1];
+}
+
+static uint32_t read_be32(const uint8_t* p)
+{
+    return (read_be16(p) << 16) | read_be16(p + 2);
+}
+
+static uint32_t read_le16(const uint8_t* p)
+{
+    return ((uint32_t)p[1] << 8) | p[0];
+}
+
+static uint32_t read_le32(const uint8_t* p)
+{
+    return (read_le16(p + 2) << 16) | read_le16(p);
+}
+
+/*
+ * is_jpeg_sof
+ * -----------
+ * Returns true if the marker starts a frame, i.e. carries the image size.
+ * The DHT (C4), JPG (C8) and DAC (CC) markers share the range but do not.
+ */
+static bool is_jpeg_sof(uint8_t marker)
+{
+    return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4
+            && marker != 0xC8 && marker != 0xCC;
+}
+
+/*
+ * jpeg_dimensions
+ * ---------------
+ * Walks the JPEG marker segments up to the start of frame.
+ * Returns false if no frame header is found within the data.
+ */
+static bool jpeg_dimensions(
+        const uint8_t* data, uint32_t size, int* width, int* height)
+{
+    uint32_t index = 2; // after the SOI marker
+    while (index + 4 <= size) {
+        if (data[index] != JPEG_MARKER) {
+            return false;
+        }
+        uint8_t marker = data[index + 1];
+        if (marker == JPEG_MARKER) {
+            index++; // fill byte
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            index += 2; // markers without a length
+            continue;
+        }
+        uint32_t length = read_be16(data + index + 2);
+        if (is_jpeg_sof(marker)) {
+            if (index + 2 + JPEG_SOF_HEADER_BYTES > size) {
+                return false;
+            }
+            *height = (int)read_be16(data + index + 5);
+            *width = (int)read_be16(data + index + 7);
+            return *width > 0 && *height > 0;
+        }
+        index += 2 + length;
+    }
+    return false;
+}
+
+/*
+ * image_dimensions
+ * ----------------
+ * Reads the width and height of an encoded JPEG, PNG, BMP or GIF image from
+ * its header, without decoding it.
+ * Returns false if the format is not recognised or the header is truncated.
+ */
+bool image_dimensions(
+        const uint8_t* data, uint32_t size, int* width, int* height)
+{
+    if (size >= 2 && data[0] == JPEG_MARKER && data[1] == JPEG_SOI) {
+        return jpeg_dimensions(data, size, width, height);
+    }
+    if (size >= PNG_HEADER_BYTES
+            && memcmp(data, pngSignature, PNG_SIGNATURE_BYTES) == 0) {
+        *width = (int)read_be32(data + PNG_WIDTH_OFFSET);
+        *height = (int)read_be32(data + PNG_HEIGHT_OFFSET);
+        return *width > 0 && *height > 0;
+    }
+    if (size >= BMP_HEADER_BYTES && data[0] == 'B' && data[1] == 'M') {
+        *width = (int)read_le32(data + BMP_WIDTH_OFFSET);
+        *height = (int)read_le32(data + BMP_HEIGHT_OFFSET);
+        if (*height < 0) { // stored top down
+            *height = -*height;
+        }
+        return *width > 0 && *height > 0;
+    }
+    if (size >= GIF_HEADER_BYTES && memcmp(data, "GIF8", 4) == 0) {
+        *width = (int)read_le16(data + GIF_WIDTH_OFFSET);
+        *height = (int)read_le16(data + GIF_HEIGHT_OFFSET);
+        return *width > 0 && *height > 0;
+    }
+    return false;
+}
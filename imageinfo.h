@@ -0,0 +1,10 @@
+#ifndef IMAGEINFO_H
+#define IMAGEINFO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool image_dimensions(
+        const uint8_t* data, uint32_t size, int* width, int* height);
+
+#endif
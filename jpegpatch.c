@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <math.h>
+#include <jpeglib.h>
+#include "jpegpatch.h"
+
+#define EXIF_MARKER (JPEG_APP0 + 1)
+#define EXIF_HEADER_BYTES 6
+#define TIFF_HEADER_BYTES 8
+#define IFD_ENTRY_BYTES 12
+#define EXIF_ORIENTATION_TAG 0x0112
+#define UPRIGHT 1
+#define MAX_MARKER_LENGTH 0xFFFF
+#define MAX_SAMPLE 255
+#define CENTER_SAMPLE 128
+
+static const char exifHeader[EXIF_HEADER_BYTES] = "Exif\0";
+
+// libjpeg error handling that returns to the caller instead of exiting
+typedef struct {
+    struct jpeg_error_mgr manager;
+    jmp_buf escape;
+} PatchError;
+
+// The original coefficients being patched and what is needed to patch them
+typedef struct {
+    struct jpeg_decompress_struct* source;
+    jvirt_barray_ptr* coefficients;
+    const IplImage* frame;
+    float cosines[DCTSIZE2]; // cos((2x + 1)u pi / 16) at [x * DCTSIZE + u]
+} Patch;
+
+/*
+ * escape_error
+ * ------------
+ * libjpeg error exit: abandons the patch instead of exiting the process.
+ */
+static void escape_error(j_common_ptr info)
+{
+    longjmp(((PatchError*)info->err)->escape, 1);
+}
+
+/*
+ * ignore_message
+ * --------------
+ * libjpeg message output: warnings about the input are not ours to print.
+ */
+static void ignore_message(j_common_ptr info)
+{
+    (void)info;
+}
+
+/*
+ * read_exif16 / read_exif32
+ * -------------------------
+ * Read an unsigned integer of the Exif data in its byte order.
+ */
+static uint32_t read_exif16(const JOCTET* p, bool little)
+{
+    return little ? (uint32_t)p[1] << 8 | p[0] : (uint32_t)p[0] << 8 | p[1];
+}
+
+static uint32_t read_exif32(const JOCTET* p, bool little)
+{
+    return little ? read_exif16(p + 2, true) << 16 | read_exif16(p, true)
+                  : read_exif16(p, false) << 16 | read_exif16(p + 2, false);
+}
+
+/*
+ * exif_orientation
+ * ----------------
+ * Returns the Exif orientation of the image from its saved APP1 markers, or
+ * UPRIGHT if it has none.
+ */
+static int exif_orientation(jpeg_saved_marker_ptr marker)
+{
+    for (; marker; marker = marker->next) {
+        if (marker->marker != EXIF_MARKER
+                || marker->data_length < EXIF_HEADER_BYTES + TIFF_HEADER_BYTES
+                || memcmp(marker->data, exifHeader, EXIF_HEADER_BYTES) != 0) {
+            continue;
+        }
+        const JOCTET* tiff = marker->data + EXIF_HEADER_BYTES;
+        uint32_t length = marker->data_length - EXIF_HEADER_BYTES;
+        bool little = tiff[0] == 'I';
+        uint32_t ifd = read_exif32(tiff + 4, little);
+        if (ifd > length - 2) {
+            return UPRIGHT;
+        }
+        uint32_t entries = read_exif16(tiff + ifd, little);
+        for (uint32_t i = 0; i < entries; i++) {
+            uint32_t entry = ifd + 2 + i * IFD_ENTRY_BYTES;
+            if (entry > length - IFD_ENTRY_BYTES) {
+                break;
+            }
+            if (read_exif16(tiff + entry, little) == EXIF_ORIENTATION_TAG) {
+                return (int)read_exif16(tiff + entry + 8, little);
+            }
+        }
+    }
+    return UPRIGHT;
+}
+
+/*
+ * can_patch
+ * ---------
+ * Returns true if the frame was decoded from this JPEG as it is stored: a
+ * colour image of the frame's size, not rotated by its Exif orientation.
+ */
+static bool can_patch(struct jpeg_decompress_struct* source,
+        const IplImage* frame)
+{
+    return source->num_components == 3
+            && source->jpeg_color_space == JCS_YCbCr
+            && source->data_precision == 8
+            && (int)source->image_width == frame->width
+            && (int)source->image_height == frame->height
+            && frame->nChannels == 3 && frame->depth == IPL_DEPTH_8U
+            && exif_orientation(source->marker_list) == UPRIGHT;
+}
+
+/*
+ * sample_block
+ * ------------
+ * Computes the 8x8 samples of one block of a component from the frame, as
+ * the encoder would: converted to YCbCr, averaged over the pixels each
+ * sample covers (for subsampled chroma) and level shifted. Pixels beyond the
+ * frame repeat its edge.
+ */
+static void sample_block(const IplImage* frame, int component, int left,
+        int top, int scaleX, int scaleY, float samples[DCTSIZE2])
+{
+    for (int y = 0; y < DCTSIZE; y++) {
+        for (int x = 0; x < DCTSIZE; x++) {
+            float sum = 0;
+            for (int dy = 0; dy < scaleY; dy++) {
+                int row = top + y * scaleY + dy;
+                row = row < frame->height ? row : frame->height - 1;
+                for (int dx = 0; dx < scaleX; dx++) {
+                    int column = left + x * scaleX + dx;
+                    column = column < frame->width ? column : frame->width - 1;
+                    const uint8_t* pixel = (const uint8_t*)frame->imageData
+                            + row * frame->widthStep + column * 3;
+                    float blue = pixel[0], green = pixel[1], red = pixel[2];
+                    if (component == 0) {
+                        sum += 0.299f * red + 0.587f * green + 0.114f * blue;
+                    } else if (component == 1) {
+                        sum += -0.168736f * red - 0.331264f * green
+                                + 0.5f * blue + CENTER_SAMPLE;
+                    } else {
+                        sum += 0.5f * red - 0.418688f * green
+                                - 0.081312f * blue + CENTER_SAMPLE;
+                    }
+                }
+            }
+            samples[y * DCTSIZE + x]
+                    = sum / (scaleX * scaleY) - CENTER_SAMPLE;
+        }
+    }
+}
+
+/*
+ * encode_block
+ * ------------
+ * Transforms level shifted samples with the forward DCT and quantises them
+ * with the component's table into a coefficient block (natural order).
+ */
+static void encode_block(const Patch* patch, const float samples[DCTSIZE2],
+        const JQUANT_TBL* table, JCOEFPTR block)
+{
+    float rows[DCTSIZE2];
+    for (int y = 0; y < DCTSIZE; y++) {
+        for (int u = 0; u < DCTSIZE; u++) {
+            float sum = 0;
+            for (int x = 0; x < DCTSIZE; x++) {
+                sum += samples[y * DCTSIZE + x]
+                        * patch->cosines[x * DCTSIZE + u];
+            }
+            rows[y * DCTSIZE + u] = sum * (u ? 0.5f : (float)M_SQRT1_2 / 2);
+        }
+    }
+    for (int u = 0; u < DCTSIZE; u++) {
+        for (int v = 0; v < DCTSIZE; v++) {
+            float sum = 0;
+            for (int y = 0; y < DCTSIZE; y++) {
+                sum += rows[y * DCTSIZE + u] * patch->cosines[y * DCTSIZE + v];
+            }
+            sum *= v ? 0.5f : (float)M_SQRT1_2 / 2;
+            block[v * DCTSIZE + u] = (JCOEF)lroundf(
+                    sum / table->quantval[v * DCTSIZE + u]);
+        }
+    }
+}
+
+/*
+ * patch_mcu_row
+ * -------------
+ * Re-encodes, in every component, the blocks of the marked MCUs of one MCU
+ * row from the frame.
+ */
+static void patch_mcu_row(Patch* patch, int mcuRow, const bool* marked,
+        int mcusPerRow)
+{
+    struct jpeg_decompress_struct* source = patch->source;
+    float samples[DCTSIZE2];
+    for (int c = 0; c < source->num_components; c++) {
+        jpeg_component_info* component = &source->comp_info[c];
+        int h = component->h_samp_factor, v = component->v_samp_factor;
+        int scaleX = source->max_h_samp_factor / h;
+        int scaleY = source->max_v_samp_factor / v;
+        JBLOCKARRAY rows = (*source->mem->access_virt_barray)(
+                (j_common_ptr)source, patch->coefficients[c], mcuRow * v, v,
+                TRUE);
+        for (int mcu = 0; mcu < mcusPerRow; mcu++) {
+            if (!marked[mcu]) {
+                continue;
+            }
+            for (int j = 0; j < v; j++) {
+                int blockRow = mcuRow * v + j;
+                for (int i = 0; i < h; i++) {
+                    int blockColumn = mcu * h + i;
+                    if (blockRow >= (int)component->height_in_blocks
+                            || blockColumn >= (int)component->width_in_blocks) {
+                        continue; // padding, made up by the encoder
+                    }
+                    sample_block(patch->frame, c,
+                            blockColumn * DCTSIZE * scaleX,
+                            blockRow * DCTSIZE * scaleY, scaleX, scaleY,
+                            samples);
+                    encode_block(patch, samples, component->quant_table,
+                            rows[j][blockColumn]);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * patch_regions
+ * -------------
+ * Re-encodes every MCU overlapping one of the regions of the frame into the
+ * original coefficients, leaving all the others as they were.
+ */
+static void patch_regions(
+        Patch* patch, const CvRect* regions, int regionCount)
+{
+    struct jpeg_decompress_struct* source = patch->source;
+    int mcuWidth = source->max_h_samp_factor * DCTSIZE;
+    int mcuHeight = source->max_v_samp_factor * DCTSIZE;
+    int mcusPerRow = (patch->frame->width + mcuWidth - 1) / mcuWidth;
+    int mcuRows = (patch->frame->height + mcuHeight - 1) / mcuHeight;
+    bool* marked = calloc((size_t)mcusPerRow * mcuRows, sizeof(bool));
+    for (int r = 0; r < regionCount; r++) {
+        CvRect region = regions[r];
+        int left = region.x > 0 ? region.x : 0;
+        int top = region.y > 0 ? region.y : 0;
+        int right = region.x + region.width < patch->frame->width
+                ? region.x + region.width
+                : patch->frame->width;
+        int bottom = region.y + region.height < patch->frame->height
+                ? region.y + region.height
+                : patch->frame->height;
+        for (int y = top / mcuHeight; y * mcuHeight < bottom; y++) {
+            for (int x = left / mcuWidth; x * mcuWidth < right; x++) {
+                marked[y * mcusPerRow + x] = true;
+            }
+        }
+    }
+    for (int y = 0; y < mcuRows; y++) {
+        bool any = false;
+        for (int x = 0; x < mcusPerRow && !any; x++) {
+            any = marked[y * mcusPerRow + x];
+        }
+        if (any) {
+            patch_mcu_row(patch, y, marked + y * mcusPerRow, mcusPerRow);
+        }
+    }
+    free(marked);
+}
+
+/*
+ * jpegpatch_encode
+ * ----------------
+ * Encodes a frame decoded from the given JPEG and then drawn on within the
+ * regions only. The DCT coefficients of the original are kept for every MCU
+ * outside the regions, so those areas lose nothing to re-encoding, and only
+ * the MCUs the regions touch are transformed and quantised again (with the
+ * original tables). The cost is an entropy decode and encode of the whole
+ * image, plus a DCT proportional to the regions' area.
+ * Returns the new JPEG, or NULL if the data is not a JPEG the frame could
+ * have been decoded from as it is (e.g. greyscale, CMYK or rotated by its
+ * Exif orientation), in which case the frame must be encoded as usual.
+ */
+CvMat* jpegpatch_encode(const uint8_t* jpeg, uint32_t jpegSize,
+        const IplImage* frame, const CvRect* regions, int regionCount)
+{
+    if (jpegSize < 2 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        return NULL; // not a JPEG
+    }
+    struct jpeg_decompress_struct source;
+    struct jpeg_compress_struct target;
+    PatchError error;
+    unsigned char* output = NULL;
+    unsigned long outputSize = 0;
+    CvMat* result = NULL;
+    source.err = jpeg_std_error(&error.manager);
+    target.err = &error.manager;
+    error.manager.error_exit = escape_error;
+    error.manager.output_message = ignore_message;
+    jpeg_create_decompress(&source);
+    jpeg_create_compress(&target);
+    if (setjmp(error.escape) == 0) {
+        jpeg_mem_src(&source, (unsigned char*)jpeg, jpegSize);
+        jpeg_save_markers(&source, EXIF_MARKER, MAX_MARKER_LENGTH);
+        jpeg_read_header(&source, TRUE);
+        if (can_patch(&source, frame)) {
+            Patch patch = {&source, jpeg_read_coefficients(&source), frame,
+                    {0}};
+            for (int x = 0; x < DCTSIZE; x++) {
+                for (int u = 0; u < DCTSIZE; u++) {
+                    patch.cosines[x * DCTSIZE + u]
+                            = (float)cos((2 * x + 1) * u * M_PI / 16);
+                }
+            }
+            patch_regions(&patch, regions, regionCount);
+            jpeg_mem_dest(&target, &output, &outputSize);
+            jpeg_copy_critical_parameters(&source, &target);
+            target.optimize_coding = TRUE;
+            jpeg_write_coefficients(&target, patch.coefficients);
+            jpeg_finish_compress(&target);
+            result = cvCreateMat(1, (int)outputSize, CV_8UC1);
+            memcpy(result->data.ptr, output, outputSize);
+        }
+    }
+    jpeg_destroy_compress(&target);
+    jpeg_destroy_decompress(&source);
+    free(output);
+    return result;
+}
@@ -0,0 +1,10 @@
+#ifndef JPEGPATCH_H
+#define JPEGPATCH_H
+
+#include <stdint.h>
+#include <opencv2/core/core_c.h>
+
+CvMat* jpegpatch_encode(const uint8_t* jpeg, uint32_t jpegSize,
+        const IplImage* frame, const CvRect* regions, int regionCount);
+
+#endif
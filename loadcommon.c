@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include "loadcommon.h"
+#include "protocol.h"
+
+const uint64_t nanosPerSecond = 1000000000;
+const double nanosPerMilli = 1000000.0;
+
+const char* const connectErrorKind = "cannot connect";
+const char* const connectionErrorKind = "connection lost";
+static const char* const otherErrorKind = "other";
+
+// The latency percentiles reported, and their names in the JSON report
+static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+static const char* const percentileNames[] = {"p50", "p90", "p99", "p99.9"};
+#define PERCENTILE_COUNT 4
+
+/*
+ * now_nanos
+ * ---------
+ * Returns the monotonic clock in nanoseconds.
+ */
+uint64_t now_nanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * nanosPerSecond + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * sleep_until
+ * -----------
+ * Sleeps until the monotonic clock reaches the given time.
+ */
+void sleep_until(uint64_t nanos)
+{
+    struct timespec ts = {(time_t)(nanos / nanosPerSecond),
+            (long)(nanos % nanosPerSecond)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+        // interrupted, sleep the rest
+    }
+}
+
+/*
+ * count_error
+ * -----------
+ * Counts one failed request by its kind: the server's error message, or a
+ * connection failure. Kinds beyond LOAD_MAX_ERROR_KINDS are counted as
+ * other.
+ */
+void count_error(LoadCounts* counts, const char* kind)
+{
+    pthread_mutex_lock(&counts->errorLock);
+    int i = 0;
+    while (i < counts->errorKinds
+            && strcmp(counts->errors[i].kind, kind) != 0) {
+        i++;
+    }
+    if (i == counts->errorKinds) {
+        if (counts->errorKinds == LOAD_MAX_ERROR_KINDS - 1) {
+            kind = otherErrorKind;
+            i = 0;
+            while (i < counts->errorKinds
+                    && strcmp(counts->errors[i].kind, kind) != 0) {
+                i++;
+            }
+        }
+        if (i == counts->errorKinds) {
+            counts->errors[counts->errorKinds++].kind = strdup(kind);
+        }
+    }
+    counts->errors[i].count++;
+    counts->errorCount++;
+    pthread_mutex_unlock(&counts->errorLock);
+}
+
+/*
+ * connect_to_server
+ * -----------------
+ * Opens a connection to the server at localhost on the given port.
+ * Returns the socket, or -1 if it cannot connect.
+ *
+ * REF: net2.c from Lec note week9
+ */
+int connect_to_server(const char* port)
+{
+    struct addrinfo* ai;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET; // IPv4
+    hints.ai_socktype = SOCK_STREAM; // TCP
+    if (getaddrinfo("localhost", port, &hints, &ai) != 0) {
+        return -1;
+    }
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd >= 0 && connect(sockfd, ai->ai_addr, ai->ai_addrlen) != 0) {
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(ai);
+    return sockfd;
+}
+
+/*
+ * exchange_request
+ * ----------------
+ * Sends a framed request over the connected socket and reads its response,
+ * counting it as ok or by its error message. If the connection is lost
+ * the socket is closed and set to -1. Returns false if the request failed
+ * without a response.
+ */
+bool exchange_request(
+        int* sockfd, const uint8_t* request, size_t size, LoadCounts* counts)
+{
+    uint8_t operation;
+    uint8_t* payload;
+    uint32_t payloadSize;
+    bool mapped;
+    if (write(*sockfd, request, size) != (ssize_t)size
+            || !protocol_read_response(
+                    *sockfd, &operation, &payload, &payloadSize, &mapped)) {
+        count_error(counts, connectionErrorKind);
+        close(*sockfd);
+        *sockfd = -1;
+        return false;
+    }
+    if (operation == ERROR_MESSAGE) {
+        count_error(counts, (char*)payload); // NUL terminated when read
+    } else {
+        __atomic_add_fetch(&counts->ok, 1, __ATOMIC_RELAXED);
+    }
+    protocol_free_payload(payload, payloadSize, mapped);
+    return true;
+}
+
+/*
+ * compare_nanos
+ * -------------
+ * qsort comparator of latencies.
+ */
+int compare_nanos(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * percentile_millis
+ * -----------------
+ * Returns the given fraction's percentile of sorted latencies, in
+ * milliseconds, or 0 if there are none.
+ */
+static double percentile_millis(
+        const uint64_t* sorted, size_t count, double fraction)
+{
+    if (!count) {
+        return 0;
+    }
+    size_t rank = (size_t)(fraction * count + 0.999999);
+    return sorted[rank ? rank - 1 : 0] / nanosPerMilli;
+}
+
+/*
+ * write_text_latencies
+ * --------------------
+ * Writes one line of latency percentiles for the text report.
+ */
+void write_text_latencies(
+        FILE* out, const char* label, const uint64_t* sorted, size_t count)
+{
+    fprintf(out, "%s", label);
+    for (int i = 0; i < PERCENTILE_COUNT; i++) {
+        fprintf(out, " %s %.3f ms", percentileNames[i],
+                percentile_millis(sorted, count, percentiles[i]));
+    }
+    fprintf(out, " max %.3f ms\n", percentile_millis(sorted, count, 1));
+}
+
+/*
+ * write_text_errors
+ * -----------------
+ * Writes a line of the text report for every kind of error counted.
+ */
+void write_text_errors(FILE* out, const LoadCounts* counts)
+{
+    for (int i = 0; i < counts->errorKinds; i++) {
+        fprintf(out, "error \"%s\": %" PRIu64 "\n", counts->errors[i].kind,
+                counts->errors[i].count);
+    }
+}
+
+/*
+ * write_json_string
+ * -----------------
+ * Writes a string as a JSON string literal.
+ */
+static void write_json_string(FILE* out, const char* string)
+{
+    fputc('"', out);
+    for (const char* c = string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if ((unsigned char)*c < ' ') {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * write_json_latencies
+ * --------------------
+ * Writes latency percentiles as a JSON object, in milliseconds.
+ */
+void write_json_latencies(FILE* out, const uint64_t* sorted, size_t count)
+{
+    fprintf(out, "{");
+    for (int i = 0; i < PERCENTILE_COUNT; i++) {
+        fprintf(out, "\"%s\": %.3f, ", percentileNames[i],
+                percentile_millis(sorted, count, percentiles[i]));
+    }
+    fprintf(out, "\"max\": %.3f}", percentile_millis(sorted, count, 1));
+}
+
+/*
+ * write_json_errors
+ * -----------------
+ * Writes the kinds of error counted as a JSON object of their counts.
+ */
+void write_json_errors(FILE* out, const LoadCounts* counts)
+{
+    fprintf(out, "{");
+    for (int i = 0; i < counts->errorKinds; i++) {
+        fprintf(out, "%s", i ? ", " : "");
+        write_json_string(out, counts->errors[i].kind);
+        fprintf(out, ": %" PRIu64, counts->errors[i].count);
+    }
+    fprintf(out, "}");
+}
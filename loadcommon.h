@@ -0,0 +1,47 @@
+#ifndef LOADCOMMON_H
+#define LOADCOMMON_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define LOAD_MAX_ERROR_KINDS 32
+
+extern const uint64_t nanosPerSecond;
+extern const double nanosPerMilli;
+
+// Error kinds of failures other than an error response
+extern const char* const connectErrorKind;
+extern const char* const connectionErrorKind;
+
+// How many failures of one kind were seen
+typedef struct {
+    char* kind;
+    uint64_t count;
+} ErrorCount;
+
+// What the requests of a run, sent over any of its connections, came to
+typedef struct {
+    uint64_t ok;
+    pthread_mutex_t errorLock;
+    ErrorCount errors[LOAD_MAX_ERROR_KINDS];
+    int errorKinds;
+    uint64_t errorCount;
+} LoadCounts;
+
+uint64_t now_nanos(void);
+void sleep_until(uint64_t nanos);
+void count_error(LoadCounts* counts, const char* kind);
+int connect_to_server(const char* port);
+bool exchange_request(
+        int* sockfd, const uint8_t* request, size_t size, LoadCounts* counts);
+int compare_nanos(const void* a, const void* b);
+void write_text_latencies(
+        FILE* out, const char* label, const uint64_t* sorted, size_t count);
+void write_text_errors(FILE* out, const LoadCounts* counts);
+void write_json_latencies(FILE* out, const uint64_t* sorted, size_t count);
+void write_json_errors(FILE* out, const LoadCounts* counts);
+
+#endif
@@ -0,0 +1,389 @@
+#include "loadgen.h"
+
+/* cleanup_and_exit()
+ * ---------------
+ * Print the message for the given exit status to stderr, free the args
+ * struct and exit with the given exit status.
+ */
+void cleanup_and_exit(Arguments* args, int exitStatus)
+{
+    if (exitStatus == EXIT_USAGE_STATUS) {
+        fprintf(stderr, "%s", usageErrorMessage);
+    } else if (exitStatus == EXIT_INPUTFILE_STATUS) {
+        fprintf(stderr, inputFileErrorMessageFormat, args->badFileName);
+    } else if (exitStatus == EXIT_OUTPUTFILE_STATUS) {
+        fprintf(stderr, outputFileErrorMessageFormat, args->badFileName);
+    } else if (exitStatus == EXIT_PORT_STATUS) {
+        fprintf(stderr, connectionErrorMessageFormat, args->port);
+    }
+    if (args) {
+        free(args);
+    }
+    exit(exitStatus);
+}
+
+/*
+ * check_option_value
+ * ------------------
+ * Parses the value of an optional argument as an integer between min and max
+ * inclusive. Exits with usage status on invalid input.
+ */
+int check_option_value(char* value, int min, int max, Arguments* args)
+{
+    char* ptr;
+    long result = strtol(value, &ptr, baseTen);
+    if (!*value || *ptr != '\0' || result < min || result > max) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    return (int)result;
+}
+
+/*
+ * parse_option
+ * ------------
+ * Applies one optional argument and its value. Exits with usage status on
+ * an unknown option or invalid value.
+ */
+void parse_option(char* option, char* value, Arguments* args)
+{
+    if (strcmp(option, connectionsArg) == 0) {
+        args->connections = check_option_value(value, 1, maxConnections, args);
+    } else if (strcmp(option, rateArg) == 0) {
+        args->rate = check_option_value(value, 0, maxRate, args);
+    } else if (strcmp(option, durationArg) == 0) {
+        args->duration = check_option_value(value, 1, maxDuration, args);
+    } else if (strcmp(option, requestsArg) == 0) {
+        args->requests = check_option_value(value, 1, maxRequests, args);
+    } else if (strcmp(option, replacePercentArg) == 0) {
+        args->replacePercent = check_option_value(value, 0, percent, args);
+    } else if (strcmp(option, replaceFileArg) == 0 && *value) {
+        args->replaceFileName = value;
+    } else if (strcmp(option, clientTagArg) == 0 && *value
+            && strlen(value) <= MAX_CLIENT_TAG_LENGTH) {
+        args->clientTag = value;
+    } else if (strcmp(option, jsonArg) == 0 && *value) {
+        args->jsonFileName = value;
+    } else {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+}
+
+/*
+ * parse_arguments
+ * ---------------
+ * Parses the port, the image files requests are made of and any optional
+ * --name value pairs after them. A run lasts the default duration unless
+ * a request count or duration is given.
+ * Returns: pointer to populated Arguments struct.
+ */
+Arguments* parse_arguments(int argc, char** argv)
+{
+    Arguments* args = calloc(1, sizeof(Arguments));
+    args->connections = defaultConnections;
+    args->replacePercent = defaultReplacePercent;
+    int positional = 1; // arguments before the first --option
+    while (positional < argc
+            && strncmp(argv[positional], optionArgStart,
+                       strlen(optionArgStart))
+                    != 0) {
+        positional++;
+    }
+    if (positional < minArgsCount || !*argv[portIndex]) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    args->port = argv[portIndex];
+    args->imageFileNames = argv + firstImageIndex;
+    args->imageCount = positional - firstImageIndex;
+    for (int i = positional; i < argc; i += 2) {
+        // Options come in pairs: --name value
+        if (i + 1 >= argc) {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        parse_option(argv[i], argv[i + 1], args);
+    }
+    if (!args->duration && !args->requests) {
+        args->duration = defaultDuration;
+    }
+    return args;
+}
+
+/*
+ * read_image_file
+ * ---------------
+ * Reads a whole image file. Exits with the input file status if it cannot.
+ */
+uint8_t* read_image_file(char* fileName, uint32_t* size, Arguments* args)
+{
+    FILE* file = fopen(fileName, "rb");
+    if (!file) {
+        args->badFileName = fileName;
+        cleanup_and_exit(args, EXIT_INPUTFILE_STATUS);
+    }
+    fclose(file);
+    uint8_t* image = read_file_to_buffer(fileName, size);
+    if (!image) {
+        args->badFileName = fileName;
+        cleanup_and_exit(args, EXIT_INPUTFILE_STATUS);
+    }
+    return image;
+}
+
+/*
+ * pack_requests
+ * -------------
+ * Packs a detect request for every image file, and a replace request with
+ * the replacement image for every one if there is a replacement, so the
+ * connections only have to send them.
+ */
+void pack_requests(LoadRun* run)
+{
+    Arguments* args = run->args;
+    uint32_t replaceSize = 0;
+    uint8_t* replace = args->replaceFileName
+            ? read_image_file(args->replaceFileName, &replaceSize, args)
+            : NULL;
+    RequestOptions options = {0};
+    options.clientTag = args->clientTag;
+    run->packedCount = args->imageCount * (replace ? 2 : 1);
+    run->packed = calloc(run->packedCount, sizeof(PackedRequest));
+    for (int i = 0; i < args->imageCount; i++) {
+        uint32_t size;
+        uint8_t* image = read_image_file(args->imageFileNames[i], &size, args);
+        PackedRequest* detect = &run->packed[i];
+        protocol_pack_request_with_options(REQUEST_DETECT, &options, image,
+                size, NULL, 0, &detect->data, &detect->size);
+        if (replace) {
+            PackedRequest* swap = &run->packed[args->imageCount + i];
+            protocol_pack_request_with_options(REQUEST_REPLACE, &options,
+                    image, size, replace, replaceSize, &swap->data,
+                    &swap->size);
+        }
+        free(image);
+    }
+    free(replace);
+}
+
+/*
+ * pick_request
+ * ------------
+ * Returns the packed request to send as the index'th of the run: the images
+ * in turn, replace for replacePercent of every hundred requests if there is
+ * a replacement.
+ */
+PackedRequest* pick_request(LoadRun* run, uint64_t index)
+{
+    int images = run->args->imageCount;
+    int image = (int)(index % images);
+    bool replace = run->packedCount > images
+            && (int)(index % percent) < run->args->replacePercent;
+    return &run->packed[replace ? images + image : image];
+}
+
+/*
+ * add_sample
+ * ----------
+ * Keeps the latencies of one answered request.
+ */
+void add_sample(Samples* samples, uint64_t latency, uint64_t service)
+{
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->latencies = realloc(samples->latencies,
+                samples->capacity * sizeof(uint64_t));
+        samples->services = realloc(
+                samples->services, samples->capacity * sizeof(uint64_t));
+    }
+    samples->latencies[samples->count] = latency;
+    samples->services[samples->count++] = service;
+}
+
+/*
+ * send_request
+ * ------------
+ * Sends a packed request and reads its response over the connection,
+ * reconnecting first if it has been lost. Error responses are counted by
+ * their message. Returns false if the request failed without a response.
+ */
+bool send_request(Connection* connection, PackedRequest* request)
+{
+    LoadRun* run = connection->run;
+    if (connection->sockfd < 0
+            && (connection->sockfd = connect_to_server(run->args->port)) < 0) {
+        count_error(&run->counts, connectErrorKind);
+        usleep(reconnectDelay); // do not spin against a server that is down
+        return false;
+    }
+    return exchange_request(&connection->sockfd, request->data, request->size,
+            &run->counts);
+}
+
+/*
+ * connection_thread
+ * -----------------
+ * Thread body of one connection. Takes the next request of the run until
+ * it is over, sending it when it is due (at once in a closed loop).
+ * Latency is measured from when the request was due, not when it could be
+ * sent, so a server that falls behind an open-loop rate is charged for
+ * the time requests waited for a free connection too.
+ */
+void* connection_thread(void* arg)
+{
+    Connection* connection = (Connection*)arg;
+    LoadRun* run = connection->run;
+    for (;;) {
+        uint64_t index = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+        if (run->args->requests && index >= (uint64_t)run->args->requests) {
+            break;
+        }
+        uint64_t due = run->interval ? run->start + index * run->interval
+                                     : now_nanos();
+        if (run->end && due >= run->end) {
+            break;
+        }
+        if (run->interval) {
+            sleep_until(due);
+        }
+        uint64_t sent = now_nanos();
+        if (send_request(connection, pick_request(run, index))) {
+            uint64_t done = now_nanos();
+            add_sample(&connection->samples, done - due, done - sent);
+        }
+    }
+    if (connection->sockfd >= 0) {
+        close(connection->sockfd);
+    }
+    return NULL;
+}
+
+/*
+ * merge_samples
+ * -------------
+ * Gathers the latencies measured by every connection into all, each kind
+ * sorted.
+ */
+void merge_samples(Connection* connections, int count, Samples* all)
+{
+    memset(all, 0, sizeof(Samples));
+    for (int i = 0; i < count; i++) {
+        Samples* samples = &connections[i].samples;
+        for (size_t j = 0; j < samples->count; j++) {
+            add_sample(all, samples->latencies[j], samples->services[j]);
+        }
+        free(samples->latencies);
+        free(samples->services);
+    }
+    qsort(all->latencies, all->count, sizeof(uint64_t), compare_nanos);
+    qsort(all->services, all->count, sizeof(uint64_t), compare_nanos);
+}
+
+/*
+ * write_text_report
+ * -----------------
+ * Writes the results of the run for people to read.
+ */
+void write_text_report(FILE* out, LoadRun* run, Samples* all, double seconds)
+{
+    LoadCounts* counts = &run->counts;
+    fprintf(out,
+            "%" PRIu64 " requests in %.3f s, %.1f per second: %" PRIu64
+            " ok, %" PRIu64 " errors\n",
+            counts->ok + counts->errorCount, seconds,
+            (counts->ok + counts->errorCount) / seconds, counts->ok,
+            counts->errorCount);
+    write_text_latencies(
+            out, "latency (from due time):", all->latencies, all->count);
+    write_text_latencies(
+            out, "service (from send):    ", all->services, all->count);
+    write_text_errors(out, counts);
+}
+
+/*
+ * write_json_report
+ * -----------------
+ * Writes the results of the run as a JSON object, for runs to be compared.
+ */
+void write_json_report(FILE* out, LoadRun* run, Samples* all, double seconds)
+{
+    Arguments* args = run->args;
+    LoadCounts* counts = &run->counts;
+    fprintf(out,
+            "{\"connections\": %d, \"rate\": %d, \"seconds\": %.3f, "
+            "\"requests\": %" PRIu64 ", \"ok\": %" PRIu64
+            ", \"errors\": %" PRIu64 ", \"throughput\": %.3f,\n",
+            args->connections, args->rate, seconds,
+            counts->ok + counts->errorCount, counts->ok, counts->errorCount,
+            (counts->ok + counts->errorCount) / seconds);
+    fprintf(out, " \"latency_ms\": ");
+    write_json_latencies(out, all->latencies, all->count);
+    fprintf(out, ",\n \"service_ms\": ");
+    write_json_latencies(out, all->services, all->count);
+    fprintf(out, ",\n \"error_kinds\": ");
+    write_json_errors(out, counts);
+    fprintf(out, "}\n");
+}
+
+/*
+ * run_load
+ * --------
+ * Sends the load with one thread per connection and waits for the run to
+ * finish. Returns how long it took, in seconds.
+ */
+double run_load(LoadRun* run, Connection* connections)
+{
+    Arguments* args = run->args;
+    run->start = now_nanos();
+    run->end = args->duration
+            ? run->start + (uint64_t)args->duration * nanosPerSecond
+            : 0;
+    run->interval = args->rate ? nanosPerSecond / args->rate : 0;
+    pthread_t* threads = calloc(args->connections, sizeof(pthread_t));
+    for (int i = 0; i < args->connections; i++) {
+        connections[i].run = run;
+        connections[i].sockfd = -1;
+        pthread_create(&threads[i], NULL, connection_thread, &connections[i]);
+    }
+    for (int i = 0; i < args->connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return (now_nanos() - run->start) / (double)nanosPerSecond;
+}
+
+/**
+ * main()
+ * -------
+ * Entry point for uqfaceload. Loads the server on the given port with
+ * requests made of the image files, over many connections at once, then
+ * reports throughput, latency percentiles and errors.
+ *
+ * Returns: program exit status (0 on success, or error code)
+ */
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN); // the server may close a connection
+    Arguments* args = parse_arguments(argc, argv);
+    FILE* json = NULL;
+    if (args->jsonFileName && !(json = fopen(args->jsonFileName, "w"))) {
+        args->badFileName = args->jsonFileName;
+        cleanup_and_exit(args, EXIT_OUTPUTFILE_STATUS);
+    }
+    int probe = connect_to_server(args->port);
+    if (probe < 0) {
+        cleanup_and_exit(args, EXIT_PORT_STATUS);
+    }
+    close(probe);
+    LoadRun run = {0};
+    run.args = args;
+    pthread_mutex_init(&run.counts.errorLock, NULL);
+    pack_requests(&run);
+    Connection* connections = calloc(args->connections, sizeof(Connection));
+    double seconds = run_load(&run, connections);
+    Samples all;
+    merge_samples(connections, args->connections, &all);
+    write_text_report(stdout, &run, &all, seconds);
+    if (json) {
+        write_json_report(json, &run, &all, seconds);
+        fclose(json);
+    }
+    cleanup_and_exit(args, EXIT_OK_STATUS);
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "protocol.h"
+#include "loadcommon.h"
+
+// Optional arguments, after the port and the image files
+const char* const optionArgStart = "--";
+const char* const connectionsArg = "--connections";
+const char* const rateArg = "--rate";
+const char* const durationArg = "--duration";
+const char* const requestsArg = "--requests";
+const char* const replaceFileArg = "--replacefile";
+const char* const replacePercentArg = "--replacepercent";
+const char* const clientTagArg = "--clienttag";
+const char* const jsonArg = "--json";
+
+// Defaults and limits of the optional arguments
+const int defaultConnections = 16;
+const int maxConnections = 10000;
+const int maxRate = 1000000; // requests per second, 0 for closed loop
+const int defaultDuration = 10; // seconds, unless a request count is given
+const int maxDuration = 86400;
+const int maxRequests = 1000000000;
+const int defaultReplacePercent = 20; // of requests, given a replacement
+const int percent = 100;
+const int baseTen = 10;
+const int minArgsCount = 3;
+const int portIndex = 1;
+const int firstImageIndex = 2;
+
+const unsigned reconnectDelay = 100000; // microseconds after a failed connect
+
+// Error Message
+const char* const usageErrorMessage
+        = "Usage: ./uqfaceload port imagefile [imagefile ...]"
+          " [--connections n] [--rate requestspersecond]"
+          " [--duration seconds] [--requests n] [--replacefile filename]"
+          " [--replacepercent n] [--clienttag tag] [--json filename]\n";
+const char* const inputFileErrorMessageFormat
+        = "uqfaceload: cannot open the input file \"%s\" for reading\n";
+const char* const outputFileErrorMessageFormat
+        = "uqfaceload: unable to open the output file \"%s\" for writing\n";
+const char* const connectionErrorMessageFormat
+        = "uqfaceload: cannot connect to the server on port \"%s\"\n";
+
+// The Argument of the program
+typedef struct {
+    char* port;
+    char** imageFileNames;
+    int imageCount;
+    char* replaceFileName; // NULL to send detect requests only
+    int replacePercent;
+    int connections;
+    int rate; // requests per second across all connections, 0 closed loop
+    int duration; // seconds, 0 for until the request count is reached
+    int requests; // 0 for as many as the duration allows
+    char* clientTag;
+    char* jsonFileName; // where the JSON report goes, NULL for none
+    char* badFileName; // the file that could not be opened, for the error
+} Arguments;
+
+// A request packed ready to send
+typedef struct {
+    uint8_t* data;
+    size_t size;
+} PackedRequest;
+
+// The latencies a connection measured, in nanoseconds. latencies are from
+// when each request was due to be sent, services from when it was sent;
+// the two differ once the server falls behind an open-loop rate.
+typedef struct {
+    uint64_t* latencies;
+    uint64_t* services;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+// A run of the load: the packed requests and the schedule shared by all
+// connections, and what they have counted
+typedef struct {
+    Arguments* args;
+    PackedRequest* packed; // every image as detect, then as replace
+    int packedCount;
+    uint64_t start; // monotonic time the run starts at
+    uint64_t end; // no request is due from then on, 0 for no limit
+    uint64_t interval; // between due times, 0 for closed loop
+    uint64_t next; // index of the next request to send
+    LoadCounts counts;
+} LoadRun;
+
+// One connection to the server, sending one request at a time
+typedef struct {
+    LoadRun* run;
+    int sockfd; // -1 while not connected
+    Samples samples;
+} Connection;
+
+// This enum contains the program exit status codes
+typedef enum {
+    EXIT_OK_STATUS = 0,
+    EXIT_USAGE_STATUS = 17,
+    EXIT_OUTPUTFILE_STATUS = 9,
+    EXIT_INPUTFILE_STATUS = 20,
+    EXIT_PORT_STATUS = 4
+} ExitStatus;
@@ -0,0 +1,616 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "metrics.h"
+#include "protocol.h"
+
+#define NANOS_PER_SECOND 1000000000.0
+#define MAX_LABEL_LENGTH 32
+#define CACHE_LINE 64
+
+// Threads count into their own stripe, threads beyond this many sharing
+#define METRICS_STRIPES 32
+
+// Latency histograms are log-linear, as HDR histograms are: every power of
+// two from HISTOGRAM_MIN_SHIFT nanoseconds on is split into 1 <<
+// HISTOGRAM_SUB_BITS buckets, so a bucket is within 25% of its values.
+// Below the first power go in the first bucket, beyond the last in the
+// overflow bucket.
+#define HISTOGRAM_MIN_SHIFT 10 // about a microsecond
+#define HISTOGRAM_OCTAVES 26 // up to about 69 seconds
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_OCTAVES << HISTOGRAM_SUB_BITS) + 2)
+
+// Distinct error messages counted apart, the others together
+#define MAX_ERROR_KINDS 16
+// Requests are counted by operation, those of no known one together
+#define REQUEST_KINDS (REQUEST_CROP + 2)
+#define INVALID_REQUEST (REQUEST_KINDS - 1)
+
+typedef struct {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t sumNanos;
+} Histogram;
+
+// Counters kept for every stage of the pipeline
+typedef struct {
+    uint64_t jobs;
+    uint64_t cost;
+    uint64_t waitNanos;
+    uint64_t busyNanos;
+    uint64_t expired;
+    Histogram wait;
+    Histogram busy;
+} StageMetrics;
+
+// The share of the counters of the threads counting into it. Each stripe
+// has cache lines of its own, so threads do not contend for them.
+typedef struct {
+    StageMetrics stages[STAGE_COUNT];
+    Histogram phases[PHASE_COUNT];
+    uint64_t counters[COUNTER_COUNT];
+    uint64_t requests[REQUEST_KINDS];
+    uint64_t errors[MAX_ERROR_KINDS + 1]; // the last for any other message
+} __attribute__((aligned(CACHE_LINE))) MetricsStripe;
+
+// Values of a stage that are set rather than counted
+typedef struct {
+    uint64_t threads;
+    uint64_t capacity;
+    uint64_t depth;
+} StageGauges;
+
+static MetricsStripe stripes[METRICS_STRIPES];
+static __thread MetricsStripe* threadStripe;
+static int stripesTaken;
+static StageGauges stageGauges[STAGE_COUNT];
+static uint64_t gauges[GAUGE_COUNT];
+static char shardLabel[MAX_LABEL_LENGTH]; // empty unless the server is sharded
+
+// The error messages counted apart, in the order first seen
+static struct {
+    const char* messages[MAX_ERROR_KINDS];
+    int count;
+    pthread_mutex_t lock;
+} errorKinds = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Prometheus name of every counter, indexed by Counter
+static const char* const counterNames[COUNTER_COUNT] = {
+        "uqfacedetect_rate_limited_total",
+        "uqfacedetect_concurrency_limited_total",
+        "uqfacedetect_partial_jpeg_encodes_total",
+        "uqfacedetect_prescreen_rejected_total",
+        "uqfacedetect_prescreen_audited_total",
+        "uqfacedetect_prescreen_missed_total",
+        "uqfacedetect_received_bytes_total",
+        "uqfacedetect_sent_bytes_total",
+        "uqfacedetect_captured_requests_total",
+        "uqfacedetect_captured_slow_requests_total",
+        "uqfacedetect_model_reloads_total",
+        "uqfacedetect_model_reload_failures_total",
+        "uqfacedetect_face_cache_hits_total",
+        "uqfacedetect_face_cache_misses_total",
+};
+
+// Prometheus name of every gauge, indexed by Gauge
+static const char* const gaugeNames[GAUGE_COUNT] = {
+        "uqfacedetect_detect_active_workers",
+        "uqfacedetect_inflight_limit",
+        "uqfacedetect_inflight",
+        "uqfacedetect_model_generation",
+};
+
+// Label of every kind of request, indexed by operation; NULL for the
+// operations only responses carry, which are counted as invalid
+static const char* const requestNames[REQUEST_KINDS] = {
+        [REQUEST_DETECT] = "detect",
+        [REQUEST_REPLACE] = "replace",
+        [REQUEST_CROP] = "crop",
+        [INVALID_REQUEST] = "invalid",
+};
+
+// Label of every phase, indexed by Phase
+static const char* const phaseNames[PHASE_COUNT] = {
+        "gray",
+        "faces",
+        "eyes",
+        "composite",
+};
+
+/*
+ * now_nanos
+ * ---------
+ * Returns the monotonic clock in nanoseconds.
+ */
+uint64_t now_nanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * thread_stripe
+ * -------------
+ * Returns the stripe the calling thread counts into, handing out the
+ * stripes in turn to threads as they first count.
+ */
+static MetricsStripe* thread_stripe(void)
+{
+    if (!threadStripe) {
+        int index = __atomic_fetch_add(&stripesTaken, 1, __ATOMIC_RELAXED);
+        threadStripe = &stripes[index % METRICS_STRIPES];
+    }
+    return threadStripe;
+}
+
+/*
+ * add
+ * ---
+ * Adds to a counter of the caller's stripe. Stripes may be shared, so the
+ * addition is atomic, but it is rarely contended.
+ */
+static inline void add(uint64_t* counter, uint64_t amount)
+{
+    __atomic_add_fetch(counter, amount, __ATOMIC_RELAXED);
+}
+
+/*
+ * total
+ * -----
+ * Sums a counter over every stripe, given by its offset in a stripe.
+ */
+static uint64_t total(size_t offset)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < METRICS_STRIPES; i++) {
+        sum += __atomic_load_n(
+                (uint64_t*)((char*)&stripes[i] + offset), __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+/*
+ * histogram_bucket
+ * ----------------
+ * Returns the bucket of a latency histogram a duration falls in.
+ */
+static int histogram_bucket(uint64_t nanos)
+{
+    if (nanos < (1ULL << HISTOGRAM_MIN_SHIFT)) {
+        return 0;
+    }
+    int power = 63 - __builtin_clzll(nanos);
+    int octave = power - HISTOGRAM_MIN_SHIFT;
+    if (octave >= HISTOGRAM_OCTAVES) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int sub = (int)(nanos >> (power - HISTOGRAM_SUB_BITS))
+            & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return 1 + (octave << HISTOGRAM_SUB_BITS) + sub;
+}
+
+/*
+ * histogram_bound
+ * ---------------
+ * Returns the upper bound, in nanoseconds, of a bucket of a latency
+ * histogram other than the overflow bucket.
+ */
+static uint64_t histogram_bound(int bucket)
+{
+    if (bucket == 0) {
+        return 1ULL << HISTOGRAM_MIN_SHIFT;
+    }
+    int octave = (bucket - 1) >> HISTOGRAM_SUB_BITS;
+    int sub = (bucket - 1) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return (uint64_t)((1 << HISTOGRAM_SUB_BITS) + sub + 1)
+            << (octave + HISTOGRAM_MIN_SHIFT - HISTOGRAM_SUB_BITS);
+}
+
+/*
+ * record
+ * ------
+ * Adds a duration to a latency histogram of the caller's stripe.
+ */
+static void record(Histogram* histogram, uint64_t nanos)
+{
+    add(&histogram->buckets[histogram_bucket(nanos)], 1);
+    add(&histogram->sumNanos, nanos);
+}
+
+/*
+ * metrics_set_shard
+ * -----------------
+ * Labels every metric written by this process with its shard number, so the
+ * reports of the shards of one server can be told apart.
+ */
+void metrics_set_shard(int shard)
+{
+    snprintf(shardLabel, sizeof(shardLabel), "shard=\"%d\"", shard);
+}
+
+/*
+ * metrics_stage_configure
+ * -----------------------
+ * Records the configured size of a stage: its thread count and the capacity
+ * of the queue in front of it.
+ */
+void metrics_stage_configure(StageId id, int threads, int capacity)
+{
+    __atomic_store_n(&stageGauges[id].threads, threads, __ATOMIC_RELAXED);
+    __atomic_store_n(&stageGauges[id].capacity, capacity, __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_stage_depth
+ * -------------------
+ * Updates the number of jobs currently waiting in front of a stage.
+ */
+void metrics_stage_depth(StageId id, int depth)
+{
+    __atomic_store_n(&stageGauges[id].depth, depth, __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_stage_record
+ * --------------------
+ * Accounts one job processed by a stage, with its expected cost, the time it
+ * spent queued and the time the stage spent working on it.
+ */
+void metrics_stage_record(
+        StageId id, uint64_t cost, uint64_t waitNanos, uint64_t busyNanos)
+{
+    StageMetrics* stage = &thread_stripe()->stages[id];
+    add(&stage->jobs, 1);
+    add(&stage->cost, cost);
+    add(&stage->waitNanos, waitNanos);
+    add(&stage->busyNanos, busyNanos);
+    record(&stage->wait, waitNanos);
+    record(&stage->busy, busyNanos);
+}
+
+/*
+ * metrics_stage_totals
+ * --------------------
+ * Reads what a stage has processed since start.
+ */
+void metrics_stage_totals(StageId id, StageTotals* totals)
+{
+    size_t stage = offsetof(MetricsStripe, stages) + id * sizeof(StageMetrics);
+    totals->jobs = total(stage + offsetof(StageMetrics, jobs));
+    totals->cost = total(stage + offsetof(StageMetrics, cost));
+    totals->waitNanos = total(stage + offsetof(StageMetrics, waitNanos));
+    totals->busyNanos = total(stage + offsetof(StageMetrics, busyNanos));
+}
+
+/*
+ * metrics_stage_expired
+ * ---------------------
+ * Accounts one job dropped in front of a stage because its deadline passed.
+ */
+void metrics_stage_expired(StageId id)
+{
+    add(&thread_stripe()->stages[id].expired, 1);
+}
+
+/*
+ * metrics_connection
+ * ------------------
+ * Tracks the open client connections; each one is served by a receive thread.
+ */
+void metrics_connection(int delta)
+{
+    __atomic_add_fetch(&stageGauges[STAGE_RECEIVE].threads, (int64_t)delta,
+            __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_count
+ * -------------
+ * Counts one occurrence of a server-wide event.
+ */
+void metrics_count(Counter counter)
+{
+    add(&thread_stripe()->counters[counter], 1);
+}
+
+/*
+ * metrics_add
+ * -----------
+ * Adds an amount, such as a number of bytes, to a server-wide counter.
+ */
+void metrics_add(Counter counter, uint64_t amount)
+{
+    add(&thread_stripe()->counters[counter], amount);
+}
+
+/*
+ * metrics_request
+ * ---------------
+ * Counts one request of the given operation byte, flags and all.
+ */
+void metrics_request(uint8_t operation)
+{
+    operation &= OPERATION_MASK;
+    int kind = operation < INVALID_REQUEST && requestNames[operation]
+            ? operation
+            : INVALID_REQUEST;
+    add(&thread_stripe()->requests[kind], 1);
+}
+
+/*
+ * error_kind
+ * ----------
+ * Returns the index an error message is counted at, taking the next free
+ * one for a message not seen before while there is one.
+ */
+static int error_kind(const char* message)
+{
+    int count = __atomic_load_n(&errorKinds.count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(errorKinds.messages[i], message) == 0) {
+            return i;
+        }
+    }
+    pthread_mutex_lock(&errorKinds.lock);
+    int kind = 0;
+    while (kind < errorKinds.count
+            && strcmp(errorKinds.messages[kind], message) != 0) {
+        kind++;
+    }
+    if (kind == errorKinds.count && kind < MAX_ERROR_KINDS) {
+        errorKinds.messages[kind] = message;
+        __atomic_store_n(&errorKinds.count, kind + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&errorKinds.lock);
+    return kind; // MAX_ERROR_KINDS once they are all taken
+}
+
+/*
+ * metrics_error
+ * -------------
+ * Counts one error response with the given message, which must stay valid
+ * for the life of the process.
+ */
+void metrics_error(const char* message)
+{
+    add(&thread_stripe()->errors[error_kind(message)], 1);
+}
+
+/*
+ * metrics_phase
+ * -------------
+ * Records how long one part of the work on a request took.
+ */
+void metrics_phase(Phase phase, uint64_t nanos)
+{
+    record(&thread_stripe()->phases[phase], nanos);
+}
+
+/*
+ * metrics_gauge
+ * -------------
+ * Sets the current value of a server-wide gauge.
+ */
+void metrics_gauge(Gauge gauge, uint64_t value)
+{
+    __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+/*
+ * write_sample
+ * ------------
+ * Writes a single server-wide sample in Prometheus text format.
+ */
+static void write_sample(FILE* out, const char* metric, uint64_t value)
+{
+    fprintf(out, "%s%s%s%s %" PRIu64 "\n", metric, *shardLabel ? "{" : "",
+            shardLabel, *shardLabel ? "}" : "", value);
+}
+
+/*
+ * write_stage_counter
+ * -------------------
+ * Writes a single per-stage sample in Prometheus text format.
+ */
+static void write_stage_counter(
+        FILE* out, const char* metric, StageId id, uint64_t value)
+{
+    fprintf(out, "uqfacedetect_stage_%s{%s%sstage=\"%s\"} %" PRIu64 "\n",
+            metric, shardLabel, *shardLabel ? "," : "", stageNames[id], value);
+}
+
+/*
+ * write_stage_seconds
+ * -------------------
+ * Writes a per-stage nanosecond total as seconds in Prometheus text format.
+ */
+static void write_stage_seconds(
+        FILE* out, const char* metric, StageId id, uint64_t nanos)
+{
+    fprintf(out, "uqfacedetect_stage_%s{%s%sstage=\"%s\"} %.6f\n", metric,
+            shardLabel, *shardLabel ? "," : "", stageNames[id],
+            nanos / NANOS_PER_SECOND);
+}
+
+/*
+ * write_histogram
+ * ---------------
+ * Writes a latency histogram, summed over the stripes and given by its
+ * offset in a stripe, as a Prometheus histogram in seconds with the given
+ * label.
+ */
+static void write_histogram(
+        FILE* out, const char* metric, const char* label, size_t offset)
+{
+    const char* separator = *shardLabel ? "," : "";
+    uint64_t count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += total(offset + offsetof(Histogram, buckets)
+                + i * sizeof(uint64_t));
+        if (i == HISTOGRAM_BUCKETS - 1) {
+            fprintf(out, "%s_bucket{%s%s%s,le=\"+Inf\"} %" PRIu64 "\n",
+                    metric, shardLabel, separator, label, count);
+        } else {
+            fprintf(out, "%s_bucket{%s%s%s,le=\"%.9f\"} %" PRIu64 "\n",
+                    metric, shardLabel, separator, label,
+                    histogram_bound(i) / NANOS_PER_SECOND, count);
+        }
+    }
+    fprintf(out, "%s_sum{%s%s%s} %.6f\n", metric, shardLabel, separator,
+            label, total(offset + offsetof(Histogram, sumNanos))
+                    / NANOS_PER_SECOND);
+    fprintf(out, "%s_count{%s%s%s} %" PRIu64 "\n", metric, shardLabel,
+            separator, label, count);
+}
+
+/*
+ * write_stages
+ * ------------
+ * Writes the metrics of every stage of the pipeline.
+ */
+static void write_stages(FILE* out)
+{
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        StageGauges* gauge = &stageGauges[i];
+        size_t stage
+                = offsetof(MetricsStripe, stages) + i * sizeof(StageMetrics);
+        write_stage_counter(out, "threads", i,
+                __atomic_load_n(&gauge->threads, __ATOMIC_RELAXED));
+        write_stage_counter(out, "queue_capacity", i,
+                __atomic_load_n(&gauge->capacity, __ATOMIC_RELAXED));
+        write_stage_counter(out, "queue_depth", i,
+                __atomic_load_n(&gauge->depth, __ATOMIC_RELAXED));
+        write_stage_counter(out, "jobs_total", i,
+                total(stage + offsetof(StageMetrics, jobs)));
+        write_stage_counter(out, "cost_total", i,
+                total(stage + offsetof(StageMetrics, cost)));
+        write_stage_counter(out, "expired_total", i,
+                total(stage + offsetof(StageMetrics, expired)));
+        write_stage_seconds(out, "wait_seconds_total", i,
+                total(stage + offsetof(StageMetrics, waitNanos)));
+        write_stage_seconds(out, "busy_seconds_total", i,
+                total(stage + offsetof(StageMetrics, busyNanos)));
+    }
+    char label[MAX_LABEL_LENGTH];
+    const char* histograms[2] = {"uqfacedetect_stage_queue_wait_seconds",
+            "uqfacedetect_stage_latency_seconds"};
+    size_t offsets[2]
+            = {offsetof(StageMetrics, wait), offsetof(StageMetrics, busy)};
+    for (int h = 0; h < 2; h++) {
+        fprintf(out, "# TYPE %s histogram\n", histograms[h]);
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            snprintf(label, sizeof(label), "stage=\"%s\"", stageNames[i]);
+            write_histogram(out, histograms[h], label,
+                    offsetof(MetricsStripe, stages) + i * sizeof(StageMetrics)
+                            + offsets[h]);
+        }
+    }
+}
+
+/*
+ * write_label_value
+ * -----------------
+ * Writes a Prometheus label with the given value, escaped.
+ */
+static void write_label_value(FILE* out, const char* name, const char* value)
+{
+    fprintf(out, "%s=\"", name);
+    for (const char* c = value; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*c == '\n' ? ' ' : *c, out);
+    }
+    fputc('"', out);
+}
+
+/*
+ * write_requests
+ * --------------
+ * Writes the requests counted by operation type and the error responses
+ * counted by message.
+ */
+static void write_requests(FILE* out)
+{
+    const char* separator = *shardLabel ? "," : "";
+    for (int i = 0; i < REQUEST_KINDS; i++) {
+        uint64_t count = total(offsetof(MetricsStripe, requests)
+                + i * sizeof(uint64_t));
+        if (requestNames[i]) {
+            fprintf(out,
+                    "uqfacedetect_requests_total{%s%soperation=\"%s\"} "
+                    "%" PRIu64 "\n",
+                    shardLabel, separator, requestNames[i], count);
+        }
+    }
+    int kinds = __atomic_load_n(&errorKinds.count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i <= MAX_ERROR_KINDS; i++) {
+        uint64_t count = total(offsetof(MetricsStripe, errors)
+                + i * sizeof(uint64_t));
+        if (i < kinds || (i == MAX_ERROR_KINDS && count)) {
+            fprintf(out, "uqfacedetect_errors_total{%s%s", shardLabel,
+                    separator);
+            write_label_value(out, "message",
+                    i < kinds ? errorKinds.messages[i] : "other");
+            fprintf(out, "} %" PRIu64 "\n", count);
+        }
+    }
+}
+
+/*
+ * metrics_report
+ * --------------
+ * Returns every metric in Prometheus text format, as a malloc'd buffer
+ * whose length is stored through size, or NULL if it cannot be made.
+ */
+char* metrics_report(size_t* size)
+{
+    char* report = NULL;
+    FILE* out = open_memstream(&report, size);
+    if (!out) {
+        return NULL;
+    }
+    write_stages(out);
+    fprintf(out, "# TYPE uqfacedetect_phase_latency_seconds histogram\n");
+    char label[MAX_LABEL_LENGTH];
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        snprintf(label, sizeof(label), "phase=\"%s\"", phaseNames[i]);
+        write_histogram(out, "uqfacedetect_phase_latency_seconds", label,
+                offsetof(MetricsStripe, phases) + i * sizeof(Histogram));
+    }
+    write_requests(out);
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        write_sample(out, counterNames[i],
+                total(offsetof(MetricsStripe, counters)
+                        + i * sizeof(uint64_t)));
+    }
+    for (int i = 0; i < GAUGE_COUNT; i++) {
+        write_sample(out, gaugeNames[i],
+                __atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+    }
+    fclose(out);
+    return report;
+}
+
+/*
+ * metrics_write
+ * -------------
+ * Writes every metric to the given stream in Prometheus text format, in a
+ * single write so the reports of several shards sharing the stream do not
+ * interleave.
+ */
+void metrics_write(FILE* stream)
+{
+    size_t reportSize;
+    char* report = metrics_report(&reportSize);
+    if (!report) {
+        return;
+    }
+    fwrite(report, 1, reportSize, stream);
+    fflush(stream);
+    free(report);
+}
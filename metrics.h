@@ -0,0 +1,72 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "pipeline.h"
+
+// Server-wide event counters
+typedef enum {
+    COUNTER_RATE_LIMITED = 0,
+    COUNTER_TOO_MANY_IN_FLIGHT,
+    COUNTER_PARTIAL_ENCODES,
+    COUNTER_PRESCREEN_REJECTED,
+    COUNTER_PRESCREEN_AUDITED,
+    COUNTER_PRESCREEN_MISSED,
+    COUNTER_BYTES_RECEIVED,
+    COUNTER_BYTES_SENT,
+    COUNTER_CAPTURED,
+    COUNTER_CAPTURED_SLOW,
+    COUNTER_MODEL_RELOADS,
+    COUNTER_MODEL_RELOAD_FAILURES,
+    COUNTER_FACE_CACHE_HITS,
+    COUNTER_FACE_CACHE_MISSES,
+    COUNTER_COUNT
+} Counter;
+
+// Server-wide values that go up and down
+typedef enum {
+    GAUGE_DETECT_ACTIVE = 0,
+    GAUGE_INFLIGHT_LIMIT,
+    GAUGE_INFLIGHT,
+    GAUGE_MODEL_GENERATION,
+    GAUGE_COUNT
+} Gauge;
+
+// Parts of the work on a request timed on their own, within the stages
+typedef enum {
+    PHASE_GRAY = 0, // grey conversion and equalisation
+    PHASE_FACES, // face search
+    PHASE_EYES, // eye search of one face
+    PHASE_COMPOSITE, // replacement of the faces of a replace
+    PHASE_COUNT
+} Phase;
+
+// What a stage has processed since start
+typedef struct {
+    uint64_t jobs;
+    uint64_t cost;
+    uint64_t waitNanos;
+    uint64_t busyNanos;
+} StageTotals;
+
+uint64_t now_nanos(void);
+
+void metrics_set_shard(int shard);
+void metrics_stage_configure(StageId id, int threads, int capacity);
+void metrics_stage_depth(StageId id, int depth);
+void metrics_stage_record(
+        StageId id, uint64_t cost, uint64_t waitNanos, uint64_t busyNanos);
+void metrics_stage_totals(StageId id, StageTotals* totals);
+void metrics_stage_expired(StageId id);
+void metrics_connection(int delta);
+void metrics_count(Counter counter);
+void metrics_add(Counter counter, uint64_t amount);
+void metrics_request(uint8_t operation);
+void metrics_error(const char* message);
+void metrics_phase(Phase phase, uint64_t nanos);
+void metrics_gauge(Gauge gauge, uint64_t value);
+char* metrics_report(size_t* size);
+void metrics_write(FILE* out);
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "models.h"
+
+#define MAX_CONFIG_LINE (MODEL_MAX_PATH + 64)
+
+// Names of the settings of a model file, and of the cascade engines
+static const char* const faceCascadeName = "facecascade";
+static const char* const eyesCascadeName = "eyescascade";
+static const char* const cascadeFileName = "cascadefile";
+static const char* const extraCascadeName = "extracascade";
+static const char* const mirroredCascadeName = "mirroredcascade";
+static const char* const cascadeEngineName = "cascadeengine";
+static const char* const scaleFactorName = "scalefactor";
+static const char* const minNeighboursName = "minneighbours";
+static const char* const simdEngineValue = "simd";
+static const char* const opencvEngineValue = "opencv";
+static const char* const separators = " \t\r\n";
+static const char commentStart = '#';
+static const int baseTen = 10;
+
+static const float maxScaleFactor = 4.0;
+static const int maxMinNeighbours = 100;
+
+static pthread_mutex_t currentLock = PTHREAD_MUTEX_INITIALIZER;
+static ModelSet* current; // the set new requests take, NULL before the first
+static uint64_t generations; // sets made so far
+
+/*
+ * set_config_value
+ * ----------------
+ * Applies one setting of a model file to the configuration. Returns false
+ * if the name is unknown or the value invalid.
+ */
+static bool set_config_value(char* name, char* value, ModelConfig* config)
+{
+    char* end;
+    if (strcmp(name, faceCascadeName) == 0) {
+        snprintf(config->faceCascade, MODEL_MAX_PATH, "%s", value);
+    } else if (strcmp(name, eyesCascadeName) == 0) {
+        snprintf(config->eyesCascade, MODEL_MAX_PATH, "%s", value);
+    } else if (strcmp(name, cascadeFileName) == 0) {
+        snprintf(config->compiledFace, MODEL_MAX_PATH, "%s", value);
+    } else if (strcmp(name, extraCascadeName) == 0
+            || strcmp(name, mirroredCascadeName) == 0) {
+        if (config->extraCount == MODEL_MAX_EXTRA_CASCADES) {
+            return false;
+        }
+        snprintf(config->extraCascades[config->extraCount], MODEL_MAX_PATH,
+                "%s", value);
+        config->extraMirrored[config->extraCount++]
+                = strcmp(name, mirroredCascadeName) == 0;
+    } else if (strcmp(name, cascadeEngineName) == 0
+            && (strcmp(value, simdEngineValue) == 0
+                    || strcmp(value, opencvEngineValue) == 0)) {
+        config->simdCascade = strcmp(value, simdEngineValue) == 0;
+    } else if (strcmp(name, scaleFactorName) == 0) {
+        float factor = strtof(value, &end);
+        if (*end || !(factor > 1.0f && factor <= maxScaleFactor)) {
+            return false;
+        }
+        config->scaleFactor = factor;
+    } else if (strcmp(name, minNeighboursName) == 0) {
+        long neighbours = strtol(value, &end, baseTen);
+        if (*end || neighbours < 1 || neighbours > maxMinNeighbours) {
+            return false;
+        }
+        config->minNeighbours = (int)neighbours;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * models_read_config
+ * ------------------
+ * Applies the settings of a model file to the configuration, which keeps
+ * its values for those the file leaves out. Each line of the file is a
+ * name and a value separated by spaces; blank lines and lines starting
+ * with # are skipped. The names are facecascade, eyescascade and
+ * cascadefile (paths), cascadeengine (simd or opencv), scalefactor and
+ * minneighbours, and extracascade or mirroredcascade (paths) for each more
+ * face cascade, as is or also mirrored, up to MODEL_MAX_EXTRA_CASCADES.
+ * Returns false if the file cannot be read or has an
+ * invalid line, leaving the configuration partly applied.
+ */
+bool models_read_config(const char* path, ModelConfig* config)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    char line[MAX_CONFIG_LINE];
+    bool valid = true;
+    while (valid && fgets(line, sizeof(line), file)) {
+        char* rest;
+        char* name = strtok_r(line, separators, &rest);
+        char* value = strtok_r(NULL, separators, &rest);
+        if (!name || *name == commentStart) {
+            continue;
+        }
+        valid = value && !strtok_r(NULL, separators, &rest)
+                && set_config_value(name, value, config);
+    }
+    fclose(file);
+    return valid;
+}
+
+/*
+ * models_create
+ * -------------
+ * Makes a set of the loaded cascades, which it takes over, and the
+ * parameters of the configuration, with one reference for the caller.
+ */
+ModelSet* models_create(CvHaarClassifierCascade* faceCascade,
+        CvHaarClassifierCascade* eyesCascade, CompiledCascade* faceEngine,
+        CompiledCascade* const* extraEngines, int extraCount,
+        const ModelConfig* config)
+{
+    ModelSet* models = calloc(1, sizeof(ModelSet));
+    models->generation
+            = __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+    models->faceCascade = faceCascade;
+    models->eyesCascade = eyesCascade;
+    models->faceEngine = faceEngine;
+    models->faceWindow = faceCascade ? faceCascade->orig_window_size
+                                     : faceEngine->window;
+    for (int i = 0; i < extraCount; i++) {
+        models->extraEngines[i] = extraEngines[i];
+    }
+    models->extraCount = extraCount;
+    models->scaleFactor = config->scaleFactor;
+    models->minNeighbours = config->minNeighbours;
+    models->references = 1;
+    return models;
+}
+
+/*
+ * models_publish
+ * --------------
+ * Makes the set, and the caller's reference to it, the current one, which
+ * requests starting from now take. The previous set is released, and
+ * freed once the requests still running on it are done.
+ */
+void models_publish(ModelSet* models)
+{
+    pthread_mutex_lock(&currentLock);
+    ModelSet* previous = current;
+    current = models;
+    pthread_mutex_unlock(&currentLock);
+    if (previous) {
+        models_release(previous);
+    }
+}
+
+/*
+ * models_acquire
+ * --------------
+ * Returns the current set with a reference for the caller, to be given
+ * back with models_release(), or NULL if none has been published.
+ */
+ModelSet* models_acquire(void)
+{
+    pthread_mutex_lock(&currentLock);
+    ModelSet* models = current;
+    if (models) {
+        // the current set cannot be freed while its reference is held here
+        __atomic_add_fetch(&models->references, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&currentLock);
+    return models;
+}
+
+/*
+ * models_release
+ * --------------
+ * Gives back a reference to a set, freeing it and its cascades with the
+ * last one.
+ */
+void models_release(ModelSet* models)
+{
+    if (__atomic_sub_fetch(&models->references, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    if (models->faceCascade) {
+        cvReleaseHaarClassifierCascade(&models->faceCascade);
+    }
+    if (models->eyesCascade) {
+        cvReleaseHaarClassifierCascade(&models->eyesCascade);
+    }
+    if (models->faceEngine) {
+        cascade_free(models->faceEngine);
+    }
+    for (int i = 0; i < models->extraCount; i++) {
+        cascade_free(models->extraEngines[i]);
+    }
+    free(models);
+}
@@ -0,0 +1,57 @@
+#ifndef MODELS_H
+#define MODELS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <opencv2/objdetect/objdetect_c.h>
+#include "cascade.h"
+
+#define MODEL_MAX_PATH 4096
+#define MODEL_MAX_EXTRA_CASCADES 4
+
+// Where the models of a set are loaded from, and the parameters the face
+// search runs with
+typedef struct {
+    char faceCascade[MODEL_MAX_PATH]; // XML of the face cascade
+    char eyesCascade[MODEL_MAX_PATH]; // XML of the eye cascade
+    char compiledFace[MODEL_MAX_PATH]; // compiled face cascade, "" for none
+    // XML of more face cascades, such as a profile one, and whether each is
+    // searched for mirrored too
+    char extraCascades[MODEL_MAX_EXTRA_CASCADES][MODEL_MAX_PATH];
+    bool extraMirrored[MODEL_MAX_EXTRA_CASCADES];
+    int extraCount;
+    bool simdCascade; // run the face cascade with cascade.c if it can
+    float scaleFactor;
+    int minNeighbours;
+} ModelConfig;
+
+// The models requests are detected with. A set never changes once made:
+// a reload makes a new one and publishes it for the requests that start
+// after, while those already running keep the set they started with. Each
+// holds a reference, as does the set's place as the current one, and the
+// set is freed with the last of them.
+typedef struct ModelSet {
+    uint64_t generation; // numbers the sets of the process, from 1
+    CvHaarClassifierCascade* faceCascade; // NULL if only compiled
+    CvHaarClassifierCascade* eyesCascade;
+    CompiledCascade* faceEngine; // NULL to run the face cascade on OpenCV
+    CvSize faceWindow; // smallest window of the face cascade
+    // More face cascades, mirrored ones as cascades of their own, always
+    // compiled so they run on the integral images of the face one
+    CompiledCascade* extraEngines[2 * MODEL_MAX_EXTRA_CASCADES];
+    int extraCount;
+    float scaleFactor;
+    int minNeighbours;
+    int references;
+} ModelSet;
+
+bool models_read_config(const char* path, ModelConfig* config);
+ModelSet* models_create(CvHaarClassifierCascade* faceCascade,
+        CvHaarClassifierCascade* eyesCascade, CompiledCascade* faceEngine,
+        CompiledCascade* const* extraEngines, int extraCount,
+        const ModelConfig* config);
+void models_publish(ModelSet* models);
+ModelSet* models_acquire(void);
+void models_release(ModelSet* models);
+
+#endif
@@ -0,0 +1,351 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <opencv2/core/core_c.h>
+#include "pipeline.h"
+#include "metrics.h"
+#include "trace.h"
+#include "models.h"
+
+const char* const stageNames[STAGE_COUNT]
+        = {"receive", "decode", "detect", "encode", "send"};
+
+// Weight of the newest sample in the per-stage cost rate average is 1/8
+const int64_t costRateSmoothing = 8;
+
+// Requests created so far
+static uint64_t jobsCreated;
+
+/*
+ * job_create
+ * ----------
+ * Allocates an empty job for a request read from the given client socket.
+ */
+Job* job_create(int clientfd)
+{
+    Job* job = calloc(1, sizeof(Job));
+    job->id = __atomic_add_fetch(&jobsCreated, 1, __ATOMIC_RELAXED);
+    job->clientfd = clientfd;
+    sem_init(&job->done, 0, 0);
+    return job;
+}
+
+/*
+ * release_image
+ * -------------
+ * Releases request image data, unmapping it if it was mapped.
+ */
+static void release_image(uint8_t* image, uint32_t size, bool mapped)
+{
+    if (mapped) {
+        munmap(image, size);
+    } else {
+        free(image);
+    }
+}
+
+/*
+ * job_free
+ * --------
+ * Releases the request data, the decoded images and the encoded output held
+ * by the job, and its model set, then the job itself.
+ */
+void job_free(Job* job)
+{
+    if (job->models) {
+        models_release(job->models);
+    }
+    release_image(job->image1, job->image1Size, job->image1Mapped);
+    release_image(job->image2, job->image2Size, job->image2Mapped);
+    free(job->faces);
+    if (job->frame && job->frameBorrowed) {
+        cvReleaseImageHeader(&job->frame);
+    } else if (job->frame) {
+        cvReleaseImage(&job->frame);
+    }
+    if (job->replace) {
+        cvReleaseImage(&job->replace);
+    }
+    if (job->output) {
+        cvReleaseMat(&job->output);
+    }
+    sem_destroy(&job->done);
+    free(job);
+}
+
+/*
+ * queue_init
+ * ----------
+ * Initialises an empty queue holding at most capacity jobs.
+ */
+static void queue_init(JobQueue* queue, int capacity)
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->length = 0;
+    queue->capacity = capacity;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+}
+
+/*
+ * queue_push
+ * ----------
+ * Inserts a job into the queue in queueKey order, after any job with the
+ * same key, blocking while the queue is full so that a slow stage pushes back
+ * on the stages in front of it.
+ * Returns the queue length after the push.
+ */
+static int queue_push(JobQueue* queue, Job* job)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->length >= queue->capacity) {
+        pthread_cond_wait(&queue->notFull, &queue->lock);
+    }
+    if (!queue->tail || queue->tail->queueKey <= job->queueKey) {
+        // Most jobs go last, FIFO ones always do
+        job->next = NULL;
+        if (queue->tail) {
+            queue->tail->next = job;
+        } else {
+            queue->head = job;
+        }
+        queue->tail = job;
+    } else if (queue->head->queueKey > job->queueKey) {
+        job->next = queue->head;
+        queue->head = job;
+    } else {
+        Job* before = queue->head;
+        while (before->next->queueKey <= job->queueKey) {
+            before = before->next;
+        }
+        job->next = before->next;
+        before->next = job;
+    }
+    int length = ++queue->length;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+    return length;
+}
+
+/*
+ * queue_pop
+ * ---------
+ * Removes the job with the lowest key from the queue, blocking while the
+ * queue is empty.
+ * The queue length after the pop is stored in length.
+ */
+static Job* queue_pop(JobQueue* queue, int* length)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->head) {
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    }
+    Job* job = queue->head;
+    queue->head = job->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    *length = --queue->length;
+    pthread_cond_signal(&queue->notFull);
+    pthread_mutex_unlock(&queue->lock);
+    job->next = NULL;
+    return job;
+}
+
+/*
+ * update_cost_rate
+ * ----------------
+ * Folds the time a stage took over a job of the given cost into the running
+ * average the stage uses to predict how long its next jobs will take.
+ */
+static void update_cost_rate(Stage* stage, uint64_t busyNanos, uint64_t cost)
+{
+    if (!cost) {
+        return;
+    }
+    int64_t sample = (int64_t)(busyNanos * 1000 / cost);
+    int64_t average
+            = (int64_t)__atomic_load_n(&stage->picosPerCost, __ATOMIC_RELAXED);
+    average += (sample - average) / costRateSmoothing;
+    __atomic_store_n(&stage->picosPerCost, (uint64_t)average, __ATOMIC_RELAXED);
+}
+
+/*
+ * stage_worker
+ * ------------
+ * Thread body of a stage worker. Takes jobs from the stage queue, processes
+ * them and hands them on to the next stage, forever. A job whose deadline has
+ * passed is failed before any stage but send does work on it. A job split
+ * into parts only moves on once the last part meets it in front of its join
+ * stage.
+ */
+static void* stage_worker(void* arg)
+{
+    Stage* stage = (Stage*)arg;
+    void* state = stage->init ? stage->init(stage->context) : NULL;
+    int index = __atomic_fetch_add(&stage->started, 1, __ATOMIC_RELAXED);
+    while (1) {
+        pthread_mutex_lock(&stage->activeLock);
+        while (index >= stage->active) {
+            // parked until the stage is given more active workers
+            pthread_cond_wait(&stage->activeChanged, &stage->activeLock);
+        }
+        pthread_mutex_unlock(&stage->activeLock);
+        int length;
+        Job* job = queue_pop(&stage->queue, &length);
+        metrics_stage_depth(stage->id, length);
+        if (stage->dequeued) {
+            stage->dequeued(job->queueKey);
+        }
+        uint64_t start = now_nanos();
+        uint64_t waited = start - job->enqueueTime;
+        uint64_t cost = job->cost;
+        bool last = stage->id + 1 == STAGE_COUNT;
+        if (!last && job->deadline && start >= job->deadline && !job->error
+                && !job->closed) {
+            // The caller has given up: skip the remaining work
+            job->error = stage->pipeline->expiredError;
+            metrics_stage_expired(stage->id);
+        }
+        // The last stage hands the job back to its receive thread, which may
+        // free it as soon as process returns
+        trace_set_request(job->id, job->image1Size);
+        int faces = job->faceCount;
+        if (last || job->error != stage->pipeline->expiredError) {
+            // an expired job only has its error sent
+            stage->process(job, state);
+        }
+        uint64_t busy = now_nanos() - start;
+        if (!last) {
+            faces = job->faceCount;
+        }
+        trace_end(stageNames[stage->id], start,
+                stage->id >= STAGE_DETECT ? faces : -1);
+        metrics_stage_record(stage->id, cost, waited, busy);
+        update_cost_rate(stage, busy, cost);
+        if (!last && job->joinBefore == stage->id + 1) {
+            pipeline_join(stage->pipeline, stage->id + 1, job);
+        } else if (!last) {
+            pipeline_submit(stage->pipeline, stage->id + 1, job);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * pipeline_init_stage
+ * -------------------
+ * Configures one stage of the pipeline: how many threads serve it, how many
+ * jobs may wait in front of it, and the work each thread does on a job.
+ * init (optional) is run once by every worker thread to build its private
+ * state, which is then passed to process along with each job.
+ */
+void pipeline_init_stage(Pipeline* pipeline, StageId id, int threads,
+        int capacity, StageFunction process, StageWorkerInit init,
+        void* context)
+{
+    Stage* stage = &pipeline->stages[id];
+    stage->id = id;
+    stage->threads = threads;
+    stage->active = threads;
+    pthread_mutex_init(&stage->activeLock, NULL);
+    pthread_cond_init(&stage->activeChanged, NULL);
+    stage->process = process;
+    stage->init = init;
+    stage->context = context;
+    stage->pipeline = pipeline;
+    queue_init(&stage->queue, capacity);
+    metrics_stage_configure(id, threads, capacity);
+}
+
+/*
+ * pipeline_order_stage
+ * --------------------
+ * Orders the queue of one stage by keys from the given function instead of
+ * the pipeline schedule. dequeued (optional) is told the key of every job
+ * taken off the queue.
+ */
+void pipeline_order_stage(Pipeline* pipeline, StageId id,
+        StageQueueKey queueKey, StageDequeued dequeued)
+{
+    pipeline->stages[id].queueKey = queueKey;
+    pipeline->stages[id].dequeued = dequeued;
+}
+
+/*
+ * pipeline_start
+ * --------------
+ * Spawns the worker threads of every stage that has work to do.
+ */
+void pipeline_start(Pipeline* pipeline)
+{
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        Stage* stage = &pipeline->stages[i];
+        if (!stage->process) {
+            continue;
+        }
+        for (int j = 0; j < stage->threads; j++) {
+            pthread_t tid;
+            pthread_create(&tid, NULL, stage_worker, stage);
+            pthread_detach(tid);
+        }
+    }
+}
+
+/*
+ * pipeline_set_active
+ * -------------------
+ * Sets how many of the worker threads of a stage take jobs, between one and
+ * all of them. The others park after their current job.
+ */
+void pipeline_set_active(Pipeline* pipeline, StageId id, int active)
+{
+    Stage* stage = &pipeline->stages[id];
+    pthread_mutex_lock(&stage->activeLock);
+    stage->active = active < 1
+            ? 1
+            : (active > stage->threads ? stage->threads : active);
+    pthread_cond_broadcast(&stage->activeChanged);
+    pthread_mutex_unlock(&stage->activeLock);
+}
+
+/*
+ * pipeline_submit
+ * ---------------
+ * Queues a job for the given stage, blocking while that stage is full.
+ * Under SCHEDULE_SJF, jobs expected to be quick are served ahead of earlier
+ * expensive ones.
+ */
+void pipeline_submit(Pipeline* pipeline, StageId id, Job* job)
+{
+    Stage* stage = &pipeline->stages[id];
+    job->enqueueTime = now_nanos();
+    job->queueKey = job->enqueueTime;
+    if (stage->queueKey) {
+        job->queueKey = stage->queueKey(job);
+    } else if (pipeline->schedule == SCHEDULE_SJF) {
+        // Order by arrival plus a head start for cheap jobs: a job's key is
+        // pushed back by its expected time in this stage, so it can only be
+        // overtaken for a bounded time and never starves
+        uint64_t picos
+                = __atomic_load_n(&stage->picosPerCost, __ATOMIC_RELAXED);
+        job->queueKey += job->cost * picos / 1000 * pipeline->agingFactor;
+    }
+    metrics_stage_depth(id, queue_push(&stage->queue, job));
+}
+
+/*
+ * pipeline_join
+ * -------------
+ * Marks one part of a job that was split across threads as finished. The
+ * last part to finish queues the job for the given stage; the job must not
+ * be touched by the caller afterwards.
+ */
+void pipeline_join(Pipeline* pipeline, StageId id, Job* job)
+{
+    if (__atomic_sub_fetch(&job->pendingParts, 1, __ATOMIC_ACQ_REL) == 0) {
+        pipeline_submit(pipeline, id, job);
+    }
+}
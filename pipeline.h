@@ -0,0 +1,140 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <opencv2/imgproc/imgproc_c.h>
+#include "protocol.h"
+
+// The stages a request passes through, in order
+typedef enum {
+    STAGE_RECEIVE = 0,
+    STAGE_DECODE,
+    STAGE_DETECT,
+    STAGE_ENCODE,
+    STAGE_SEND,
+    STAGE_COUNT
+} StageId;
+
+// Printable name of every stage, indexed by StageId
+extern const char* const stageNames[STAGE_COUNT];
+
+struct ClientIdentity;
+struct BatchRun;
+struct ModelSet;
+
+// A single request as it travels from one stage to the next
+typedef struct Job {
+    uint64_t id; // numbers the requests of the process, in traces
+    int clientfd;
+    struct ClientIdentity* identity; // who the request is accounted to
+    struct ModelSet* models; // held until the job is freed, NULL for none
+    uint8_t operation;
+    bool sharedMemory; // images came, and the output goes, as descriptors
+    uint8_t* image1;
+    uint32_t image1Size;
+    bool image1Mapped; // image1 is a mapping of a shared file, not malloc'd
+    bool rawPixels; // image1 is raw pixels of the shape in raw, not encoded
+    RawImage raw;
+    CropOptions crop; // how the faces of a crop request are cut out
+    uint8_t* image2;
+    uint32_t image2Size;
+    bool image2Mapped;
+    IplImage* frame; // decoded image1
+    bool frameBorrowed; // frame is a header over the pixels of image1
+    IplImage* replace; // decoded image2 (replace only)
+    CvRect* faces; // faces found in the frame
+    int faceCount;
+    uint64_t frameHash; // perceptual hash of the frame, if hashed
+    bool hashed; // frameHash is set, and the result is to be cached
+    bool cachedFaces; // faces were taken from the face cache
+    CvMat* output; // encoded result image
+    const char* error; // set once the job has failed, sent instead of output
+    bool closed; // the connection is gone, nothing is sent
+    int pendingParts; // parts still running before the job reaches joinBefore
+    StageId joinBefore; // stage the parts of a split job meet in front of
+    uint64_t arrival; // monotonic time the request began arriving
+    uint64_t deadline; // monotonic time the caller gives up at, 0 for none
+    uint64_t cost; // expected work, in pixels times cascade scales
+    uint64_t enqueueTime; // when the job entered its current queue
+    uint64_t queueKey; // jobs leave a queue in increasing key order
+    sem_t done; // posted by the send stage once the response is written
+    struct BatchRun* batch; // the offline run of a batch job, NULL otherwise
+    const char* batchInput; // the file a batch job was read from
+    const char* batchOutput; // the name its output is written under
+    bool facesOnly; // only the faces are wanted, nothing is drawn or encoded
+    struct Job* next;
+} Job;
+
+// How the jobs waiting for a stage are ordered
+typedef enum {
+    SCHEDULE_FIFO = 0, // in arrival order
+    SCHEDULE_SJF // shortest expected job first, with aging
+} Schedule;
+
+// Bounded queue of jobs waiting for a stage, kept sorted by queueKey
+typedef struct {
+    Job* head;
+    Job* tail;
+    int length;
+    int capacity;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} JobQueue;
+
+typedef struct Pipeline Pipeline;
+
+// Work done by a stage on one job, with the worker's private state
+typedef void (*StageFunction)(Job* job, void* workerState);
+// Creates the private state of one worker thread of a stage
+typedef void* (*StageWorkerInit)(void* context);
+// Computes the queue key of a job for a stage with its own ordering
+typedef uint64_t (*StageQueueKey)(Job* job);
+// Told the key of each job taken off the queue of such a stage
+typedef void (*StageDequeued)(uint64_t queueKey);
+
+// A stage: a bounded queue served by its own pool of threads
+typedef struct {
+    StageId id;
+    int threads;
+    int started; // worker threads that have taken an index
+    int active; // workers with a lower index take jobs, the others park
+    pthread_mutex_t activeLock;
+    pthread_cond_t activeChanged;
+    JobQueue queue;
+    StageFunction process;
+    StageWorkerInit init;
+    void* context;
+    uint64_t picosPerCost; // running average of busy time per unit of cost
+    StageQueueKey queueKey; // replaces the pipeline schedule if set
+    StageDequeued dequeued;
+    Pipeline* pipeline;
+} Stage;
+
+struct Pipeline {
+    Stage stages[STAGE_COUNT];
+    Schedule schedule;
+    // Under SJF a job may be overtaken by later, cheaper jobs for at most
+    // agingFactor times its own expected time in the stage
+    int agingFactor;
+    // Error a job fails with when its deadline passes before a stage
+    const char* expiredError;
+};
+
+Job* job_create(int clientfd);
+void job_free(Job* job);
+
+void pipeline_init_stage(Pipeline* pipeline, StageId id, int threads,
+        int capacity, StageFunction process, StageWorkerInit init,
+        void* context);
+void pipeline_order_stage(Pipeline* pipeline, StageId id,
+        StageQueueKey queueKey, StageDequeued dequeued);
+void pipeline_start(Pipeline* pipeline);
+void pipeline_set_active(Pipeline* pipeline, StageId id, int active);
+void pipeline_submit(Pipeline* pipeline, StageId id, Job* job);
+void pipeline_join(Pipeline* pipeline, StageId id, Job* job);
+
+#endif
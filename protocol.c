@@ -1,5 +1,12 @@
+#define _GNU_SOURCE // memfd_create and file seals
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include "protocol.h"
 
+// Seals that keep a shared image from shrinking under its reader, or changing
+#define IMAGE_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
 /**
  * read_file_to_buffer
  * -------------------
@@ -45,12 +52,41 @@ void protocol_pack_request(uint8_t operation, const uint8_t* image1,
         uint32_t image1Size, const uint8_t* image2, uint32_t image2Size,
         uint8_t** resultBuffer, size_t* resultSize)
 {
-    // Get the total Size first
-    size_t totalSize
-            = IMAGE_BYTES + OPERATION_BYTES + PREFIX_BYTES + image1Size;
-    if (operation == REQUEST_REPLACE) {
-        // Add the extra size space if it's replace operation type
-        totalSize += (IMAGE_BYTES + image2Size);
+    protocol_pack_request_with_options(operation, NULL, image1, image1Size,
+            image2, image2Size, resultBuffer, resultSize);
+}
+
+/*
+ * protocol_pack_header
+ * --------------------
+ * Builds the header of a request: the prefix, the operation byte and the
+ * optional header fields set in options (which may be NULL), flagged in the
+ * operation byte, and the crop field of a crop request. The image fields are
+ * left to the caller.
+ * The packed result is allocated and returned via ResultBuffer and ResultSize.
+ */
+void protocol_pack_header(uint8_t operation, const RequestOptions* options,
+        uint8_t** resultBuffer, size_t* resultSize)
+{
+    size_t totalSize = OPERATION_BYTES + PREFIX_BYTES;
+    if (options && options->deadlineMs) {
+        operation |= FLAG_DEADLINE;
+        totalSize += DEADLINE_BYTES;
+    }
+    uint8_t tagLength = 0;
+    if (options && options->clientTag && *options->clientTag) {
+        size_t length = strlen(options->clientTag);
+        tagLength = length > MAX_CLIENT_TAG_LENGTH ? MAX_CLIENT_TAG_LENGTH
+                                                   : (uint8_t)length;
+        operation |= FLAG_CLIENT_TAG;
+        totalSize += CLIENT_TAG_LENGTH_BYTES + tagLength;
+    }
+    if (options && options->raw) {
+        operation |= FLAG_RAW_PIXELS;
+        totalSize += RAW_HEADER_BYTES;
+    }
+    if ((operation & OPERATION_MASK) == REQUEST_CROP) {
+        totalSize += CROP_HEADER_BYTES;
     }
     uint8_t* buffer = malloc(totalSize);
     size_t index = 0;
@@ -60,6 +96,57 @@ void protocol_pack_request(uint8_t operation, const uint8_t* image1,
     index += PREFIX_BYTES; // Move pointer
     // Write the opertaion type
     buffer[index++] = operation;
+    if (operation & FLAG_DEADLINE) {
+        // Write the optional header fields
+        memcpy(buffer + index, &options->deadlineMs, DEADLINE_BYTES);
+        index += DEADLINE_BYTES;
+    }
+    if (operation & FLAG_CLIENT_TAG) {
+        buffer[index++] = tagLength;
+        memcpy(buffer + index, options->clientTag, tagLength);
+        index += tagLength;
+    }
+    if (operation & FLAG_RAW_PIXELS) {
+        uint32_t shape[] = {options->raw->width, options->raw->height,
+                options->raw->stride};
+        memcpy(buffer + index, shape, sizeof(shape));
+        buffer[index + sizeof(shape)] = options->raw->format;
+        index += RAW_HEADER_BYTES;
+    }
+    if ((operation & OPERATION_MASK) == REQUEST_CROP) {
+        CropOptions crop = {0};
+        if (options && options->crop) {
+            crop = *options->crop;
+        }
+        buffer[index] = crop.marginPercent;
+        memcpy(buffer + index + 1, &crop.size, sizeof(uint16_t));
+        buffer[index + 3] = crop.quality;
+    }
+    *resultBuffer = buffer;
+    *resultSize = totalSize;
+}
+
+/*
+ * protocol_pack_request_with_options
+ * ----------------------------------
+ * As protocol_pack_request, also writing the optional header fields that are
+ * set in options (which may be NULL) and flagging them in the operation byte.
+ */
+void protocol_pack_request_with_options(uint8_t operation,
+        const RequestOptions* options, const uint8_t* image1,
+        uint32_t image1Size, const uint8_t* image2, uint32_t image2Size,
+        uint8_t** resultBuffer, size_t* resultSize)
+{
+    uint8_t* buffer;
+    size_t index;
+    protocol_pack_header(operation, options, &buffer, &index);
+    // Get the total Size
+    size_t totalSize = index + IMAGE_BYTES + image1Size;
+    if (operation == REQUEST_REPLACE) {
+        // Add the extra size space if it's replace operation type
+        totalSize += (IMAGE_BYTES + image2Size);
+    }
+    buffer = realloc(buffer, totalSize);
     // Write the image Size
     memcpy(buffer + index, &image1Size, IMAGE_BYTES);
     index += IMAGE_BYTES;
@@ -67,7 +154,7 @@ void protocol_pack_request(uint8_t operation, const uint8_t* image1,
     memcpy(buffer + index, image1, image1Size);
     index += image1Size;
 
-    if (operation == REQUEST_REPLACE && image2) {
+    if ((operation & OPERATION_MASK) == REQUEST_REPLACE && image2) {
         // Write the image2 size
         // For the replace operation only
         memcpy(buffer + index, &image2Size, IMAGE_BYTES);
@@ -122,25 +209,299 @@ void send_error(int fd, const char* message)
 /*
  * send_client
  * -----------
- * Reads the processed image from a temporary file and sends it to the client.
+ * Sends the processed image to the client.
  * Packs the image using the protocol with the REQUEST_OUTPUT operation.
  */
-void send_client(int fd)
+void send_client(int fd, const uint8_t* image, uint32_t imageSize)
 {
-    uint8_t* resultBuffer = NULL;
-    size_t resultSize = 0;
-    uint8_t* image1;
-    uint32_t image1Size;
-
-    // Get the image data from TEM_IMAGE_PATH
-    image1 = read_file_to_buffer(TEMP_IMAGE_PATH, &image1Size);
-    uint8_t operation = REQUEST_OUTPUT;
-
-    // Pack the message and operation detia
-    protocol_pack_request(
-            operation, image1, image1Size, NULL, 0, &resultBuffer, &resultSize);
+    send_result(fd, REQUEST_OUTPUT, image, imageSize);
+}
 
+/*
+ * send_result
+ * -----------
+ * Sends a response of the given operation carrying the image (or other
+ * payload) to the client, in one write.
+ */
+void send_result(
+        int fd, uint8_t operation, const uint8_t* image, uint32_t imageSize)
+{
+    size_t resultSize
+            = PREFIX_BYTES + OPERATION_BYTES + IMAGE_BYTES + imageSize;
+    uint8_t* resultBuffer = malloc(resultSize);
+    uint32_t prefix = PROTOCOL_PREFIX;
+    memcpy(resultBuffer, &prefix, PREFIX_BYTES);
+    resultBuffer[PREFIX_BYTES] = operation;
+    memcpy(resultBuffer + PREFIX_BYTES + OPERATION_BYTES, &imageSize,
+            IMAGE_BYTES);
+    memcpy(resultBuffer + PREFIX_BYTES + OPERATION_BYTES + IMAGE_BYTES, image,
+            imageSize);
     write(fd, resultBuffer, resultSize); // Send to the client
     free(resultBuffer);
-    free(image1);
+}
+
+/*
+ * send_shared_result
+ * ------------------
+ * As send_result, for a request that passed its images as file descriptors:
+ * the image is written to a sealed memfd whose descriptor is sent with the
+ * size field. Falls back to sending the bytes if no memfd can be made.
+ */
+void send_shared_result(
+        int fd, uint8_t operation, const uint8_t* image, uint32_t imageSize)
+{
+    int memfd = protocol_create_memfd(image, imageSize);
+    if (memfd < 0) {
+        send_result(fd, operation, image, imageSize);
+        return;
+    }
+    uint8_t header[PREFIX_BYTES + OPERATION_BYTES];
+    uint32_t prefix = PROTOCOL_PREFIX;
+    memcpy(header, &prefix, PREFIX_BYTES);
+    header[PREFIX_BYTES] = operation | FLAG_SHARED_MEMORY;
+    if (write(fd, header, sizeof(header)) == (ssize_t)sizeof(header)) {
+        protocol_send_fd(fd, imageSize, memfd);
+    }
+    close(memfd);
+}
+
+/*
+ * protocol_read_exact
+ * -------------------
+ * Reads exactly size bytes from fd into buffer, however many reads the
+ * socket splits them into. Returns false on EOF or an error before then.
+ */
+bool protocol_read_exact(int fd, void* buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = read(fd, (uint8_t*)buffer + done, size - done);
+        if (count <= 0) {
+            return false;
+        }
+        done += count;
+    }
+    return true;
+}
+
+/*
+ * protocol_read_response
+ * ----------------------
+ * Reads a response from the server: its operation, without the shared
+ * memory flag, and its payload (an image, crops or an error message). A
+ * payload sent as bytes is malloc'd with a NUL after it, so an error message
+ * can be used as a string; one passed as a descriptor may be mapped instead,
+ * with mapped set. Free it with protocol_free_payload().
+ * Returns false if the response is not well formed or cannot be read.
+ */
+bool protocol_read_response(int fd, uint8_t* operation, uint8_t** payload,
+        uint32_t* size, bool* mapped)
+{
+    uint32_t prefix;
+    if (!protocol_read_exact(fd, &prefix, PREFIX_BYTES)
+            || prefix != PROTOCOL_PREFIX
+            || !protocol_read_exact(fd, operation, OPERATION_BYTES)) {
+        return false;
+    }
+    *mapped = false;
+    if (*operation & FLAG_SHARED_MEMORY) {
+        // The payload is in a memfd sent with its size
+        *operation &= ~FLAG_SHARED_MEMORY;
+        int payloadfd;
+        if (!protocol_receive_fd(fd, size, &payloadfd) || payloadfd < 0) {
+            return false;
+        }
+        *payload = protocol_map_image(payloadfd, *size, mapped);
+        close(payloadfd);
+        return *payload != NULL;
+    }
+    if (!protocol_read_exact(fd, size, IMAGE_BYTES)) {
+        return false;
+    }
+    *payload = malloc((size_t)*size + 1);
+    if (!*payload || !protocol_read_exact(fd, *payload, *size)) {
+        free(*payload);
+        return false;
+    }
+    (*payload)[*size] = '\0';
+    return true;
+}
+
+/*
+ * protocol_free_payload
+ * ---------------------
+ * Releases a payload read by protocol_read_response().
+ */
+void protocol_free_payload(uint8_t* payload, uint32_t size, bool mapped)
+{
+    if (mapped) {
+        munmap(payload, size);
+    } else {
+        free(payload);
+    }
+}
+
+/*
+ * protocol_create_memfd
+ * ---------------------
+ * Copies the data into a new anonymous memory file, sealed so that whoever
+ * it is passed to can map it without it changing or shrinking underneath.
+ * Returns the descriptor, or -1 on failure.
+ */
+int protocol_create_memfd(const uint8_t* data, uint32_t size)
+{
+    int fd = memfd_create("image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+    uint32_t written = 0;
+    while (written < size) {
+        ssize_t count = write(fd, data + written, size - written);
+        if (count <= 0) {
+            close(fd);
+            return -1;
+        }
+        written += count;
+    }
+    if (fcntl(fd, F_ADD_SEALS, IMAGE_SEALS) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * protocol_send_fd
+ * ----------------
+ * Sends an image size field with the descriptor holding the image attached.
+ * The field goes in a message of its own, so the descriptor reaches the
+ * reader of exactly these bytes. Returns true on success.
+ */
+bool protocol_send_fd(int sock, uint32_t size, int fd)
+{
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec field = {&size, IMAGE_BYTES};
+    struct msghdr message = {0};
+    message.msg_iov = &field;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    return sendmsg(sock, &message, MSG_NOSIGNAL) == IMAGE_BYTES;
+}
+
+/*
+ * protocol_receive_fd
+ * -------------------
+ * Reads an image size field sent by protocol_send_fd, and the descriptor
+ * attached to it into fd (-1 if there is none). Any further descriptors are
+ * closed. Returns false if the field cannot be read.
+ */
+bool protocol_receive_fd(int sock, uint32_t* size, int* fd)
+{
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec field = {size, IMAGE_BYTES};
+    struct msghdr message = {0};
+    message.msg_iov = &field;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    *fd = -1;
+    ssize_t count = recvmsg(sock, &message, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); count > 0 && header;
+            header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET
+                || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < received; i++) {
+            int descriptor;
+            memcpy(&descriptor, CMSG_DATA(header) + i * sizeof(int),
+                    sizeof(int));
+            if (*fd < 0) {
+                *fd = descriptor;
+            } else {
+                close(descriptor); // one image per field
+            }
+        }
+    }
+    // the rest of a field split by the socket carries no descriptor
+    while (count > 0 && count < IMAGE_BYTES) {
+        ssize_t more = read(sock, (uint8_t*)size + count, IMAGE_BYTES - count);
+        count = more > 0 ? count + more : -1;
+    }
+    if (count != IMAGE_BYTES && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+    return count == IMAGE_BYTES;
+}
+
+/*
+ * protocol_map_image
+ * ------------------
+ * Makes the first size bytes of a file passed by descriptor readable in
+ * memory, writable by the caller without changing the file. A memfd sealed
+ * against shrinking is mapped copy-on-write, with mapped set; any other file
+ * is read into a malloc'd buffer instead, as it could be truncated under a
+ * mapping. Returns NULL if the file is shorter than size or
+ * cannot be read. The descriptor may be closed afterwards.
+ */
+uint8_t* protocol_map_image(int fd, uint32_t size, bool* mapped)
+{
+    struct stat info;
+    *mapped = false;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)size) {
+        return NULL;
+    }
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals > 0 && (seals & F_SEAL_SHRINK)) {
+        void* image = mmap(
+                NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (image != MAP_FAILED) {
+            *mapped = true;
+            return image;
+        }
+    }
+    uint8_t* image = malloc(size);
+    uint32_t done = 0;
+    while (image && done < size) {
+        ssize_t count = pread(fd, image + done, size - done, done);
+        if (count <= 0) {
+            free(image);
+            return NULL;
+        }
+        done += count;
+    }
+    return image;
+}
+
+/*
+ * protocol_pixel_channels
+ * -----------------------
+ * Returns the number of channels of a raw pixel format, or 0 if the format
+ * is unknown.
+ */
+int protocol_pixel_channels(uint8_t format)
+{
+    if (format == PIXEL_BGR) {
+        return 3;
+    } else if (format == PIXEL_BGRA) {
+        return 4;
+    } else if (format == PIXEL_GRAY) {
+        return 1;
+    }
+    return 0;
 }
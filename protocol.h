@@ -1,4 +1,8 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
@@ -19,6 +23,39 @@
 #define REQUEST_REPLACE 1
 #define REQUEST_OUTPUT 2
 #define ERROR_MESSAGE 3
+#define REQUEST_CROP 4
+
+// The operation byte of a request may carry flags in its high bits. Each
+// flag adds an optional field to the header, after the operation byte and in
+// the order listed here
+#define OPERATION_MASK 0x0F
+#define FLAG_DEADLINE 0x80 // DEADLINE_BYTES: milliseconds the caller waits
+#define FLAG_CLIENT_TAG 0x40 // length byte, then the tag naming the client
+#define FLAG_RAW_PIXELS 0x10 // RAW_HEADER_BYTES: image1 is raw, see RawImage
+// Over a Unix socket the images may instead be passed as file descriptors:
+// every image size field is then sent alone with an SCM_RIGHTS descriptor
+// holding the image from offset 0, and no image bytes follow. The response
+// to such a request is sent the same way
+#define FLAG_SHARED_MEMORY 0x20
+#define DEADLINE_BYTES 4
+#define CLIENT_TAG_LENGTH_BYTES 1
+#define MAX_CLIENT_TAG_LENGTH 255
+#define RAW_HEADER_BYTES 13
+
+// The pixel formats of a raw image, 8 bits per channel
+#define PIXEL_BGR 0
+#define PIXEL_BGRA 1
+#define PIXEL_GRAY 2
+
+// A crop request has, after the optional header fields, CROP_HEADER_BYTES:
+// the margin added around each face in percent of its size (1 byte), the
+// longer side every crop is resized to (2 bytes, 0 to keep the face's own)
+// and the JPEG quality (1 byte, 0 for the default). Its response, operation
+// REQUEST_CROP, carries as its image the number of faces (4 bytes), then for
+// each face CROP_PART_HEADER_BYTES: the x, y, width and height of the crop in
+// the frame and the size of the crop image (4 bytes each), then the image
+#define CROP_HEADER_BYTES 4
+#define CROP_PART_HEADER_BYTES 20
 
 // the initial size for reading
 #define INITIAL_SIZE 1024
@@ -26,11 +63,58 @@
 // Response File
 #define RESPONSE_FILE "/local/courses/csse2310/resources/a4/responsefile"
 
+// The shape of a raw image1: rows of width pixels, stride bytes apart, sent
+// as the width, height and stride (4 bytes each) then the format byte
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint8_t format;
+} RawImage;
+
+// The crop field of a crop request
+typedef struct {
+    uint8_t marginPercent;
+    uint16_t size;
+    uint8_t quality;
+} CropOptions;
+
+// Optional header fields of a request; zero values are left out
+typedef struct {
+    uint32_t deadlineMs;
+    const char* clientTag; // groups requests for fair sharing, NULL for none
+    const RawImage* raw; // image1 is raw pixels of this shape, NULL if encoded
+    const CropOptions* crop; // for a crop request, NULL for the defaults
+} RequestOptions;
+
+void protocol_pack_header(uint8_t operation, const RequestOptions* options,
+        uint8_t** resultBuffer, size_t* resultSize);
 void protocol_pack_request(uint8_t operation, const uint8_t* image1,
         uint32_t image1Size, const uint8_t* image2, uint32_t image2Size,
         uint8_t** resultBuffer, size_t* resultSize);
+void protocol_pack_request_with_options(uint8_t operation,
+        const RequestOptions* options, const uint8_t* image1,
+        uint32_t image1Size, const uint8_t* image2, uint32_t image2Size,
+        uint8_t** resultBuffer, size_t* resultSize);
 
 void send_responsefile(int fd);
 void send_error(int fd, const char* message);
 uint8_t* read_file_to_buffer(char* filename, uint32_t* imageSize);
-void send_client(int fd);
+void send_client(int fd, const uint8_t* image, uint32_t imageSize);
+void send_result(
+        int fd, uint8_t operation, const uint8_t* image, uint32_t imageSize);
+void send_shared_result(
+        int fd, uint8_t operation, const uint8_t* image, uint32_t imageSize);
+
+bool protocol_read_exact(int fd, void* buffer, size_t size);
+bool protocol_read_response(int fd, uint8_t* operation, uint8_t** payload,
+        uint32_t* size, bool* mapped);
+void protocol_free_payload(uint8_t* payload, uint32_t size, bool mapped);
+
+int protocol_create_memfd(const uint8_t* data, uint32_t size);
+bool protocol_send_fd(int sock, uint32_t size, int fd);
+bool protocol_receive_fd(int sock, uint32_t* size, int* fd);
+uint8_t* protocol_map_image(int fd, uint32_t size, bool* mapped);
+int protocol_pixel_channels(uint8_t format);
+
+#endif
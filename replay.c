@@ -0,0 +1,329 @@
+#include "replay.h"
+
+/* cleanup_and_exit()
+ * ---------------
+ * Print the message for the given exit status to stderr, free the args
+ * struct and exit with the given exit status.
+ */
+void cleanup_and_exit(Arguments* args, int exitStatus)
+{
+    if (exitStatus == EXIT_USAGE_STATUS) {
+        fprintf(stderr, "%s", usageErrorMessage);
+    } else if (exitStatus == EXIT_CAPTUREFILE_STATUS) {
+        fprintf(stderr, captureFileErrorMessageFormat, args->captureFileName);
+    } else if (exitStatus == EXIT_OUTPUTFILE_STATUS) {
+        fprintf(stderr, outputFileErrorMessageFormat, args->jsonFileName);
+    } else if (exitStatus == EXIT_PORT_STATUS) {
+        fprintf(stderr, connectionErrorMessageFormat, args->port);
+    }
+    if (args) {
+        free(args);
+    }
+    exit(exitStatus);
+}
+
+/*
+ * parse_option
+ * ------------
+ * Applies one optional argument and its value. Exits with usage status on
+ * an unknown option or invalid value.
+ */
+void parse_option(char* option, char* value, Arguments* args)
+{
+    if (strcmp(option, timingArg) == 0
+            && strcmp(value, originalTimingName) == 0) {
+        args->fast = false;
+    } else if (strcmp(option, timingArg) == 0
+            && strcmp(value, fastTimingName) == 0) {
+        args->fast = true;
+    } else if (strcmp(option, selectArg) == 0
+            && strcmp(value, allSelectName) == 0) {
+        args->slowOnly = false;
+    } else if (strcmp(option, selectArg) == 0
+            && strcmp(value, slowSelectName) == 0) {
+        args->slowOnly = true;
+    } else if (strcmp(option, jsonArg) == 0 && *value) {
+        args->jsonFileName = value;
+    } else {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+}
+
+/*
+ * parse_arguments
+ * ---------------
+ * Parses the port, the capture file and the optional arguments of the
+ * command line. Exits with usage status if they are invalid.
+ */
+Arguments* parse_arguments(int argc, char** argv)
+{
+    Arguments* args = calloc(1, sizeof(Arguments));
+    if (argc < argsCount || !*argv[portIndex] || !*argv[captureIndex]
+            || (argc - argsCount) % 2) {
+        cleanup_and_exit(args, EXIT_USAGE_STATUS);
+    }
+    args->port = argv[portIndex];
+    args->captureFileName = argv[captureIndex];
+    for (int i = argsCount; i < argc; i += 2) {
+        // Options come in pairs: --name value
+        if (strncmp(argv[i], optionArgStart, strlen(optionArgStart)) != 0) {
+            cleanup_and_exit(args, EXIT_USAGE_STATUS);
+        }
+        parse_option(argv[i], argv[i + 1], args);
+    }
+    return args;
+}
+
+/*
+ * compare_records
+ * ---------------
+ * qsort comparator putting the records of a connection together, in the
+ * order they arrived.
+ */
+int compare_records(const void* a, const void* b)
+{
+    const CaptureRecord* x = *(const CaptureRecord* const*)a;
+    const CaptureRecord* y = *(const CaptureRecord* const*)b;
+    if (x->connection != y->connection) {
+        return (x->connection > y->connection)
+                - (x->connection < y->connection);
+    }
+    return (x->arrival > y->arrival) - (x->arrival < y->arrival);
+}
+
+/*
+ * split_connections
+ * -----------------
+ * Picks the records of the capture to replay and splits them into the
+ * connections they came on. Stores the connections in a malloc'd array
+ * through connections and returns how many there are.
+ */
+int split_connections(Replay* replay, ReplayConnection** connections)
+{
+    int total = 0;
+    int capacity = 0;
+    const CaptureRecord** records = NULL;
+    const CaptureRecord* record = NULL;
+    while ((record = capture_next(&replay->capture, record))) {
+        if (replay->args->slowOnly && !(record->reasons & CAPTURE_SLOW)) {
+            continue;
+        }
+        if (total == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            records = realloc(records, capacity * sizeof(CaptureRecord*));
+        }
+        records[total++] = record;
+    }
+    qsort(records, total, sizeof(CaptureRecord*), compare_records);
+    int count = 0;
+    *connections = calloc(total ? total : 1, sizeof(ReplayConnection));
+    for (int i = 0; i < total; i++) {
+        if (i == 0 || records[i]->connection != records[i - 1]->connection) {
+            (*connections)[count].records = &records[i];
+            count++;
+        }
+        (*connections)[count - 1].count++;
+        if (i == 0 || records[i]->arrival < replay->firstArrival) {
+            replay->firstArrival = records[i]->arrival;
+        }
+    }
+    return count;
+}
+
+/*
+ * send_record
+ * -----------
+ * Sends a captured request, straight from the mapping of the capture file,
+ * and reads its response, connecting first if not connected. Error
+ * responses are counted by their message. Returns false if the request
+ * failed without a response.
+ */
+bool send_record(ReplayConnection* connection, const CaptureRecord* record)
+{
+    Replay* replay = connection->replay;
+    if (connection->sockfd < 0
+            && (connection->sockfd = connect_to_server(replay->args->port))
+                    < 0) {
+        count_error(&replay->counts, connectErrorKind);
+        return false;
+    }
+    return exchange_request(&connection->sockfd, capture_request(record),
+            record->requestSize, &replay->counts);
+}
+
+/*
+ * connection_thread
+ * -----------------
+ * Thread body replaying one captured connection: its requests one at a
+ * time, in order, over a connection of its own. In the original timing a
+ * request is due as long after the start of the replay as it arrived after
+ * the first request captured, and is sent then, or once the one before it
+ * is answered if that is later; its latency is measured from when it was
+ * due, as the capture measured it from its arrival.
+ */
+void* connection_thread(void* arg)
+{
+    ReplayConnection* connection = (ReplayConnection*)arg;
+    Replay* replay = connection->replay;
+    for (int i = 0; i < connection->count; i++) {
+        const CaptureRecord* record = connection->records[i];
+        uint64_t due = now_nanos();
+        if (!replay->args->fast) {
+            due = replay->start + (record->arrival - replay->firstArrival);
+            sleep_until(due);
+        }
+        if (send_record(connection, record)) {
+            connection->recorded[connection->answered] = record->latency;
+            connection->replayed[connection->answered++] = now_nanos() - due;
+        }
+    }
+    if (connection->sockfd >= 0) {
+        close(connection->sockfd);
+    }
+    return NULL;
+}
+
+/*
+ * gather_latencies
+ * ----------------
+ * Gathers one kind of latency of the answered requests of every connection
+ * into a malloc'd array, sorted. recorded picks the recorded latencies
+ * rather than the replayed ones. Returns the array; count is set to its
+ * length.
+ */
+uint64_t* gather_latencies(ReplayConnection* connections, int connectionCount,
+        bool recorded, size_t* count)
+{
+    *count = 0;
+    for (int i = 0; i < connectionCount; i++) {
+        *count += connections[i].answered;
+    }
+    uint64_t* all = malloc(sizeof(uint64_t) * (*count ? *count : 1));
+    size_t index = 0;
+    for (int i = 0; i < connectionCount; i++) {
+        memcpy(all + index,
+                recorded ? connections[i].recorded : connections[i].replayed,
+                sizeof(uint64_t) * connections[i].answered);
+        index += connections[i].answered;
+    }
+    qsort(all, *count, sizeof(uint64_t), compare_nanos);
+    return all;
+}
+
+/*
+ * write_text_report
+ * -----------------
+ * Writes the results of the replay for people to read, the latencies
+ * replayed beside those recorded for the same requests.
+ */
+void write_text_report(FILE* out, Replay* replay, int connectionCount,
+        uint64_t* recorded, uint64_t* replayed, size_t count, double seconds)
+{
+    LoadCounts* counts = &replay->counts;
+    fprintf(out,
+            "%" PRIu64 " requests over %d connections in %.3f s: %" PRIu64
+            " ok, %" PRIu64 " errors\n",
+            counts->ok + counts->errorCount, connectionCount, seconds,
+            counts->ok, counts->errorCount);
+    write_text_latencies(out, "replayed:", replayed, count);
+    write_text_latencies(out, "recorded:", recorded, count);
+    write_text_errors(out, counts);
+}
+
+/*
+ * write_json_report
+ * -----------------
+ * Writes the results of the replay as a JSON object, for runs to be
+ * compared.
+ */
+void write_json_report(FILE* out, Replay* replay, int connectionCount,
+        uint64_t* recorded, uint64_t* replayed, size_t count, double seconds)
+{
+    LoadCounts* counts = &replay->counts;
+    fprintf(out,
+            "{\"timing\": \"%s\", \"select\": \"%s\", \"connections\": %d, "
+            "\"seconds\": %.3f, \"requests\": %" PRIu64 ", \"ok\": %" PRIu64
+            ", \"errors\": %" PRIu64 ",\n",
+            replay->args->fast ? fastTimingName : originalTimingName,
+            replay->args->slowOnly ? slowSelectName : allSelectName,
+            connectionCount, seconds, counts->ok + counts->errorCount,
+            counts->ok, counts->errorCount);
+    fprintf(out, " \"replayed_ms\": ");
+    write_json_latencies(out, replayed, count);
+    fprintf(out, ",\n \"recorded_ms\": ");
+    write_json_latencies(out, recorded, count);
+    fprintf(out, ",\n \"error_kinds\": ");
+    write_json_errors(out, counts);
+    fprintf(out, "}\n");
+}
+
+/*
+ * run_replay
+ * ----------
+ * Replays every connection with a thread of its own and waits for them
+ * all to finish. Returns how long it took, in seconds.
+ */
+double run_replay(Replay* replay, ReplayConnection* connections, int count)
+{
+    pthread_t* threads = calloc(count ? count : 1, sizeof(pthread_t));
+    replay->start = now_nanos();
+    for (int i = 0; i < count; i++) {
+        connections[i].replay = replay;
+        connections[i].sockfd = -1;
+        size_t size = sizeof(uint64_t) * connections[i].count;
+        connections[i].recorded = malloc(size);
+        connections[i].replayed = malloc(size);
+        pthread_create(&threads[i], NULL, connection_thread, &connections[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return (now_nanos() - replay->start) / (double)nanosPerSecond;
+}
+
+/**
+ * main()
+ * -------
+ * Entry point for uqfacereplay. Replays the requests of a capture file
+ * recorded by uqfacedetect against the server on the given port, over the
+ * connections they were captured on, then reports their latency beside the
+ * latency recorded.
+ *
+ * Returns: program exit status (0 on success, or error code)
+ */
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN); // the server may close a connection
+    Arguments* args = parse_arguments(argc, argv);
+    Replay replay = {0};
+    replay.args = args;
+    pthread_mutex_init(&replay.counts.errorLock, NULL);
+    if (!capture_map(args->captureFileName, &replay.capture)) {
+        cleanup_and_exit(args, EXIT_CAPTUREFILE_STATUS);
+    }
+    FILE* json = NULL;
+    if (args->jsonFileName && !(json = fopen(args->jsonFileName, "w"))) {
+        cleanup_and_exit(args, EXIT_OUTPUTFILE_STATUS);
+    }
+    int probe = connect_to_server(args->port);
+    if (probe < 0) {
+        cleanup_and_exit(args, EXIT_PORT_STATUS);
+    }
+    close(probe);
+    ReplayConnection* connections;
+    int count = split_connections(&replay, &connections);
+    double seconds = run_replay(&replay, connections, count);
+    size_t answered;
+    uint64_t* recorded = gather_latencies(connections, count, true, &answered);
+    uint64_t* replayed = gather_latencies(connections, count, false, &answered);
+    write_text_report(
+            stdout, &replay, count, recorded, replayed, answered, seconds);
+    if (json) {
+        write_json_report(
+                json, &replay, count, recorded, replayed, answered, seconds);
+        fclose(json);
+    }
+    capture_unmap(&replay.capture);
+    cleanup_and_exit(args, EXIT_OK_STATUS);
+}
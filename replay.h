@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "protocol.h"
+#include "capture.h"
+#include "loadcommon.h"
+
+// Optional arguments, after the port and the capture file
+const char* const optionArgStart = "--";
+const char* const timingArg = "--timing";
+const char* const selectArg = "--select";
+const char* const jsonArg = "--json";
+const char* const originalTimingName = "original";
+const char* const fastTimingName = "fast";
+const char* const allSelectName = "all";
+const char* const slowSelectName = "slow";
+const int argsCount = 3;
+const int portIndex = 1;
+const int captureIndex = 2;
+
+// Error Message
+const char* const usageErrorMessage
+        = "Usage: ./uqfacereplay port capturefile [--timing original|fast]"
+          " [--select all|slow] [--json filename]\n";
+const char* const captureFileErrorMessageFormat
+        = "uqfacereplay: cannot read the capture file \"%s\"\n";
+const char* const outputFileErrorMessageFormat
+        = "uqfacereplay: unable to open the output file \"%s\" for writing\n";
+const char* const connectionErrorMessageFormat
+        = "uqfacereplay: cannot connect to the server on port \"%s\"\n";
+
+// The Argument of the program
+typedef struct {
+    char* port;
+    char* captureFileName;
+    bool fast; // send every request as soon as the last is answered
+    bool slowOnly; // replay only the requests captured for being slow
+    char* jsonFileName; // where the JSON report goes, NULL for none
+} Arguments;
+
+// A replay of a capture: the schedule shared by all connections, and what
+// they have counted
+typedef struct {
+    Arguments* args;
+    CaptureFile capture;
+    uint64_t firstArrival; // when the earliest request replayed arrived
+    uint64_t start; // monotonic time the replay starts at
+    LoadCounts counts;
+} Replay;
+
+// One connection of the capture, replayed on a connection of its own. The
+// latencies are those of the requests answered: as recorded, and as
+// replayed, from when the request was due in the original timing.
+typedef struct {
+    Replay* replay;
+    const CaptureRecord** records; // in the order they were sent
+    int count;
+    int sockfd; // -1 while not connected
+    uint64_t* recorded;
+    uint64_t* replayed;
+    int answered;
+} ReplayConnection;
+
+// This enum contains the program exit status codes
+typedef enum {
+    EXIT_OK_STATUS = 0,
+    EXIT_USAGE_STATUS = 17,
+    EXIT_OUTPUTFILE_STATUS = 9,
+    EXIT_CAPTUREFILE_STATUS = 20,
+    EXIT_PORT_STATUS = 4
+} ExitStatus;
@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "statsserver.h"
+#include "metrics.h"
+
+#define REQUEST_BUFFER_SIZE 1024
+
+// How long a scraper may keep the stats thread waiting to read or write
+static const int scrapeTimeoutSeconds = 2;
+
+// Every response is the whole report, as a Prometheus scrape expects
+static const char responseHeader[] = "HTTP/1.0 200 OK\r\n"
+                                     "Content-Type: text/plain; "
+                                     "version=0.0.4\r\n"
+                                     "Connection: close\r\n\r\n";
+
+/*
+ * write_all
+ * ---------
+ * Writes the whole buffer to the descriptor. Returns false if it cannot.
+ */
+static bool write_all(int fd, const char* buffer, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, buffer, size);
+        if (written <= 0) {
+            return false;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return true;
+}
+
+/*
+ * serve_scrape
+ * ------------
+ * Answers one connection to the stats port with the metrics report. Whatever
+ * the request asked for, the report is the response; only its first read is
+ * waited for, so a scraper is not answered before it has spoken. Reads and
+ * writes time out, so a client that connects and goes quiet cannot hold up
+ * the scrapes after it.
+ */
+static void serve_scrape(int fd)
+{
+    struct timeval timeout = {scrapeTimeoutSeconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    char request[REQUEST_BUFFER_SIZE];
+    if (read(fd, request, sizeof(request)) <= 0) {
+        return;
+    }
+    size_t reportSize;
+    char* report = metrics_report(&reportSize);
+    if (!report) {
+        return;
+    }
+    if (write_all(fd, responseHeader, strlen(responseHeader))) {
+        write_all(fd, report, reportSize);
+    }
+    free(report);
+}
+
+/*
+ * stats_thread
+ * ------------
+ * Thread body accepting scrapes on the listening stats socket, one at a
+ * time; they are rare and quick.
+ */
+static void* stats_thread(void* arg)
+{
+    int listenfd = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        serve_scrape(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * stats_server_start
+ * ------------------
+ * Listens on the given TCP port of the loopback interface and serves the
+ * metrics report over HTTP to every connection, from a thread of its own.
+ * Returns false if the port cannot be listened on.
+ */
+bool stats_server_start(int port)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    if (listenfd < 0
+            || setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+                    != 0
+            || bind(listenfd, (struct sockaddr*)&address, sizeof(address)) != 0
+            || listen(listenfd, SOMAXCONN) != 0) {
+        if (listenfd >= 0) {
+            close(listenfd);
+        }
+        return false;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, stats_thread, (void*)(intptr_t)listenfd)
+            != 0) {
+        close(listenfd);
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
@@ -0,0 +1,8 @@
+#ifndef STATSSERVER_H
+#define STATSSERVER_H
+
+#include <stdbool.h>
+
+bool stats_server_start(int port);
+
+#endif
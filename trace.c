@@ -0,0 +1,334 @@
+#define _GNU_SOURCE // gettid
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "trace.h"
+#include "metrics.h"
+
+// Spans each thread can hold between flushes; older ones are overwritten
+#define TRACE_RING_EVENTS 4096
+#define TRACE_FLUSH_SECONDS 1
+#define NANOS_PER_MICRO 1000.0
+
+// One finished span of work, a Chrome trace complete ("X") event
+typedef struct {
+    const char* name; // a string literal
+    uint64_t start;
+    uint64_t duration;
+    uint64_t request; // 0 for none
+    uint32_t imageSize; // 0 for not known
+    int32_t faces; // -1 for not known
+    int32_t tid;
+} TraceEvent;
+
+// The spans of one thread. Only the owning thread writes, advancing head
+// once an event is complete; the flusher reads behind it and discards what
+// the owner may have overwritten while it read. A ring outlives its thread
+// and is taken over by a later one.
+typedef struct TraceRing {
+    TraceEvent events[TRACE_RING_EVENTS];
+    uint64_t head; // events ever written
+    uint64_t flushed; // events written out or lost
+    bool owned;
+    struct TraceRing* next;
+} TraceRing;
+
+// What the calling thread is working on, attached to its spans
+typedef struct {
+    TraceRing* ring;
+    int tid;
+    uint64_t request;
+    uint32_t imageSize;
+} TraceThread;
+
+static int traceFd = -1; // the trace file, -1 while tracing is off
+static TraceRing* rings; // every ring ever made, newest first
+static pthread_key_t ringKey; // releases a thread's ring when it exits
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceThread current;
+
+/*
+ * trace_open
+ * ----------
+ * Turns tracing on, writing spans to a new trace file at path in the Chrome
+ * trace JSON format Perfetto opens. The array is never closed, which that
+ * format allows, so spans can be appended for as long as the server runs.
+ * Processes forked later, such as shards, append to the same file.
+ * Returns false if the file cannot be created.
+ */
+bool trace_open(const char* path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (write(fd, "[\n", 2) != 2) {
+        close(fd);
+        return false;
+    }
+    traceFd = fd;
+    return true;
+}
+
+/*
+ * trace_enabled
+ * -------------
+ * Returns true if spans are being recorded.
+ */
+bool trace_enabled(void)
+{
+    return traceFd >= 0;
+}
+
+/*
+ * release_ring
+ * ------------
+ * Thread-exit destructor handing a thread's ring over to the next thread
+ * that needs one. Its unflushed spans are kept.
+ */
+static void release_ring(void* ring)
+{
+    __atomic_store_n(&((TraceRing*)ring)->owned, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * create_ring_key
+ * ---------------
+ * Creates the key whose destructor releases the rings of exiting threads.
+ */
+static void create_ring_key(void)
+{
+    pthread_key_create(&ringKey, release_ring);
+}
+
+/*
+ * claim_ring
+ * ----------
+ * Gives the calling thread a ring of its own: one released by a thread that
+ * has exited if there is one, otherwise a new one. Returns NULL if out of
+ * memory.
+ */
+static TraceRing* claim_ring(void)
+{
+    pthread_once(&ringKeyOnce, create_ring_key);
+    TraceRing* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next) {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&ring->owned, &expected, true, false,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(TraceRing));
+        if (!ring) {
+            return NULL;
+        }
+        ring->owned = true;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            // another thread added its ring first; ring->next is updated
+        }
+    }
+    pthread_setspecific(ringKey, ring);
+    current.tid = (int)gettid();
+    return ring;
+}
+
+/*
+ * trace_set_request
+ * -----------------
+ * Sets the request the calling thread works on, attached to the spans it
+ * records with trace_end() until the next call.
+ */
+void trace_set_request(uint64_t request, uint32_t imageSize)
+{
+    current.request = request;
+    current.imageSize = imageSize;
+}
+
+/*
+ * trace_request
+ * -------------
+ * Returns the request the calling thread works on, for the sub-tasks it
+ * spawns to record their spans against with trace_end_for().
+ */
+uint64_t trace_request(void)
+{
+    return current.request;
+}
+
+/*
+ * trace_begin
+ * -----------
+ * Returns the start time of a span to be ended by trace_end(), or 0 while
+ * tracing is off. Any time from now_nanos() will also do.
+ */
+uint64_t trace_begin(void)
+{
+    return trace_enabled() ? now_nanos() : 0;
+}
+
+/*
+ * record
+ * ------
+ * Appends a span ending now to the calling thread's ring.
+ */
+static void record(const char* name, uint64_t start, uint64_t request,
+        uint32_t imageSize, int faces)
+{
+    if (!start || !trace_enabled()) {
+        return; // begun while tracing was off
+    }
+    uint64_t end = now_nanos();
+    TraceRing* ring = current.ring;
+    if (!ring && !(ring = current.ring = claim_ring())) {
+        return;
+    }
+    uint64_t head = ring->head;
+    ring->events[head % TRACE_RING_EVENTS] = (TraceEvent) {name, start,
+            end - start, request, imageSize, faces, current.tid};
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * trace_end
+ * ---------
+ * Records a span of the calling thread's current request from start, as
+ * returned by trace_begin(), until now. faces is the number of faces known
+ * to the request by then, or -1.
+ */
+void trace_end(const char* name, uint64_t start, int faces)
+{
+    record(name, start, current.request, current.imageSize, faces);
+}
+
+/*
+ * trace_end_for
+ * -------------
+ * Records a span of the given request from start until now, for a sub-task
+ * that may run on any thread of the pool.
+ */
+void trace_end_for(
+        const char* name, uint64_t start, uint64_t request, int faces)
+{
+    record(name, start, request, 0, faces);
+}
+
+/*
+ * write_event
+ * -----------
+ * Writes one span as a Chrome trace JSON event, times in microseconds.
+ */
+static void write_event(FILE* out, const TraceEvent* event, int pid)
+{
+    fprintf(out,
+            "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"request\":%" PRIu64,
+            event->name, event->start / NANOS_PER_MICRO,
+            event->duration / NANOS_PER_MICRO, pid, event->tid,
+            event->request);
+    if (event->imageSize) {
+        fprintf(out, ",\"image_bytes\":%" PRIu32, event->imageSize);
+    }
+    if (event->faces >= 0) {
+        fprintf(out, ",\"faces\":%d", event->faces);
+    }
+    fprintf(out, "}},\n");
+}
+
+/*
+ * flush_ring
+ * ----------
+ * Writes the spans recorded in a ring since the last flush. Spans the
+ * owner overwrote before they could be flushed, or while they were being
+ * read, are lost.
+ */
+static void flush_ring(FILE* out, TraceRing* ring, int pid)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t from = ring->flushed;
+    if (head - from > TRACE_RING_EVENTS) {
+        from = head - TRACE_RING_EVENTS;
+    }
+    for (uint64_t i = from; i < head; i++) {
+        TraceEvent event = ring->events[i % TRACE_RING_EVENTS];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        if (now - i >= TRACE_RING_EVENTS) {
+            // overwritten while it was copied, or being overwritten: the
+            // owner writes event now into this slot before moving head on
+            continue;
+        }
+        write_event(out, &event, pid);
+    }
+    ring->flushed = head;
+}
+
+/*
+ * trace_flush
+ * -----------
+ * Appends the spans recorded by every thread since the last flush to the
+ * trace file, in a single write so processes sharing the file do not
+ * interleave.
+ */
+void trace_flush(void)
+{
+    if (!trace_enabled()) {
+        return;
+    }
+    pthread_mutex_lock(&flushLock);
+    char* buffer = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&buffer, &size);
+    if (out) {
+        int pid = (int)getpid();
+        TraceRing* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+        for (; ring; ring = ring->next) {
+            flush_ring(out, ring, pid);
+        }
+        fclose(out);
+        if (size && write(traceFd, buffer, size) < 0) {
+            perror("trace");
+        }
+        free(buffer);
+    }
+    pthread_mutex_unlock(&flushLock);
+}
+
+/*
+ * flush_thread
+ * ------------
+ * Thread body flushing the trace file every TRACE_FLUSH_SECONDS.
+ */
+static void* flush_thread(void* arg)
+{
+    (void)arg;
+    for (;;) {
+        sleep(TRACE_FLUSH_SECONDS);
+        trace_flush();
+    }
+    return NULL;
+}
+
+/*
+ * trace_start_flusher
+ * -------------------
+ * Starts flushing the trace file at an interval, if tracing is on. The
+ * rings are sized to hold the spans of a busy thread between two flushes.
+ */
+void trace_start_flusher(void)
+{
+    if (!trace_enabled()) {
+        return;
+    }
+    pthread_t tid;
+    pthread_create(&tid, NULL, flush_thread, NULL);
+    pthread_detach(tid);
+}
@@ -0,0 +1,19 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool trace_open(const char* path);
+bool trace_enabled(void);
+void trace_start_flusher(void);
+void trace_flush(void);
+
+void trace_set_request(uint64_t request, uint32_t imageSize);
+uint64_t trace_request(void);
+uint64_t trace_begin(void);
+void trace_end(const char* name, uint64_t start, int faces);
+void trace_end_for(
+        const char* name, uint64_t start, uint64_t request, int faces);
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+#include "worksteal.h"
+
+#define INITIAL_DEQUE_CAPACITY 64
+
+// The deque and private state of the calling thread, if it is attached
+static __thread TaskDeque* ownDeque;
+static __thread void* ownState;
+static __thread unsigned stealSeed;
+
+/*
+ * deque_push
+ * ----------
+ * Adds a task at the bottom of the deque, growing it if it is full.
+ */
+static void deque_push(TaskDeque* deque, Task task)
+{
+    pthread_mutex_lock(&deque->lock);
+    int length = deque->bottom - deque->top;
+    if (length == deque->capacity) {
+        Task* tasks = malloc(sizeof(Task) * deque->capacity * 2);
+        for (int i = 0; i < length; i++) {
+            tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity *= 2;
+        deque->top = 0;
+        deque->bottom = length;
+    }
+    deque->tasks[deque->bottom % deque->capacity] = task;
+    __atomic_store_n(&deque->bottom, deque->bottom + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/*
+ * deque_take
+ * ----------
+ * Removes the newest task of the deque (its owner's end), or the oldest if
+ * steal is set. Returns false if the deque is empty.
+ */
+static bool deque_take(TaskDeque* deque, Task* task, bool steal)
+{
+    if (__atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE)
+            == __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE)) {
+        return false; // empty, without taking the lock
+    }
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom > deque->top;
+    if (found && steal) {
+        *task = deque->tasks[deque->top % deque->capacity];
+        __atomic_store_n(&deque->top, deque->top + 1, __ATOMIC_RELEASE);
+    } else if (found) {
+        __atomic_store_n(&deque->bottom, deque->bottom - 1, __ATOMIC_RELEASE);
+        *task = deque->tasks[deque->bottom % deque->capacity];
+    }
+    if (deque->bottom == deque->top) {
+        // keep the indices small
+        __atomic_store_n(&deque->top, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&deque->bottom, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/*
+ * find_task
+ * ---------
+ * Takes the newest task of the calling thread's own deque or, failing that,
+ * steals the oldest task of another, starting at a random victim.
+ * Returns false if there is nothing to run.
+ */
+static bool find_task(TaskPool* pool, Task* task)
+{
+    bool found = ownDeque && deque_take(ownDeque, task, false);
+    int start = (int)(rand_r(&stealSeed) % (unsigned)pool->slots);
+    for (int i = 0; !found && i < pool->slots; i++) {
+        TaskDeque* victim = &pool->deques[(start + i) % pool->slots];
+        found = victim != ownDeque && deque_take(victim, task, true);
+    }
+    if (found) {
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    }
+    return found;
+}
+
+/*
+ * run_task
+ * --------
+ * Runs a task with the calling thread's state and wakes the threads waiting
+ * for its group if it was the last one.
+ */
+static void run_task(TaskPool* pool, Task* task)
+{
+    task->run(task->arg, ownState);
+    if (__atomic_sub_fetch(&task->group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&pool->idleLock);
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->idleLock);
+    }
+}
+
+/*
+ * helper_thread
+ * -------------
+ * Body of a helper thread: runs tasks stolen from the other threads, and
+ * sleeps while there are none.
+ */
+static void* helper_thread(void* arg)
+{
+    TaskPool* pool = (TaskPool*)arg;
+    taskpool_attach(pool);
+    Task task;
+    while (1) {
+        if (find_task(pool, &task)) {
+            run_task(pool, &task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->idleLock);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&pool->idle, &pool->idleLock);
+        }
+        pthread_mutex_unlock(&pool->idleLock);
+    }
+    return NULL;
+}
+
+/*
+ * taskpool_init
+ * -------------
+ * Prepares a work-stealing pool of helper threads, with room for attachable
+ * further threads (e.g. pipeline stage workers) to spawn and run tasks too.
+ * init (optional) builds the private state every thread runs tasks with.
+ */
+void taskpool_init(TaskPool* pool, int helpers, int attachable,
+        TaskWorkerInit init, void* context)
+{
+    memset(pool, 0, sizeof(TaskPool));
+    pool->helpers = helpers;
+    pool->slots = helpers + attachable;
+    pool->init = init;
+    pool->context = context;
+    pool->deques = calloc(pool->slots, sizeof(TaskDeque));
+    for (int i = 0; i < pool->slots; i++) {
+        pool->deques[i].capacity = INITIAL_DEQUE_CAPACITY;
+        pool->deques[i].tasks = malloc(sizeof(Task) * INITIAL_DEQUE_CAPACITY);
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&pool->idleLock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+}
+
+/*
+ * taskpool_start
+ * --------------
+ * Starts the helper threads of the pool.
+ */
+void taskpool_start(TaskPool* pool)
+{
+    for (int i = 0; i < pool->helpers; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, helper_thread, pool);
+        pthread_detach(tid);
+    }
+}
+
+/*
+ * taskpool_attach
+ * ---------------
+ * Gives the calling thread a deque of the pool, so the tasks it spawns can
+ * be stolen by idle threads, and its private state.
+ * Returns the state. Tasks spawned by a thread that finds the pool full run
+ * straight away.
+ */
+void* taskpool_attach(TaskPool* pool)
+{
+    ownState = pool->init ? pool->init(pool->context) : NULL;
+    int slot = __atomic_fetch_add(&pool->attached, 1, __ATOMIC_ACQ_REL);
+    if (slot < pool->slots) {
+        ownDeque = &pool->deques[slot];
+        ownDeque->state = ownState;
+    }
+    stealSeed = (unsigned)slot + 1;
+    return ownState;
+}
+
+/*
+ * taskpool_spawn
+ * --------------
+ * Adds a task to the group, to be run by the calling thread or stolen by an
+ * idle one.
+ */
+void taskpool_spawn(
+        TaskPool* pool, TaskGroup* group, TaskFunction run, void* arg)
+{
+    Task task = {run, arg, group};
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+    if (!ownDeque) {
+        run_task(pool, &task);
+        return;
+    }
+    // counted first, so a thief never takes queued below zero
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    deque_push(ownDeque, task);
+    pthread_mutex_lock(&pool->idleLock);
+    pthread_cond_signal(&pool->idle);
+    pthread_mutex_unlock(&pool->idleLock);
+}
+
+/*
+ * taskpool_wait
+ * -------------
+ * Waits until every task of the group has run. Meanwhile the calling thread
+ * runs tasks itself: its own newest first, then stolen ones.
+ */
+void taskpool_wait(TaskPool* pool, TaskGroup* group)
+{
+    Task task;
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+        if (find_task(pool, &task)) {
+            run_task(pool, &task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->idleLock);
+        while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0
+                && __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&pool->idle, &pool->idleLock);
+        }
+        pthread_mutex_unlock(&pool->idleLock);
+    }
+}
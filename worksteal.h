@@ -0,0 +1,55 @@
+#ifndef WORKSTEAL_H
+#define WORKSTEAL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+// A sub-task, run with the private state of whichever thread runs it
+typedef void (*TaskFunction)(void* arg, void* workerState);
+// Creates the private state of one thread of the task pool
+typedef void* (*TaskWorkerInit)(void* context);
+
+// A set of spawned tasks that can be waited for together
+typedef struct {
+    int pending;
+} TaskGroup;
+
+typedef struct {
+    TaskFunction run;
+    void* arg;
+    TaskGroup* group;
+} Task;
+
+// The tasks spawned by one thread. The owner pushes and pops at the bottom,
+// newest first; idle threads steal from the top, oldest (biggest) first.
+typedef struct {
+    Task* tasks;
+    int capacity;
+    int top; // index of the oldest task
+    int bottom; // index one past the newest task
+    pthread_mutex_t lock;
+    void* state; // private state of the owning thread
+} TaskDeque;
+
+// Helper threads plus the threads attached to it, each owning a deque
+typedef struct {
+    TaskDeque* deques;
+    int slots;
+    int attached;
+    int helpers;
+    int queued; // tasks waiting in all the deques
+    pthread_mutex_t idleLock;
+    pthread_cond_t idle; // something to steal, or a group finished
+    TaskWorkerInit init;
+    void* context;
+} TaskPool;
+
+void taskpool_init(TaskPool* pool, int helpers, int attachable,
+        TaskWorkerInit init, void* context);
+void taskpool_start(TaskPool* pool);
+void* taskpool_attach(TaskPool* pool);
+void taskpool_spawn(
+        TaskPool* pool, TaskGroup* group, TaskFunction run, void* arg);
+void taskpool_wait(TaskPool* pool, TaskGroup* group);
+
+#endif